@@ -0,0 +1,996 @@
+/*
+@novbytes - 2025
+
+Benchmark suite for sputil. Each case reports throughput and per-operation
+latency percentiles as JSON, one object per (case, variant, threads, size),
+so results can be diffed across releases.
+
+Build:
+    g++ -std=c++17 -O2 -pthread src/benchmark/benchmark.cpp -o sputil_bench
+
+Build with -std=c++20 to include the coroutine (async.task) cases.
+
+Run:
+    ./sputil_bench [--filter <substring>] [--threads 1,2,4,8] [--quick] [--out results.json]
+
+"baseline" variants are the straightforward implementations sputil used to
+ship (kept here only as reference points); the remaining variants are the
+current fast paths.
+*/
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <numeric>
+#include <unordered_map>
+#include <cstdlib>
+#include <new>
+
+#include "../single/sputil.hpp"
+
+using namespace sputil;
+
+// ---------------------------------------------
+// Reference implementations
+// ---------------------------------------------
+namespace baseline {
+    std::vector<std::string> split(const std::string& str, const std::string& delimiter) {
+        std::vector<std::string> tokens;
+        size_t start = 0;
+        size_t end = str.find(delimiter);
+        while (end != std::string::npos) {
+            tokens.push_back(str.substr(start, end - start));
+            start = end + delimiter.length();
+            end = str.find(delimiter, start);
+        }
+        tokens.push_back(str.substr(start));
+        return tokens;
+    }
+
+    std::string url_encode(const std::string& value) {
+        std::ostringstream escaped;
+        escaped.fill('0');
+        escaped << std::hex;
+        for (char c : value) {
+            if (isalnum(static_cast<unsigned char>(c)) || c == '-' || c == '_' || c == '.' || c == '~') {
+                escaped << c;
+            } else {
+                escaped << '%' << std::setw(2) << int((unsigned char)c);
+            }
+        }
+        return escaped.str();
+    }
+
+    std::map<std::string, std::string> parse_query_string(const std::string& query) {
+        std::map<std::string, std::string> result;
+        for (const auto& pair : split(query, "&")) {
+            auto key_value = split(pair, "=");
+            if (key_value.size() == 2) result[key_value[0]] = key_value[1];
+        }
+        return result;
+    }
+
+    std::string format_time(const char* format) {
+        std::time_t now = std::time(nullptr);
+        std::tm parts{};
+#if defined(_WIN32)
+        localtime_s(&parts, &now);
+#else
+        localtime_r(&now, &parts);
+#endif
+        std::ostringstream out;
+        out << std::put_time(&parts, format);
+        return out.str();
+    }
+
+    std::string to_lower(const std::string& str) {
+        std::string result = str;
+        std::transform(result.begin(), result.end(), result.begin(), [](unsigned char c) { return std::tolower(c); });
+        return result;
+    }
+
+    std::string trim(const std::string& str) {
+        size_t start = str.find_first_not_of(" \t\n\r\f\v");
+        if (start == std::string::npos) return "";
+        size_t end = str.find_last_not_of(" \t\n\r\f\v");
+        return str.substr(start, end - start + 1);
+    }
+
+    std::string replace(std::string str, const std::string& from, const std::string& to) {
+        for (size_t pos = str.find(from); pos != std::string::npos; pos = str.find(from, pos + to.size()))
+            str.replace(pos, from.size(), to);
+        return str;
+    }
+
+    // std::list + std::unordered_map LRU behind one mutex.
+    class LRUCache {
+    private:
+        size_t capacity;
+        std::list<std::pair<int, int>> items;
+        std::unordered_map<int, std::list<std::pair<int, int>>::iterator> index;
+        std::mutex mutex;
+
+    public:
+        explicit LRUCache(size_t cap) : capacity(cap) {}
+
+        void put(int key, int value) {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = index.find(key);
+            if (it != index.end()) items.erase(it->second);
+            items.emplace_front(key, value);
+            index[key] = items.begin();
+            if (items.size() > capacity) {
+                index.erase(items.back().first);
+                items.pop_back();
+            }
+        }
+
+        bool get(int key, int& value) {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = index.find(key);
+            if (it == index.end()) return false;
+            items.splice(items.begin(), items, it->second);
+            value = it->second->second;
+            return true;
+        }
+    };
+}
+
+// ---------------------------------------------
+// Harness
+// ---------------------------------------------
+
+// Every heap allocation in the process, so each case can report allocations
+// per operation; paths that are meant to be allocation-free should show 0.
+std::atomic<uint64_t> allocations{0};
+
+void* operator new(std::size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+
+// GCC flags malloc/free inside replaced new/delete once they are inlined.
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+
+struct Options {
+    std::string filter;
+    std::vector<size_t> threads;
+    bool quick = false;
+    std::string out;
+};
+
+struct Result {
+    std::string name;
+    std::string variant;
+    size_t threads;
+    size_t pool_threads;
+    size_t size;
+    uint64_t ops;
+    double seconds;
+    debug::LatencyHistogram latency;  // nanoseconds per operation
+    uint64_t allocations = 0;
+};
+
+std::vector<Result> results;
+Options options;
+
+bool selected(const std::string& name) {
+    return options.filter.empty() || name.find(options.filter) != std::string::npos;
+}
+
+double budget_seconds() {
+    return options.quick ? 0.05 : 0.4;
+}
+
+// Runs body(thread_index, batch) on `threads` calling threads until the time
+// budget is spent. Each call performs `batch` operations and is timed as one
+// sample. pool_threads only labels cases that drive a ThreadPool.
+template <typename Body>
+void run(const std::string& name, const std::string& variant, size_t threads, size_t size, size_t batch, Body body,
+         size_t pool_threads = 0) {
+    std::vector<debug::LatencyHistogram> histograms(threads);
+    std::vector<uint64_t> counts(threads, 0);
+    std::atomic<bool> stop{false};
+    std::atomic<size_t> ready{0};
+
+    auto worker = [&](size_t index) {
+        ready++;
+        while (ready.load() < threads) threading::cpu_relax();
+        while (!stop.load(std::memory_order_relaxed)) {
+            auto start = std::chrono::steady_clock::now();
+            body(index, batch);
+            auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+            histograms[index].record(static_cast<uint64_t>(ns) / batch, batch);
+            counts[index] += batch;
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (size_t i = 1; i < threads; i++) workers.emplace_back(worker, i);
+    uint64_t allocations_before = allocations.load(std::memory_order_relaxed);
+    auto start = std::chrono::steady_clock::now();
+    std::thread timer([&] {
+        std::this_thread::sleep_for(std::chrono::duration<double>(budget_seconds()));
+        stop = true;
+    });
+    worker(0);
+    for (auto& w : workers) w.join();
+    timer.join();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    Result result{name, variant, threads, pool_threads, size, 0, seconds, {},
+                  allocations.load(std::memory_order_relaxed) - allocations_before};
+    for (size_t i = 0; i < threads; i++) {
+        result.ops += counts[i];
+        result.latency.merge(histograms[i]);
+    }
+    std::cerr << name << "/" << variant << " threads=" << threads << " pool=" << pool_threads << " size=" << size << ": "
+              << static_cast<uint64_t>(result.ops / seconds) << " ops/s, p99 " << result.latency.percentile(99) << "ns, "
+              << static_cast<double>(result.allocations) / static_cast<double>(std::max<uint64_t>(result.ops, 1)) << " allocs/op\n";
+    results.push_back(std::move(result));
+}
+
+std::string to_json() {
+    std::ostringstream out;
+    out << "{\n  \"hardware_concurrency\": " << std::thread::hardware_concurrency() << ",\n  \"results\": [\n";
+    for (size_t i = 0; i < results.size(); i++) {
+        const Result& r = results[i];
+        out << "    {\"name\": \"" << r.name << "\", \"variant\": \"" << r.variant << "\", \"threads\": " << r.threads
+            << ", \"pool_threads\": " << r.pool_threads << ", \"size\": " << r.size << ", \"ops\": " << r.ops << ", \"seconds\": " << r.seconds
+            << ", \"ops_per_sec\": " << static_cast<uint64_t>(r.ops / r.seconds)
+            << ", \"allocs_per_op\": " << static_cast<double>(r.allocations) / static_cast<double>(std::max<uint64_t>(r.ops, 1))
+            << ", \"latency_ns\": {\"mean\": " << r.latency.mean() << ", \"p50\": " << r.latency.percentile(50)
+            << ", \"p99\": " << r.latency.percentile(99) << ", \"p999\": " << r.latency.percentile(99.9)
+            << ", \"max\": " << r.latency.max() << "}}" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    out << "  ]\n}\n";
+    return out.str();
+}
+
+std::string random_text(size_t length) {
+    static std::mt19937 rng(42);
+    static const char alphabet[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+    std::string text(length, ' ');
+    for (char& c : text) c = alphabet[rng() % (sizeof(alphabet) - 1)];
+    return text;
+}
+
+std::string make_text(size_t fields, size_t field_length) {
+    std::string text;
+    for (size_t i = 0; i < fields; i++) {
+        if (i) text += ',';
+        text += random_text(field_length);
+    }
+    return text;
+}
+
+// Keeps the optimizer from discarding a benchmarked result.
+template <typename T>
+void keep(const T& value) {
+#if defined(__GNUC__) || defined(__clang__)
+    asm volatile("" : : "g"(&value) : "memory");
+#else
+    static const void* volatile sink;
+    sink = &value;
+#endif
+}
+
+// ---------------------------------------------
+// Cases
+// ---------------------------------------------
+void bench_split() {
+    if (!selected("string.split")) return;
+    for (size_t fields : {8, 64, 1024}) {
+        std::string text = make_text(fields, 12);
+        run("string.split", "baseline", 1, fields, 64, [&](size_t, size_t n) {
+            for (size_t i = 0; i < n; i++) keep(baseline::split(text, ","));
+        });
+        run("string.split", "split", 1, fields, 64, [&](size_t, size_t n) {
+            for (size_t i = 0; i < n; i++) keep(string::split(text, ","));
+        });
+        std::vector<std::string_view> pieces;
+        run("string.split", "split_into_view", 1, fields, 64, [&](size_t, size_t n) {
+            for (size_t i = 0; i < n; i++) keep(string::split_into(text, ",", pieces));
+        });
+    }
+}
+
+void bench_url() {
+    if (!selected("net.url")) return;
+    for (size_t length : {16, 256, 4096}) {
+        std::string text = random_text(length) + " /?&=";
+        run("net.url_encode", "baseline", 1, length, 256, [&](size_t, size_t n) {
+            for (size_t i = 0; i < n; i++) keep(baseline::url_encode(text));
+        });
+        std::string buffer;
+        run("net.url_encode", "append", 1, length, 256, [&](size_t, size_t n) {
+            for (size_t i = 0; i < n; i++) {
+                buffer.clear();
+                net::url_encode_append(buffer, text);
+            }
+        });
+    }
+
+    std::string query;
+    for (int i = 0; i < 30; i++) query += (i ? "&k" : "k") + std::to_string(i) + "=value%20" + std::to_string(i);
+    run("net.query", "baseline", 1, 30, 256, [&](size_t, size_t n) {
+        for (size_t i = 0; i < n; i++) keep(baseline::parse_query_string(query));
+    });
+    run("net.query", "parse_query_string", 1, 30, 256, [&](size_t, size_t n) {
+        for (size_t i = 0; i < n; i++) keep(net::parse_query_string(query));
+    });
+    net::QueryParams<32> params;
+    run("net.query", "QueryParams", 1, 30, 256, [&](size_t, size_t n) {
+        for (size_t i = 0; i < n; i++) keep(params.parse(query));
+    });
+}
+
+void bench_time() {
+    if (selected("time.format_time")) {
+        run("time.format_time", "baseline", 1, 1, 64, [&](size_t, size_t n) {
+            for (size_t i = 0; i < n; i++) keep(baseline::format_time("%Y-%m-%d %H:%M:%S"));
+        });
+        run("time.format_time", "format_time", 1, 1, 64, [&](size_t, size_t n) {
+            for (size_t i = 0; i < n; i++) keep(time::format_time());
+        });
+        std::string buffer;
+        run("time.format_time", "format_time_append", 1, 1, 64, [&](size_t, size_t n) {
+            for (size_t i = 0; i < n; i++) {
+                buffer.clear();
+                time::format_time_append(buffer, time::coarse_timestamp());
+            }
+        });
+    }
+    if (selected("time.now")) {
+        for (size_t threads : options.threads) {
+            run("time.now", "system_clock", threads, 1, 256, [&](size_t, size_t n) {
+                for (size_t i = 0; i < n; i++) keep(std::chrono::system_clock::now());
+            });
+            run("time.now", "timestamp", threads, 1, 256, [&](size_t, size_t n) {
+                for (size_t i = 0; i < n; i++) keep(time::timestamp());
+            });
+            time::CoarseClock& clock = time::CoarseClock::instance();
+            run("time.now", "CoarseClock", threads, 1, 256, [&](size_t, size_t n) {
+                for (size_t i = 0; i < n; i++) keep(clock.now_ms());
+            });
+        }
+    }
+}
+
+void bench_strings() {
+    for (size_t length : {16, 256, 4096}) {
+        std::string text = random_text(length);
+        if (selected("string.to_lower")) {
+            run("string.to_lower", "baseline", 1, length, 256, [&](size_t, size_t n) {
+                for (size_t i = 0; i < n; i++) keep(baseline::to_lower(text));
+            });
+            run("string.to_lower", "to_lower", 1, length, 256, [&](size_t, size_t n) {
+                for (size_t i = 0; i < n; i++) keep(string::to_lower(text));
+            });
+        }
+        if (selected("string.trim")) {
+            std::string padded = std::string(length / 4, ' ') + text + std::string(length / 4, '\t');
+            run("string.trim", "baseline", 1, length, 256, [&](size_t, size_t n) {
+                for (size_t i = 0; i < n; i++) keep(baseline::trim(padded));
+            });
+            run("string.trim", "trim", 1, length, 256, [&](size_t, size_t n) {
+                for (size_t i = 0; i < n; i++) keep(string::trim(padded));
+            });
+            run("string.trim", "trim_view", 1, length, 256, [&](size_t, size_t n) {
+                for (size_t i = 0; i < n; i++) keep(string::trim_view(padded));
+            });
+        }
+    }
+}
+
+void bench_replace() {
+    if (!selected("string.replace")) return;
+    for (size_t fields : {64, 4096}) {
+        std::string text = make_text(fields, 12);
+        run("string.replace", "baseline", 1, fields, 16, [&](size_t, size_t n) {
+            for (size_t i = 0; i < n; i++) keep(baseline::replace(text, ",", ", "));
+        });
+        run("string.replace", "replace", 1, fields, 16, [&](size_t, size_t n) {
+            for (size_t i = 0; i < n; i++) keep(string::replace(text, ",", ", "));
+        });
+
+        const std::vector<std::pair<std::string, std::string>> table = {
+            {"a", "A"}, {"e", "E"}, {"ab", "<ab>"}, {"xyz", "-"}, {"Q", "q"}, {"00", "0"}, {",", ";"}};
+        run("string.replace_all", "replace chain", 1, fields, 16, [&](size_t, size_t n) {
+            for (size_t i = 0; i < n; i++) {
+                std::string out = text;
+                for (const auto& [from, to] : table) out = string::replace(out, from, to);
+                keep(out);
+            }
+        });
+        run("string.replace_all", "replace_all", 1, fields, 16, [&](size_t, size_t n) {
+            for (size_t i = 0; i < n; i++) keep(string::replace_all(text, table));
+        });
+        string::MultiReplacer replacer(table);
+        run("string.replace_all", "MultiReplacer", 1, fields, 16, [&](size_t, size_t n) {
+            for (size_t i = 0; i < n; i++) keep(replacer.apply(text));
+        });
+    }
+}
+
+void bench_memory() {
+    struct Node {
+        Node* next;
+        uint64_t payload[3];
+    };
+    // One op allocates and frees `count` nodes.
+    const size_t count = 1024;
+    if (selected("memory.arena")) {
+        std::vector<Node*> nodes(count);
+        run("memory.arena", "new/delete", 1, count, 1, [&](size_t, size_t n) {
+            for (size_t i = 0; i < n; i++) {
+                for (auto& node : nodes) node = new Node{};
+                for (auto* node : nodes) delete node;
+            }
+        });
+        memory::Arena arena;
+        run("memory.arena", "Arena", 1, count, 1, [&](size_t, size_t n) {
+            for (size_t i = 0; i < n; i++) {
+                for (size_t j = 0; j < count; j++) keep(arena.create<Node>());
+                arena.reset();
+            }
+        });
+    }
+    if (selected("memory.fixed_pool")) {
+        using Pool = memory::FixedPool<sizeof(Node), alignof(Node)>;
+        for (size_t threads : options.threads) {
+            run("memory.fixed_pool", "new/delete", threads, count, 1, [&](size_t, size_t n) {
+                static thread_local std::vector<Node*> nodes(count);
+                for (size_t i = 0; i < n; i++) {
+                    for (auto& node : nodes) node = new Node{};
+                    for (auto* node : nodes) delete node;
+                }
+            });
+            run("memory.fixed_pool", "FixedPool", threads, count, 1, [&](size_t, size_t n) {
+                static thread_local std::vector<void*> blocks(count);
+                for (size_t i = 0; i < n; i++) {
+                    for (auto& block : blocks) block = Pool::allocate();
+                    for (void* block : blocks) Pool::deallocate(block);
+                }
+            });
+        }
+    }
+}
+
+void bench_thread_pool() {
+    if (!selected("threading.pool")) return;
+    for (size_t threads : options.threads) {
+        for (auto mode : {threading::ThreadPool::Mode::SharedQueue, threading::ThreadPool::Mode::WorkStealing}) {
+            threading::ThreadPool pool(threads, mode);
+            std::string variant = mode == threading::ThreadPool::Mode::SharedQueue ? "shared" : "stealing";
+            run("threading.pool.enqueue", variant, 1, 256, 256, [&](size_t, size_t n) {
+                std::vector<std::future<void>> futures;
+                futures.reserve(n);
+                for (size_t i = 0; i < n; i++) futures.push_back(pool.enqueue([] {}));
+                for (auto& f : futures) f.get();
+            }, threads);
+            // Future states are recycled on the submitting thread, so this
+            // should report 0 allocs/op once warmed up.
+            run("threading.pool.submit", variant, 1, 256, 256, [&](size_t, size_t n) {
+                for (size_t i = 0; i < n; i++) pool.submit([] { return 1; }).get();
+            }, threads);
+            run("threading.pool.post", variant, 1, 256, 256, [&](size_t, size_t n) {
+                std::atomic<size_t> done{0};
+                for (size_t i = 0; i < n; i++) pool.post([&done] { done.fetch_add(1, std::memory_order_release); });
+                while (done.load(std::memory_order_acquire) < n) std::this_thread::yield();
+            }, threads);
+        }
+    }
+}
+
+void bench_timer_wheel() {
+    if (!selected("threading.timer_wheel")) return;
+    threading::ThreadPool pool(1);
+    threading::TimerWheel wheel(pool);
+    // Timeouts that are almost always cancelled before they fire.
+    run("threading.timer_wheel", "schedule+cancel", 1, 1, 256, [&](size_t, size_t n) {
+        for (size_t i = 0; i < n; i++) wheel.cancel(wheel.schedule_after(std::chrono::seconds(30), [] {}));
+    });
+    std::vector<threading::TimerWheel::Handle> handles;
+    for (size_t pending : {size_t(1) << 10, size_t(1) << 16}) {
+        handles.clear();
+        for (size_t i = 0; i < pending; i++) handles.push_back(wheel.schedule_after(std::chrono::seconds(30 + i % 600), [] {}));
+        run("threading.timer_wheel", "schedule+cancel", 1, pending, 256, [&](size_t, size_t n) {
+            for (size_t i = 0; i < n; i++) wheel.cancel(wheel.schedule_after(std::chrono::milliseconds(500 + i), [] {}));
+        });
+        for (auto handle : handles) wheel.cancel(handle);
+    }
+    // Batches of 1 ms timers, waited for until all have run on the pool.
+    run("threading.timer_wheel", "fire", 1, 256, 256, [&](size_t, size_t n) {
+        std::atomic<size_t> fired{0};
+        for (size_t i = 0; i < n; i++) wheel.schedule_after(std::chrono::milliseconds(1), [&fired] { fired.fetch_add(1); });
+        while (fired.load() < n) std::this_thread::yield();
+    }, 1);
+}
+
+void bench_fs() {
+    if (!selected("fs.atomic_write") && !selected("fs.scan")) return;
+    std::filesystem::path root = std::filesystem::temp_directory_path() / ("sputil_bench_" + std::to_string(time::timestamp()));
+    std::filesystem::create_directories(root);
+
+    if (selected("fs.atomic_write")) {
+        for (size_t length : {256, 1 << 16}) {
+            std::string content = random_text(length);
+            std::string path = (root / "config.json").string();
+            run("fs.atomic_write", "write_file", 1, length, 1, [&](size_t, size_t n) {
+                for (size_t i = 0; i < n; i++) fs::write_file(path, content);
+            });
+            // Includes the file and directory fsyncs, so this mostly measures the disk.
+            run("fs.atomic_write", "atomic_write", 1, length, 1, [&](size_t, size_t n) {
+                for (size_t i = 0; i < n; i++) fs::atomic_write(path, content);
+            });
+        }
+    }
+
+    if (selected("fs.scan")) {
+        // 16 x 16 directories of 8 files each; a quarter of the files match.
+        std::filesystem::path tree = root / "tree";
+        size_t files = 0;
+        for (int a = 0; a < 16; a++) {
+            for (int b = 0; b < 16; b++) {
+                std::filesystem::path dir = tree / ("a" + std::to_string(a)) / ("b" + std::to_string(b));
+                std::filesystem::create_directories(dir);
+                for (int f = 0; f < 8; f++, files++) fs::write_file((dir / ("f" + std::to_string(f) + (f % 4 ? ".txt" : ".log"))).string(), "x");
+            }
+        }
+        std::string tree_path = tree.string();
+        run("fs.scan", "recursive_directory_iterator", 1, files, 1, [&](size_t, size_t n) {
+            for (size_t i = 0; i < n; i++) {
+                size_t matched = 0;
+                for (const auto& entry : std::filesystem::recursive_directory_iterator(tree_path))
+                    if (entry.is_regular_file() && entry.path().extension() == ".log") matched++;
+                keep(matched);
+            }
+        });
+        fs::ScanOptions scan_options;
+        scan_options.extensions = {".log"};
+        for (size_t threads : options.threads) {
+            threading::ThreadPool pool(threads);
+            run("fs.scan", "scan", 1, files, 1, [&](size_t, size_t n) {
+                for (size_t i = 0; i < n; i++) keep(fs::scan(pool, tree_path, scan_options, [](const fs::ScanEntry&) {}));
+            }, threads);
+        }
+    }
+
+    std::error_code ec;
+    std::filesystem::remove_all(root, ec);
+}
+
+void bench_rate_limiter() {
+    if (!selected("concurrency.rate_limiter")) return;
+    // A rate no caller can reach, so every call is granted and the case
+    // measures the limiter's own cost.
+    const double rate = 1e12;
+    for (size_t threads : options.threads) {
+        concurrency::RateLimiter limiter(rate, 1 << 20);
+        run("concurrency.rate_limiter", "RateLimiter", threads, 1, 256, [&](size_t, size_t n) {
+            for (size_t i = 0; i < n; i++) keep(limiter.try_acquire());
+        });
+        concurrency::ShardedRateLimiter sharded(rate, 1 << 20);
+        run("concurrency.rate_limiter", "ShardedRateLimiter", threads, 1, 256, [&](size_t, size_t n) {
+            for (size_t i = 0; i < n; i++) keep(sharded.try_acquire());
+        });
+    }
+}
+
+#if defined(SPUTIL_HAS_COROUTINES)
+async::Task<int> leaf(int value) {
+    co_return value;
+}
+
+async::Task<int> chain(int depth) {
+    if (depth == 0) co_return 0;
+    co_return 1 + co_await chain(depth - 1);
+}
+
+async::Task<int> hop(threading::ThreadPool& pool, int value) {
+    co_await pool;
+    co_return value;
+}
+
+async::Task<int> fan_out(threading::ThreadPool& pool, int width) {
+    std::vector<async::Task<int>> tasks;
+    for (int i = 0; i < width; i++) tasks.push_back(hop(pool, i));
+    std::vector<int> values = co_await async::when_all(std::move(tasks));
+    co_return std::accumulate(values.begin(), values.end(), 0);
+}
+
+void bench_task() {
+    if (!selected("async.task")) return;
+    run("async.task", "sync_wait", 1, 1, 256, [&](size_t, size_t n) {
+        for (size_t i = 0; i < n; i++) keep(async::sync_wait(leaf(static_cast<int>(i))));
+    });
+    run("async.task", "await chain", 1, 64, 4, [&](size_t, size_t n) {
+        for (size_t i = 0; i < n; i++) keep(async::sync_wait(chain(64)));
+    });
+    for (size_t threads : options.threads) {
+        threading::ThreadPool pool(threads);
+        run("async.task", "schedule", 1, 1, 64, [&](size_t, size_t n) {
+            for (size_t i = 0; i < n; i++) keep(async::sync_wait(hop(pool, static_cast<int>(i))));
+        }, threads);
+        run("async.task", "when_all", 1, 64, 1, [&](size_t, size_t n) {
+            for (size_t i = 0; i < n; i++) keep(async::sync_wait(fan_out(pool, 64)));
+        }, threads);
+    }
+}
+#endif
+
+template <typename Lock>
+void bench_lock(const char* variant, size_t threads) {
+    Lock lock;
+    uint64_t shared[8] = {};
+    run("threading.lock", variant, threads, 1, 256, [&](size_t, size_t n) {
+        for (size_t i = 0; i < n; i++) {
+            std::lock_guard<Lock> guard(lock);
+            for (uint64_t& v : shared) v++;
+        }
+    });
+}
+
+void bench_locks() {
+    if (!selected("threading.lock")) return;
+    for (size_t threads : options.threads) {
+        bench_lock<std::mutex>("std::mutex", threads);
+        bench_lock<threading::TicketSpinLock>("TicketSpinLock", threads);
+        bench_lock<threading::AdaptiveMutex>("AdaptiveMutex", threads);
+        bench_lock<threading::ReaderWriterLock>("ReaderWriterLock", threads);
+    }
+}
+
+void bench_queues() {
+    if (!selected("concurrency.queue")) return;
+    for (size_t threads : options.threads) {
+        concurrency::ConcurrentQueue<int> locked;
+        run("concurrency.queue", "ConcurrentQueue", threads, threads, 256, [&](size_t, size_t n) {
+            int value;
+            for (size_t i = 0; i < n; i++) {
+                locked.push(static_cast<int>(i));
+                locked.try_pop(value);
+            }
+        });
+        concurrency::MPMCQueue<int> bounded(1 << 14);
+        run("concurrency.queue", "MPMCQueue", threads, threads, 256, [&](size_t, size_t n) {
+            int value;
+            for (size_t i = 0; i < n; i++) {
+                bounded.try_push(static_cast<int>(i));
+                bounded.try_pop(value);
+            }
+        });
+    }
+}
+
+void bench_pipeline() {
+    if (!selected("concurrency.pipeline")) return;
+    auto work = [](uint64_t x) { return x * 0x9E3779B97F4A7C15ull ^ (x >> 29); };
+    for (size_t threads : options.threads) {
+        // One producer feeding `threads` consumers, one item per lock and wakeup.
+        concurrency::ConcurrentQueue<uint64_t> queue(1024);
+        std::atomic<uint64_t> sink{0};
+        std::vector<std::thread> consumers;
+        for (size_t i = 0; i < threads; i++) {
+            consumers.emplace_back([&] {
+                uint64_t value, sum = 0;
+                while (queue.pop(value)) sum += work(value);
+                sink += sum;
+            });
+        }
+        run("concurrency.pipeline", "per-item", 1, 1024, 256, [&](size_t, size_t n) {
+            for (size_t i = 0; i < n; i++) queue.push(i);
+        }, threads);
+        queue.close();
+        for (auto& c : consumers) c.join();
+
+        auto pipeline = concurrency::Pipeline<uint64_t>(1024)
+            .batch<void>("work", [&](std::vector<uint64_t>& items) {
+                uint64_t sum = 0;
+                for (uint64_t x : items) sum += work(x);
+                sink += sum;
+            }, {threads, 256});
+        std::vector<uint64_t> items(256);
+        std::iota(items.begin(), items.end(), 0);
+        run("concurrency.pipeline", "Pipeline", 1, 1024, 256, [&](size_t, size_t n) {
+            pipeline.push_bulk(items.begin(), items.begin() + n);
+        }, threads);
+        pipeline.wait();
+        keep(sink.load());
+    }
+}
+
+void bench_concurrent_map() {
+    if (!selected("concurrency.map")) return;
+    const size_t keys = 1 << 16;
+    std::unordered_map<uint32_t, uint32_t> locked;
+    std::mutex mutex;
+    concurrency::ConcurrentHashMap<uint32_t, uint32_t> shared(keys);
+    for (uint32_t k = 0; k < keys; k++) {
+        locked[k] = k;
+        shared.insert(k, k);
+    }
+    for (size_t threads : options.threads) {
+        // 1 write per 100 operations, the rest reads.
+        run("concurrency.map", "unordered_map+mutex", threads, keys, 256, [&](size_t index, size_t n) {
+            uint32_t x = static_cast<uint32_t>(index * 2654435761u + 1);
+            for (size_t i = 0; i < n; i++) {
+                x = x * 1664525u + 1013904223u;
+                uint32_t key = x % keys;
+                std::lock_guard<std::mutex> lock(mutex);
+                if (x % 100 == 0) locked[key] = x;
+                else keep(locked.find(key)->second);
+            }
+        });
+        run("concurrency.map", "ConcurrentHashMap", threads, keys, 256, [&](size_t index, size_t n) {
+            uint32_t x = static_cast<uint32_t>(index * 2654435761u + 1);
+            for (size_t i = 0; i < n; i++) {
+                x = x * 1664525u + 1013904223u;
+                uint32_t key = x % keys;
+                if (x % 100 == 0) shared.insert_or_assign(key, x);
+                else keep(*shared.find(key));
+            }
+        });
+    }
+}
+
+void bench_metrics() {
+    if (!selected("metrics.counter")) return;
+    for (size_t threads : options.threads) {
+        std::atomic<uint64_t> shared{0};
+        run("metrics.counter", "std::atomic", threads, 1, 256, [&](size_t, size_t n) {
+            for (size_t i = 0; i < n; i++) shared.fetch_add(1, std::memory_order_relaxed);
+        });
+        metrics::Counter counter;
+        run("metrics.counter", "Counter", threads, 1, 256, [&](size_t, size_t n) {
+            for (size_t i = 0; i < n; i++) counter.add();
+        });
+        metrics::Histogram histogram;
+        run("metrics.counter", "Histogram", threads, 1, 256, [&](size_t index, size_t n) {
+            for (size_t i = 0; i < n; i++) histogram.record(index * 131 + i);
+        });
+        keep(shared.load() + counter.value() + histogram.snapshot().count);
+    }
+}
+
+void bench_lru() {
+    if (!selected("algorithm.lru")) return;
+    const size_t capacity = 1 << 16;
+    for (size_t threads : options.threads) {
+        baseline::LRUCache reference(capacity);
+        run("algorithm.lru", "baseline", threads, capacity, 256, [&](size_t index, size_t n) {
+            uint32_t x = static_cast<uint32_t>(index * 2654435761u + 1);
+            int value;
+            for (size_t i = 0; i < n; i++) {
+                x = x * 1664525u + 1013904223u;
+                int key = static_cast<int>(x % (capacity * 2));
+                if (!reference.get(key, value)) reference.put(key, key);
+            }
+        });
+
+        algorithm::LRUCache<int, int> single(capacity);
+        std::mutex mutex;
+        run("algorithm.lru", "LRUCache+mutex", threads, capacity, 256, [&](size_t index, size_t n) {
+            uint32_t x = static_cast<uint32_t>(index * 2654435761u + 1);
+            for (size_t i = 0; i < n; i++) {
+                x = x * 1664525u + 1013904223u;
+                int key = static_cast<int>(x % (capacity * 2));
+                std::lock_guard<std::mutex> lock(mutex);
+                if (!single.get(key)) single.put(key, key);
+            }
+        });
+
+        algorithm::ShardedLRUCache<int, int> sharded(capacity);
+        run("algorithm.lru", "ShardedLRUCache", threads, capacity, 256, [&](size_t index, size_t n) {
+            uint32_t x = static_cast<uint32_t>(index * 2654435761u + 1);
+            for (size_t i = 0; i < n; i++) {
+                x = x * 1664525u + 1013904223u;
+                int key = static_cast<int>(x % (capacity * 2));
+                if (!sharded.get(key)) sharded.put(key, key);
+            }
+        });
+    }
+}
+
+void bench_hash() {
+    if (!selected("hash.map")) return;
+    for (size_t size : {size_t(1) << 10, size_t(1) << 20}) {
+        std::vector<uint64_t> keys(size);
+        std::mt19937_64 rng(7);
+        for (auto& k : keys) k = rng();
+        std::unordered_map<uint64_t, uint64_t> node_map;
+        hash::FlatHashMap<uint64_t, uint64_t> flat_map;
+        for (uint64_t k : keys) {
+            node_map[k] = k;
+            flat_map[k] = k;
+        }
+
+        size_t cursor = 0;
+        run("hash.map", "std::unordered_map", 1, size, 256, [&](size_t, size_t n) {
+            for (size_t i = 0; i < n; i++) keep(node_map.find(keys[cursor++ & (size - 1)])->second);
+        });
+        run("hash.map", "FlatHashMap", 1, size, 256, [&](size_t, size_t n) {
+            for (size_t i = 0; i < n; i++) keep(flat_map.find(keys[cursor++ & (size - 1)])->second);
+        });
+
+        std::vector<std::string> words(size);
+        for (auto& w : words) w = random_text(12);
+        std::unordered_map<std::string, int> node_words;
+        hash::FlatHashMap<std::string, int> flat_words;
+        for (const auto& w : words) {
+            node_words[w] = 1;
+            flat_words[w] = 1;
+        }
+        run("hash.map", "std::unordered_map<string>", 1, size, 256, [&](size_t, size_t n) {
+            for (size_t i = 0; i < n; i++) keep(node_words.count(words[cursor++ & (size - 1)]));
+        });
+        run("hash.map", "FlatHashMap<string>", 1, size, 256, [&](size_t, size_t n) {
+            for (size_t i = 0; i < n; i++) keep(flat_words.count(std::string_view(words[cursor++ & (size - 1)])));
+        });
+    }
+}
+
+void bench_search() {
+    if (!selected("algorithm.search")) return;
+    for (size_t size : {size_t(1) << 12, size_t(1) << 24}) {
+        if (options.quick && size > (size_t(1) << 20)) size = size_t(1) << 20;
+        std::vector<int32_t> keys(size);
+        for (size_t i = 0; i < size; i++) keys[i] = static_cast<int32_t>(i * 3);
+        algorithm::EytzingerIndex<int32_t> eytzinger(keys);
+        algorithm::STreeIndex<int32_t> stree(keys);
+        const size_t batch = 256;
+        std::vector<int32_t> queries(batch);
+        std::vector<size_t> positions(batch);
+        uint32_t x = 12345;
+        auto refill = [&] {
+            for (auto& q : queries) {
+                x = x * 1664525u + 1013904223u;
+                q = static_cast<int32_t>(x % (size * 3));
+            }
+        };
+
+        run("algorithm.search", "std::lower_bound", 1, size, batch, [&](size_t, size_t n) {
+            refill();
+            for (size_t i = 0; i < n; i++) keep(std::lower_bound(keys.begin(), keys.end(), queries[i]));
+        });
+        run("algorithm.search", "lower_bound", 1, size, batch, [&](size_t, size_t n) {
+            refill();
+            for (size_t i = 0; i < n; i++) keep(algorithm::lower_bound(keys, queries[i]));
+        });
+        run("algorithm.search", "EytzingerIndex", 1, size, batch, [&](size_t, size_t n) {
+            refill();
+            for (size_t i = 0; i < n; i++) keep(eytzinger.lower_bound(queries[i]));
+        });
+        run("algorithm.search", "EytzingerIndex::batch", 1, size, batch, [&](size_t, size_t n) {
+            refill();
+            eytzinger.lower_bound_batch(queries.data(), n, positions.data());
+            keep(positions);
+        });
+        run("algorithm.search", "STreeIndex", 1, size, batch, [&](size_t, size_t n) {
+            refill();
+            for (size_t i = 0; i < n; i++) keep(stree.lower_bound(queries[i]));
+        });
+    }
+}
+
+void bench_parallel() {
+    if (!selected("algorithm.reduce") && !selected("algorithm.sort")) return;
+    for (size_t size : {size_t(1) << 12, size_t(1) << 20}) {
+        std::vector<int> data(size);
+        for (size_t i = 0; i < size; i++) data[i] = static_cast<int>((i * 2654435761u) % 1000);
+        run("algorithm.reduce", "std::accumulate", 1, size, 1, [&](size_t, size_t n) {
+            for (size_t i = 0; i < n; i++) keep(std::accumulate(data.begin(), data.end(), 0LL));
+        });
+        run("algorithm.sort", "std::sort", 1, size, 1, [&](size_t, size_t n) {
+            for (size_t i = 0; i < n; i++) {
+                std::vector<int> copy = data;
+                std::sort(copy.begin(), copy.end());
+            }
+        });
+        run("algorithm.sort", "algorithm::sort", 1, size, 1, [&](size_t, size_t n) {
+            for (size_t i = 0; i < n; i++) {
+                std::vector<int> copy = data;
+                algorithm::sort(copy.begin(), copy.end());
+            }
+        });
+        run("algorithm.sort", "pdq_sort", 1, size, 1, [&](size_t, size_t n) {
+            for (size_t i = 0; i < n; i++) {
+                std::vector<int> copy = data;
+                algorithm::pdq_sort(copy.begin(), copy.end(), [](int a, int b) { return a < b; });
+            }
+        });
+        // Not radix sortable, so algorithm::sort must fall back to pdq_sort.
+        std::vector<long double> wide(data.begin(), data.end());
+        run("algorithm.sort", "algorithm::sort<long double>", 1, size, 1, [&](size_t, size_t n) {
+            for (size_t i = 0; i < n; i++) {
+                std::vector<long double> copy = wide;
+                algorithm::sort(copy.begin(), copy.end());
+                if (!std::is_sorted(copy.begin(), copy.end())) throw std::runtime_error("long double sort out of order");
+            }
+        });
+    }
+    for (size_t threads : options.threads) {
+        threading::ThreadPool pool(threads);
+        for (size_t size : {size_t(1) << 12, size_t(1) << 20}) {
+            std::vector<int> data(size);
+            for (size_t i = 0; i < size; i++) data[i] = static_cast<int>((i * 2654435761u) % 1000);
+            run("algorithm.reduce", "parallel_reduce", 1, size, 1, [&](size_t, size_t n) {
+                for (size_t i = 0; i < n; i++) keep(algorithm::parallel_reduce(pool, data, 0LL, [](long long a, int b) { return a + b; }, std::plus<long long>()));
+            }, threads);
+            run("algorithm.sort", "parallel_merge_sort", 1, size, 1, [&](size_t, size_t n) {
+                for (size_t i = 0; i < n; i++) {
+                    std::vector<int> copy = data;
+                    algorithm::parallel_merge_sort(pool, copy);
+                }
+            }, threads);
+            run("algorithm.sort", "parallel_sort", 1, size, 1, [&](size_t, size_t n) {
+                for (size_t i = 0; i < n; i++) {
+                    std::vector<int> copy = data;
+                    algorithm::parallel_sort(pool, copy);
+                }
+            }, threads);
+        }
+    }
+}
+
+int main(int argc, char** argv) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--filter" && i + 1 < argc) options.filter = argv[++i];
+        else if (arg == "--out" && i + 1 < argc) options.out = argv[++i];
+        else if (arg == "--quick") options.quick = true;
+        else if (arg == "--threads" && i + 1 < argc) {
+            for (std::string_view count : string::split_view(argv[++i], ",")) {
+                options.threads.push_back(std::max<size_t>(1, std::stoul(std::string(count))));
+            }
+        } else {
+            std::cerr << "usage: " << argv[0] << " [--filter <substring>] [--threads 1,2,4] [--quick] [--out file]\n";
+            return 1;
+        }
+    }
+    if (options.threads.empty()) {
+        size_t hardware = std::max(1u, std::thread::hardware_concurrency());
+        for (size_t t = 1; t < hardware; t *= 2) options.threads.push_back(t);
+        options.threads.push_back(hardware);
+    }
+
+    bench_split();
+    bench_url();
+    bench_time();
+    bench_strings();
+    bench_replace();
+    bench_memory();
+    bench_thread_pool();
+    bench_timer_wheel();
+    bench_fs();
+    bench_locks();
+    bench_queues();
+    bench_pipeline();
+    bench_concurrent_map();
+    bench_lru();
+    bench_rate_limiter();
+    bench_metrics();
+    bench_hash();
+    bench_search();
+    bench_parallel();
+#if defined(SPUTIL_HAS_COROUTINES)
+    bench_task();
+#endif
+
+    std::string json = to_json();
+    if (options.out.empty()) {
+        std::cout << json;
+    } else {
+        fs::write_file(options.out, json);
+    }
+    return 0;
+}
@@ -68,11 +68,16 @@ int main()
     std::cout << "\n";
 
     // ---------------------------------------------
-    // 5. DEBUG - Fix this soon!
+    // 5. DEBUG
     // ---------------------------------------------
-    // {
-    //     SPTR_SCOPE_TIMER();
-    //     time::sleep(0.5);
-    // }
-    // std::cout << "[DEBUG] ScopeTimer was finished successfully.\n\n";
+    {
+        SPTR_SCOPE_TIMER();
+        time::sleep(0.5);
+    }
+    std::cout << "[DEBUG] ScopeTimer was finished successfully.\n\n";
+    
+    for (int i = 0; i < 1000; i++) {
+        SPUTIL_PROFILE_SCOPE("example_loop");
+    }
+    std::cout << debug::Profiler::instance().summary() << "\n";
 }
@@ -25,6 +25,7 @@ SOFTWARE.
 
 #include <iostream>
 #include <string>
+#include <string_view>
 #include <algorithm>
 #include <chrono>
 #include <vector>
@@ -48,6 +49,81 @@ SOFTWARE.
 #include <condition_variable>
 #include <future>
 #include <optional>
+#include <variant>
+#include <list>
+#include <deque>
+#include <memory>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <cstddef>
+#include <iterator>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <new>
+
+#include <cstring>
+#include <cerrno>
+#include <cstdio>
+#include <ctime>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#include <immintrin.h>
+#endif
+
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#endif
+
+#if __has_include(<memory_resource>)
+#include <memory_resource>
+#endif
+
+#if __has_include(<span>)
+#include <span>
+#endif
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#include <coroutine>
+#define SPUTIL_HAS_COROUTINES 1
+#endif
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#include <io.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <unistd.h>
+#endif
+
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+#if !defined(SPUTIL_NO_SIMD)
+#if defined(__SSE2__) || defined(_M_X64)
+#define SPUTIL_SIMD_SSE2 1
+#if defined(__GNUC__) || defined(__clang__)
+#define SPUTIL_SIMD_AVX2 1
+#endif
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#define SPUTIL_SIMD_NEON 1
+#include <arm_neon.h>
+#endif
+#endif
 
 namespace sputil
 {
@@ -70,650 +146,9904 @@ namespace sputil
                 std::chrono::system_clock::now().time_since_epoch()).count();
         }
         
+        // Thread-safe replacement for std::localtime.
+        std::tm local_time(std::time_t seconds)
+        {
+            std::tm result{};
+#if defined(_WIN32)
+            localtime_s(&result, &seconds);
+#else
+            localtime_r(&seconds, &result);
+#endif
+            return result;
+        }
+        
+        // Appends epoch_ms rendered with the strftime format to out, plus
+        // ".mmm" when milliseconds is set. The rendered second is cached per
+        // thread, so repeated calls within one second only redo the suffix.
+        void format_time_append(std::string& out, long long epoch_ms,
+                                const std::string& format = "%Y-%m-%d %H:%M:%S", bool milliseconds = false)
+        {
+            struct Cache
+            {
+                long long second = std::numeric_limits<long long>::min();
+                std::string format;
+                std::string text;
+            };
+            static thread_local Cache cache;
+            
+            long long second = epoch_ms >= 0 ? epoch_ms / 1000 : (epoch_ms - 999) / 1000;
+            if (second != cache.second || format != cache.format)
+            {
+                std::tm parts = local_time(static_cast<std::time_t>(second));
+                cache.text.resize(std::max<size_t>(64, format.size() * 4));
+                size_t length;
+                while ((length = std::strftime(&cache.text[0], cache.text.size(), format.c_str(), &parts)) == 0 &&
+                       !format.empty() && cache.text.size() < 4096)
+                {
+                    cache.text.resize(cache.text.size() * 2);
+                }
+                cache.text.resize(length);
+                cache.second = second;
+                cache.format = format;
+            }
+            
+            out += cache.text;
+            if (milliseconds)
+            {
+                int ms = static_cast<int>(epoch_ms - second * 1000);
+                char suffix[4] = {'.', static_cast<char>('0' + ms / 100), static_cast<char>('0' + ms / 10 % 10),
+                                  static_cast<char>('0' + ms % 10)};
+                out.append(suffix, 4);
+            }
+        }
+        
         std::string format_time(const std::string& format = "%Y-%m-%d %H:%M:%S")
         {
-            auto now = std::chrono::system_clock::now();
-            auto time_t = std::chrono::system_clock::to_time_t(now);
-            std::stringstream ss;
-            ss << std::put_time(std::localtime(&time_t), format.c_str());
-            return ss.str();
+            std::string result;
+            format_time_append(result, timestamp(), format);
+            return result;
+        }
+        
+        // format_time with a ".mmm" millisecond suffix.
+        std::string format_time_ms(const std::string& format = "%Y-%m-%d %H:%M:%S")
+        {
+            std::string result;
+            format_time_append(result, timestamp(), format, true);
+            return result;
         }
         
+        // Monotonic stopwatch on steady_clock.
         class Timer
         {
         private:
-            std::chrono::time_point<std::chrono::high_resolution_clock> start_time;
+            std::chrono::steady_clock::time_point start_time;
             
         public:
-            Timer() : start_time(std::chrono::high_resolution_clock::now()) {}
+            Timer() : start_time(std::chrono::steady_clock::now()) {}
             
             void reset()
             {
-                start_time = std::chrono::high_resolution_clock::now();
+                start_time = std::chrono::steady_clock::now();
             }
             
             double elapsed() const
             {
-                auto end_time = std::chrono::high_resolution_clock::now();
+                auto end_time = std::chrono::steady_clock::now();
                 return std::chrono::duration<double>(end_time - start_time).count();
             }
             
             double elapsed_ms() const
             {
-                auto end_time = std::chrono::high_resolution_clock::now();
+                auto end_time = std::chrono::steady_clock::now();
                 return std::chrono::duration<double, std::milli>(end_time - start_time).count();
             }
+            
+            long long elapsed_ns() const
+            {
+                return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start_time).count();
+            }
         };
-    }
-
-    // ===== ARRAY/COLLECTION UTILITIES =====
-    namespace array
-    {
-        template <typename T>
-        void shuffle(std::vector<T>& data)
-        {
-            unsigned seed = std::chrono::system_clock::now().time_since_epoch().count();
-            std::shuffle(data.begin(), data.end(), std::default_random_engine(seed));
-        }
         
-        template <typename T>
-        bool contains(const std::vector<T>& data, const T& value)
+        // Raw cycle counter: rdtsc on x86, steady_clock nanoseconds elsewhere.
+        uint64_t cpu_ticks()
         {
-            return std::find(data.begin(), data.end(), value) != data.end();
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+            return __rdtsc();
+#else
+            return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count());
+#endif
         }
         
-        template <typename T>
-        void remove_duplicates(std::vector<T>& data)
+        // Nanoseconds per cpu_ticks() unit, calibrated once against steady_clock
+        // over about 10ms on first use. Assumes an invariant TSC.
+        double ns_per_tick()
         {
-            std::sort(data.begin(), data.end());
-            data.erase(std::unique(data.begin(), data.end()), data.end());
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+            static const double scale = []
+            {
+                auto begin_time = std::chrono::steady_clock::now();
+                uint64_t begin_ticks = cpu_ticks();
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                uint64_t ticks = cpu_ticks() - begin_ticks;
+                double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - begin_time).count();
+                return ticks ? ns / static_cast<double>(ticks) : 1.0;
+            }();
+            return scale;
+#else
+            return 1.0;
+#endif
         }
         
-        template <typename T>
-        std::vector<T> slice(const std::vector<T>& data, int start, int end = -1)
+        // Stopwatch on the TSC: cheaper to read than steady_clock, calibrated
+        // through ns_per_tick().
+        class TscTimer
         {
-            if (end == -1) end = data.size();
-            if (start < 0) start = data.size() + start;
-            if (end < 0) end = data.size() + end;
+        private:
+            uint64_t start_ticks;
+            double scale;
+            
+        public:
+            TscTimer() : scale(ns_per_tick()) { start_ticks = cpu_ticks(); }
             
-            start = std::max(0, std::min(start, (int)data.size()));
-            end = std::max(0, std::min(end, (int)data.size()));
+            void reset()
+            {
+                start_ticks = cpu_ticks();
+            }
             
-            return std::vector<T>(data.begin() + start, data.begin() + end);
-        }
+            uint64_t elapsed_ticks() const { return cpu_ticks() - start_ticks; }
+            double elapsed_ns() const { return static_cast<double>(elapsed_ticks()) * scale; }
+            double elapsed_ms() const { return elapsed_ns() / 1e6; }
+            double elapsed() const { return elapsed_ns() / 1e9; }
+        };
         
-        template <typename T, typename Func>
-        std::vector<T> filter(const std::vector<T>& data, Func predicate)
+        // Millisecond clock refreshed by a background thread, so reading it is
+        // a single relaxed atomic load. Values lag real time by up to one
+        // resolution tick.
+        class CoarseClock
         {
-            std::vector<T> result;
-            std::copy_if(data.begin(), data.end(), std::back_inserter(result), predicate);
-            return result;
-        }
+        private:
+            std::atomic<long long> wall_ms;
+            std::atomic<long long> steady_ms;
+            std::chrono::milliseconds resolution;
+            std::mutex mutex;
+            std::condition_variable condition;
+            bool stopping = false;
+            std::thread updater;
+            
+            void update()
+            {
+                wall_ms.store(timestamp(), std::memory_order_relaxed);
+                steady_ms.store(std::chrono::duration_cast<std::chrono::milliseconds>(
+                    std::chrono::steady_clock::now().time_since_epoch()).count(), std::memory_order_relaxed);
+            }
+            
+        public:
+            explicit CoarseClock(std::chrono::milliseconds tick = std::chrono::milliseconds(1))
+                : resolution(tick)
+            {
+                update();
+                updater = std::thread([this]()
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    while (!condition.wait_for(lock, resolution, [this] { return stopping; })) update();
+                });
+            }
+            
+            CoarseClock(const CoarseClock&) = delete;
+            CoarseClock& operator=(const CoarseClock&) = delete;
+            
+            ~CoarseClock()
+            {
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    stopping = true;
+                }
+                condition.notify_all();
+                updater.join();
+            }
+            
+            static CoarseClock& instance()
+            {
+                static CoarseClock clock;
+                return clock;
+            }
+            
+            // Milliseconds since the Unix epoch, like timestamp().
+            long long now_ms() const { return wall_ms.load(std::memory_order_relaxed); }
+            
+            // Monotonic milliseconds on the steady_clock epoch.
+            long long steady_now_ms() const { return steady_ms.load(std::memory_order_relaxed); }
+        };
         
-        template <typename T, typename Func>
-        auto map(const std::vector<T>& data, Func transform)
+        // timestamp() from the shared CoarseClock.
+        long long coarse_timestamp()
         {
-            std::vector<decltype(transform(data[0]))> result;
-            result.reserve(data.size());
-            std::transform(data.begin(), data.end(), std::back_inserter(result), transform);
-            return result;
+            return CoarseClock::instance().now_ms();
         }
     }
 
-    // ===== STRING UTILITIES =====
-    namespace string
+    // ===== MEMORY UTILITIES =====
+    namespace memory
     {
-        std::string trim(const std::string& str)
+        // Monotonic bump allocator. Memory is handed out from chunks that grow
+        // geometrically and is only reclaimed as a whole: reset() rewinds to
+        // the first chunk in O(1) and keeps every chunk for reuse, release()
+        // frees them. Objects made with create() are never destroyed, so use
+        // it for trivially destructible types or run destructors yourself.
+        class Arena
         {
-            auto start = str.begin();
-            while (start != str.end() && std::isspace(*start)) {
-                start++;
+        private:
+            struct Chunk
+            {
+                Chunk* next;
+                size_t size;   // usable bytes after the header
+                bool owned;
+                
+                char* data() { return reinterpret_cast<char*>(this + 1); }
+            };
+            
+            static constexpr size_t max_chunk_size = size_t(64) << 20;
+            
+            Chunk* first = nullptr;
+            Chunk* current = nullptr;
+            char* cursor = nullptr;
+            char* limit = nullptr;
+            size_t next_size;
+            size_t bytes_used = 0;
+            
+            void enter(Chunk* chunk)
+            {
+                current = chunk;
+                cursor = chunk->data();
+                limit = cursor + chunk->size;
             }
             
-            auto end = str.end();
-            do {
-                end--;
-            } while (std::distance(start, end) > 0 && std::isspace(*end));
+            // Moves to the next kept chunk that fits, or links in a new one.
+            void grow(size_t size, size_t align)
+            {
+                size_t needed = size + align;
+                while (current && current->next)
+                {
+                    enter(current->next);
+                    if (static_cast<size_t>(limit - cursor) >= needed) return;
+                }
+                
+                size_t chunk_size = std::max(next_size, needed);
+                void* memory = ::operator new(sizeof(Chunk) + chunk_size);
+                Chunk* chunk = new (memory) Chunk{nullptr, chunk_size, true};
+                next_size = std::min(next_size * 2, max_chunk_size);
+                if (current) current->next = chunk;
+                else first = chunk;
+                enter(chunk);
+            }
             
-            return std::string(start, end + 1);
-        }
-        
-        std::string to_lower(const std::string& str)
-        {
-            std::string result = str;
-            std::transform(result.begin(), result.end(), result.begin(), ::tolower);
-            return result;
-        }
-        
-        std::string to_upper(const std::string& str)
-        {
-            std::string result = str;
-            std::transform(result.begin(), result.end(), result.begin(), ::toupper);
-            return result;
-        }
+        public:
+            explicit Arena(size_t initial_size = 4096) : next_size(std::max<size_t>(initial_size, 64)) {}
+            
+            // Serves allocations from buffer first; buffer must outlive the arena.
+            Arena(void* buffer, size_t size, size_t next_chunk_size = 4096) : next_size(std::max<size_t>(next_chunk_size, 64))
+            {
+                void* aligned = buffer;
+                size_t space = size;
+                if (std::align(alignof(Chunk), sizeof(Chunk) + 1, aligned, space))
+                {
+                    first = new (aligned) Chunk{nullptr, space - sizeof(Chunk), false};
+                    enter(first);
+                }
+            }
+            
+            Arena(const Arena&) = delete;
+            Arena& operator=(const Arena&) = delete;
+            
+            ~Arena() { release(); }
+            
+            void* allocate(size_t size, size_t align = alignof(std::max_align_t))
+            {
+                size_t offset = (align - reinterpret_cast<uintptr_t>(cursor) % align) % align;
+                if (!cursor || static_cast<size_t>(limit - cursor) < size + offset)
+                {
+                    grow(size, align);
+                    offset = (align - reinterpret_cast<uintptr_t>(cursor) % align) % align;
+                }
+                char* result = cursor + offset;
+                cursor = result + size;
+                bytes_used += size + offset;
+                return result;
+            }
+            
+            // No-op: arena memory is reclaimed by reset() or release().
+            void deallocate(void*, size_t, size_t = alignof(std::max_align_t)) {}
+            
+            template <typename T, typename... Args>
+            T* create(Args&&... args)
+            {
+                return new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+            }
+            
+            // Rewinds to the first chunk; every chunk stays allocated for reuse.
+            void reset()
+            {
+                bytes_used = 0;
+                if (first) enter(first);
+            }
+            
+            // Returns all owned chunks to the global allocator.
+            void release()
+            {
+                Chunk* keep = nullptr;
+                for (Chunk* chunk = first; chunk;)
+                {
+                    Chunk* next = chunk->next;
+                    if (chunk->owned) ::operator delete(chunk);
+                    else keep = chunk;
+                    chunk = next;
+                }
+                first = current = keep;
+                cursor = limit = nullptr;
+                bytes_used = 0;
+                if (keep)
+                {
+                    keep->next = nullptr;
+                    enter(keep);
+                }
+            }
+            
+            size_t used() const { return bytes_used; }
+            
+            size_t capacity() const
+            {
+                size_t total = 0;
+                for (Chunk* chunk = first; chunk; chunk = chunk->next) total += chunk->size;
+                return total;
+            }
+        };
         
-        bool starts_with(const std::string& str, const std::string& prefix)
+        // Standard allocator over an Arena; deallocate is a no-op.
+        template <typename T>
+        class ArenaAllocator
         {
-            return str.size() >= prefix.size() && 
-                   str.compare(0, prefix.size(), prefix) == 0;
-        }
+        private:
+            template <typename> friend class ArenaAllocator;
+            Arena* arena;
+            
+        public:
+            using value_type = T;
+            
+            explicit ArenaAllocator(Arena& a) noexcept : arena(&a) {}
+            template <typename U>
+            ArenaAllocator(const ArenaAllocator<U>& other) noexcept : arena(other.arena) {}
+            
+            T* allocate(size_t n)
+            {
+                if (n > std::numeric_limits<size_t>::max() / sizeof(T)) throw std::bad_array_new_length();
+                return static_cast<T*>(arena->allocate(n * sizeof(T), alignof(T)));
+            }
+            
+            void deallocate(T*, size_t) noexcept {}
+            
+            template <typename U>
+            bool operator==(const ArenaAllocator<U>& other) const noexcept { return arena == other.arena; }
+            template <typename U>
+            bool operator!=(const ArenaAllocator<U>& other) const noexcept { return arena != other.arena; }
+        };
         
-        bool ends_with(const std::string& str, const std::string& suffix)
+        // Process-wide pool of Size-byte blocks. Each thread allocates from and
+        // frees into its own free list without locking; a thread holding more
+        // than a batch's worth hands the surplus to a shared list, which is
+        // also where exiting threads leave their blocks. Slabs are never
+        // returned to the system.
+        template <size_t Size, size_t Align = alignof(std::max_align_t)>
+        class FixedPool
         {
-            return str.size() >= suffix.size() && 
-                   str.compare(str.size() - suffix.size(), suffix.size(), suffix) == 0;
-        }
+        private:
+            static constexpr size_t block_size = (std::max(Size, sizeof(void*)) + Align - 1) / Align * Align;
+            static constexpr size_t batch = std::max<size_t>(16, 16384 / block_size);
+            
+            struct Block
+            {
+                Block* next;
+            };
+            
+            struct Shared
+            {
+                std::mutex mutex;
+                Block* head = nullptr;
+                size_t count = 0;
+                std::vector<void*> slabs;
+            };
+            
+            struct Local
+            {
+                Block* head = nullptr;
+                size_t count = 0;
+                
+                ~Local()
+                {
+                    if (head) give_back(*this, count);
+                }
+            };
+            
+            static Shared& shared()
+            {
+                static Shared* instance = new Shared();  // leaked so late thread exits stay safe
+                return *instance;
+            }
+            
+            static Local& local()
+            {
+                static thread_local Local instance;
+                return instance;
+            }
+            
+            // Moves n blocks from the front of local's list to the shared list.
+            static void give_back(Local& cache, size_t n)
+            {
+                Block* first = cache.head;
+                Block* last = first;
+                for (size_t i = 1; i < n; ++i) last = last->next;
+                cache.head = last->next;
+                cache.count -= n;
+                
+                Shared& pool = shared();
+                std::lock_guard<std::mutex> lock(pool.mutex);
+                last->next = pool.head;
+                pool.head = first;
+                pool.count += n;
+            }
+            
+            static void refill(Local& cache)
+            {
+                Shared& pool = shared();
+                std::lock_guard<std::mutex> lock(pool.mutex);
+                if (pool.head)
+                {
+                    for (size_t i = 0; i < batch && pool.head; ++i)
+                    {
+                        Block* block = pool.head;
+                        pool.head = block->next;
+                        pool.count--;
+                        block->next = cache.head;
+                        cache.head = block;
+                        cache.count++;
+                    }
+                    return;
+                }
+                
+                char* slab = static_cast<char*>(::operator new(block_size * batch, std::align_val_t(Align)));
+                pool.slabs.push_back(slab);
+                for (size_t i = batch; i-- > 0;)
+                {
+                    Block* block = reinterpret_cast<Block*>(slab + i * block_size);
+                    block->next = cache.head;
+                    cache.head = block;
+                }
+                cache.count += batch;
+            }
+            
+        public:
+            static void* allocate()
+            {
+                Local& cache = local();
+                if (!cache.head) refill(cache);
+                Block* block = cache.head;
+                cache.head = block->next;
+                cache.count--;
+                return block;
+            }
+            
+            static void deallocate(void* p) noexcept
+            {
+                if (!p) return;
+                Local& cache = local();
+                Block* block = static_cast<Block*>(p);
+                block->next = cache.head;
+                cache.head = block;
+                if (++cache.count > batch * 2) give_back(cache, batch);
+            }
+        };
         
-        std::vector<std::string> split(const std::string& str, const std::string& delimiter)
+        // Typed front end to FixedPool for objects of type T.
+        template <typename T>
+        class ObjectPool
         {
-            std::vector<std::string> result;
-            size_t start = 0;
-            size_t end = str.find(delimiter);
+        private:
+            using Pool = FixedPool<sizeof(T), alignof(T) < alignof(void*) ? alignof(void*) : alignof(T)>;
             
-            while (end != std::string::npos)
+        public:
+            template <typename... Args>
+            static T* create(Args&&... args)
             {
-                result.push_back(str.substr(start, end - start));
-                start = end + delimiter.length();
-                end = str.find(delimiter, start);
+                void* memory = Pool::allocate();
+                try
+                {
+                    return new (memory) T(std::forward<Args>(args)...);
+                }
+                catch (...)
+                {
+                    Pool::deallocate(memory);
+                    throw;
+                }
             }
             
-            result.push_back(str.substr(start, end));
-            return result;
-        }
+            static void destroy(T* object) noexcept
+            {
+                if (!object) return;
+                object->~T();
+                Pool::deallocate(object);
+            }
+        };
         
-        std::string join(const std::vector<std::string>& strings, const std::string& delimiter)
+        // Standard allocator that takes single-object allocations (list, map
+        // and set nodes) from the thread-local FixedPool; arrays fall through
+        // to operator new.
+        template <typename T>
+        class PoolAllocator
         {
-            if (strings.empty()) return "";
+        private:
+            using Pool = FixedPool<sizeof(T), alignof(T) < alignof(void*) ? alignof(void*) : alignof(T)>;
             
-            std::string result = strings[0];
-            for (size_t i = 1; i < strings.size(); i++)
+        public:
+            using value_type = T;
+            
+            PoolAllocator() noexcept = default;
+            template <typename U>
+            PoolAllocator(const PoolAllocator<U>&) noexcept {}
+            
+            T* allocate(size_t n)
             {
-                result += delimiter + strings[i];
+                if (n == 1) return static_cast<T*>(Pool::allocate());
+                if (n > std::numeric_limits<size_t>::max() / sizeof(T)) throw std::bad_array_new_length();
+                return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t(alignof(T))));
             }
-            return result;
-        }
+            
+            void deallocate(T* p, size_t n) noexcept
+            {
+                if (n == 1) Pool::deallocate(p);
+                else ::operator delete(p, std::align_val_t(alignof(T)));
+            }
+            
+            template <typename U>
+            bool operator==(const PoolAllocator<U>&) const noexcept { return true; }
+            template <typename U>
+            bool operator!=(const PoolAllocator<U>&) const noexcept { return false; }
+        };
         
-        std::string replace(const std::string& str, const std::string& from, const std::string& to)
+        // Fixed-length, value-initialized array with allocator-provided storage.
+        template <typename T, typename Allocator = std::allocator<T>>
+        class AllocatedArray
         {
-            std::string result = str;
-            size_t start_pos = 0;
-            while ((start_pos = result.find(from, start_pos)) != std::string::npos)
+        private:
+            using Traits = std::allocator_traits<Allocator>;
+            
+            Allocator allocator;
+            T* items = nullptr;
+            size_t count = 0;
+            
+            void destroy()
             {
-                result.replace(start_pos, from.length(), to);
-                start_pos += to.length();
+                if (!items) return;
+                for (size_t i = count; i-- > 0;) Traits::destroy(allocator, items + i);
+                Traits::deallocate(allocator, items, count);
+                items = nullptr;
+                count = 0;
             }
-            return result;
-        }
-    }
-
-    // ===== MATH UTILITIES =====
-    // namespace math
-    // {
-    //     const double PI = 3.14159265358979323846;
-    //     const double E = 2.71828182845904523536;
-        
-    //     template <typename T>
-    //     T clamp(T value, T min, T max)
-    //     {
-    //         return std::max(min, std::min(value, max));
-    //     }
-        
-    //     template <typename T>
-    //     T lerp(T a, T b, double t)
-    //     {
+            
+        public:
+            explicit AllocatedArray(const Allocator& alloc = Allocator()) : allocator(alloc) {}
+            
+            AllocatedArray(size_t n, const Allocator& alloc = Allocator()) : allocator(alloc)
+            {
+                items = Traits::allocate(allocator, n);
+                size_t built = 0;
+                try
+                {
+                    for (; built < n; ++built) Traits::construct(allocator, items + built);
+                }
+                catch (...)
+                {
+                    while (built-- > 0) Traits::destroy(allocator, items + built);
+                    Traits::deallocate(allocator, items, n);
+                    throw;
+                }
+                count = n;
+            }
+            
+            AllocatedArray(AllocatedArray&& other) noexcept
+                : allocator(std::move(other.allocator)), items(std::exchange(other.items, nullptr)), count(std::exchange(other.count, 0)) {}
+            
+            AllocatedArray& operator=(AllocatedArray&& other) noexcept
+            {
+                if (this != &other)
+                {
+                    destroy();
+                    allocator = std::move(other.allocator);
+                    items = std::exchange(other.items, nullptr);
+                    count = std::exchange(other.count, 0);
+                }
+                return *this;
+            }
+            
+            AllocatedArray(const AllocatedArray&) = delete;
+            AllocatedArray& operator=(const AllocatedArray&) = delete;
+            
+            ~AllocatedArray() { destroy(); }
+            
+            T& operator[](size_t i) { return items[i]; }
+            const T& operator[](size_t i) const { return items[i]; }
+            T* data() { return items; }
+            const T* data() const { return items; }
+            size_t size() const { return count; }
+            Allocator get_allocator() const { return allocator; }
+        };
+        
+#if defined(__cpp_lib_memory_resource)
+        // std::pmr view of an Arena, e.g. for std::pmr::vector or pmr strings.
+        class ArenaResource : public std::pmr::memory_resource
+        {
+        private:
+            Arena& arena;
+            
+        protected:
+            void* do_allocate(size_t bytes, size_t alignment) override { return arena.allocate(bytes, alignment); }
+            void do_deallocate(void*, size_t, size_t) override {}
+            bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override { return this == &other; }
+            
+        public:
+            explicit ArenaResource(Arena& a) : arena(a) {}
+        };
+        
+        // std::pmr resource that serves requests up to 256 bytes from
+        // thread-local FixedPool size classes (16-byte steps) and passes larger
+        // or over-aligned ones to upstream.
+        class PoolResource : public std::pmr::memory_resource
+        {
+        private:
+            static constexpr size_t step = 16;
+            static constexpr size_t classes = 16;
+            
+            std::pmr::memory_resource* upstream;
+            
+            template <size_t... I>
+            static void* allocate_class(size_t index, std::index_sequence<I...>)
+            {
+                static void* (*const table[])() = {&FixedPool<(I + 1) * step, step>::allocate...};
+                return table[index]();
+            }
+            
+            template <size_t... I>
+            static void deallocate_class(size_t index, void* p, std::index_sequence<I...>)
+            {
+                static void (*const table[])(void*) = {&FixedPool<(I + 1) * step, step>::deallocate...};
+                table[index](p);
+            }
+            
+        protected:
+            void* do_allocate(size_t bytes, size_t alignment) override
+            {
+                if (bytes == 0 || bytes > step * classes || alignment > step) return upstream->allocate(bytes, alignment);
+                return allocate_class((bytes - 1) / step, std::make_index_sequence<classes>());
+            }
+            
+            void do_deallocate(void* p, size_t bytes, size_t alignment) override
+            {
+                if (bytes == 0 || bytes > step * classes || alignment > step) upstream->deallocate(p, bytes, alignment);
+                else deallocate_class((bytes - 1) / step, p, std::make_index_sequence<classes>());
+            }
+            
+            // Instances share the same size-class pools, so two can free each
+            // other's blocks as long as their upstreams can too.
+            bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override
+            {
+                const PoolResource* pool = dynamic_cast<const PoolResource*>(&other);
+                return pool && (pool->upstream == upstream || pool->upstream->is_equal(*upstream));
+            }
+            
+        public:
+            explicit PoolResource(std::pmr::memory_resource* up = std::pmr::get_default_resource()) : upstream(up) {}
+        };
+#endif
+    }
+
+    // ===== HASHING UTILITIES =====
+    namespace hash
+    {
+        // 64x64 -> 128 bit multiply folded back to 64 bits.
+        uint64_t mum(uint64_t a, uint64_t b)
+        {
+#if defined(__SIZEOF_INT128__)
+            __uint128_t r = static_cast<__uint128_t>(a) * b;
+            return static_cast<uint64_t>(r) ^ static_cast<uint64_t>(r >> 64);
+#elif defined(_MSC_VER) && defined(_M_X64)
+            uint64_t high;
+            uint64_t low = _umul128(a, b, &high);
+            return low ^ high;
+#else
+            uint64_t ha = a >> 32, la = a & 0xFFFFFFFFu, hb = b >> 32, lb = b & 0xFFFFFFFFu;
+            uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+            uint64_t t = rl + (rm0 << 32);
+            uint64_t carry = t < rl;
+            uint64_t low = t + (rm1 << 32);
+            carry += low < t;
+            uint64_t high = rh + (rm0 >> 32) + (rm1 >> 32) + carry;
+            return low ^ high;
+#endif
+        }
+        
+        uint64_t read64(const unsigned char* p)
+        {
+            uint64_t v;
+            std::memcpy(&v, p, sizeof(v));
+            return v;
+        }
+        
+        uint64_t read32(const unsigned char* p)
+        {
+            uint32_t v;
+            std::memcpy(&v, p, sizeof(v));
+            return v;
+        }
+        
+        // wyhash-style byte hash: short inputs take a couple of overlapping
+        // loads, long ones are consumed 48 bytes per round in three
+        // independent lanes. Not for adversarial inputs without a secret seed.
+        uint64_t hash_bytes(const void* data, size_t len, uint64_t seed = 0)
+        {
+            constexpr uint64_t s0 = 0xa0761d6478bd642fULL;
+            constexpr uint64_t s1 = 0xe7037ed1a0b428dbULL;
+            constexpr uint64_t s2 = 0x8ebc6af09c88c6e3ULL;
+            constexpr uint64_t s3 = 0x589965cc75374cc3ULL;
+            
+            const unsigned char* p = static_cast<const unsigned char*>(data);
+            seed ^= mum(seed ^ s0, s1);
+            uint64_t a, b;
+            if (len <= 16)
+            {
+                if (len >= 4)
+                {
+                    size_t shift = (len >> 3) << 2;
+                    a = (read32(p) << 32) | read32(p + shift);
+                    b = (read32(p + len - 4) << 32) | read32(p + len - 4 - shift);
+                }
+                else if (len > 0)
+                {
+                    a = (uint64_t(p[0]) << 16) | (uint64_t(p[len >> 1]) << 8) | p[len - 1];
+                    b = 0;
+                }
+                else
+                {
+                    a = b = 0;
+                }
+            }
+            else
+            {
+                size_t i = len;
+                if (i > 48)
+                {
+                    uint64_t lane1 = seed, lane2 = seed;
+                    do
+                    {
+                        seed = mum(read64(p) ^ s1, read64(p + 8) ^ seed);
+                        lane1 = mum(read64(p + 16) ^ s2, read64(p + 24) ^ lane1);
+                        lane2 = mum(read64(p + 32) ^ s3, read64(p + 40) ^ lane2);
+                        p += 48;
+                        i -= 48;
+                    } while (i > 48);
+                    seed ^= lane1 ^ lane2;
+                }
+                while (i > 16)
+                {
+                    seed = mum(read64(p) ^ s1, read64(p + 8) ^ seed);
+                    p += 16;
+                    i -= 16;
+                }
+                a = read64(p + i - 16);
+                b = read64(p + i - 8);
+            }
+            return mum(s1 ^ len, mum(a ^ s1, b ^ seed));
+        }
+        
+        // Spreads an integer over all 64 bits, high and low, as the flat
+        // tables use both ends of the hash.
+        uint64_t hash_int(uint64_t value)
+        {
+            return mum(value ^ 0xa0761d6478bd642fULL, 0xe7037ed1a0b428dbULL);
+        }
+        
+        // Default hash for sputil containers. Integers, enums, floats and
+        // pointers are mixed directly, strings go through hash_bytes (and
+        // accept any string-like argument for heterogeneous lookup), pairs
+        // combine their members, anything else mixes std::hash.
+        template <typename T, typename Enable = void>
+        struct Hash
+        {
+            size_t operator()(const T& value) const
+            {
+                return static_cast<size_t>(hash_int(static_cast<uint64_t>(std::hash<T>()(value))));
+            }
+        };
+        
+        template <typename T>
+        struct Hash<T, std::enable_if_t<std::is_integral_v<T> || std::is_enum_v<T>>>
+        {
+            size_t operator()(T value) const
+            {
+                return static_cast<size_t>(hash_int(static_cast<uint64_t>(value)));
+            }
+        };
+        
+        template <typename T>
+        struct Hash<T, std::enable_if_t<std::is_floating_point_v<T>>>
+        {
+            size_t operator()(T value) const
+            {
+                if (value == T(0)) value = T(0);  // -0.0 == 0.0
+                return static_cast<size_t>(hash_bytes(&value, sizeof(value)));
+            }
+        };
+        
+        template <typename T>
+        struct Hash<T*>
+        {
+            size_t operator()(T* value) const
+            {
+                return static_cast<size_t>(hash_int(static_cast<uint64_t>(reinterpret_cast<uintptr_t>(value))));
+            }
+        };
+        
+        struct StringHash
+        {
+            using is_transparent = void;
+            
+            size_t operator()(std::string_view value) const
+            {
+                return static_cast<size_t>(hash_bytes(value.data(), value.size()));
+            }
+        };
+        
+        template <typename Traits, typename Alloc>
+        struct Hash<std::basic_string<char, Traits, Alloc>> : StringHash {};
+        
+        template <>
+        struct Hash<std::string_view> : StringHash {};
+        
+        template <typename A, typename B>
+        struct Hash<std::pair<A, B>>
+        {
+            size_t operator()(const std::pair<A, B>& value) const
+            {
+                uint64_t h = static_cast<uint64_t>(Hash<A>()(value.first));
+                return static_cast<size_t>(mum(h ^ 0x8ebc6af09c88c6e3ULL, static_cast<uint64_t>(Hash<B>()(value.second)) ^ 0x589965cc75374cc3ULL));
+            }
+        };
+        
+        // SwissTable internals: one control byte per slot (empty, deleted, or
+        // 7 bits of the hash when full), scanned 16 at a time. The first group
+        // of control bytes is mirrored past the end so any slot can start an
+        // unaligned group load.
+        namespace swiss
+        {
+            using ctrl_t = int8_t;
+            constexpr ctrl_t empty = -128;
+            constexpr ctrl_t deleted = -2;
+            constexpr size_t group_width = 16;
+            
+            unsigned lowest_bit(uint32_t mask)
+            {
+#if defined(_MSC_VER) && !defined(__clang__)
+                unsigned long index;
+                _BitScanForward(&index, mask);
+                return static_cast<unsigned>(index);
+#else
+                return static_cast<unsigned>(__builtin_ctz(mask));
+#endif
+            }
+            
+            unsigned highest_bit(uint32_t mask)
+            {
+#if defined(_MSC_VER) && !defined(__clang__)
+                unsigned long index;
+                _BitScanReverse(&index, mask);
+                return static_cast<unsigned>(index);
+#else
+                return 31u - static_cast<unsigned>(__builtin_clz(mask));
+#endif
+            }
+            
+#if defined(SPUTIL_SIMD_SSE2)
+            uint32_t match(const ctrl_t* group, ctrl_t h2)
+            {
+                __m128i ctrl = _mm_loadu_si128(reinterpret_cast<const __m128i*>(group));
+                return static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(h2))));
+            }
+            
+            uint32_t match_empty(const ctrl_t* group)
+            {
+                return match(group, empty);
+            }
+            
+            // Empty and deleted are the only control values with the sign bit set.
+            uint32_t match_empty_or_deleted(const ctrl_t* group)
+            {
+                return static_cast<uint32_t>(_mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(group))));
+            }
+#else
+            uint32_t match(const ctrl_t* group, ctrl_t h2)
+            {
+                uint32_t mask = 0;
+                for (size_t i = 0; i < group_width; ++i) mask |= uint32_t(group[i] == h2) << i;
+                return mask;
+            }
+            
+            uint32_t match_empty(const ctrl_t* group)
+            {
+                return match(group, empty);
+            }
+            
+            uint32_t match_empty_or_deleted(const ctrl_t* group)
+            {
+                uint32_t mask = 0;
+                for (size_t i = 0; i < group_width; ++i) mask |= uint32_t(group[i] < 0) << i;
+                return mask;
+            }
+#endif
+            
+            template <typename T, typename = void>
+            struct is_transparent : std::false_type {};
+            
+            template <typename T>
+            struct is_transparent<T, std::void_t<typename T::is_transparent>> : std::true_type {};
+            
+            // Lookup argument type: any Q when both functors are transparent,
+            // otherwise the key type itself (so arguments convert as usual).
+            template <bool Transparent>
+            struct KeyArg
+            {
+                template <typename Q, typename K>
+                using type = K;
+            };
+            
+            template <>
+            struct KeyArg<true>
+            {
+                template <typename Q, typename K>
+                using type = Q;
+            };
+        }
+        
+        // Open-addressed table shared by FlatHashMap and FlatHashSet. Slots are
+        // stored inline in one array next to the control bytes; capacity is a
+        // power of two (at least one group) and the load factor is kept at or
+        // below 7/8, tombstones included. Iterators and references are
+        // invalidated by any insertion that grows the table.
+        template <typename K, typename Slot, typename Hash, typename KeyEqual, typename Allocator>
+        class FlatTable
+        {
+        protected:
+            static constexpr bool is_set = std::is_same_v<K, Slot>;
+            static constexpr bool transparent = swiss::is_transparent<Hash>::value && swiss::is_transparent<KeyEqual>::value;
+            static constexpr size_t npos = std::numeric_limits<size_t>::max();
+            
+            template <typename Q>
+            using key_arg = typename swiss::KeyArg<transparent>::template type<Q, K>;
+            
+            using SlotAllocator = typename std::allocator_traits<Allocator>::template rebind_alloc<Slot>;
+            using SlotTraits = std::allocator_traits<SlotAllocator>;
+            using CtrlAllocator = typename std::allocator_traits<Allocator>::template rebind_alloc<swiss::ctrl_t>;
+            
+        public:
+            using key_type = K;
+            using value_type = Slot;
+            using size_type = size_t;
+            using hasher = Hash;
+            using key_equal = KeyEqual;
+            using allocator_type = Allocator;
+            
+            template <bool Const>
+            class Iterator
+            {
+            private:
+                friend class FlatTable;
+                template <bool> friend class Iterator;
+                using Table = std::conditional_t<Const, const FlatTable, FlatTable>;
+                Table* table = nullptr;
+                size_t index = 0;
+                
+                Iterator(Table* t, size_t i) : table(t), index(i) { skip(); }
+                
+                void skip()
+                {
+                    while (index < table->capacity_ && table->ctrl_[index] < 0) index++;
+                }
+                
+            public:
+                using iterator_category = std::forward_iterator_tag;
+                using value_type = Slot;
+                using difference_type = std::ptrdiff_t;
+                using reference = std::conditional_t<Const || is_set, const Slot&, Slot&>;
+                using pointer = std::conditional_t<Const || is_set, const Slot*, Slot*>;
+                
+                Iterator() = default;
+                
+                template <bool C = Const, typename = std::enable_if_t<C>>
+                Iterator(const Iterator<false>& other) : table(other.table), index(other.index) {}
+                
+                reference operator*() const { return table->slots_[index]; }
+                pointer operator->() const { return &table->slots_[index]; }
+                
+                Iterator& operator++()
+                {
+                    index++;
+                    skip();
+                    return *this;
+                }
+                
+                Iterator operator++(int)
+                {
+                    Iterator copy = *this;
+                    ++*this;
+                    return copy;
+                }
+                
+                bool operator==(const Iterator& other) const { return index == other.index; }
+                bool operator!=(const Iterator& other) const { return index != other.index; }
+            };
+            
+            using iterator = Iterator<false>;
+            using const_iterator = Iterator<true>;
+            
+            FlatTable() = default;
+            
+            explicit FlatTable(size_t capacity, const Hash& hash = Hash(), const KeyEqual& equal = KeyEqual(),
+                               const Allocator& allocator = Allocator())
+                : hasher_(hash), equal_(equal), slot_alloc_(allocator), ctrl_alloc_(allocator)
+            {
+                reserve(capacity);
+            }
+            
+            FlatTable(const FlatTable& other)
+                : hasher_(other.hasher_), equal_(other.equal_),
+                  slot_alloc_(SlotTraits::select_on_container_copy_construction(other.slot_alloc_)),
+                  ctrl_alloc_(other.ctrl_alloc_)
+            {
+                reserve(other.size_);
+                for (const Slot& slot : other) insert_unique(hasher_(key_of(slot)), slot);
+            }
+            
+            FlatTable(FlatTable&& other) noexcept
+                : hasher_(std::move(other.hasher_)), equal_(std::move(other.equal_)),
+                  slot_alloc_(std::move(other.slot_alloc_)), ctrl_alloc_(std::move(other.ctrl_alloc_))
+            {
+                steal(other);
+            }
+            
+            FlatTable& operator=(const FlatTable& other)
+            {
+                if (this != &other)
+                {
+                    FlatTable copy(other);
+                    swap(copy);
+                }
+                return *this;
+            }
+            
+            FlatTable& operator=(FlatTable&& other) noexcept
+            {
+                if (this != &other)
+                {
+                    destroy();
+                    hasher_ = std::move(other.hasher_);
+                    equal_ = std::move(other.equal_);
+                    slot_alloc_ = std::move(other.slot_alloc_);
+                    ctrl_alloc_ = std::move(other.ctrl_alloc_);
+                    steal(other);
+                }
+                return *this;
+            }
+            
+            ~FlatTable() { destroy(); }
+            
+            void swap(FlatTable& other) noexcept
+            {
+                using std::swap;
+                swap(hasher_, other.hasher_);
+                swap(equal_, other.equal_);
+                swap(slot_alloc_, other.slot_alloc_);
+                swap(ctrl_alloc_, other.ctrl_alloc_);
+                swap(ctrl_, other.ctrl_);
+                swap(slots_, other.slots_);
+                swap(capacity_, other.capacity_);
+                swap(size_, other.size_);
+                swap(growth_left_, other.growth_left_);
+            }
+            
+            iterator begin() { return iterator(this, 0); }
+            iterator end() { return iterator(this, capacity_); }
+            const_iterator begin() const { return const_iterator(this, 0); }
+            const_iterator end() const { return const_iterator(this, capacity_); }
+            const_iterator cbegin() const { return begin(); }
+            const_iterator cend() const { return end(); }
+            
+            size_t size() const { return size_; }
+            bool empty() const { return size_ == 0; }
+            size_t capacity() const { return capacity_; }
+            float load_factor() const { return capacity_ ? static_cast<float>(size_) / capacity_ : 0.0f; }
+            hasher hash_function() const { return hasher_; }
+            key_equal key_eq() const { return equal_; }
+            
+            // Destroys every element but keeps the allocated capacity.
+            void clear()
+            {
+                for (size_t i = 0; i < capacity_; ++i)
+                {
+                    if (ctrl_[i] >= 0) SlotTraits::destroy(slot_alloc_, slots_ + i);
+                }
+                if (capacity_) std::memset(ctrl_, static_cast<unsigned char>(swiss::empty), capacity_ + swiss::group_width);
+                size_ = 0;
+                growth_left_ = max_load(capacity_);
+            }
+            
+            // Makes room for count elements without further rehashing.
+            void reserve(size_t count)
+            {
+                if (count > max_load(capacity_)) resize(capacity_for(count));
+            }
+            
+            template <typename Q = K>
+            iterator find(const key_arg<Q>& key)
+            {
+                size_t i = find_index(key, hasher_(key));
+                return i == npos ? end() : iterator(this, i);
+            }
+            
+            template <typename Q = K>
+            const_iterator find(const key_arg<Q>& key) const
+            {
+                size_t i = find_index(key, hasher_(key));
+                return i == npos ? end() : const_iterator(this, i);
+            }
+            
+            template <typename Q = K>
+            bool contains(const key_arg<Q>& key) const
+            {
+                return find_index(key, hasher_(key)) != npos;
+            }
+            
+            template <typename Q = K>
+            size_t count(const key_arg<Q>& key) const
+            {
+                return contains<Q>(key) ? 1 : 0;
+            }
+            
+            template <typename Q = K>
+            size_t erase(const key_arg<Q>& key)
+            {
+                size_t i = find_index(key, hasher_(key));
+                if (i == npos) return 0;
+                erase_at(i);
+                return 1;
+            }
+            
+            // Returns the iterator following the erased element.
+            iterator erase(const_iterator position)
+            {
+                erase_at(position.index);
+                return iterator(this, position.index + 1);
+            }
+            
+            iterator erase(iterator position)
+            {
+                erase_at(position.index);
+                return iterator(this, position.index + 1);
+            }
+            
+        protected:
+            static const K& key_of(const Slot& slot)
+            {
+                if constexpr (is_set) return slot;
+                else return slot.first;
+            }
+            
+            iterator make_iterator(size_t i) { return iterator(this, i); }
+            
+            static size_t max_load(size_t capacity) { return capacity - capacity / 8; }
+            
+            static size_t capacity_for(size_t count)
+            {
+                size_t capacity = swiss::group_width;
+                while (max_load(capacity) < count) capacity <<= 1;
+                return capacity;
+            }
+            
+            void set_ctrl(size_t i, swiss::ctrl_t value)
+            {
+                ctrl_[i] = value;
+                if (i < swiss::group_width) ctrl_[capacity_ + i] = value;
+            }
+            
+            template <typename Q>
+            size_t find_index(const Q& key, size_t hash) const
+            {
+                if (capacity_ == 0) return npos;
+                const size_t mask = capacity_ - 1;
+                const swiss::ctrl_t h2 = static_cast<swiss::ctrl_t>(hash & 0x7F);
+                size_t pos = (hash >> 7) & mask;
+                for (size_t step = swiss::group_width; ; step += swiss::group_width)
+                {
+                    const swiss::ctrl_t* group = ctrl_ + pos;
+                    for (uint32_t match = swiss::match(group, h2); match; match &= match - 1)
+                    {
+                        size_t i = (pos + swiss::lowest_bit(match)) & mask;
+                        if (equal_(key_of(slots_[i]), key)) return i;
+                    }
+                    if (swiss::match_empty(group)) return npos;
+                    pos = (pos + step) & mask;
+                }
+            }
+            
+            // First empty or deleted slot on the probe sequence of hash.
+            size_t find_free(size_t hash) const
+            {
+                const size_t mask = capacity_ - 1;
+                size_t pos = (hash >> 7) & mask;
+                for (size_t step = swiss::group_width; ; step += swiss::group_width)
+                {
+                    uint32_t match = swiss::match_empty_or_deleted(ctrl_ + pos);
+                    if (match) return (pos + swiss::lowest_bit(match)) & mask;
+                    pos = (pos + step) & mask;
+                }
+            }
+            
+            // Claims a slot for a key known to be absent and constructs the
+            // element in it; grows (or purges tombstones) when out of room.
+            template <typename... Args>
+            size_t insert_unique(size_t hash, Args&&... args)
+            {
+                if (growth_left_ == 0)
+                {
+                    // Mostly tombstones: rebuild at the same size instead of doubling.
+                    size_t target = capacity_ == 0 ? swiss::group_width
+                                  : size_ < max_load(capacity_) / 2 ? capacity_ : capacity_ * 2;
+                    resize(target);
+                }
+                size_t i = find_free(hash);
+                SlotTraits::construct(slot_alloc_, slots_ + i, std::forward<Args>(args)...);
+                if (ctrl_[i] == swiss::empty) growth_left_--;
+                set_ctrl(i, static_cast<swiss::ctrl_t>(hash & 0x7F));
+                size_++;
+                return i;
+            }
+            
+            template <typename Q, typename... Args>
+            std::pair<size_t, bool> emplace_key(const Q& key, Args&&... args)
+            {
+                size_t hash = hasher_(key);
+                size_t i = find_index(key, hash);
+                if (i != npos) return {i, false};
+                return {insert_unique(hash, std::forward<Args>(args)...), true};
+            }
+            
+            // A slot may go back to empty only if no probe could have passed
+            // it, i.e. every group-wide window around it still has an empty slot.
+            void erase_at(size_t i)
+            {
+                SlotTraits::destroy(slot_alloc_, slots_ + i);
+                size_--;
+                const size_t mask = capacity_ - 1;
+                uint32_t empty_after = swiss::match_empty(ctrl_ + i);
+                uint32_t empty_before = swiss::match_empty(ctrl_ + ((i - swiss::group_width) & mask));
+                bool never_full = empty_before && empty_after &&
+                    swiss::lowest_bit(empty_after) + (swiss::group_width - 1 - swiss::highest_bit(empty_before)) < swiss::group_width;
+                set_ctrl(i, never_full ? swiss::empty : swiss::deleted);
+                if (never_full) growth_left_++;
+            }
+            
+            void resize(size_t new_capacity)
+            {
+                swiss::ctrl_t* old_ctrl = ctrl_;
+                Slot* old_slots = slots_;
+                size_t old_capacity = capacity_;
+                
+                ctrl_ = std::allocator_traits<CtrlAllocator>::allocate(ctrl_alloc_, new_capacity + swiss::group_width);
+                try
+                {
+                    slots_ = SlotTraits::allocate(slot_alloc_, new_capacity);
+                }
+                catch (...)
+                {
+                    std::allocator_traits<CtrlAllocator>::deallocate(ctrl_alloc_, ctrl_, new_capacity + swiss::group_width);
+                    ctrl_ = old_ctrl;
+                    throw;
+                }
+                std::memset(ctrl_, static_cast<unsigned char>(swiss::empty), new_capacity + swiss::group_width);
+                capacity_ = new_capacity;
+                growth_left_ = max_load(new_capacity) - size_;
+                
+                for (size_t i = 0; i < old_capacity; ++i)
+                {
+                    if (old_ctrl[i] < 0) continue;
+                    size_t hash = hasher_(key_of(old_slots[i]));
+                    size_t target = find_free(hash);
+                    SlotTraits::construct(slot_alloc_, slots_ + target, std::move(old_slots[i]));
+                    SlotTraits::destroy(slot_alloc_, old_slots + i);
+                    set_ctrl(target, static_cast<swiss::ctrl_t>(hash & 0x7F));
+                }
+                
+                if (old_capacity)
+                {
+                    std::allocator_traits<CtrlAllocator>::deallocate(ctrl_alloc_, old_ctrl, old_capacity + swiss::group_width);
+                    SlotTraits::deallocate(slot_alloc_, old_slots, old_capacity);
+                }
+            }
+            
+            void destroy()
+            {
+                if (capacity_ == 0) return;
+                for (size_t i = 0; i < capacity_; ++i)
+                {
+                    if (ctrl_[i] >= 0) SlotTraits::destroy(slot_alloc_, slots_ + i);
+                }
+                std::allocator_traits<CtrlAllocator>::deallocate(ctrl_alloc_, ctrl_, capacity_ + swiss::group_width);
+                SlotTraits::deallocate(slot_alloc_, slots_, capacity_);
+                ctrl_ = nullptr;
+                slots_ = nullptr;
+                capacity_ = size_ = growth_left_ = 0;
+            }
+            
+            void steal(FlatTable& other)
+            {
+                ctrl_ = std::exchange(other.ctrl_, nullptr);
+                slots_ = std::exchange(other.slots_, nullptr);
+                capacity_ = std::exchange(other.capacity_, 0);
+                size_ = std::exchange(other.size_, 0);
+                growth_left_ = std::exchange(other.growth_left_, 0);
+            }
+            
+            Hash hasher_{};
+            KeyEqual equal_{};
+            SlotAllocator slot_alloc_{};
+            CtrlAllocator ctrl_alloc_{};
+            swiss::ctrl_t* ctrl_ = nullptr;
+            Slot* slots_ = nullptr;
+            size_t capacity_ = 0;
+            size_t size_ = 0;
+            size_t growth_left_ = 0;
+        };
+        
+        // Flat (SwissTable-style) hash map. Elements are std::pair<K, V> stored
+        // in the table itself; never modify .first through an iterator. With
+        // the default Hash/KeyEqual, std::string keys can be looked up by
+        // std::string_view or const char* without building a string.
+        template <typename K, typename V, typename Hash = hash::Hash<K>, typename KeyEqual = std::equal_to<>,
+                  typename Allocator = std::allocator<std::pair<K, V>>>
+        class FlatHashMap : public FlatTable<K, std::pair<K, V>, Hash, KeyEqual, Allocator>
+        {
+        private:
+            using Base = FlatTable<K, std::pair<K, V>, Hash, KeyEqual, Allocator>;
+            template <typename Q>
+            using key_arg = typename Base::template key_arg<Q>;
+            
+        public:
+            using mapped_type = V;
+            using typename Base::iterator;
+            using typename Base::const_iterator;
+            using typename Base::value_type;
+            using Base::Base;
+            
+            FlatHashMap() = default;
+            
+            FlatHashMap(std::initializer_list<value_type> init)
+            {
+                this->reserve(init.size());
+                for (const value_type& entry : init) insert(entry);
+            }
+            
+            std::pair<iterator, bool> insert(const value_type& entry)
+            {
+                return try_emplace(entry.first, entry.second);
+            }
+            
+            std::pair<iterator, bool> insert(value_type&& entry)
+            {
+                return try_emplace(std::move(entry.first), std::move(entry.second));
+            }
+            
+            template <typename... Args>
+            std::pair<iterator, bool> emplace(Args&&... args)
+            {
+                value_type entry(std::forward<Args>(args)...);
+                return insert(std::move(entry));
+            }
+            
+            // Constructs the value only when key is absent; a heterogeneous key
+            // is converted to K only on insertion.
+            template <typename Q = K, typename... Args>
+            std::pair<iterator, bool> try_emplace(key_arg<Q>&& key, Args&&... args)
+            {
+                auto [i, inserted] = this->emplace_key(key, std::piecewise_construct,
+                    std::forward_as_tuple(std::forward<key_arg<Q>>(key)), std::forward_as_tuple(std::forward<Args>(args)...));
+                return {this->make_iterator(i), inserted};
+            }
+            
+            template <typename Q = K, typename... Args>
+            std::pair<iterator, bool> try_emplace(const key_arg<Q>& key, Args&&... args)
+            {
+                auto [i, inserted] = this->emplace_key(key, std::piecewise_construct,
+                    std::forward_as_tuple(key), std::forward_as_tuple(std::forward<Args>(args)...));
+                return {this->make_iterator(i), inserted};
+            }
+            
+            template <typename Q = K, typename M>
+            std::pair<iterator, bool> insert_or_assign(key_arg<Q>&& key, M&& value)
+            {
+                auto result = try_emplace<Q>(std::forward<key_arg<Q>>(key), std::forward<M>(value));
+                if (!result.second) result.first->second = std::forward<M>(value);
+                return result;
+            }
+            
+            template <typename Q = K, typename M>
+            std::pair<iterator, bool> insert_or_assign(const key_arg<Q>& key, M&& value)
+            {
+                auto result = try_emplace<Q>(key, std::forward<M>(value));
+                if (!result.second) result.first->second = std::forward<M>(value);
+                return result;
+            }
+            
+            template <typename Q = K>
+            V& operator[](key_arg<Q>&& key)
+            {
+                return try_emplace<Q>(std::forward<key_arg<Q>>(key)).first->second;
+            }
+            
+            template <typename Q = K>
+            V& operator[](const key_arg<Q>& key)
+            {
+                return try_emplace<Q>(key).first->second;
+            }
+            
+            template <typename Q = K>
+            V& at(const key_arg<Q>& key)
+            {
+                auto it = this->template find<Q>(key);
+                if (it == this->end()) throw std::out_of_range("FlatHashMap::at: key not found");
+                return it->second;
+            }
+            
+            template <typename Q = K>
+            const V& at(const key_arg<Q>& key) const
+            {
+                auto it = this->template find<Q>(key);
+                if (it == this->end()) throw std::out_of_range("FlatHashMap::at: key not found");
+                return it->second;
+            }
+            
+            // Value for key or nullptr, without inserting.
+            template <typename Q = K>
+            V* get(const key_arg<Q>& key)
+            {
+                auto it = this->template find<Q>(key);
+                return it == this->end() ? nullptr : &it->second;
+            }
+            
+            template <typename Q = K>
+            const V* get(const key_arg<Q>& key) const
+            {
+                auto it = this->template find<Q>(key);
+                return it == this->end() ? nullptr : &it->second;
+            }
+        };
+        
+        // Flat (SwissTable-style) hash set; see FlatHashMap.
+        template <typename K, typename Hash = hash::Hash<K>, typename KeyEqual = std::equal_to<>,
+                  typename Allocator = std::allocator<K>>
+        class FlatHashSet : public FlatTable<K, K, Hash, KeyEqual, Allocator>
+        {
+        private:
+            using Base = FlatTable<K, K, Hash, KeyEqual, Allocator>;
+            template <typename Q>
+            using key_arg = typename Base::template key_arg<Q>;
+            
+        public:
+            using typename Base::iterator;
+            using typename Base::const_iterator;
+            using Base::Base;
+            
+            FlatHashSet() = default;
+            
+            FlatHashSet(std::initializer_list<K> init)
+            {
+                this->reserve(init.size());
+                for (const K& key : init) insert(key);
+            }
+            
+            template <typename Q = K>
+            std::pair<iterator, bool> insert(key_arg<Q>&& key)
+            {
+                auto [i, inserted] = this->emplace_key(key, std::forward<key_arg<Q>>(key));
+                return {this->make_iterator(i), inserted};
+            }
+            
+            template <typename Q = K>
+            std::pair<iterator, bool> insert(const key_arg<Q>& key)
+            {
+                auto [i, inserted] = this->emplace_key(key, key);
+                return {this->make_iterator(i), inserted};
+            }
+            
+            template <typename... Args>
+            std::pair<iterator, bool> emplace(Args&&... args)
+            {
+                K key(std::forward<Args>(args)...);
+                return insert(std::move(key));
+            }
+        };
+    }
+
+    // ===== METRICS UTILITIES =====
+    // Counters, gauges and histograms that sputil components register into
+    // a Registry via attach_metrics(), read back through collect() or as
+    // Prometheus text. Recording is a relaxed atomic add on a shard the
+    // calling thread mostly has to itself; everything is summed on read.
+    // Define SPUTIL_NO_METRICS to compile recording out.
+    namespace metrics
+    {
+        // Small per-thread number used to pick a shard.
+        size_t thread_slot()
+        {
+            static std::atomic<size_t> next_thread{0};
+            static thread_local size_t slot = next_thread.fetch_add(1, std::memory_order_relaxed);
+            return slot;
+        }
+        
+        // Monotonic count, striped over cache-line sized shards.
+        class Counter
+        {
+        private:
+            static constexpr size_t shard_count = 16;
+            
+            struct alignas(64) Shard
+            {
+                std::atomic<uint64_t> value{0};
+            };
+            
+            Shard shards[shard_count];
+            
+        public:
+            void add(uint64_t n = 1)
+            {
+#if !defined(SPUTIL_NO_METRICS)
+                shards[thread_slot() % shard_count].value.fetch_add(n, std::memory_order_relaxed);
+#else
+                (void)n;
+#endif
+            }
+            
+            uint64_t value() const
+            {
+                uint64_t total = 0;
+                for (const Shard& shard : shards) total += shard.value.load(std::memory_order_relaxed);
+                return total;
+            }
+            
+            void reset()
+            {
+                for (Shard& shard : shards) shard.value.store(0, std::memory_order_relaxed);
+            }
+        };
+        
+        // Value that goes up and down. Mostly set from a single place, so it is
+        // one atomic rather than striped.
+        class Gauge
+        {
+        private:
+            std::atomic<int64_t> current{0};
+            
+        public:
+            void set(int64_t value) { current.store(value, std::memory_order_relaxed); }
+            void add(int64_t n = 1) { current.fetch_add(n, std::memory_order_relaxed); }
+            void sub(int64_t n = 1) { current.fetch_sub(n, std::memory_order_relaxed); }
+            int64_t value() const { return current.load(std::memory_order_relaxed); }
+        };
+        
+        // Read-side copy of a Histogram. Bucket i < size() - 1 counts values
+        // of bit width i, i.e. up to upper_bound(i) = 2^i - 1; the last bucket
+        // counts everything larger.
+        struct HistogramSnapshot
+        {
+            std::vector<uint64_t> buckets;
+            uint64_t count = 0;
+            uint64_t sum = 0;
+            
+            static uint64_t upper_bound(size_t index)
+            {
+                return index >= 64 ? std::numeric_limits<uint64_t>::max() : (uint64_t(1) << index) - 1;
+            }
+            
+            double mean() const { return count ? static_cast<double>(sum) / static_cast<double>(count) : 0.0; }
+            
+            // Upper bound of the bucket holding percentile p (0-100), so
+            // within a factor of two of the true value.
+            uint64_t percentile(double p) const
+            {
+                if (count == 0) return 0;
+                double wanted = std::ceil(std::clamp(p, 0.0, 100.0) / 100.0 * static_cast<double>(count));
+                uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(wanted));
+                uint64_t seen = 0;
+                for (size_t i = 0; i < buckets.size(); ++i)
+                {
+                    seen += buckets[i];
+                    if (seen >= rank) return i + 1 == buckets.size() ? std::numeric_limits<uint64_t>::max() : upper_bound(i);
+                }
+                return std::numeric_limits<uint64_t>::max();
+            }
+        };
+        
+        // Power-of-two bucketed histogram of non-negative integers (usually
+        // nanoseconds), striped like Counter. With the default 40 buckets
+        // everything up to 2^38 ns (about 4.5 minutes) gets its own bucket.
+        class Histogram
+        {
+        public:
+            static constexpr size_t default_buckets = 40;
+            
+        private:
+            static constexpr size_t shard_count = 8;
+            
+            size_t bucket_count;
+            size_t stride;   // per shard: buckets then the sum, padded to whole cache lines
+            std::unique_ptr<std::atomic<uint64_t>[]> cells;
+            
+            static size_t bit_width(uint64_t value)
+            {
+                if (value == 0) return 0;
+#if defined(_MSC_VER) && !defined(__clang__)
+                unsigned long top;
+                _BitScanReverse64(&top, value);
+                return static_cast<size_t>(top) + 1;
+#else
+                return static_cast<size_t>(64 - __builtin_clzll(value));
+#endif
+            }
+            
+        public:
+            explicit Histogram(size_t buckets = default_buckets)
+                : bucket_count(std::clamp<size_t>(buckets, 2, 65)),
+                  stride((bucket_count + 1 + 7) / 8 * 8),
+                  cells(new std::atomic<uint64_t>[stride * shard_count])
+            {
+                for (size_t i = 0; i < stride * shard_count; ++i) cells[i].store(0, std::memory_order_relaxed);
+            }
+            
+            void record(uint64_t value)
+            {
+#if !defined(SPUTIL_NO_METRICS)
+                std::atomic<uint64_t>* shard = &cells[(thread_slot() % shard_count) * stride];
+                shard[std::min(bit_width(value), bucket_count - 1)].fetch_add(1, std::memory_order_relaxed);
+                shard[bucket_count].fetch_add(value, std::memory_order_relaxed);
+#else
+                (void)value;
+#endif
+            }
+            
+            size_t buckets() const { return bucket_count; }
+            
+            // Not atomic as a whole; a snapshot taken while others record may
+            // be off by the few values in flight.
+            HistogramSnapshot snapshot() const
+            {
+                HistogramSnapshot result;
+                result.buckets.assign(bucket_count, 0);
+                for (size_t s = 0; s < shard_count; ++s)
+                {
+                    const std::atomic<uint64_t>* shard = &cells[s * stride];
+                    for (size_t i = 0; i < bucket_count; ++i) result.buckets[i] += shard[i].load(std::memory_order_relaxed);
+                    result.sum += shard[bucket_count].load(std::memory_order_relaxed);
+                }
+                for (uint64_t n : result.buckets) result.count += n;
+                return result;
+            }
+            
+            void reset()
+            {
+                for (size_t i = 0; i < stride * shard_count; ++i) cells[i].store(0, std::memory_order_relaxed);
+            }
+        };
+        
+        // Named metrics, kept sorted by name. Counters, gauges and histograms
+        // are created on first use and live as long as the registry, so the
+        // references handed out stay valid. Callback metrics compute their
+        // value on read; collect() runs them under the registry lock, and
+        // remove(), which only applies to them, waits for a running collect(),
+        // so after remove() returns the callback is never called again.
+        class Registry
+        {
+        public:
+            enum class Kind
+            {
+                Counter,
+                Gauge,
+                Histogram
+            };
+            
+            struct Sample
+            {
+                std::string name;
+                std::string help;
+                Kind kind = Kind::Counter;
+                double value = 0;               // counters and gauges
+                HistogramSnapshot histogram;    // histograms
+            };
+            
+        private:
+            struct Entry
+            {
+                Kind kind;
+                std::string help;
+                std::unique_ptr<Counter> counter;
+                std::unique_ptr<Gauge> gauge;
+                std::unique_ptr<Histogram> histogram;
+                std::function<double()> callback;
+            };
+            
+            mutable std::mutex mutex;
+            std::map<std::string, Entry, std::less<>> entries;
+            
+            Entry& lookup(const std::string& name, const std::string& help, Kind kind)
+            {
+                auto it = entries.find(name);
+                if (it == entries.end())
+                {
+                    it = entries.emplace(name, Entry{kind, help, nullptr, nullptr, nullptr, nullptr}).first;
+                }
+                else if (it->second.kind != kind || it->second.callback)
+                {
+                    throw std::invalid_argument("metric " + name + " is already registered as a different kind");
+                }
+                return it->second;
+            }
+            
+            void add_callback(const std::string& name, const std::string& help, Kind kind, std::function<double()> fn)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (entries.count(name)) throw std::invalid_argument("metric " + name + " is already registered");
+                entries.emplace(name, Entry{kind, help, nullptr, nullptr, nullptr, std::move(fn)});
+            }
+            
+            // Prometheus names allow [a-zA-Z0-9_:], so "lru.hits" becomes "lru_hits".
+            static std::string exposition_name(const std::string& name)
+            {
+                std::string result = name;
+                for (char& c : result)
+                {
+                    if (!std::isalnum(static_cast<unsigned char>(c)) && c != '_' && c != ':') c = '_';
+                }
+                if (!result.empty() && std::isdigit(static_cast<unsigned char>(result[0]))) result.insert(result.begin(), '_');
+                return result;
+            }
+            
+            static std::string escape_help(const std::string& help)
+            {
+                std::string result;
+                for (char c : help)
+                {
+                    if (c == '\\') result += "\\\\";
+                    else if (c == '\n') result += "\\n";
+                    else result += c;
+                }
+                return result;
+            }
+            
+        public:
+            Registry() = default;
+            Registry(const Registry&) = delete;
+            Registry& operator=(const Registry&) = delete;
+            
+            // Process-wide default registry. Never destroyed, so components
+            // attached to it can outlive static destruction order.
+            static Registry& instance()
+            {
+                static Registry* registry = new Registry();
+                return *registry;
+            }
+            
+            // These return the existing metric when the name is already
+            // registered with the same kind, and throw std::invalid_argument
+            // when it is registered as something else.
+            Counter& counter(const std::string& name, const std::string& help = "")
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                Entry& entry = lookup(name, help, Kind::Counter);
+                if (!entry.counter) entry.counter = std::make_unique<Counter>();
+                return *entry.counter;
+            }
+            
+            Gauge& gauge(const std::string& name, const std::string& help = "")
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                Entry& entry = lookup(name, help, Kind::Gauge);
+                if (!entry.gauge) entry.gauge = std::make_unique<Gauge>();
+                return *entry.gauge;
+            }
+            
+            Histogram& histogram(const std::string& name, const std::string& help = "",
+                                 size_t buckets = Histogram::default_buckets)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                Entry& entry = lookup(name, help, Kind::Histogram);
+                if (!entry.histogram) entry.histogram = std::make_unique<Histogram>(buckets);
+                return *entry.histogram;
+            }
+            
+            // Metrics computed on read, e.g. a queue depth. Throw
+            // std::invalid_argument if the name is taken.
+            void callback_counter(const std::string& name, const std::string& help, std::function<double()> fn)
+            {
+                add_callback(name, help, Kind::Counter, std::move(fn));
+            }
+            
+            void callback_gauge(const std::string& name, const std::string& help, std::function<double()> fn)
+            {
+                add_callback(name, help, Kind::Gauge, std::move(fn));
+            }
+            
+            // Unregisters a callback metric. Stored counters, gauges and
+            // histograms are never removed, since components may hold
+            // references to them; for those this returns false.
+            bool remove(const std::string& name)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                auto it = entries.find(name);
+                if (it == entries.end() || !it->second.callback) return false;
+                entries.erase(it);
+                return true;
+            }
+            
+            std::vector<Sample> collect() const
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                std::vector<Sample> samples;
+                samples.reserve(entries.size());
+                for (const auto& [name, entry] : entries)
+                {
+                    Sample sample;
+                    sample.name = name;
+                    sample.help = entry.help;
+                    sample.kind = entry.kind;
+                    if (entry.callback) sample.value = entry.callback();
+                    else if (entry.counter) sample.value = static_cast<double>(entry.counter->value());
+                    else if (entry.gauge) sample.value = static_cast<double>(entry.gauge->value());
+                    else if (entry.histogram) sample.histogram = entry.histogram->snapshot();
+                    samples.push_back(std::move(sample));
+                }
+                return samples;
+            }
+            
+            // Prometheus text exposition format (version 0.0.4).
+            std::string prometheus() const
+            {
+                std::ostringstream out;
+                out << std::setprecision(17);
+                for (const Sample& sample : collect())
+                {
+                    const std::string name = exposition_name(sample.name);
+                    if (!sample.help.empty()) out << "# HELP " << name << ' ' << escape_help(sample.help) << '\n';
+                    switch (sample.kind)
+                    {
+                        case Kind::Counter:
+                            out << "# TYPE " << name << " counter\n" << name << ' ' << sample.value << '\n';
+                            break;
+                        case Kind::Gauge:
+                            out << "# TYPE " << name << " gauge\n" << name << ' ' << sample.value << '\n';
+                            break;
+                        case Kind::Histogram:
+                        {
+                            out << "# TYPE " << name << " histogram\n";
+                            const HistogramSnapshot& h = sample.histogram;
+                            uint64_t cumulative = 0;
+                            for (size_t i = 0; i + 1 < h.buckets.size(); ++i)
+                            {
+                                cumulative += h.buckets[i];
+                                out << name << "_bucket{le=\"" << HistogramSnapshot::upper_bound(i) << "\"} " << cumulative << '\n';
+                            }
+                            out << name << "_bucket{le=\"+Inf\"} " << h.count << '\n';
+                            out << name << "_sum " << h.sum << '\n';
+                            out << name << "_count " << h.count << '\n';
+                            break;
+                        }
+                    }
+                }
+                return out.str();
+            }
+        };
+        
+        // Owns callback metrics registered on behalf of a component and
+        // removes them when destroyed, so a callback never outlives the
+        // object it reads. Counters and histograms stay in the registry, so
+        // their totals survive the component.
+        class Registration
+        {
+        private:
+            Registry* registry = nullptr;
+            std::vector<std::string> names;
+            
+        public:
+            Registration() = default;
+            Registration(Registration&& other) noexcept
+                : registry(std::exchange(other.registry, nullptr)), names(std::move(other.names)) {}
+            Registration& operator=(Registration&& other) noexcept
+            {
+                if (this != &other)
+                {
+                    reset();
+                    registry = std::exchange(other.registry, nullptr);
+                    names = std::move(other.names);
+                }
+                return *this;
+            }
+            Registration(const Registration&) = delete;
+            Registration& operator=(const Registration&) = delete;
+            
+            ~Registration() { reset(); }
+            
+            void callback_gauge(Registry& target, const std::string& name, const std::string& help, std::function<double()> fn)
+            {
+                if (registry && registry != &target) throw std::invalid_argument("Registration already belongs to another registry");
+                target.callback_gauge(name, help, std::move(fn));
+                registry = &target;
+                names.push_back(name);
+            }
+            
+            void reset()
+            {
+                if (registry)
+                {
+                    for (const std::string& name : names) registry->remove(name);
+                }
+                registry = nullptr;
+                names.clear();
+            }
+        };
+    }
+
+    // ===== ARRAY/COLLECTION UTILITIES =====
+    namespace array
+    {
+        template <typename T>
+        void shuffle(std::vector<T>& data)
+        {
+            unsigned seed = std::chrono::system_clock::now().time_since_epoch().count();
+            std::shuffle(data.begin(), data.end(), std::default_random_engine(seed));
+        }
+        
+        template <typename T>
+        bool contains(const std::vector<T>& data, const T& value)
+        {
+            return std::find(data.begin(), data.end(), value) != data.end();
+        }
+        
+        // Binary-search contains for data already sorted by comp.
+        template <typename T, typename Compare = std::less<T>>
+        bool contains_sorted(const std::vector<T>& data, const T& value, Compare comp = Compare())
+        {
+            return std::binary_search(data.begin(), data.end(), value, comp);
+        }
+        
+        // Integer keys mapped to unsigned so that byte order matches value order.
+        template <typename T>
+        std::make_unsigned_t<T> radix_key(T value)
+        {
+            using U = std::make_unsigned_t<T>;
+            U key = static_cast<U>(value);
+            if constexpr (std::is_signed_v<T>) key ^= U(1) << (sizeof(T) * 8 - 1);
+            return key;
+        }
+        
+        // In-place MSD radix sort (American flag sort) on one byte per pass.
+        template <typename T>
+        void radix_sort_range(T* first, T* last, int shift)
+        {
+            size_t n = static_cast<size_t>(last - first);
+            if (n < 64)
+            {
+                std::sort(first, last);
+                return;
+            }
+            
+            size_t count[256] = {};
+            for (T* it = first; it != last; ++it) count[(radix_key(*it) >> shift) & 0xFF]++;
+            
+            size_t head[256], tail[256];
+            size_t offset = 0;
+            for (int b = 0; b < 256; ++b)
+            {
+                head[b] = offset;
+                offset += count[b];
+                tail[b] = offset;
+            }
+            
+            for (int b = 0; b < 256; ++b)
+            {
+                if (count[b] == n) break;  // one bucket holds everything: nothing to move
+                while (head[b] < tail[b])
+                {
+                    T value = first[head[b]];
+                    size_t digit = (radix_key(value) >> shift) & 0xFF;
+                    while (digit != static_cast<size_t>(b))
+                    {
+                        std::swap(value, first[head[digit]++]);
+                        digit = (radix_key(value) >> shift) & 0xFF;
+                    }
+                    first[head[b]++] = value;
+                }
+            }
+            
+            if (shift == 0) return;
+            size_t begin = 0;
+            for (int b = 0; b < 256; ++b)
+            {
+                if (count[b] > 1) radix_sort_range(first + begin, first + begin + count[b], shift - 8);
+                begin += count[b];
+            }
+        }
+        
+        // Sorts integers in place in O(n * sizeof(T)) without extra buffers.
+        template <typename T, typename Allocator>
+        void radix_sort(std::vector<T, Allocator>& data)
+        {
+            static_assert(std::is_integral_v<T> && !std::is_same_v<T, bool>, "radix_sort needs an integer type");
+            if (data.size() > 1) radix_sort_range(data.data(), data.data() + data.size(), static_cast<int>(sizeof(T) * 8 - 8));
+        }
+        
+        // Sorts and drops repeated values; integers go through radix_sort.
+        template <typename T, typename Allocator>
+        void remove_duplicates(std::vector<T, Allocator>& data)
+        {
+            if constexpr (std::is_integral_v<T> && !std::is_same_v<T, bool>) radix_sort(data);
+            else std::sort(data.begin(), data.end());
+            data.erase(std::unique(data.begin(), data.end()), data.end());
+        }
+        
+        // Drops repeated values but keeps the first occurrence of each in its
+        // original position, using an open-addressed index of kept elements.
+        template <typename T, typename Allocator, typename Hash = hash::Hash<T>, typename KeyEqual = std::equal_to<T>>
+        void dedup_stable(std::vector<T, Allocator>& data, Hash hash = Hash(), KeyEqual equal = KeyEqual())
+        {
+            if (data.size() < 2) return;
+            size_t table_size = 2;
+            while (table_size < data.size() * 2) table_size <<= 1;
+            const size_t mask = table_size - 1;
+            const size_t empty = std::numeric_limits<size_t>::max();
+            std::vector<size_t> table(table_size, empty);
+            
+            size_t kept = 0;
+            for (size_t i = 0; i < data.size(); ++i)
+            {
+                uint64_t h = static_cast<uint64_t>(hash(data[i]));
+                h ^= h >> 33;
+                h *= 0xff51afd7ed558ccdULL;
+                h ^= h >> 33;
+                size_t slot = static_cast<size_t>(h) & mask;
+                while (table[slot] != empty && !equal(data[table[slot]], data[i])) slot = (slot + 1) & mask;
+                if (table[slot] != empty) continue;
+                
+                if (kept != i) data[kept] = std::move(data[i]);
+                table[slot] = kept++;
+            }
+            data.erase(data.begin() + kept, data.end());
+        }
+        
+        // Clamps python-style start/end (negative counts from the back, end -1
+        // means the end) to [0, size].
+        std::pair<size_t, size_t> slice_bounds(size_t size, long long start, long long end)
+        {
+            long long n = static_cast<long long>(size);
+            if (end == -1) end = n;
+            if (start < 0) start += n;
+            if (end < 0) end += n;
+            start = std::max(0LL, std::min(start, n));
+            end = std::max(start, std::min(end, n));
+            return {static_cast<size_t>(start), static_cast<size_t>(end)};
+        }
+        
+        template <typename T>
+        std::vector<T> slice(const std::vector<T>& data, int start, int end = -1)
+        {
+            auto [first, last] = slice_bounds(data.size(), start, end);
+            return std::vector<T>(data.begin() + first, data.begin() + last);
+        }
+        
+#if defined(__cpp_lib_span)
+        template <typename T>
+        using SliceView = std::span<T>;
+#else
+        // Minimal stand-in for std::span before C++20.
+        template <typename T>
+        class SliceView
+        {
+        private:
+            T* first = nullptr;
+            size_t count = 0;
+            
+        public:
+            SliceView() = default;
+            SliceView(T* data, size_t size) : first(data), count(size) {}
+            
+            T* data() const { return first; }
+            size_t size() const { return count; }
+            bool empty() const { return count == 0; }
+            T* begin() const { return first; }
+            T* end() const { return first + count; }
+            T& operator[](size_t i) const { return first[i]; }
+            T& front() const { return first[0]; }
+            T& back() const { return first[count - 1]; }
+        };
+#endif
+        
+        // slice without the copy: a view that is valid until data reallocates.
+        template <typename T, typename Allocator>
+        SliceView<const T> slice_view(const std::vector<T, Allocator>& data, long long start, long long end = -1)
+        {
+            auto [first, last] = slice_bounds(data.size(), start, end);
+            return SliceView<const T>(data.data() + first, last - first);
+        }
+        
+        template <typename T, typename Allocator>
+        SliceView<T> slice_view(std::vector<T, Allocator>& data, long long start, long long end = -1)
+        {
+            auto [first, last] = slice_bounds(data.size(), start, end);
+            return SliceView<T>(data.data() + first, last - first);
+        }
+        
+        // The result uses a copy of the input's allocator.
+        template <typename T, typename Allocator, typename Func>
+        std::vector<T, Allocator> filter(const std::vector<T, Allocator>& data, Func predicate)
+        {
+            std::vector<T, Allocator> result(data.get_allocator());
+            std::copy_if(data.begin(), data.end(), std::back_inserter(result), predicate);
+            return result;
+        }
+        
+        // Takes ownership of data and compacts the kept elements in place, so
+        // no second buffer is allocated.
+        template <typename T, typename Allocator, typename Func>
+        std::vector<T, Allocator> filter(std::vector<T, Allocator>&& data, Func predicate)
+        {
+            data.erase(std::remove_if(data.begin(), data.end(), [&](const T& value) { return !predicate(value); }), data.end());
+            return std::move(data);
+        }
+        
+        // Same, with the result allocated through allocator.
+        template <typename T, typename InputAllocator, typename Func, typename Allocator,
+                  typename = std::enable_if_t<!std::is_pointer_v<Allocator>>>
+        std::vector<T, Allocator> filter(const std::vector<T, InputAllocator>& data, Func predicate, const Allocator& allocator)
+        {
+            std::vector<T, Allocator> result(allocator);
+            std::copy_if(data.begin(), data.end(), std::back_inserter(result), predicate);
+            return result;
+        }
+        
+#if defined(__cpp_lib_memory_resource)
+        template <typename T, typename InputAllocator, typename Func>
+        std::pmr::vector<T> filter(const std::vector<T, InputAllocator>& data, Func predicate, std::pmr::memory_resource* resource)
+        {
+            std::pmr::vector<T> result(resource);
+            std::copy_if(data.begin(), data.end(), std::back_inserter(result), predicate);
+            return result;
+        }
+#endif
+        
+        template <typename T, typename Func>
+        auto map(const std::vector<T>& data, Func transform)
+        {
+            std::vector<decltype(transform(data[0]))> result;
+            result.reserve(data.size());
+            std::transform(data.begin(), data.end(), std::back_inserter(result), transform);
+            return result;
+        }
+        
+        // Output-iterator forms of filter and map, for appending into an
+        // existing (e.g. pre-reserved) container or writing to a raw buffer.
+        template <typename Range, typename OutputIt, typename Func>
+        OutputIt filter_to(const Range& data, OutputIt out, Func predicate)
+        {
+            return std::copy_if(std::begin(data), std::end(data), out, predicate);
+        }
+        
+        template <typename Range, typename OutputIt, typename Func>
+        OutputIt map_to(const Range& data, OutputIt out, Func transform)
+        {
+            return std::transform(std::begin(data), std::end(data), out, transform);
+        }
+    }
+
+    // ===== STRING UTILITIES =====
+    namespace string
+    {
+        // ASCII kernels behind to_lower/to_upper, split_any and trim. Each has a
+        // scalar reference version; the SSE2/AVX2/NEON paths must produce the
+        // same bytes. AVX2 is compiled with a target attribute and only used
+        // after a runtime CPU check. Define SPUTIL_NO_SIMD to force scalar code.
+        namespace simd
+        {
+            bool is_space(unsigned char c)
+            {
+                return c == ' ' || (c >= '\t' && c <= '\r');
+            }
+            
+            void ascii_lower_scalar(const char* src, char* dst, size_t n)
+            {
+                for (size_t i = 0; i < n; ++i)
+                    dst[i] = (src[i] >= 'A' && src[i] <= 'Z') ? static_cast<char>(src[i] | 0x20) : src[i];
+            }
+            
+            void ascii_upper_scalar(const char* src, char* dst, size_t n)
+            {
+                for (size_t i = 0; i < n; ++i)
+                    dst[i] = (src[i] >= 'a' && src[i] <= 'z') ? static_cast<char>(src[i] & ~0x20) : src[i];
+            }
+            
+            size_t find_any_scalar(const char* data, size_t n, std::string_view set, size_t from = 0)
+            {
+                bool table[256] = {};
+                for (char c : set) table[static_cast<unsigned char>(c)] = true;
+                for (size_t i = from; i < n; ++i)
+                    if (table[static_cast<unsigned char>(data[i])]) return i;
+                return std::string_view::npos;
+            }
+            
+            // Index of the first non-whitespace byte, or n.
+            size_t skip_space_scalar(const char* data, size_t n, size_t from = 0)
+            {
+                while (from < n && is_space(static_cast<unsigned char>(data[from]))) from++;
+                return from;
+            }
+            
+            // Length of data once trailing whitespace is dropped.
+            size_t skip_space_back_scalar(const char* data, size_t n)
+            {
+                while (n > 0 && is_space(static_cast<unsigned char>(data[n - 1]))) n--;
+                return n;
+            }
+            
+            unsigned count_trailing_zeros(uint32_t mask)
+            {
+#if defined(_MSC_VER) && !defined(__clang__)
+                unsigned long index;
+                _BitScanForward(&index, mask);
+                return static_cast<unsigned>(index);
+#else
+                return static_cast<unsigned>(__builtin_ctz(mask));
+#endif
+            }
+            
+            unsigned highest_bit(uint32_t mask)
+            {
+#if defined(_MSC_VER) && !defined(__clang__)
+                unsigned long index;
+                _BitScanReverse(&index, mask);
+                return static_cast<unsigned>(index);
+#else
+                return 31u - static_cast<unsigned>(__builtin_clz(mask));
+#endif
+            }
+            
+#if defined(SPUTIL_SIMD_SSE2)
+            // Sets 0xFF in lanes holding 'lo'..'hi'. Bytes >= 0x80 compare as
+            // negative and so never match, exactly like the scalar ASCII tests.
+            __m128i in_range_sse2(__m128i v, char lo, char hi)
+            {
+                return _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(static_cast<char>(lo - 1))),
+                                     _mm_cmpgt_epi8(_mm_set1_epi8(static_cast<char>(hi + 1)), v));
+            }
+            
+            __m128i space_mask_sse2(__m128i v)
+            {
+                return _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), in_range_sse2(v, '\t', '\r'));
+            }
+            
+            void ascii_case_sse2(const char* src, char* dst, size_t n, bool lower)
+            {
+                const char lo = lower ? 'A' : 'a';
+                const char hi = lower ? 'Z' : 'z';
+                const __m128i bit = _mm_set1_epi8(0x20);
+                size_t i = 0;
+                for (; i + 16 <= n; i += 16)
+                {
+                    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+                    __m128i flip = _mm_and_si128(in_range_sse2(v, lo, hi), bit);
+                    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_xor_si128(v, flip));
+                }
+                if (lower) ascii_lower_scalar(src + i, dst + i, n - i);
+                else ascii_upper_scalar(src + i, dst + i, n - i);
+            }
+            
+            size_t find_any_sse2(const char* data, size_t n, std::string_view set, size_t from)
+            {
+                if (set.size() > 16) return find_any_scalar(data, n, set, from);
+                __m128i needles[16];
+                for (size_t k = 0; k < set.size(); ++k) needles[k] = _mm_set1_epi8(set[k]);
+                
+                size_t i = from;
+                for (; i + 16 <= n; i += 16)
+                {
+                    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+                    __m128i hit = _mm_setzero_si128();
+                    for (size_t k = 0; k < set.size(); ++k) hit = _mm_or_si128(hit, _mm_cmpeq_epi8(v, needles[k]));
+                    uint32_t mask = static_cast<uint32_t>(_mm_movemask_epi8(hit));
+                    if (mask) return i + count_trailing_zeros(mask);
+                }
+                return find_any_scalar(data, n, set, i);
+            }
+            
+            size_t skip_space_sse2(const char* data, size_t n, size_t from)
+            {
+                size_t i = from;
+                for (; i + 16 <= n; i += 16)
+                {
+                    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+                    uint32_t mask = ~static_cast<uint32_t>(_mm_movemask_epi8(space_mask_sse2(v))) & 0xFFFFu;
+                    if (mask) return i + count_trailing_zeros(mask);
+                }
+                return skip_space_scalar(data, n, i);
+            }
+            
+            size_t skip_space_back_sse2(const char* data, size_t n)
+            {
+                while (n >= 16)
+                {
+                    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + n - 16));
+                    uint32_t mask = ~static_cast<uint32_t>(_mm_movemask_epi8(space_mask_sse2(v))) & 0xFFFFu;
+                    if (mask) return n - 16 + highest_bit(mask) + 1;
+                    n -= 16;
+                }
+                return skip_space_back_scalar(data, n);
+            }
+#endif
+            
+#if defined(SPUTIL_SIMD_AVX2)
+            // The tails below run the SSE2 kernels, which are built without
+            // VEX encoding; clearing the upper halves first avoids the AVX to
+            // SSE transition stall, which GCC does not guard against when it
+            // turns the call into a tail jump.
+            __attribute__((target("avx2"))) __m256i in_range_avx2(__m256i v, char lo, char hi)
+            {
+                return _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8(static_cast<char>(lo - 1))),
+                                        _mm256_cmpgt_epi8(_mm256_set1_epi8(static_cast<char>(hi + 1)), v));
+            }
+            
+            __attribute__((target("avx2"))) void ascii_case_avx2(const char* src, char* dst, size_t n, bool lower)
+            {
+                const char lo = lower ? 'A' : 'a';
+                const char hi = lower ? 'Z' : 'z';
+                const __m256i bit = _mm256_set1_epi8(0x20);
+                size_t i = 0;
+                for (; i + 32 <= n; i += 32)
+                {
+                    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+                    __m256i flip = _mm256_and_si256(in_range_avx2(v, lo, hi), bit);
+                    _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), _mm256_xor_si256(v, flip));
+                }
+                _mm256_zeroupper();
+                ascii_case_sse2(src + i, dst + i, n - i, lower);
+            }
+            
+            __attribute__((target("avx2"))) size_t find_any_avx2(const char* data, size_t n, std::string_view set, size_t from)
+            {
+                if (set.size() > 16) return find_any_scalar(data, n, set, from);
+                __m256i needles[16];
+                for (size_t k = 0; k < set.size(); ++k) needles[k] = _mm256_set1_epi8(set[k]);
+                
+                size_t i = from;
+                for (; i + 32 <= n; i += 32)
+                {
+                    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+                    __m256i hit = _mm256_setzero_si256();
+                    for (size_t k = 0; k < set.size(); ++k) hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(v, needles[k]));
+                    uint32_t mask = static_cast<uint32_t>(_mm256_movemask_epi8(hit));
+                    if (mask) return i + count_trailing_zeros(mask);
+                }
+                _mm256_zeroupper();
+                return find_any_sse2(data, n, set, i);
+            }
+            
+            __attribute__((target("avx2"))) size_t skip_space_avx2(const char* data, size_t n, size_t from)
+            {
+                size_t i = from;
+                for (; i + 32 <= n; i += 32)
+                {
+                    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+                    __m256i space = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')), in_range_avx2(v, '\t', '\r'));
+                    uint32_t mask = ~static_cast<uint32_t>(_mm256_movemask_epi8(space));
+                    if (mask) return i + count_trailing_zeros(mask);
+                }
+                _mm256_zeroupper();
+                return skip_space_sse2(data, n, i);
+            }
+            
+            bool has_avx2()
+            {
+                static const bool supported = __builtin_cpu_supports("avx2");
+                return supported;
+            }
+#endif
+            
+#if defined(SPUTIL_SIMD_NEON)
+            // NEON has no movemask; narrowing each 16-bit pair by 4 leaves one
+            // nibble per byte lane in a 64-bit mask.
+            uint64_t nibble_mask_neon(uint8x16_t lanes)
+            {
+                return vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(lanes), 4)), 0);
+            }
+            
+            void ascii_case_neon(const char* src, char* dst, size_t n, bool lower)
+            {
+                const uint8x16_t lo = vdupq_n_u8(static_cast<uint8_t>(lower ? 'A' : 'a'));
+                const uint8x16_t span = vdupq_n_u8(25);
+                const uint8x16_t bit = vdupq_n_u8(0x20);
+                size_t i = 0;
+                for (; i + 16 <= n; i += 16)
+                {
+                    uint8x16_t v = vld1q_u8(reinterpret_cast<const uint8_t*>(src + i));
+                    uint8x16_t in_range = vcleq_u8(vsubq_u8(v, lo), span);
+                    vst1q_u8(reinterpret_cast<uint8_t*>(dst + i), veorq_u8(v, vandq_u8(in_range, bit)));
+                }
+                if (lower) ascii_lower_scalar(src + i, dst + i, n - i);
+                else ascii_upper_scalar(src + i, dst + i, n - i);
+            }
+            
+            size_t find_any_neon(const char* data, size_t n, std::string_view set, size_t from)
+            {
+                if (set.size() > 16) return find_any_scalar(data, n, set, from);
+                size_t i = from;
+                for (; i + 16 <= n; i += 16)
+                {
+                    uint8x16_t v = vld1q_u8(reinterpret_cast<const uint8_t*>(data + i));
+                    uint8x16_t hit = vdupq_n_u8(0);
+                    for (char c : set) hit = vorrq_u8(hit, vceqq_u8(v, vdupq_n_u8(static_cast<uint8_t>(c))));
+                    uint64_t mask = nibble_mask_neon(hit);
+                    if (mask) return i + static_cast<size_t>(__builtin_ctzll(mask) >> 2);
+                }
+                return find_any_scalar(data, n, set, i);
+            }
+            
+            uint8x16_t space_mask_neon(uint8x16_t v)
+            {
+                return vorrq_u8(vceqq_u8(v, vdupq_n_u8(' ')), vcleq_u8(vsubq_u8(v, vdupq_n_u8('\t')), vdupq_n_u8(4)));
+            }
+            
+            size_t skip_space_neon(const char* data, size_t n, size_t from)
+            {
+                size_t i = from;
+                for (; i + 16 <= n; i += 16)
+                {
+                    uint8x16_t v = vld1q_u8(reinterpret_cast<const uint8_t*>(data + i));
+                    uint64_t mask = ~nibble_mask_neon(space_mask_neon(v));
+                    if (mask) return i + static_cast<size_t>(__builtin_ctzll(mask) >> 2);
+                }
+                return skip_space_scalar(data, n, i);
+            }
+            
+            size_t skip_space_back_neon(const char* data, size_t n)
+            {
+                while (n >= 16)
+                {
+                    uint8x16_t v = vld1q_u8(reinterpret_cast<const uint8_t*>(data + n - 16));
+                    uint64_t mask = ~nibble_mask_neon(space_mask_neon(v));
+                    if (mask) return n - 16 + static_cast<size_t>((63 - __builtin_clzll(mask)) >> 2) + 1;
+                    n -= 16;
+                }
+                return skip_space_back_scalar(data, n);
+            }
+#endif
+            
+            void ascii_lower(const char* src, char* dst, size_t n)
+            {
+#if defined(SPUTIL_SIMD_AVX2)
+                if (has_avx2()) return ascii_case_avx2(src, dst, n, true);
+#endif
+#if defined(SPUTIL_SIMD_SSE2)
+                ascii_case_sse2(src, dst, n, true);
+#elif defined(SPUTIL_SIMD_NEON)
+                ascii_case_neon(src, dst, n, true);
+#else
+                ascii_lower_scalar(src, dst, n);
+#endif
+            }
+            
+            void ascii_upper(const char* src, char* dst, size_t n)
+            {
+#if defined(SPUTIL_SIMD_AVX2)
+                if (has_avx2()) return ascii_case_avx2(src, dst, n, false);
+#endif
+#if defined(SPUTIL_SIMD_SSE2)
+                ascii_case_sse2(src, dst, n, false);
+#elif defined(SPUTIL_SIMD_NEON)
+                ascii_case_neon(src, dst, n, false);
+#else
+                ascii_upper_scalar(src, dst, n);
+#endif
+            }
+            
+            // Position of the first byte at or after from that is in set, or npos.
+            size_t find_any(const char* data, size_t n, std::string_view set, size_t from = 0)
+            {
+                if (from >= n || set.empty()) return std::string_view::npos;
+                if (set.size() == 1)
+                {
+                    const void* hit = std::memchr(data + from, set[0], n - from);
+                    return hit ? static_cast<size_t>(static_cast<const char*>(hit) - data) : std::string_view::npos;
+                }
+#if defined(SPUTIL_SIMD_AVX2)
+                if (has_avx2()) return find_any_avx2(data, n, set, from);
+#endif
+#if defined(SPUTIL_SIMD_SSE2)
+                return find_any_sse2(data, n, set, from);
+#elif defined(SPUTIL_SIMD_NEON)
+                return find_any_neon(data, n, set, from);
+#else
+                return find_any_scalar(data, n, set, from);
+#endif
+            }
+            
+            size_t skip_space(const char* data, size_t n, size_t from = 0)
+            {
+#if defined(SPUTIL_SIMD_AVX2)
+                if (has_avx2()) return skip_space_avx2(data, n, from);
+#endif
+#if defined(SPUTIL_SIMD_SSE2)
+                return skip_space_sse2(data, n, from);
+#elif defined(SPUTIL_SIMD_NEON)
+                return skip_space_neon(data, n, from);
+#else
+                return skip_space_scalar(data, n, from);
+#endif
+            }
+            
+            size_t skip_space_back(const char* data, size_t n)
+            {
+#if defined(SPUTIL_SIMD_SSE2)
+                return skip_space_back_sse2(data, n);
+#elif defined(SPUTIL_SIMD_NEON)
+                return skip_space_back_neon(data, n);
+#else
+                return skip_space_back_scalar(data, n);
+#endif
+            }
+        }
+        
+        // Returns str without leading and trailing whitespace, as a view into str.
+        std::string_view trim_view(std::string_view str)
+        {
+            size_t start = simd::skip_space(str.data(), str.size());
+            size_t end = start == str.size() ? start : simd::skip_space_back(str.data(), str.size());
+            return str.substr(start, end - start);
+        }
+        
+        std::string trim(std::string_view str)
+        {
+            return std::string(trim_view(str));
+        }
+        
+        // ASCII case conversion; bytes outside A-Z/a-z are copied unchanged.
+        std::string to_lower(std::string_view str)
+        {
+            std::string result(str.size(), '\0');
+            simd::ascii_lower(str.data(), result.data(), str.size());
+            return result;
+        }
+        
+        std::string to_upper(std::string_view str)
+        {
+            std::string result(str.size(), '\0');
+            simd::ascii_upper(str.data(), result.data(), str.size());
+            return result;
+        }
+        
+        bool starts_with(std::string_view str, std::string_view prefix)
+        {
+            return str.size() >= prefix.size() && 
+                   str.compare(0, prefix.size(), prefix) == 0;
+        }
+        
+        bool ends_with(std::string_view str, std::string_view suffix)
+        {
+            return str.size() >= suffix.size() && 
+                   str.compare(str.size() - suffix.size(), suffix.size(), suffix) == 0;
+        }
+        
+        // Lazy split: iterating yields the same pieces as split(), as views into
+        // the source, without allocating. The source must outlive the view.
+        // An empty delimiter yields the whole string. In any-of mode every byte
+        // of the delimiter is a separator on its own (see split_any).
+        class SplitView
+        {
+        private:
+            std::string_view source;
+            std::string_view delimiter;
+            bool any_of;
+            
+        public:
+            class iterator
+            {
+            private:
+                std::string_view source;
+                std::string_view delimiter;
+                bool any_of = false;
+                size_t start = std::string_view::npos;
+                size_t end = std::string_view::npos;
+                
+                void find_end()
+                {
+                    if (delimiter.empty()) end = std::string_view::npos;
+                    else if (any_of || delimiter.size() == 1) end = simd::find_any(source.data(), source.size(), delimiter, start);
+                    else end = source.find(delimiter, start);
+                    if (end == std::string_view::npos) end = source.size();
+                }
+                
+            public:
+                using iterator_category = std::forward_iterator_tag;
+                using value_type = std::string_view;
+                using difference_type = std::ptrdiff_t;
+                using pointer = const std::string_view*;
+                using reference = std::string_view;
+                
+                iterator() = default;
+                iterator(std::string_view src, std::string_view delim, bool any)
+                    : source(src), delimiter(delim), any_of(any), start(0)
+                {
+                    find_end();
+                }
+                
+                std::string_view operator*() const { return source.substr(start, end - start); }
+                
+                iterator& operator++()
+                {
+                    if (end == source.size())
+                    {
+                        start = end = std::string_view::npos;
+                    }
+                    else
+                    {
+                        start = end + (any_of ? 1 : delimiter.size());
+                        find_end();
+                    }
+                    return *this;
+                }
+                
+                iterator operator++(int)
+                {
+                    iterator previous = *this;
+                    ++*this;
+                    return previous;
+                }
+                
+                bool operator==(const iterator& other) const { return start == other.start; }
+                bool operator!=(const iterator& other) const { return start != other.start; }
+            };
+            
+            SplitView(std::string_view str, std::string_view delim, bool any = false)
+                : source(str), delimiter(delim), any_of(any) {}
+            
+            iterator begin() const { return iterator(source, delimiter, any_of); }
+            iterator end() const { return iterator(); }
+        };
+        
+        SplitView split_view(std::string_view str, std::string_view delimiter)
+        {
+            return SplitView(str, delimiter);
+        }
+        
+        // Lazy split on any of the given separator bytes.
+        SplitView split_any_view(std::string_view str, std::string_view separators)
+        {
+            return SplitView(str, separators, true);
+        }
+        
+        // Splits into out, reusing its capacity. Returns the number of pieces.
+        template <typename Allocator>
+        size_t split_into(std::string_view str, std::string_view delimiter, std::vector<std::string_view, Allocator>& out)
+        {
+            out.clear();
+            for (std::string_view piece : split_view(str, delimiter)) out.push_back(piece);
+            return out.size();
+        }
+        
+        // Same as above, but also reuses the buffers of strings already in out.
+        // Works with any string and vector allocator, e.g. std::pmr containers.
+        template <typename CharAllocator, typename Allocator>
+        size_t split_into(std::string_view str, std::string_view delimiter,
+                          std::vector<std::basic_string<char, std::char_traits<char>, CharAllocator>, Allocator>& out)
+        {
+            size_t count = 0;
+            for (std::string_view piece : split_view(str, delimiter))
+            {
+                if (count < out.size()) out[count].assign(piece.data(), piece.size());
+                else out.emplace_back(piece);
+                count++;
+            }
+            out.resize(count);
+            return count;
+        }
+        
+        std::vector<std::string> split(std::string_view str, std::string_view delimiter)
+        {
+            std::vector<std::string> result;
+            for (std::string_view piece : split_view(str, delimiter)) result.emplace_back(piece);
+            return result;
+        }
+        
+#if defined(__cpp_lib_memory_resource)
+        // split with the vector and every piece allocated from resource.
+        std::pmr::vector<std::pmr::string> split(std::string_view str, std::string_view delimiter,
+                                                 std::pmr::memory_resource* resource)
+        {
+            std::pmr::vector<std::pmr::string> result(resource);
+            for (std::string_view piece : split_view(str, delimiter)) result.emplace_back(piece);
+            return result;
+        }
+#endif
+        
+        std::vector<std::string> split_any(std::string_view str, std::string_view separators)
+        {
+            std::vector<std::string> result;
+            for (std::string_view piece : split_any_view(str, separators)) result.emplace_back(piece);
+            return result;
+        }
+        
+        // Sizes the result once, then appends every piece in a single pass.
+        // Works for any sized container of strings or string_views.
+        template <typename Strings>
+        std::string join_range(const Strings& strings, std::string_view delimiter)
+        {
+            if (strings.empty()) return "";
+            
+            size_t total = delimiter.size() * (strings.size() - 1);
+            for (const auto& piece : strings) total += std::string_view(piece).size();
+            
+            std::string result;
+            result.reserve(total);
+            bool first = true;
+            for (const auto& piece : strings)
+            {
+                if (!first) result.append(delimiter.data(), delimiter.size());
+                result.append(std::string_view(piece).data(), std::string_view(piece).size());
+                first = false;
+            }
+            return result;
+        }
+        
+        std::string join(const std::vector<std::string>& strings, std::string_view delimiter)
+        {
+            return join_range(strings, delimiter);
+        }
+        
+        // Builds the result in one pass over str. Patterns of at least
+        // horspool_threshold bytes are searched with Boyer-Moore-Horspool.
+        std::string replace(std::string_view str, std::string_view from, std::string_view to)
+        {
+            constexpr size_t horspool_threshold = 16;
+            if (from.empty()) return std::string(str);
+            
+            std::optional<std::boyer_moore_horspool_searcher<const char*>> searcher;
+            if (from.size() >= horspool_threshold) searcher.emplace(from.data(), from.data() + from.size());
+            
+            auto find = [&](size_t pos) -> size_t
+            {
+                if (!searcher) return str.find(from, pos);
+                const char* hit = std::search(str.data() + pos, str.data() + str.size(), *searcher);
+                return hit == str.data() + str.size() ? std::string_view::npos : static_cast<size_t>(hit - str.data());
+            };
+            
+            size_t match = find(0);
+            if (match == std::string_view::npos) return std::string(str);
+            
+            std::string result;
+            result.reserve(to.size() > from.size() ? str.size() + (to.size() - from.size()) * 4 : str.size());
+            size_t last = 0;
+            while (match != std::string_view::npos)
+            {
+                result.append(str.data() + last, match - last);
+                result.append(to.data(), to.size());
+                last = match + from.size();
+                match = find(last);
+            }
+            result.append(str.data() + last, str.size() - last);
+            return result;
+        }
+        
+        // Aho-Corasick automaton for replacing many patterns in one pass. Matches
+        // are leftmost-longest and never overlap; replaced text is not scanned
+        // again. Bytes are mapped to classes first, so the transition table is
+        // only as wide as the number of distinct bytes in the patterns. Build it
+        // once and reuse it when the same table is applied to many inputs.
+        class MultiReplacer
+        {
+        private:
+            std::vector<std::string> replacements;
+            std::vector<std::size_t> pattern_lengths;
+            uint16_t byte_class[256] = {};
+            size_t classes = 1;
+            std::vector<int32_t> transitions;   // state * classes + class
+            std::vector<uint32_t> depth;
+            std::vector<int32_t> output;        // longest pattern ending in this state, or -1
+            
+            int32_t step(int32_t state, unsigned char c) const
+            {
+                return transitions[static_cast<size_t>(state) * classes + byte_class[c]];
+            }
+            
+        public:
+            explicit MultiReplacer(const std::vector<std::pair<std::string, std::string>>& pairs)
+            {
+                for (const auto& pair : pairs)
+                    for (unsigned char c : pair.first)
+                        if (!byte_class[c]) byte_class[c] = static_cast<uint16_t>(classes++);
+                
+                // Trie first; -1 marks a missing edge until the BFS fills it in.
+                transitions.assign(classes, -1);
+                depth.push_back(0);
+                output.push_back(-1);
+                for (const auto& pair : pairs)
+                {
+                    if (pair.first.empty()) continue;
+                    int32_t state = 0;
+                    for (unsigned char c : pair.first)
+                    {
+                        int32_t& edge = transitions[static_cast<size_t>(state) * classes + byte_class[c]];
+                        if (edge < 0)
+                        {
+                            edge = static_cast<int32_t>(depth.size());
+                            depth.push_back(depth[state] + 1);
+                            output.push_back(-1);
+                            transitions.resize(transitions.size() + classes, -1);
+                        }
+                        state = transitions[static_cast<size_t>(state) * classes + byte_class[c]];
+                    }
+                    if (output[state] < 0)
+                    {
+                        output[state] = static_cast<int32_t>(replacements.size());
+                        replacements.push_back(pair.second);
+                        pattern_lengths.push_back(pair.first.size());
+                    }
+                }
+                
+                // BFS turns the trie into a full DFA. A state's output is its own
+                // pattern if it ends one, else the longest one along its fail link.
+                std::vector<int32_t> fail(depth.size(), 0);
+                std::vector<int32_t> queue;
+                for (size_t c = 0; c < classes; ++c)
+                {
+                    int32_t& edge = transitions[c];
+                    if (edge < 0) edge = 0;
+                    else queue.push_back(edge);
+                }
+                for (size_t head = 0; head < queue.size(); ++head)
+                {
+                    int32_t state = queue[head];
+                    if (output[state] < 0) output[state] = output[fail[state]];
+                    for (size_t c = 0; c < classes; ++c)
+                    {
+                        int32_t& edge = transitions[static_cast<size_t>(state) * classes + c];
+                        int32_t fallback = transitions[static_cast<size_t>(fail[state]) * classes + c];
+                        if (edge < 0)
+                        {
+                            edge = fallback;
+                        }
+                        else
+                        {
+                            fail[edge] = fallback;
+                            queue.push_back(edge);
+                        }
+                    }
+                }
+            }
+            
+            std::string apply(std::string_view text) const
+            {
+                std::string result;
+                result.reserve(text.size());
+                
+                const size_t none = std::string_view::npos;
+                size_t emitted = 0;
+                size_t i = 0;
+                while (true)
+                {
+                    int32_t state = 0;
+                    size_t best_start = none, best_length = 0;
+                    int32_t best = -1;
+                    
+                    for (; i < text.size(); ++i)
+                    {
+                        state = step(state, static_cast<unsigned char>(text[i]));
+                        int32_t hit = output[state];
+                        if (hit >= 0)
+                        {
+                            size_t length = pattern_lengths[hit];
+                            size_t start = i + 1 - length;
+                            if (best_start == none || start < best_start || (start == best_start && length > best_length))
+                            {
+                                best_start = start;
+                                best_length = length;
+                                best = hit;
+                            }
+                        }
+                        // Once no live prefix reaches back to best_start, nothing
+                        // earlier or longer can still match: commit it.
+                        if (best_start != none && i + 1 - depth[state] > best_start) break;
+                    }
+                    
+                    if (best_start == none) break;
+                    result.append(text.data() + emitted, best_start - emitted);
+                    result += replacements[best];
+                    emitted = i = best_start + best_length;
+                }
+                
+                result.append(text.data() + emitted, text.size() - emitted);
+                return result;
+            }
+        };
+        
+        // Replaces every from -> to pair in one pass; see MultiReplacer.
+        std::string replace_all(std::string_view str, const std::vector<std::pair<std::string, std::string>>& replacements)
+        {
+            return MultiReplacer(replacements).apply(str);
+        }
+    }
+
+    // ===== MATH UTILITIES =====
+    // namespace math
+    // {
+    //     const double PI = 3.14159265358979323846;
+    //     const double E = 2.71828182845904523536;
+        
+    //     template <typename T>
+    //     T clamp(T value, T min, T max)
+    //     {
+    //         return std::max(min, std::min(value, max));
+    //     }
+        
+    //     template <typename T>
+    //     T lerp(T a, T b, double t)
+    //     {
     //         return a + (b - a) * clamp(t, 0.0, 1.0);
     //     }
         
-    //     double degrees_to_radians(double degrees)
-    //     {
-    //         return degrees * PI / 180.0;
-    //     }
+    //     double degrees_to_radians(double degrees)
+    //     {
+    //         return degrees * PI / 180.0;
+    //     }
+        
+    //     double radians_to_degrees(double radians)
+    //     {
+    //         return radians * 180.0 / PI;
+    //     }
+        
+    //     int random_int(int min, int max)
+    //     {
+    //         static std::random_device rd;
+    //         static std::mt19937 gen(rd());
+    //         std::uniform_int_distribution<> dis(min, max);
+    //         return dis(gen);
+    //     }
+        
+    //     double random_double(double min, double max)
+    //     {
+    //         static std::random_device rd;
+    //         static std::mt19937 gen(rd());
+    //         std::uniform_real_distribution<> dis(min, max);
+    //         return dis(gen);
+    //     }
+        
+    //     template <typename T>
+    //     T min(const std::vector<T>& values)
+    //     {
+    //         return *std::min_element(values.begin(), values.end());
+    //     }
+        
+    //     template <typename T>
+    //     T max(const std::vector<T>& values)
+    //     {
+    //         return *std::max_element(values.begin(), values.end());
+    //     }
+        
+    //     template <typename T>
+    //     double average(const std::vector<T>& values)
+    //     {
+    //         if (values.empty()) return 0.0;
+    //         double sum = 0.0;
+    //         for (const auto& value : values) sum += value;
+    //         return sum / values.size();
+    //     }
+    // }
+
+    // ===== FILE SYSTEM UTILITIES =====
+    namespace fs
+    {
+        bool exists(const std::string& path)
+        {
+            return std::filesystem::exists(path);
+        }
+        
+        bool is_file(const std::string& path)
+        {
+            return std::filesystem::is_regular_file(path);
+        }
+        
+        bool is_directory(const std::string& path)
+        {
+            return std::filesystem::is_directory(path);
+        }
+        
+        // Reads the whole file in binary mode with a single read into a buffer
+        // sized from the file size. Files that report size 0 (pipes, /proc
+        // entries) fall back to a streaming read.
+        std::string read_file(const std::string& path)
+        {
+            std::ifstream file(path, std::ios::binary);
+            if (!file.is_open()) throw std::runtime_error("Cannot open file: " + path);
+            
+            std::error_code ec;
+            uintmax_t size = std::filesystem::file_size(path, ec);
+            if (ec || size == 0)
+            {
+                return std::string((std::istreambuf_iterator<char>(file)),
+                                   std::istreambuf_iterator<char>());
+            }
+            
+            std::string content(static_cast<size_t>(size), '\0');
+            file.read(content.data(), static_cast<std::streamsize>(content.size()));
+            content.resize(static_cast<size_t>(file.gcount()));
+            return content;
+        }
+        
+        // Streams the file through fn(std::string_view) in chunks of up to
+        // chunk_size bytes, reusing one buffer, and returns the bytes read.
+        // Views are only valid during the call.
+        template <typename Func>
+        uintmax_t for_each_chunk(const std::string& path, size_t chunk_size, Func&& fn)
+        {
+            std::ifstream file(path, std::ios::binary);
+            if (!file.is_open()) throw std::runtime_error("Cannot open file: " + path);
+            
+            std::vector<char> buffer(std::max<size_t>(chunk_size, 1));
+            uintmax_t total = 0;
+            while (file)
+            {
+                file.read(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+                size_t got = static_cast<size_t>(file.gcount());
+                if (got == 0) break;
+                total += got;
+                fn(std::string_view(buffer.data(), got));
+            }
+            return total;
+        }
+        
+        // Read-only memory mapping of a whole file (mmap / MapViewOfFile).
+        // Move-only; the view is valid until the object is destroyed.
+        class MappedFile
+        {
+        public:
+            enum class Access
+            {
+                Normal,
+                Sequential,  // read-ahead aggressively, drop pages behind
+                Random,      // no read-ahead
+                WillNeed,    // start paging the file in now
+                DontNeed     // pages may be dropped
+            };
+            
+        private:
+            const char* data_ = nullptr;
+            size_t size_ = 0;
+#if defined(_WIN32)
+            HANDLE file = INVALID_HANDLE_VALUE;
+            HANDLE mapping = nullptr;
+#endif
+            
+            void close()
+            {
+#if defined(_WIN32)
+                if (data_) UnmapViewOfFile(data_);
+                if (mapping) CloseHandle(mapping);
+                if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+                mapping = nullptr;
+                file = INVALID_HANDLE_VALUE;
+#else
+                if (data_) munmap(const_cast<char*>(data_), size_);
+#endif
+                data_ = nullptr;
+                size_ = 0;
+            }
+            
+        public:
+            explicit MappedFile(const std::string& path, Access access = Access::Normal)
+            {
+#if defined(_WIN32)
+                file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                                   access == Access::Sequential ? FILE_FLAG_SEQUENTIAL_SCAN :
+                                   access == Access::Random ? FILE_FLAG_RANDOM_ACCESS : FILE_ATTRIBUTE_NORMAL,
+                                   nullptr);
+                if (file == INVALID_HANDLE_VALUE) throw std::runtime_error("Cannot open file: " + path);
+                
+                LARGE_INTEGER length;
+                if (!GetFileSizeEx(file, &length))
+                {
+                    close();
+                    throw std::runtime_error("Cannot stat file: " + path);
+                }
+                if (length.QuadPart == 0) return;
+                
+                mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+                if (mapping) data_ = static_cast<const char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+                if (!data_)
+                {
+                    close();
+                    throw std::runtime_error("Cannot map file: " + path);
+                }
+                size_ = static_cast<size_t>(length.QuadPart);
+#else
+                int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+                if (fd < 0) throw std::runtime_error("Cannot open file: " + path);
+                
+                struct stat info;
+                if (::fstat(fd, &info) != 0)
+                {
+                    ::close(fd);
+                    throw std::runtime_error("Cannot stat file: " + path);
+                }
+                
+                // mmap rejects empty files; an empty mapping is simply an empty view.
+                if (info.st_size > 0)
+                {
+                    void* address = ::mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+                    if (address == MAP_FAILED)
+                    {
+                        ::close(fd);
+                        throw std::runtime_error("Cannot map file: " + path);
+                    }
+                    data_ = static_cast<const char*>(address);
+                    size_ = static_cast<size_t>(info.st_size);
+                }
+                ::close(fd);
+                if (access != Access::Normal) advise(access);
+#endif
+            }
+            
+            MappedFile(MappedFile&& other) noexcept
+                : data_(std::exchange(other.data_, nullptr)), size_(std::exchange(other.size_, 0))
+#if defined(_WIN32)
+                , file(std::exchange(other.file, INVALID_HANDLE_VALUE)), mapping(std::exchange(other.mapping, nullptr))
+#endif
+            {
+            }
+            
+            MappedFile& operator=(MappedFile&& other) noexcept
+            {
+                if (this != &other)
+                {
+                    close();
+                    data_ = std::exchange(other.data_, nullptr);
+                    size_ = std::exchange(other.size_, 0);
+#if defined(_WIN32)
+                    file = std::exchange(other.file, INVALID_HANDLE_VALUE);
+                    mapping = std::exchange(other.mapping, nullptr);
+#endif
+                }
+                return *this;
+            }
+            
+            MappedFile(const MappedFile&) = delete;
+            MappedFile& operator=(const MappedFile&) = delete;
+            
+            ~MappedFile() { close(); }
+            
+            // Passes an access-pattern hint to the kernel; a no-op where the
+            // platform has no equivalent.
+            void advise(Access access)
+            {
+                if (!data_) return;
+#if defined(_WIN32)
+                if (access == Access::WillNeed)
+                {
+                    WIN32_MEMORY_RANGE_ENTRY range{const_cast<char*>(data_), size_};
+                    PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+                }
+#else
+                int advice = MADV_NORMAL;
+                switch (access)
+                {
+                    case Access::Normal: advice = MADV_NORMAL; break;
+                    case Access::Sequential: advice = MADV_SEQUENTIAL; break;
+                    case Access::Random: advice = MADV_RANDOM; break;
+                    case Access::WillNeed: advice = MADV_WILLNEED; break;
+                    case Access::DontNeed: advice = MADV_DONTNEED; break;
+                }
+                ::madvise(const_cast<char*>(data_), size_, advice);
+#endif
+            }
+            
+            const char* data() const { return data_; }
+            size_t size() const { return size_; }
+            bool empty() const { return size_ == 0; }
+            std::string_view view() const { return std::string_view(data_, size_); }
+            operator std::string_view() const { return view(); }
+#if defined(__cpp_lib_span)
+            std::span<const char> span() const { return std::span<const char>(data_, size_); }
+#endif
+        };
+        
+        // Writes content in binary mode with a single write call.
+        void write_file(const std::string& path, std::string_view content)
+        {
+            std::ofstream file(path, std::ios::binary | std::ios::trunc);
+            if (!file.is_open()) throw std::runtime_error("Cannot open file: " + path);
+            file.write(content.data(), static_cast<std::streamsize>(content.size()));
+            if (!file) throw std::runtime_error("Cannot write file: " + path);
+        }
+        
+        // Flushes the stream and asks the OS to put its data on stable storage.
+        bool sync_file(std::FILE* file)
+        {
+            if (std::fflush(file) != 0) return false;
+#if defined(_WIN32)
+            return _commit(_fileno(file)) == 0;
+#else
+            return ::fsync(::fileno(file)) == 0;
+#endif
+        }
+        
+        // Replaces path so that readers see either the old or the new content,
+        // never a torn file: write a temp file next to it, fsync it, then rename
+        // it over the original (and fsync the directory on POSIX). The temp file
+        // is created exclusively and given the original's mode (and owner, where
+        // permitted) before the rename, so replacing a file keeps its permissions.
+        void atomic_write(const std::string& path, std::string_view content)
+        {
+            static std::atomic<unsigned> counter{0};
+#if defined(_WIN32)
+            const unsigned long pid = GetCurrentProcessId();
+#else
+            const unsigned long pid = static_cast<unsigned long>(::getpid());
+            struct stat original;
+            const bool replacing = ::stat(path.c_str(), &original) == 0;
+#endif
+            std::string temp;
+            int fd = -1;
+            for (int attempt = 0; fd < 0 && attempt < 100; ++attempt)
+            {
+                temp = path + ".tmp" + std::to_string(pid) + "." + std::to_string(counter.fetch_add(1));
+#if defined(_WIN32)
+                fd = ::_open(temp.c_str(), _O_CREAT | _O_EXCL | _O_WRONLY | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+                fd = ::open(temp.c_str(), O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC, 0666);
+#endif
+                if (fd < 0 && errno != EEXIST) break;
+            }
+            if (fd < 0) throw std::runtime_error("Cannot open file: " + temp);
+            
+            bool ok = true;
+            for (size_t written = 0; ok && written < content.size();)
+            {
+#if defined(_WIN32)
+                int n = ::_write(fd, content.data() + written, static_cast<unsigned>(std::min<size_t>(content.size() - written, 1u << 30)));
+#else
+                ssize_t n = ::write(fd, content.data() + written, content.size() - written);
+                if (n < 0 && errno == EINTR) continue;
+#endif
+                if (n <= 0) ok = false;
+                else written += static_cast<size_t>(n);
+            }
+#if defined(_WIN32)
+            ok = ok && ::_commit(fd) == 0;
+            ok = ::_close(fd) == 0 && ok;
+#else
+            if (ok && replacing)
+            {
+                ok = ::fchmod(fd, original.st_mode & 07777) == 0;
+                // Only root (or a member of the group) may hand the file over; a
+                // failure here just leaves it owned by the writer.
+                if (ok && (original.st_uid != ::geteuid() || original.st_gid != ::getegid()))
+                    (void)::fchown(fd, original.st_uid, original.st_gid);
+            }
+            ok = ok && ::fsync(fd) == 0;
+            ok = ::close(fd) == 0 && ok;
+#endif
+            if (!ok)
+            {
+                std::remove(temp.c_str());
+                throw std::runtime_error("Cannot write file: " + temp);
+            }
+            
+#if defined(_WIN32)
+            if (!MoveFileExA(temp.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+#else
+            if (std::rename(temp.c_str(), path.c_str()) != 0)
+#endif
+            {
+                std::remove(temp.c_str());
+                throw std::runtime_error("Cannot replace file: " + path);
+            }
+            
+#if !defined(_WIN32)
+            std::string dir = std::filesystem::path(path).parent_path().string();
+            int dir_fd = ::open(dir.empty() ? "." : dir.c_str(), O_RDONLY | O_CLOEXEC);
+            if (dir_fd >= 0)
+            {
+                ::fsync(dir_fd);
+                ::close(dir_fd);
+            }
+#endif
+        }
+        
+        std::vector<std::string> list_files(const std::string& path)
+        {
+            std::vector<std::string> files;
+            for (const auto& entry : std::filesystem::directory_iterator(path))
+            {
+                if (entry.is_regular_file())
+                {
+                    files.push_back(entry.path().string());
+                }
+            }
+            return files;
+        }
+        
+        // Shell-style wildcard match of a file name: '*' matches any run,
+        // '?' one byte, and [abc], [a-z], [!x] match one byte from a set.
+        bool glob_match(std::string_view pattern, std::string_view text)
+        {
+            size_t p = 0, t = 0;
+            size_t star = std::string_view::npos, resume = 0;
+            
+            auto match_class = [&](size_t& pos, char c) -> bool
+            {
+                size_t i = pos + 1;
+                bool negate = i < pattern.size() && (pattern[i] == '!' || pattern[i] == '^');
+                if (negate) i++;
+                bool matched = false;
+                bool first = true;
+                for (; i < pattern.size() && (first || pattern[i] != ']'); ++i, first = false)
+                {
+                    if (i + 2 < pattern.size() && pattern[i + 1] == '-' && pattern[i + 2] != ']')
+                    {
+                        if (c >= pattern[i] && c <= pattern[i + 2]) matched = true;
+                        i += 2;
+                    }
+                    else if (pattern[i] == c)
+                    {
+                        matched = true;
+                    }
+                }
+                if (i >= pattern.size()) return pattern[pos] == c && (pos += 1, true);  // unterminated: literal '['
+                pos = i + 1;
+                return matched != negate;
+            };
+            
+            while (t < text.size())
+            {
+                if (p < pattern.size() && pattern[p] == '*')
+                {
+                    star = p++;
+                    resume = t;
+                    continue;
+                }
+                
+                size_t next = p;
+                bool ok = false;
+                if (p < pattern.size())
+                {
+                    if (pattern[p] == '?') { ok = true; next = p + 1; }
+                    else if (pattern[p] == '[') ok = match_class(next, text[t]);
+                    else { ok = pattern[p] == text[t]; next = p + 1; }
+                }
+                
+                if (ok)
+                {
+                    p = next;
+                    t++;
+                }
+                else if (star != std::string_view::npos)
+                {
+                    p = star + 1;
+                    t = ++resume;
+                }
+                else
+                {
+                    return false;
+                }
+            }
+            
+            while (p < pattern.size() && pattern[p] == '*') p++;
+            return p == pattern.size();
+        }
+        
+        bool create_directory(const std::string& path)
+        {
+            return std::filesystem::create_directories(path);
+        }
+        
+        uintmax_t file_size(const std::string& path)
+        {
+            return std::filesystem::file_size(path);
+        }
+    }
+
+    // ===== THREADING UTILITIES =====
+    namespace threading
+    {
+        constexpr size_t cache_line_size = 64;
+        
+        // Hint to the CPU that we are in a spin-wait loop.
+        void cpu_relax()
+        {
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+            _mm_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+            __asm__ __volatile__("yield");
+#else
+            std::this_thread::yield();
+#endif
+        }
+        
+        // Move-only void() callable used for pool tasks. Callables up to
+        // inline_size bytes are stored in place; larger ones go to the heap.
+        class Job
+        {
+        public:
+            static constexpr size_t inline_size = 48;
+            
+        private:
+            struct Ops
+            {
+                void (*invoke)(void* storage);
+                void (*move)(void* dst, void* src);
+                void (*destroy)(void* storage);
+            };
+            
+            template <typename F>
+            struct InlineOps
+            {
+                static void invoke(void* storage) { (*static_cast<F*>(storage))(); }
+                static void move(void* dst, void* src)
+                {
+                    new (dst) F(std::move(*static_cast<F*>(src)));
+                    static_cast<F*>(src)->~F();
+                }
+                static void destroy(void* storage) { static_cast<F*>(storage)->~F(); }
+                static constexpr Ops table{&invoke, &move, &destroy};
+            };
+            
+            template <typename F>
+            struct HeapOps
+            {
+                static F*& target(void* storage) { return *static_cast<F**>(storage); }
+                static void invoke(void* storage) { (*target(storage))(); }
+                static void move(void* dst, void* src) { new (dst) F*(target(src)); }
+                static void destroy(void* storage) { delete target(storage); }
+                static constexpr Ops table{&invoke, &move, &destroy};
+            };
+            
+            template <typename F>
+            static constexpr bool stored_inline = sizeof(F) <= inline_size &&
+                                                  alignof(F) <= alignof(std::max_align_t) &&
+                                                  std::is_nothrow_move_constructible_v<F>;
+            
+            alignas(std::max_align_t) unsigned char storage[inline_size];
+            const Ops* ops = nullptr;
+            
+        public:
+            Job() = default;
+            
+            template <typename F, typename = std::enable_if_t<!std::is_same_v<std::decay_t<F>, Job>>>
+            Job(F&& f)
+            {
+                using Fn = std::decay_t<F>;
+                if constexpr (stored_inline<Fn>)
+                {
+                    new (storage) Fn(std::forward<F>(f));
+                    ops = &InlineOps<Fn>::table;
+                }
+                else
+                {
+                    new (storage) Fn*(new Fn(std::forward<F>(f)));
+                    ops = &HeapOps<Fn>::table;
+                }
+            }
+            
+            Job(Job&& other) noexcept : ops(other.ops)
+            {
+                if (ops) ops->move(storage, other.storage);
+                other.ops = nullptr;
+            }
+            
+            Job& operator=(Job&& other) noexcept
+            {
+                if (this != &other)
+                {
+                    reset();
+                    ops = other.ops;
+                    if (ops) ops->move(storage, other.storage);
+                    other.ops = nullptr;
+                }
+                return *this;
+            }
+            
+            Job(const Job&) = delete;
+            Job& operator=(const Job&) = delete;
+            
+            ~Job() { reset(); }
+            
+            void reset()
+            {
+                if (ops) ops->destroy(storage);
+                ops = nullptr;
+            }
+            
+            void operator()() { ops->invoke(storage); }
+            
+            explicit operator bool() const { return ops != nullptr; }
+        };
+        
+        template <typename T>
+        class Promise;
+        
+        // Shared state of a Promise/Future pair. Released states are kept on a
+        // per-thread free list, so steady-state submission does not allocate.
+        // The promise gives up its reference as it publishes the result, so
+        // the last release, and with it the recycling, normally happens on
+        // the thread that called get(), which is also the one that acquires
+        // the next state.
+        template <typename T>
+        class FutureState
+        {
+        private:
+            using Stored = std::conditional_t<std::is_void_v<T>, bool, T>;
+            
+            struct FreeList
+            {
+                FutureState* head = nullptr;
+                size_t count = 0;
+                
+                ~FreeList()
+                {
+                    while (head)
+                    {
+                        FutureState* next = head->next_free;
+                        head->destroy();
+                        head = next;
+                    }
+                }
+            };
+            
+            static constexpr size_t max_pooled = 1024;
+            
+            static FreeList& free_list()
+            {
+                static thread_local FreeList list;
+                return list;
+            }
+            
+            std::atomic<int> refs{0};
+            std::atomic<bool> ready{false};
+            std::mutex mutex;
+            std::condition_variable condition;
+            std::optional<Stored> value;
+            std::exception_ptr error;
+            FutureState* next_free = nullptr;
+            
+            // A promise that just published may still be on its way out of
+            // the lock, so wait for it before freeing the state.
+            void destroy()
+            {
+                { std::lock_guard<std::mutex> lock(mutex); }
+                delete this;
+            }
+            
+            void recycle()
+            {
+                value.reset();
+                error = nullptr;
+                ready.store(false, std::memory_order_relaxed);
+                
+                FreeList& list = free_list();
+                if (list.count >= max_pooled)
+                {
+                    destroy();
+                    return;
+                }
+                next_free = list.head;
+                list.head = this;
+                list.count++;
+            }
+            
+        public:
+            static FutureState* acquire()
+            {
+                FreeList& list = free_list();
+                FutureState* state = list.head;
+                if (state)
+                {
+                    list.head = state->next_free;
+                    list.count--;
+                }
+                else
+                {
+                    state = new FutureState();
+                }
+                state->refs.store(2, std::memory_order_relaxed);
+                return state;
+            }
+            
+            void release()
+            {
+                if (refs.fetch_sub(1, std::memory_order_acq_rel) == 1) recycle();
+            }
+            
+            template <typename... V>
+            void store_value(V&&... v)
+            {
+                if (ready.load(std::memory_order_acquire)) throw std::future_error(std::future_errc::promise_already_satisfied);
+                if constexpr (std::is_void_v<T>) value.emplace(true);
+                else value.emplace(std::forward<V>(v)...);
+            }
+            
+            void store_exception(std::exception_ptr e)
+            {
+                if (ready.load(std::memory_order_acquire)) throw std::future_error(std::future_errc::promise_already_satisfied);
+                error = std::move(e);
+            }
+            
+            // Marks the stored result ready and wakes waiters. With
+            // drop_reference the caller's reference is released under the
+            // lock, so the caller must not touch the state afterwards.
+            void publish(bool drop_reference)
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                ready.store(true, std::memory_order_release);
+                condition.notify_all();
+                if (!drop_reference || refs.fetch_sub(1, std::memory_order_acq_rel) != 1) return;
+                lock.unlock();
+                recycle();
+            }
+            
+            bool is_ready() const { return ready.load(std::memory_order_acquire); }
+            
+            void wait()
+            {
+                if (is_ready()) return;
+                std::unique_lock<std::mutex> lock(mutex);
+                condition.wait(lock, [this] { return ready.load(std::memory_order_acquire); });
+            }
+            
+            template <typename Rep, typename Period>
+            bool wait_for(const std::chrono::duration<Rep, Period>& timeout)
+            {
+                if (is_ready()) return true;
+                std::unique_lock<std::mutex> lock(mutex);
+                return condition.wait_for(lock, timeout, [this] { return ready.load(std::memory_order_acquire); });
+            }
+            
+            T take()
+            {
+                wait();
+                if (error) std::rethrow_exception(error);
+                if constexpr (!std::is_void_v<T>) return std::move(*value);
+            }
+        };
+        
+        // Result handle returned by ThreadPool::submit. Unlike std::future its
+        // shared state is pooled and reused instead of allocated per task.
+        template <typename T>
+        class Future
+        {
+        private:
+            FutureState<T>* state = nullptr;
+            
+            explicit Future(FutureState<T>* s) : state(s) {}
+            friend class Promise<T>;
+            
+        public:
+            Future() = default;
+            Future(Future&& other) noexcept : state(std::exchange(other.state, nullptr)) {}
+            Future& operator=(Future&& other) noexcept
+            {
+                if (this != &other)
+                {
+                    if (state) state->release();
+                    state = std::exchange(other.state, nullptr);
+                }
+                return *this;
+            }
+            Future(const Future&) = delete;
+            Future& operator=(const Future&) = delete;
+            
+            ~Future() { if (state) state->release(); }
+            
+            bool valid() const { return state != nullptr; }
+            bool is_ready() const { return state && state->is_ready(); }
+            
+            void wait() const
+            {
+                if (!state) throw std::future_error(std::future_errc::no_state);
+                state->wait();
+            }
+            
+            template <typename Rep, typename Period>
+            bool wait_for(const std::chrono::duration<Rep, Period>& timeout) const
+            {
+                if (!state) throw std::future_error(std::future_errc::no_state);
+                return state->wait_for(timeout);
+            }
+            
+            T get()
+            {
+                if (!state) throw std::future_error(std::future_errc::no_state);
+                FutureState<T>* s = std::exchange(state, nullptr);
+                struct Release { FutureState<T>* s; ~Release() { s->release(); } } guard{s};
+                return s->take();
+            }
+        };
+        
+        template <typename T>
+        class Promise
+        {
+            static_assert(!std::is_reference_v<T>, "Promise/Future do not support reference results; use enqueue");
+            
+        private:
+            FutureState<T>* state = nullptr;
+            bool future_retrieved = false;
+            bool satisfied = false;   // result published and state handed over
+            
+        public:
+            Promise() : state(FutureState<T>::acquire()) {}
+            Promise(Promise&& other) noexcept
+                : state(std::exchange(other.state, nullptr)),
+                  future_retrieved(other.future_retrieved), satisfied(other.satisfied) {}
+            Promise& operator=(Promise&& other) noexcept
+            {
+                if (this != &other)
+                {
+                    abandon();
+                    state = std::exchange(other.state, nullptr);
+                    future_retrieved = other.future_retrieved;
+                    satisfied = other.satisfied;
+                }
+                return *this;
+            }
+            Promise(const Promise&) = delete;
+            Promise& operator=(const Promise&) = delete;
+            
+            ~Promise() { abandon(); }
+            
+            Future<T> get_future()
+            {
+                if (future_retrieved) throw std::future_error(std::future_errc::future_already_retrieved);
+                if (!state) throw std::future_error(std::future_errc::no_state);
+                future_retrieved = true;
+                return Future<T>(state);
+            }
+            
+            template <typename... V>
+            void set_value(V&&... v)
+            {
+                check_state();
+                state->store_value(std::forward<V>(v)...);
+                publish();
+            }
+            
+            void set_exception(std::exception_ptr e)
+            {
+                check_state();
+                state->store_exception(std::move(e));
+                publish();
+            }
+            
+        private:
+            void check_state() const
+            {
+                if (state) return;
+                if (satisfied) throw std::future_error(std::future_errc::promise_already_satisfied);
+                throw std::future_error(std::future_errc::no_state);
+            }
+            
+            // Once the future is out the promise hands over its reference with
+            // the result. Before that it keeps both until abandon().
+            void publish()
+            {
+                if (future_retrieved)
+                {
+                    satisfied = true;
+                    std::exchange(state, nullptr)->publish(true);
+                }
+                else
+                {
+                    state->publish(false);
+                }
+            }
+            
+            void abandon()
+            {
+                if (!state) return;
+                if (!state->is_ready())
+                {
+                    state->store_exception(std::make_exception_ptr(std::future_error(std::future_errc::broken_promise)));
+                    if (future_retrieved)
+                    {
+                        std::exchange(state, nullptr)->publish(true);
+                        return;
+                    }
+                    state->publish(false);
+                }
+                // The future side holds the second reference until it is retrieved and dropped.
+                if (!future_retrieved) state->release();
+                state->release();
+                state = nullptr;
+            }
+        };
+        
+        class ThreadPool
+        {
+        public:
+            enum class Mode
+            {
+                SharedQueue,  // every task goes through one queue and one mutex
+                WorkStealing  // per-worker deques, idle workers steal from the others
+            };
+            
+        private:
+            // Growable ring buffer of jobs. Unlike std::deque it keeps its
+            // storage once grown, so a busy pool stops allocating.
+            class JobDeque
+            {
+            private:
+                std::unique_ptr<Job[]> slots;
+                size_t mask = 0;
+                size_t head = 0;
+                size_t count = 0;
+                
+                void grow()
+                {
+                    size_t capacity = slots ? (mask + 1) * 2 : 64;
+                    std::unique_ptr<Job[]> next(new Job[capacity]);
+                    for (size_t i = 0; i < count; ++i)
+                        next[i] = std::move(slots[(head + i) & mask]);
+                    slots = std::move(next);
+                    mask = capacity - 1;
+                    head = 0;
+                }
+                
+            public:
+                bool empty() const { return count == 0; }
+                size_t size() const { return count; }
+                
+                void push_back(Job job)
+                {
+                    if (!slots || count == mask + 1) grow();
+                    slots[(head + count) & mask] = std::move(job);
+                    count++;
+                }
+                
+                void push_front(Job job)
+                {
+                    if (!slots || count == mask + 1) grow();
+                    head = (head - 1) & mask;
+                    slots[head] = std::move(job);
+                    count++;
+                }
+                
+                Job pop_front()
+                {
+                    Job job = std::move(slots[head]);
+                    head = (head + 1) & mask;
+                    count--;
+                    return job;
+                }
+                
+                Job pop_back()
+                {
+                    count--;
+                    return std::move(slots[(head + count) & mask]);
+                }
+            };
+            
+            struct alignas(cache_line_size) WorkerQueue
+            {
+                std::mutex mutex;
+                JobDeque tasks;
+            };
+            
+            std::vector<std::thread> workers;
+            JobDeque tasks;
+            mutable std::mutex queue_mutex;
+            std::condition_variable condition;
+            std::atomic<bool> stop;
+            
+            // Work-stealing state. queue_mutex/condition are only used to park idle workers.
+            Mode mode;
+            std::vector<std::unique_ptr<WorkerQueue>> local_queues;
+            std::atomic<size_t> pending{0};
+            std::atomic<size_t> idle{0};
+            std::atomic<size_t> next_queue{0};
+            
+            // Null until attach_metrics().
+            std::atomic<metrics::Counter*> tasks_run{nullptr};
+            std::atomic<metrics::Histogram*> task_latency{nullptr};
+            metrics::Registration registration;
+            
+            struct WorkerContext
+            {
+                ThreadPool* pool = nullptr;
+                size_t index = 0;
+            };
+            
+            static WorkerContext& current_worker()
+            {
+                static thread_local WorkerContext context;
+                return context;
+            }
+            
+            void shared_loop(size_t index)
+            {
+                current_worker() = WorkerContext{this, index};
+                while (true)
+                {
+                    Job task;
+                    {
+                        std::unique_lock<std::mutex> lock(this->queue_mutex);
+                        this->condition.wait(lock, [this]
+                        {
+                            return this->stop || !this->tasks.empty();
+                        });
+                        
+                        if (this->stop && this->tasks.empty()) return;
+                        
+                        task = this->tasks.pop_front();
+                    }
+                    run(task);
+                }
+            }
+            
+            void run(Job& task)
+            {
+                metrics::Histogram* latency = task_latency.load(std::memory_order_acquire);
+                if (!latency)
+                {
+                    task();
+                }
+                else
+                {
+                    auto start = std::chrono::steady_clock::now();
+                    task();
+                    latency->record(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::steady_clock::now() - start).count()));
+                }
+                if (metrics::Counter* counter = tasks_run.load(std::memory_order_acquire)) counter->add();
+            }
+            
+            bool pop_local(size_t index, Job& task)
+            {
+                WorkerQueue& queue = *local_queues[index];
+                std::lock_guard<std::mutex> lock(queue.mutex);
+                if (queue.tasks.empty()) return false;
+                task = queue.tasks.pop_back();
+                return true;
+            }
+            
+            bool steal(size_t thief, Job& task)
+            {
+                const size_t count = local_queues.size();
+                for (size_t offset = 1; offset < count; ++offset)
+                {
+                    WorkerQueue& victim = *local_queues[(thief + offset) % count];
+                    std::unique_lock<std::mutex> lock(victim.mutex, std::try_to_lock);
+                    if (!lock.owns_lock() || victim.tasks.empty()) continue;
+                    task = victim.tasks.pop_front();
+                    return true;
+                }
+                return false;
+            }
+            
+            void stealing_loop(size_t index)
+            {
+                current_worker() = WorkerContext{this, index};
+                Job task;
+                
+                while (true)
+                {
+                    // Spin briefly before parking; a steal pass is only attempted
+                    // when something is actually queued somewhere.
+                    bool found = false;
+                    for (int spin = 0; spin < 64 && !found; ++spin)
+                    {
+                        if (pending.load() == 0)
+                        {
+                            if (stop && pending.load() == 0) return;
+                            std::this_thread::yield();
+                            continue;
+                        }
+                        found = pop_local(index, task) || steal(index, task);
+                    }
+                    
+                    if (found)
+                    {
+                        pending.fetch_sub(1);
+                        run(task);
+                        task.reset();
+                        continue;
+                    }
+                    
+                    std::unique_lock<std::mutex> lock(queue_mutex);
+                    idle.fetch_add(1);
+                    condition.wait(lock, [this]
+                    {
+                        return stop || pending.load() > 0;
+                    });
+                    idle.fetch_sub(1);
+                    if (stop && pending.load() == 0) return;
+                }
+            }
+            
+            void push_task(Job task)
+            {
+                if (mode == Mode::SharedQueue)
+                {
+                    {
+                        std::unique_lock<std::mutex> lock(queue_mutex);
+                        if (stop) throw std::runtime_error("enqueue on stopped ThreadPool");
+                        tasks.push_back(std::move(task));
+                    }
+                    condition.notify_one();
+                    return;
+                }
+                
+                // Count the task before checking stop: a worker only exits once it has
+                // seen stop and then pending == 0, so either it sees this task or we
+                // see stop and back out.
+                pending.fetch_add(1);
+                if (stop)
+                {
+                    pending.fetch_sub(1);
+                    throw std::runtime_error("enqueue on stopped ThreadPool");
+                }
+                
+                // Tasks spawned by a worker stay on its own deque (LIFO for locality);
+                // external submissions are spread round-robin and run FIFO.
+                const WorkerContext& context = current_worker();
+                if (context.pool == this)
+                {
+                    WorkerQueue& queue = *local_queues[context.index];
+                    std::lock_guard<std::mutex> lock(queue.mutex);
+                    queue.tasks.push_back(std::move(task));
+                }
+                else
+                {
+                    WorkerQueue& queue = *local_queues[next_queue.fetch_add(1, std::memory_order_relaxed) % local_queues.size()];
+                    std::lock_guard<std::mutex> lock(queue.mutex);
+                    queue.tasks.push_front(std::move(task));
+                }
+                
+                if (idle.load() > 0)
+                {
+                    { std::lock_guard<std::mutex> lock(queue_mutex); }
+                    condition.notify_one();
+                }
+            }
+            
+        public:
+            ThreadPool(size_t threads = std::thread::hardware_concurrency(), Mode mode = Mode::SharedQueue)
+                : stop(false), mode(mode)
+            {
+                if (threads == 0) threads = 1;
+                
+                if (mode == Mode::WorkStealing)
+                {
+                    for (size_t i = 0; i < threads; ++i)
+                        local_queues.emplace_back(std::make_unique<WorkerQueue>());
+                }
+                
+                for (size_t i = 0; i < threads; ++i)
+                {
+                    if (mode == Mode::WorkStealing)
+                        workers.emplace_back([this, i] { stealing_loop(i); });
+                    else
+                        workers.emplace_back([this, i] { shared_loop(i); });
+                }
+            }
+            
+            template<class F, class... Args>
+            auto enqueue(F&& f, Args&&... args) -> std::future<decltype(f(args...))>
+            {
+                using return_type = decltype(f(args...));
+                
+                // The packaged_task is moved straight into the Job, so its shared
+                // state is the only allocation left on this path.
+                std::packaged_task<return_type()> task(
+                    [func = std::forward<F>(f), params = std::make_tuple(std::forward<Args>(args)...)]() mutable -> return_type
+                    {
+                        return std::apply(func, params);
+                    });
+                
+                std::future<return_type> res = task.get_future();
+                push_task(Job(std::move(task)));
+                return res;
+            }
+            
+            // Fire-and-forget submission. Small callables are stored inline in
+            // the Job, so nothing is allocated per task.
+            template<class F, class... Args>
+            void post(F&& f, Args&&... args)
+            {
+                if constexpr (sizeof...(Args) == 0)
+                {
+                    push_task(Job(std::forward<F>(f)));
+                }
+                else
+                {
+                    push_task(Job([func = std::forward<F>(f), params = std::make_tuple(std::forward<Args>(args)...)]() mutable
+                    {
+                        std::apply(func, params);
+                    }));
+                }
+            }
+            
+            // Like enqueue, but returns a threading::Future whose shared state
+            // comes from a per-thread pool instead of a fresh allocation.
+            template<class F, class... Args>
+            auto submit(F&& f, Args&&... args) -> Future<decltype(f(args...))>
+            {
+                using return_type = decltype(f(args...));
+                
+                Promise<return_type> promise;
+                Future<return_type> res = promise.get_future();
+                push_task(Job([promise = std::move(promise), func = std::forward<F>(f),
+                               params = std::make_tuple(std::forward<Args>(args)...)]() mutable
+                {
+                    try
+                    {
+                        if constexpr (std::is_void_v<return_type>)
+                        {
+                            std::apply(func, params);
+                            promise.set_value();
+                        }
+                        else
+                        {
+                            promise.set_value(std::apply(func, params));
+                        }
+                    }
+                    catch (...)
+                    {
+                        promise.set_exception(std::current_exception());
+                    }
+                }));
+                return res;
+            }
+            
+            Mode scheduling_mode() const { return mode; }
+            
+            size_t size() const { return workers.size(); }
+            
+            // True on this pool's own worker threads, where blocking on work
+            // queued to the same pool can deadlock.
+            bool is_worker_thread() const { return current_worker().pool == this; }
+            
+            // Tasks waiting to start.
+            size_t queue_depth() const
+            {
+                if (mode == Mode::WorkStealing) return pending.load(std::memory_order_relaxed);
+                std::lock_guard<std::mutex> lock(queue_mutex);
+                return tasks.size();
+            }
+            
+            // Registers <prefix>.queue_depth, <prefix>.threads, <prefix>.tasks and
+            // <prefix>.task_latency (run time in ns). Pools sharing a registry
+            // need distinct prefixes. Until this is called the workers only
+            // pay for two null checks per task.
+            void attach_metrics(metrics::Registry& registry = metrics::Registry::instance(), const std::string& prefix = "threadpool")
+            {
+                registration.reset();
+                registration.callback_gauge(registry, prefix + ".queue_depth", "Tasks waiting to start",
+                                            [this] { return static_cast<double>(queue_depth()); });
+                registration.callback_gauge(registry, prefix + ".threads", "Worker threads",
+                                            [this] { return static_cast<double>(size()); });
+                tasks_run.store(&registry.counter(prefix + ".tasks", "Tasks run"), std::memory_order_release);
+                task_latency.store(&registry.histogram(prefix + ".task_latency", "Task run time in nanoseconds"),
+                                   std::memory_order_release);
+            }
+            
+            ~ThreadPool()
+            {
+                {
+                    std::unique_lock<std::mutex> lock(queue_mutex);
+                    stop = true;
+                }
+                condition.notify_all();
+                for (std::thread& worker : workers)
+                    worker.join();
+            }
+        };
+        
+        class MutexGuard
+        {
+        private:
+            std::mutex& mutex;
+            
+        public:
+            explicit MutexGuard(std::mutex& m) : mutex(m)
+            {
+                mutex.lock();
+            }
+            
+            ~MutexGuard()
+            {
+                mutex.unlock();
+            }
+            
+            MutexGuard(const MutexGuard&) = delete;
+            MutexGuard& operator=(const MutexGuard&) = delete;
+        };
+        
+        // ----- Locks -----
+        //
+        // Every lock below meets Lockable (SharedLockable for the reader-writer
+        // lock), so LockGuard/SharedGuard, std::lock_guard and std::unique_lock
+        // all work, and keeps contention counters readable through stats().
+        // Define SPUTIL_NO_LOCK_STATS to compile the counters out.
+        
+        struct LockCounters
+        {
+            uint64_t acquisitions = 0;
+            uint64_t contended = 0;   // acquisitions that had to wait
+            uint64_t spins = 0;       // spin iterations spent waiting
+            uint64_t parks = 0;       // times a thread slept in the kernel
+        };
+        
+        class LockStats
+        {
+        private:
+#if !defined(SPUTIL_NO_LOCK_STATS)
+            std::atomic<uint64_t> acquisitions{0};
+            std::atomic<uint64_t> contended{0};
+            std::atomic<uint64_t> spins{0};
+            std::atomic<uint64_t> parks{0};
+#endif
+            
+        public:
+#if !defined(SPUTIL_NO_LOCK_STATS)
+            void on_acquire(uint64_t spin_count)
+            {
+                acquisitions.fetch_add(1, std::memory_order_relaxed);
+                if (spin_count)
+                {
+                    contended.fetch_add(1, std::memory_order_relaxed);
+                    spins.fetch_add(spin_count, std::memory_order_relaxed);
+                }
+            }
+            
+            void on_park() { parks.fetch_add(1, std::memory_order_relaxed); }
+            
+            LockCounters snapshot() const
+            {
+                return {acquisitions.load(std::memory_order_relaxed), contended.load(std::memory_order_relaxed),
+                        spins.load(std::memory_order_relaxed), parks.load(std::memory_order_relaxed)};
+            }
+            
+            void reset()
+            {
+                acquisitions.store(0, std::memory_order_relaxed);
+                contended.store(0, std::memory_order_relaxed);
+                spins.store(0, std::memory_order_relaxed);
+                parks.store(0, std::memory_order_relaxed);
+            }
+#else
+            void on_acquire(uint64_t) {}
+            void on_park() {}
+            LockCounters snapshot() const { return {}; }
+            void reset() {}
+#endif
+        };
+        
+        // Spins with pause for a while, then yields the time slice between tries.
+        void spin_wait(uint64_t& iteration)
+        {
+            if (iteration < 64) cpu_relax();
+            else std::this_thread::yield();
+            iteration++;
+        }
+        
+        template <typename Lock>
+        class LockGuard
+        {
+        private:
+            Lock& lock;
+            
+        public:
+            explicit LockGuard(Lock& l) : lock(l)
+            {
+                lock.lock();
+            }
+            
+            ~LockGuard()
+            {
+                lock.unlock();
+            }
+            
+            LockGuard(const LockGuard&) = delete;
+            LockGuard& operator=(const LockGuard&) = delete;
+        };
+        
+        template <typename Lock>
+        class SharedGuard
+        {
+        private:
+            Lock& lock;
+            
+        public:
+            explicit SharedGuard(Lock& l) : lock(l)
+            {
+                lock.lock_shared();
+            }
+            
+            ~SharedGuard()
+            {
+                lock.unlock_shared();
+            }
+            
+            SharedGuard(const SharedGuard&) = delete;
+            SharedGuard& operator=(const SharedGuard&) = delete;
+        };
+        
+        // FIFO spinlock: threads take a ticket and wait until it is served, so
+        // nobody starves. Waiters back off in proportion to their distance
+        // from the head of the line. Padded to its own cache line. Like any
+        // FIFO spinlock it degrades badly with more threads than cores.
+        class alignas(cache_line_size) TicketSpinLock
+        {
+        private:
+            std::atomic<uint32_t> next{0};
+            std::atomic<uint32_t> serving{0};
+            LockStats counters;
+            
+        public:
+            void lock()
+            {
+                const uint32_t ticket = next.fetch_add(1, std::memory_order_relaxed);
+                uint64_t spins = 0;
+                for (uint32_t current; (current = serving.load(std::memory_order_acquire)) != ticket;)
+                {
+                    // Past the spin budget the thread being served is probably
+                    // descheduled, so give up the time slice instead.
+                    uint32_t ahead = ticket - current;
+                    if (spins > 128) std::this_thread::yield();
+                    else for (uint32_t i = 0; i < ahead; ++i) cpu_relax();
+                    spins += ahead;
+                }
+                counters.on_acquire(spins);
+            }
+            
+            bool try_lock()
+            {
+                uint32_t current = serving.load(std::memory_order_relaxed);
+                uint32_t expected = current;
+                if (!next.compare_exchange_strong(expected, current + 1, std::memory_order_acquire, std::memory_order_relaxed))
+                    return false;
+                counters.on_acquire(0);
+                return true;
+            }
+            
+            void unlock()
+            {
+                serving.store(serving.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+            }
+            
+            LockCounters stats() const { return counters.snapshot(); }
+            void reset_stats() { counters.reset(); }
+        };
+        
+        // Spinning reader-writer lock that prefers readers: readers get in
+        // whenever no writer holds the lock, and a writer waits until the
+        // reader count drops to zero. Suits very short, read-dominated
+        // sections; writers can starve under a constant stream of readers.
+        class alignas(cache_line_size) ReaderWriterLock
+        {
+        private:
+            static constexpr uint32_t writer = 1u << 31;
+            std::atomic<uint32_t> state{0};   // writer bit | reader count
+            LockStats counters;
+            
+        public:
+            void lock()
+            {
+                uint64_t spins = 0;
+                for (;;)
+                {
+                    uint32_t expected = 0;
+                    if (state.load(std::memory_order_relaxed) == 0 &&
+                        state.compare_exchange_weak(expected, writer, std::memory_order_acquire, std::memory_order_relaxed)) break;
+                    spin_wait(spins);
+                }
+                counters.on_acquire(spins);
+            }
+            
+            bool try_lock()
+            {
+                uint32_t expected = 0;
+                if (!state.compare_exchange_strong(expected, writer, std::memory_order_acquire, std::memory_order_relaxed)) return false;
+                counters.on_acquire(0);
+                return true;
+            }
+            
+            void unlock()
+            {
+                state.fetch_and(~writer, std::memory_order_release);
+            }
+            
+            void lock_shared()
+            {
+                uint64_t spins = 0;
+                uint32_t current = state.load(std::memory_order_relaxed);
+                for (;;)
+                {
+                    if (!(current & writer) &&
+                        state.compare_exchange_weak(current, current + 1, std::memory_order_acquire, std::memory_order_relaxed)) break;
+                    if (current & writer)
+                    {
+                        spin_wait(spins);
+                        current = state.load(std::memory_order_relaxed);
+                    }
+                }
+                counters.on_acquire(spins);
+            }
+            
+            bool try_lock_shared()
+            {
+                uint32_t current = state.load(std::memory_order_relaxed);
+                while (!(current & writer))
+                {
+                    if (state.compare_exchange_weak(current, current + 1, std::memory_order_acquire, std::memory_order_relaxed))
+                    {
+                        counters.on_acquire(0);
+                        return true;
+                    }
+                }
+                return false;
+            }
+            
+            void unlock_shared()
+            {
+                state.fetch_sub(1, std::memory_order_release);
+            }
+            
+            LockCounters stats() const { return counters.snapshot(); }
+            void reset_stats() { counters.reset(); }
+        };
+        
+        // Mutex that spins briefly before sleeping, for sections short enough
+        // that the holder usually leaves before a context switch would pay
+        // off. Three states (free, locked, locked with sleepers) let unlock
+        // skip the wake-up call when nobody sleeps. Sleeps on a futex on
+        // Linux and on a condition variable elsewhere.
+        class alignas(cache_line_size) AdaptiveMutex
+        {
+        private:
+            static constexpr uint32_t unlocked = 0;
+            static constexpr uint32_t locked = 1;
+            static constexpr uint32_t sleeping = 2;
+            
+            std::atomic<uint32_t> state{unlocked};
+            uint32_t spin_limit;
+            LockStats counters;
+#if !defined(__linux__)
+            std::mutex park_mutex;
+            std::condition_variable park_condition;
+#endif
+            
+            void park()
+            {
+                counters.on_park();
+#if defined(__linux__)
+                syscall(SYS_futex, reinterpret_cast<uint32_t*>(&state), FUTEX_WAIT_PRIVATE, sleeping, nullptr, nullptr, 0);
+#else
+                std::unique_lock<std::mutex> lock(park_mutex);
+                park_condition.wait(lock, [this] { return state.load(std::memory_order_relaxed) != sleeping; });
+#endif
+            }
+            
+            void wake()
+            {
+#if defined(__linux__)
+                syscall(SYS_futex, reinterpret_cast<uint32_t*>(&state), FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+#else
+                {
+                    std::lock_guard<std::mutex> lock(park_mutex);
+                }
+                park_condition.notify_one();
+#endif
+            }
+            
+        public:
+            explicit AdaptiveMutex(uint32_t spins_before_park = 100) : spin_limit(spins_before_park) {}
+            
+            void lock()
+            {
+                uint32_t expected = unlocked;
+                if (state.compare_exchange_strong(expected, locked, std::memory_order_acquire, std::memory_order_relaxed))
+                {
+                    counters.on_acquire(0);
+                    return;
+                }
+                
+                uint64_t spins = 0;
+                while (spins < spin_limit)
+                {
+                    cpu_relax();
+                    spins++;
+                    expected = unlocked;
+                    if (state.load(std::memory_order_relaxed) == unlocked &&
+                        state.compare_exchange_weak(expected, locked, std::memory_order_acquire, std::memory_order_relaxed))
+                    {
+                        counters.on_acquire(spins);
+                        return;
+                    }
+                }
+                
+                // Announce a sleeper; whoever takes the lock from here on
+                // keeps the sleeping state so unlock knows to wake someone.
+                while (state.exchange(sleeping, std::memory_order_acquire) != unlocked) park();
+                counters.on_acquire(spins);
+            }
+            
+            bool try_lock()
+            {
+                uint32_t expected = unlocked;
+                if (!state.compare_exchange_strong(expected, locked, std::memory_order_acquire, std::memory_order_relaxed)) return false;
+                counters.on_acquire(0);
+                return true;
+            }
+            
+            void unlock()
+            {
+                if (state.exchange(unlocked, std::memory_order_release) == sleeping) wake();
+            }
+            
+            LockCounters stats() const { return counters.snapshot(); }
+            void reset_stats() { counters.reset(); }
+        };
+        
+        // Sequence lock for small trivially copyable snapshots: writers bump an
+        // odd/even sequence around the update, readers copy without writing
+        // shared memory and retry if the sequence moved. The payload lives in
+        // relaxed atomic words so torn reads are detected rather than racy.
+        // Writers are serialized among themselves by the sequence itself.
+        template <typename T>
+        class alignas(cache_line_size) SeqLock
+        {
+            static_assert(std::is_trivially_copyable_v<T>, "SeqLock needs a trivially copyable type");
+            
+        private:
+            static constexpr size_t words = (sizeof(T) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+            
+            std::atomic<uint32_t> sequence{0};
+            std::atomic<uint64_t> data[words];
+            mutable LockStats counters;
+            
+            void write_words(const T& value)
+            {
+                uint64_t buffer[words] = {};
+                std::memcpy(buffer, &value, sizeof(T));
+                for (size_t i = 0; i < words; ++i) data[i].store(buffer[i], std::memory_order_relaxed);
+            }
+            
+            uint32_t begin_write()
+            {
+                uint64_t spins = 0;
+                uint32_t current = sequence.load(std::memory_order_relaxed);
+                for (;;)
+                {
+                    if (!(current & 1) &&
+                        sequence.compare_exchange_weak(current, current + 1, std::memory_order_relaxed, std::memory_order_relaxed)) break;
+                    spin_wait(spins);
+                    current = sequence.load(std::memory_order_relaxed);
+                }
+                std::atomic_thread_fence(std::memory_order_release);
+                counters.on_acquire(spins);
+                return current + 1;
+            }
+            
+            void end_write(uint32_t odd)
+            {
+                sequence.store(odd + 1, std::memory_order_release);
+            }
+            
+        public:
+            explicit SeqLock(const T& initial = T())
+            {
+                write_words(initial);
+            }
+            
+            // One read attempt; false if a write overlapped it.
+            bool try_load(T& out) const
+            {
+                uint32_t before = sequence.load(std::memory_order_acquire);
+                if (before & 1) return false;
+                uint64_t buffer[words];
+                for (size_t i = 0; i < words; ++i) buffer[i] = data[i].load(std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (sequence.load(std::memory_order_relaxed) != before) return false;
+                std::memcpy(&out, buffer, sizeof(T));
+                return true;
+            }
+            
+            T load() const
+            {
+                T value;
+                uint64_t spins = 0;
+                while (!try_load(value)) spin_wait(spins);
+                if (spins) counters.on_acquire(spins);
+                return value;
+            }
+            
+            void store(const T& value)
+            {
+                uint32_t odd = begin_write();
+                write_words(value);
+                end_write(odd);
+            }
+            
+            // Read-modify-write: value = fn(value), exclusive among writers.
+            template <typename Fn>
+            void update(Fn&& fn)
+            {
+                uint32_t odd = begin_write();
+                T value;
+                uint64_t buffer[words];
+                for (size_t i = 0; i < words; ++i) buffer[i] = data[i].load(std::memory_order_relaxed);
+                std::memcpy(&value, buffer, sizeof(T));
+                write_words(fn(value));
+                end_write(odd);
+            }
+            
+            // Writer acquisitions (contended ones spun on another writer) plus
+            // reads that had to retry.
+            LockCounters stats() const { return counters.snapshot(); }
+            void reset_stats() { counters.reset(); }
+        };
+        
+        // Hierarchical timer wheel: four levels of 256 slots, so timers up
+        // to 2^32 ticks ahead are inserted and cancelled in O(1); later ones
+        // are parked in the top level and re-filed as it turns. One driver
+        // thread advances the wheel and posts due callbacks to the pool, so
+        // callbacks must not block for long and may run on any worker.
+        class TimerWheel
+        {
+        private:
+            static constexpr uint32_t npos = std::numeric_limits<uint32_t>::max();
+            static constexpr unsigned level_bits = 8;
+            static constexpr uint32_t slots_per_level = 1u << level_bits;
+            static constexpr unsigned levels = 4;
+            
+            // schedule_every state: a tick that finds the previous call still
+            // running is skipped instead of overlapping it.
+            struct Periodic
+            {
+                Job callback;
+                std::atomic<bool> running{false};
+            };
+            
+            struct Timer
+            {
+                Job callback;
+                std::shared_ptr<Periodic> periodic;
+                uint64_t expiry = 0;
+                uint64_t period = 0;
+                uint32_t prev = npos;
+                uint32_t next = npos;
+                uint32_t slot = npos;  // npos while on the free list
+                uint32_t generation = 0;
+            };
+            
+        public:
+            // Identifies one scheduled timer; stale handles are ignored by cancel.
+            class Handle
+            {
+            private:
+                friend class TimerWheel;
+                uint32_t index = npos;
+                uint32_t generation = 0;
+                
+                Handle(uint32_t i, uint32_t g) : index(i), generation(g) {}
+                
+            public:
+                Handle() = default;
+                bool valid() const { return index != npos; }
+            };
+            
+        private:
+            ThreadPool& pool;
+            std::chrono::steady_clock::duration resolution;
+            std::chrono::steady_clock::time_point origin;
+            
+            mutable std::mutex mutex;
+            std::condition_variable condition;
+            std::vector<Timer> timers;
+            std::vector<uint32_t> slots;  // list heads, levels * slots_per_level
+            uint32_t free_list = npos;
+            size_t pending = 0;
+            size_t level0_pending = 0;
+            uint64_t current = 0;  // next tick to process
+            uint64_t wake_tick = std::numeric_limits<uint64_t>::max();
+            bool stopping = false;
+            std::thread driver;
+            
+            uint64_t now_tick() const
+            {
+                return static_cast<uint64_t>((std::chrono::steady_clock::now() - origin) / resolution);
+            }
+            
+            template <typename Rep, typename Period>
+            uint64_t to_ticks(std::chrono::duration<Rep, Period> delay) const
+            {
+                auto ticks = std::chrono::ceil<std::chrono::steady_clock::duration>(delay) / resolution;
+                return ticks > 0 ? static_cast<uint64_t>(ticks) : 0;
+            }
+            
+            uint32_t allocate()
+            {
+                if (free_list != npos)
+                {
+                    uint32_t index = free_list;
+                    free_list = timers[index].next;
+                    return index;
+                }
+                if (timers.size() >= npos) throw std::length_error("TimerWheel: too many timers");
+                timers.emplace_back();
+                return static_cast<uint32_t>(timers.size() - 1);
+            }
+            
+            void release(uint32_t index)
+            {
+                Timer& timer = timers[index];
+                timer.callback.reset();
+                timer.periodic.reset();
+                timer.slot = npos;
+                timer.generation++;
+                timer.next = free_list;
+                free_list = index;
+            }
+            
+            void link(uint32_t index)
+            {
+                Timer& timer = timers[index];
+                uint64_t expiry = std::max(timer.expiry, current);
+                uint64_t delta = expiry - current;
+                unsigned level = 0;
+                while (level + 1 < levels && delta >= (uint64_t(1) << (level_bits * (level + 1)))) level++;
+                if (delta >= (uint64_t(1) << (level_bits * levels))) expiry = current + (uint64_t(1) << (level_bits * levels)) - 1;
+                
+                uint32_t slot = level * slots_per_level + static_cast<uint32_t>((expiry >> (level_bits * level)) & (slots_per_level - 1));
+                timer.slot = slot;
+                timer.prev = npos;
+                timer.next = slots[slot];
+                if (timer.next != npos) timers[timer.next].prev = index;
+                slots[slot] = index;
+                pending++;
+                if (level == 0) level0_pending++;
+            }
+            
+            void unlink(uint32_t index)
+            {
+                Timer& timer = timers[index];
+                if (timer.prev != npos) timers[timer.prev].next = timer.next;
+                else slots[timer.slot] = timer.next;
+                if (timer.next != npos) timers[timer.next].prev = timer.prev;
+                pending--;
+                if (timer.slot < slots_per_level) level0_pending--;
+            }
+            
+            // Detaches a slot and returns its list head.
+            uint32_t take_slot(uint32_t slot)
+            {
+                uint32_t head = slots[slot];
+                slots[slot] = npos;
+                for (uint32_t i = head; i != npos; i = timers[i].next)
+                {
+                    pending--;
+                    if (slot < slots_per_level) level0_pending--;
+                }
+                return head;
+            }
+            
+            // Processes tick `current`: cascades upper levels on wrap-around and
+            // moves the due callbacks into ready.
+            void process_tick(std::vector<Job>& ready)
+            {
+                for (unsigned level = 1; level < levels; ++level)
+                {
+                    uint64_t mask = (uint64_t(1) << (level_bits * level)) - 1;
+                    if ((current & mask) != 0) break;
+                    uint32_t slot = level * slots_per_level + static_cast<uint32_t>((current >> (level_bits * level)) & (slots_per_level - 1));
+                    for (uint32_t i = take_slot(slot); i != npos;)
+                    {
+                        uint32_t next = timers[i].next;
+                        link(i);
+                        i = next;
+                    }
+                }
+                
+                for (uint32_t i = take_slot(static_cast<uint32_t>(current & (slots_per_level - 1))); i != npos;)
+                {
+                    Timer& timer = timers[i];
+                    uint32_t next = timer.next;
+                    if (timer.periodic)
+                    {
+                        std::shared_ptr<Periodic> periodic = timer.periodic;
+                        ready.emplace_back([periodic]()
+                        {
+                            if (periodic->running.exchange(true, std::memory_order_acquire)) return;
+                            periodic->callback();
+                            periodic->running.store(false, std::memory_order_release);
+                        });
+                        timer.expiry += timer.period;
+                        if (timer.expiry <= current) timer.expiry = current + 1;
+                        link(i);
+                    }
+                    else
+                    {
+                        ready.push_back(std::move(timer.callback));
+                        release(i);
+                    }
+                    i = next;
+                }
+                current++;
+            }
+            
+            // First tick at which the wheel has work: the next occupied level-0
+            // slot, or else the next cascade boundary.
+            uint64_t next_event_tick() const
+            {
+                if (pending == 0) return std::numeric_limits<uint64_t>::max();
+                uint64_t boundary = (current | (slots_per_level - 1)) + 1;
+                if (level0_pending == 0) return boundary;
+                for (uint64_t tick = current; tick < boundary; ++tick)
+                {
+                    if (slots[tick & (slots_per_level - 1)] != npos) return tick;
+                }
+                return boundary;
+            }
+            
+            void run()
+            {
+                std::vector<Job> ready;
+                std::unique_lock<std::mutex> lock(mutex);
+                while (!stopping)
+                {
+                    uint64_t target = now_tick();
+                    while (current <= target)
+                    {
+                        if (pending == 0)
+                        {
+                            current = target + 1;
+                            break;
+                        }
+                        if (level0_pending == 0 && (current & (slots_per_level - 1)) != 0)
+                        {
+                            // Nothing can fire before the next cascade boundary.
+                            current = std::min((current | (slots_per_level - 1)) + 1, target + 1);
+                            continue;
+                        }
+                        process_tick(ready);
+                    }
+                    
+                    if (!ready.empty())
+                    {
+                        lock.unlock();
+                        for (Job& job : ready) pool.post(std::move(job));
+                        ready.clear();
+                        lock.lock();
+                        continue;
+                    }
+                    
+                    wake_tick = next_event_tick();
+                    if (wake_tick == std::numeric_limits<uint64_t>::max()) condition.wait(lock);
+                    else condition.wait_until(lock, origin + resolution * static_cast<std::int64_t>(wake_tick));
+                    wake_tick = std::numeric_limits<uint64_t>::max();
+                }
+            }
+            
+            Handle add(Job callback, std::shared_ptr<Periodic> periodic, uint64_t delay, uint64_t period)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                uint32_t index = allocate();
+                Timer& timer = timers[index];
+                timer.callback = std::move(callback);
+                timer.periodic = std::move(periodic);
+                timer.period = period;
+                timer.expiry = now_tick() + std::max<uint64_t>(delay, 1);
+                link(index);
+                if (timer.expiry < wake_tick) condition.notify_one();
+                return Handle(index, timer.generation);
+            }
+            
+        public:
+            explicit TimerWheel(ThreadPool& p, std::chrono::steady_clock::duration tick = std::chrono::milliseconds(1))
+                : pool(p), resolution(tick > std::chrono::steady_clock::duration::zero() ? tick : std::chrono::milliseconds(1)),
+                  origin(std::chrono::steady_clock::now()), slots(levels * slots_per_level, npos)
+            {
+                driver = std::thread([this] { run(); });
+            }
+            
+            TimerWheel(const TimerWheel&) = delete;
+            TimerWheel& operator=(const TimerWheel&) = delete;
+            
+            // Stops the driver; timers that have not fired yet are dropped.
+            ~TimerWheel()
+            {
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    stopping = true;
+                }
+                condition.notify_all();
+                driver.join();
+            }
+            
+            // Runs f once on the pool after delay, rounded up to whole ticks.
+            template <typename Rep, typename Period, typename F>
+            Handle schedule_after(std::chrono::duration<Rep, Period> delay, F&& f)
+            {
+                return add(Job(std::forward<F>(f)), nullptr, to_ticks(delay), 0);
+            }
+            
+            // Runs f on the pool every period, first after one period. Deadlines
+            // advance from the schedule rather than from when f ran, so the
+            // rate does not drift.
+            template <typename Rep, typename Period, typename F>
+            Handle schedule_every(std::chrono::duration<Rep, Period> period, F&& f)
+            {
+                auto periodic = std::make_shared<Periodic>();
+                periodic->callback = Job(std::forward<F>(f));
+                uint64_t ticks = std::max<uint64_t>(to_ticks(period), 1);
+                return add(Job(), std::move(periodic), ticks, ticks);
+            }
+            
+            // Removes a timer that has not fired (or a periodic timer). Returns
+            // false for stale handles; a callback already posted still runs.
+            bool cancel(Handle handle)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (handle.index >= timers.size()) return false;
+                Timer& timer = timers[handle.index];
+                if (timer.generation != handle.generation || timer.slot == npos) return false;
+                unlink(handle.index);
+                release(handle.index);
+                return true;
+            }
+            
+            size_t size() const
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                return pending;
+            }
+        };
+    }
+
+    // ===== CONCURRENCY UTILITIES =====
+    namespace concurrency
+    {
+        // Mutex-protected FIFO. With a capacity it is bounded: push blocks
+        // while the queue is full, which gives producers backpressure. close()
+        // ends the stream: pushes fail, and consumers drain what is left and
+        // are then told the queue is finished. The bulk calls move many items per
+        // lock acquisition and wakeup.
+        template <typename T, typename Allocator = std::allocator<T>>
+        class ConcurrentQueue
+        {
+        private:
+            std::queue<T, std::deque<T, Allocator>> queue;
+            mutable std::mutex mutex;
+            std::condition_variable condition;
+            std::condition_variable not_full;
+            size_t limit = 0;   // 0 means unbounded
+            bool is_closed = false;
+            
+            bool full() const { return limit != 0 && queue.size() >= limit; }
+            
+            size_t room() const { return limit == 0 ? std::numeric_limits<size_t>::max() : limit - queue.size(); }
+            
+            template <typename OutputIt>
+            size_t take(OutputIt& out, size_t max)
+            {
+                size_t count = std::min(max, queue.size());
+                for (size_t i = 0; i < count; ++i)
+                {
+                    *out++ = std::move(queue.front());
+                    queue.pop();
+                }
+                return count;
+            }
+            
+            // left_over passes the wakeup on when a bulk pop left items behind:
+            // a consumer that waited for a batch may have swallowed the notify
+            // meant for another.
+            void after_take(size_t count, bool left_over = false)
+            {
+                if (left_over) condition.notify_one();
+                if (count == 0 || limit == 0) return;
+                if (count == 1) not_full.notify_one();
+                else not_full.notify_all();
+            }
+            
+        public:
+            explicit ConcurrentQueue(const Allocator& allocator = Allocator()) : queue(allocator) {}
+            
+            explicit ConcurrentQueue(size_t capacity, const Allocator& allocator = Allocator())
+                : queue(allocator), limit(capacity) {}
+            
+            // Blocks while the queue is full. Throws if the queue is closed.
+            void push(T value)
+            {
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    not_full.wait(lock, [this]{ return is_closed || !full(); });
+                    if (is_closed) throw std::runtime_error("push to a closed ConcurrentQueue");
+                    queue.push(std::move(value));
+                }
+                condition.notify_one();
+            }
+            
+            // Fails instead of blocking when the queue is full or closed.
+            bool try_push(T value)
+            {
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    if (is_closed || full()) return false;
+                    queue.push(std::move(value));
+                }
+                condition.notify_one();
+                return true;
+            }
+            
+            // Pushes [first, last) in as few lock acquisitions as capacity
+            // allows, blocking for room as needed. Returns how many items were
+            // pushed, which is short of the range only if the queue was closed.
+            // Wrap the range in std::make_move_iterator to move the items.
+            template <typename InputIt>
+            size_t push_bulk(InputIt first, InputIt last)
+            {
+                size_t pushed = 0;
+                while (first != last)
+                {
+                    {
+                        std::unique_lock<std::mutex> lock(mutex);
+                        not_full.wait(lock, [this]{ return is_closed || !full(); });
+                        if (is_closed) return pushed;
+                        for (size_t n = room(); n > 0 && first != last; --n, ++first, ++pushed)
+                            queue.push(*first);
+                    }
+                    condition.notify_all();
+                }
+                return pushed;
+            }
+            
+            // Blocks until an item is available. Throws if the queue is closed
+            // and empty.
+            T pop()
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                condition.wait(lock, [this]{ return is_closed || !queue.empty(); });
+                if (queue.empty()) throw std::runtime_error("pop from a closed, empty ConcurrentQueue");
+                T value = std::move(queue.front());
+                queue.pop();
+                lock.unlock();
+                after_take(1);
+                return value;
+            }
+            
+            // Blocks until an item is available and returns true, or returns
+            // false once the queue is closed and drained.
+            bool pop(T& value)
+            {
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    condition.wait(lock, [this]{ return is_closed || !queue.empty(); });
+                    if (queue.empty()) return false;
+                    value = std::move(queue.front());
+                    queue.pop();
+                }
+                after_take(1);
+                return true;
+            }
+            
+            bool try_pop(T& value)
+            {
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    if (queue.empty()) return false;
+                    value = std::move(queue.front());
+                    queue.pop();
+                }
+                after_take(1);
+                return true;
+            }
+            
+            // Blocks until at least one item is available, then moves up to max
+            // items into out under the same lock. Returns 0 only once the queue
+            // is closed and drained. Throws std::invalid_argument if max is 0.
+            template <typename OutputIt>
+            size_t pop_bulk(OutputIt out, size_t max)
+            {
+                if (max == 0) throw std::invalid_argument("pop_bulk needs max > 0");
+                size_t count;
+                bool left_over;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    condition.wait(lock, [this]{ return is_closed || !queue.empty(); });
+                    count = take(out, max);
+                    left_over = !queue.empty();
+                }
+                after_take(count, left_over);
+                return count;
+            }
+            
+            // Like pop_bulk, but after the first item arrives it waits up to
+            // max_wait for a full batch of max items before taking what is
+            // there. This bounds the latency batching adds under light load.
+            template <typename OutputIt, typename Rep, typename Period>
+            size_t pop_bulk(OutputIt out, size_t max, const std::chrono::duration<Rep, Period>& max_wait)
+            {
+                if (max == 0) throw std::invalid_argument("pop_bulk needs max > 0");
+                size_t count;
+                bool left_over;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    // A bounded queue can never hold more than its capacity.
+                    const size_t want = limit == 0 ? max : std::min(max, limit);
+                    do
+                    {
+                        condition.wait(lock, [this]{ return is_closed || !queue.empty(); });
+                        if (queue.size() < want && !is_closed && max_wait > max_wait.zero())
+                            condition.wait_for(lock, max_wait, [&]{ return is_closed || queue.size() >= want; });
+                        // Another consumer may have emptied the queue while this one waited.
+                    } while (queue.empty() && !is_closed);
+                    count = take(out, max);
+                    left_over = !queue.empty();
+                }
+                after_take(count, left_over);
+                return count;
+            }
+            
+            // Ends the stream and wakes every blocked producer and consumer.
+            void close()
+            {
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    is_closed = true;
+                }
+                condition.notify_all();
+                not_full.notify_all();
+            }
+            
+            bool closed() const
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                return is_closed;
+            }
+            
+            bool empty() const
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                return queue.empty();
+            }
+            
+            size_t size() const
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                return queue.size();
+            }
+            
+            // 0 for an unbounded queue.
+            size_t capacity() const { return limit; }
+        };
+        
+        // Bounded lock-free ring buffer after Dmitry Vyukov's MPMC queue: every
+        // cell carries a sequence number that tells producers and consumers
+        // whose turn it is. With MultiProducer/MultiConsumer set to false the
+        // matching side claims cells with a plain store instead of a CAS.
+        // Capacity is rounded up to a power of two.
+        template <typename T, bool MultiProducer = true, bool MultiConsumer = true>
+        class BoundedQueue
+        {
+        private:
+            struct Cell
+            {
+                std::atomic<size_t> sequence;
+                alignas(T) unsigned char storage[sizeof(T)];
+                
+                T* value() { return std::launder(reinterpret_cast<T*>(storage)); }
+            };
+            
+            static constexpr int spin_limit = 128;
+            
+            std::unique_ptr<Cell[]> buffer;
+            size_t mask;
+            alignas(threading::cache_line_size) std::atomic<size_t> enqueue_pos{0};
+            alignas(threading::cache_line_size) std::atomic<size_t> dequeue_pos{0};
+            
+            // Parking lot for the blocking push/pop, only touched when a waiter exists.
+            alignas(threading::cache_line_size) std::atomic<size_t> push_waiters{0};
+            std::atomic<size_t> pop_waiters{0};
+            std::mutex park_mutex;
+            std::condition_variable not_empty;
+            std::condition_variable not_full;
+            
+            static size_t round_up(size_t capacity)
+            {
+                size_t size = 2;
+                while (size < capacity) size <<= 1;
+                return size;
+            }
+            
+            static std::ptrdiff_t diff(size_t a, size_t b)
+            {
+                return static_cast<std::ptrdiff_t>(a - b);
+            }
+            
+            // Claims up to max consecutive cells. A cell is ready when its sequence
+            // equals pos + i + offset (offset 0 for producers, 1 for consumers).
+            template <bool Multi>
+            size_t claim(std::atomic<size_t>& position, size_t max, size_t offset, size_t& first)
+            {
+                if (max == 0) return 0;
+                size_t pos = position.load(std::memory_order_relaxed);
+                while (true)
+                {
+                    size_t ready = 0;
+                    while (ready < max)
+                    {
+                        size_t seq = buffer[(pos + ready) & mask].sequence.load(std::memory_order_acquire);
+                        if (diff(seq, pos + ready + offset) != 0) break;
+                        ready++;
+                    }
+                    
+                    if (ready == 0)
+                    {
+                        size_t seq = buffer[pos & mask].sequence.load(std::memory_order_acquire);
+                        if (diff(seq, pos + offset) < 0) return 0;
+                        pos = position.load(std::memory_order_relaxed);
+                        continue;
+                    }
+                    
+                    if constexpr (Multi)
+                    {
+                        if (!position.compare_exchange_weak(pos, pos + ready, std::memory_order_relaxed)) continue;
+                    }
+                    else
+                    {
+                        position.store(pos + ready, std::memory_order_relaxed);
+                    }
+                    first = pos;
+                    return ready;
+                }
+            }
+            
+            void wake(std::atomic<size_t>& waiters, std::condition_variable& condition)
+            {
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                if (waiters.load(std::memory_order_relaxed) == 0) return;
+                { std::lock_guard<std::mutex> lock(park_mutex); }
+                condition.notify_all();
+            }
+            
+            // True when the cell at position is ready for the given side; used as
+            // the park predicate because it does not modify the queue.
+            bool cell_ready(const std::atomic<size_t>& position, size_t offset) const
+            {
+                size_t pos = position.load(std::memory_order_relaxed);
+                return diff(buffer[pos & mask].sequence.load(std::memory_order_acquire), pos + offset) >= 0;
+            }
+            
+            template <typename Try>
+            void wait_for(std::atomic<size_t>& waiters, std::condition_variable& condition,
+                          const std::atomic<size_t>& position, size_t offset, Try attempt)
+            {
+                while (true)
+                {
+                    for (int spin = 0; spin < spin_limit; ++spin)
+                    {
+                        if (attempt()) return;
+                        threading::cpu_relax();
+                    }
+                    
+                    std::unique_lock<std::mutex> lock(park_mutex);
+                    waiters.fetch_add(1);
+                    std::atomic_thread_fence(std::memory_order_seq_cst);
+                    condition.wait(lock, [&] { return cell_ready(position, offset); });
+                    waiters.fetch_sub(1);
+                }
+            }
+            
+        public:
+            explicit BoundedQueue(size_t capacity)
+                : buffer(new Cell[round_up(capacity)]), mask(round_up(capacity) - 1)
+            {
+                for (size_t i = 0; i <= mask; ++i)
+                    buffer[i].sequence.store(i, std::memory_order_relaxed);
+            }
+            
+            BoundedQueue(const BoundedQueue&) = delete;
+            BoundedQueue& operator=(const BoundedQueue&) = delete;
+            
+            ~BoundedQueue()
+            {
+                size_t end = enqueue_pos.load(std::memory_order_relaxed);
+                for (size_t pos = dequeue_pos.load(std::memory_order_relaxed); pos != end; ++pos)
+                    buffer[pos & mask].value()->~T();
+            }
+            
+            template <typename... Args>
+            bool try_emplace(Args&&... args)
+            {
+                size_t pos;
+                if (claim<MultiProducer>(enqueue_pos, 1, 0, pos) == 0) return false;
+                Cell& cell = buffer[pos & mask];
+                new (cell.storage) T(std::forward<Args>(args)...);
+                cell.sequence.store(pos + 1, std::memory_order_release);
+                wake(pop_waiters, not_empty);
+                return true;
+            }
+            
+            bool try_push(const T& value) { return try_emplace(value); }
+            bool try_push(T&& value) { return try_emplace(std::move(value)); }
+            
+            bool try_pop(T& value)
+            {
+                size_t pos;
+                if (claim<MultiConsumer>(dequeue_pos, 1, 1, pos) == 0) return false;
+                Cell& cell = buffer[pos & mask];
+                value = std::move(*cell.value());
+                cell.value()->~T();
+                cell.sequence.store(pos + mask + 1, std::memory_order_release);
+                wake(push_waiters, not_full);
+                return true;
+            }
+            
+            // Pushes up to count items from first with a single claim and
+            // returns how many were pushed.
+            template <typename InputIt>
+            size_t push_n(InputIt first, size_t count)
+            {
+                size_t pos;
+                size_t claimed = claim<MultiProducer>(enqueue_pos, count, 0, pos);
+                for (size_t i = 0; i < claimed; ++i, ++first)
+                {
+                    Cell& cell = buffer[(pos + i) & mask];
+                    new (cell.storage) T(*first);
+                    cell.sequence.store(pos + i + 1, std::memory_order_release);
+                }
+                if (claimed) wake(pop_waiters, not_empty);
+                return claimed;
+            }
+            
+            // Pops up to count items into out with a single claim and returns how
+            // many were popped.
+            template <typename OutputIt>
+            size_t pop_n(OutputIt out, size_t count)
+            {
+                size_t pos;
+                size_t claimed = claim<MultiConsumer>(dequeue_pos, count, 1, pos);
+                for (size_t i = 0; i < claimed; ++i)
+                {
+                    Cell& cell = buffer[(pos + i) & mask];
+                    *out++ = std::move(*cell.value());
+                    cell.value()->~T();
+                    cell.sequence.store(pos + i + mask + 1, std::memory_order_release);
+                }
+                if (claimed) wake(push_waiters, not_full);
+                return claimed;
+            }
+            
+            // Blocking variants: spin for a while, then park until space/data.
+            void push(T value)
+            {
+                wait_for(push_waiters, not_full, enqueue_pos, 0, [&] { return try_push(std::move(value)); });
+            }
+            
+            T pop()
+            {
+                T value;
+                wait_for(pop_waiters, not_empty, dequeue_pos, 1, [&] { return try_pop(value); });
+                return value;
+            }
+            
+            // Approximate while other threads are pushing or popping.
+            size_t size() const
+            {
+                size_t head = dequeue_pos.load(std::memory_order_relaxed);
+                size_t tail = enqueue_pos.load(std::memory_order_relaxed);
+                return diff(tail, head) > 0 ? tail - head : 0;
+            }
+            
+            bool empty() const { return size() == 0; }
+            size_t capacity() const { return mask + 1; }
+        };
+        
+        template <typename T>
+        using MPMCQueue = BoundedQueue<T, true, true>;
+        
+        template <typename T>
+        using MPSCQueue = BoundedQueue<T, true, false>;
+        
+        template <typename T>
+        using SPSCQueue = BoundedQueue<T, false, false>;
+        
+        // Per-stage settings for Pipeline. capacity bounds the queue the stage
+        // writes to (0 for unbounded), so a slow stage pushes back on the ones
+        // before it instead of letting its input grow without limit.
+        struct StageOptions
+        {
+            size_t threads = 1;
+            size_t batch = 64;
+            std::chrono::microseconds max_latency{1000};
+            size_t capacity = 1024;
+        };
+        
+        // Wait times are summed over the stage's threads. A stage with high
+        // input_wait_ms is starved; high output_wait_ms means it is blocked
+        // on the stage after it.
+        struct StageStats
+        {
+            std::string name;
+            size_t threads = 0;
+            size_t queue_depth = 0;      // items waiting in the stage's input queue
+            size_t queue_capacity = 0;
+            uint64_t items_in = 0;
+            uint64_t items_out = 0;
+            uint64_t batches = 0;
+            double seconds = 0;          // since the stage started, or until it finished
+            double items_per_second = 0;
+            double input_wait_ms = 0;
+            double output_wait_ms = 0;
+        };
+        
+        namespace pipeline
+        {
+            // Stands in for the output of a sink, which has no queue.
+            struct None {};
+            
+            struct Shared
+            {
+                std::atomic<bool> failed{false};
+                std::mutex mutex;
+                std::exception_ptr error;
+                
+                void fail(std::exception_ptr e)
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if (!error) error = std::move(e);
+                    failed.store(true, std::memory_order_relaxed);
+                }
+            };
+            
+            class Stage
+            {
+            public:
+                virtual ~Stage() = default;
+                virtual void join() = 0;
+                virtual StageStats stats() const = 0;
+            };
+            
+            // Each thread pops a batch, runs process(batch, results) and pushes
+            // the results in one push_bulk. A thread that stops early closes the
+            // stage's input so upstream stops too; the last thread out closes the
+            // output so downstream drains and stops.
+            template <typename In, typename Out, typename Process>
+            class Worker : public Stage
+            {
+            private:
+                using Clock = std::chrono::steady_clock;
+                
+                std::string name;
+                StageOptions options;
+                std::shared_ptr<ConcurrentQueue<In>> input;
+                std::shared_ptr<ConcurrentQueue<Out>> output;   // null for a sink
+                std::shared_ptr<Shared> shared;
+                Process process;
+                Clock::time_point started;
+                std::atomic<uint64_t> items_in{0};
+                std::atomic<uint64_t> items_out{0};
+                std::atomic<uint64_t> batches{0};
+                std::atomic<uint64_t> input_wait_ns{0};
+                std::atomic<uint64_t> output_wait_ns{0};
+                std::atomic<int64_t> finished_ns{-1};
+                std::atomic<size_t> running;
+                std::vector<std::thread> threads;
+                
+                static uint64_t since(Clock::time_point start)
+                {
+                    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count());
+                }
+                
+                void run()
+                {
+                    std::vector<In> batch;
+                    std::vector<Out> results;
+                    batch.reserve(options.batch);
+                    while (!shared->failed.load(std::memory_order_relaxed))
+                    {
+                        batch.clear();
+                        Clock::time_point waited = Clock::now();
+                        size_t count = input->pop_bulk(std::back_inserter(batch), options.batch, options.max_latency);
+                        input_wait_ns.fetch_add(since(waited), std::memory_order_relaxed);
+                        if (count == 0) break;
+                        
+                        try
+                        {
+                            process(batch, results);
+                        }
+                        catch (...)
+                        {
+                            shared->fail(std::current_exception());
+                            break;
+                        }
+                        items_in.fetch_add(count, std::memory_order_relaxed);
+                        batches.fetch_add(1, std::memory_order_relaxed);
+                        
+                        if (!output || results.empty()) continue;
+                        waited = Clock::now();
+                        size_t pushed = output->push_bulk(std::make_move_iterator(results.begin()), std::make_move_iterator(results.end()));
+                        output_wait_ns.fetch_add(since(waited), std::memory_order_relaxed);
+                        items_out.fetch_add(pushed, std::memory_order_relaxed);
+                        bool downstream_closed = pushed < results.size();
+                        results.clear();
+                        if (downstream_closed) break;
+                    }
+                    
+                    input->close();
+                    if (running.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                    {
+                        finished_ns.store(static_cast<int64_t>(since(started)), std::memory_order_relaxed);
+                        if (output) output->close();
+                    }
+                }
+                
+            public:
+                Worker(std::string stage_name, const StageOptions& stage_options, std::shared_ptr<ConcurrentQueue<In>> in,
+                       std::shared_ptr<ConcurrentQueue<Out>> out, std::shared_ptr<Shared> state, Process fn)
+                    : name(std::move(stage_name)), options(stage_options), input(std::move(in)), output(std::move(out)),
+                      shared(std::move(state)), process(std::move(fn)), started(Clock::now()), running(options.threads)
+                {
+                    if (options.threads == 0) throw std::invalid_argument("Pipeline stage needs at least one thread");
+                    if (options.batch == 0) throw std::invalid_argument("Pipeline stage batch size must be positive");
+                    threads.reserve(options.threads);
+                    for (size_t i = 0; i < options.threads; ++i) threads.emplace_back([this] { run(); });
+                }
+                
+                ~Worker() override { join(); }
+                
+                void join() override
+                {
+                    for (std::thread& thread : threads)
+                        if (thread.joinable()) thread.join();
+                }
+                
+                StageStats stats() const override
+                {
+                    StageStats result;
+                    result.name = name;
+                    result.threads = options.threads;
+                    result.queue_depth = input->size();
+                    result.queue_capacity = input->capacity();
+                    result.items_in = items_in.load(std::memory_order_relaxed);
+                    result.items_out = items_out.load(std::memory_order_relaxed);
+                    result.batches = batches.load(std::memory_order_relaxed);
+                    int64_t finished = finished_ns.load(std::memory_order_relaxed);
+                    result.seconds = (finished >= 0 ? static_cast<double>(finished) : static_cast<double>(since(started))) / 1e9;
+                    result.items_per_second = result.seconds > 0 ? result.items_in / result.seconds : 0;
+                    result.input_wait_ms = input_wait_ns.load(std::memory_order_relaxed) / 1e6;
+                    result.output_wait_ms = output_wait_ns.load(std::memory_order_relaxed) / 1e6;
+                    return result;
+                }
+            };
+        }
+        
+        // Chain of stages connected by bounded ConcurrentQueues. Every stage
+        // runs on its own threads and drains its input in batches: it waits
+        // for options.batch items, or options.max_latency after the first,
+        // whichever comes first. That costs one lock and one wakeup per batch
+        // rather than per item. Stages start as soon as they are added; the
+        // stage functions are called concurrently from the stage's threads.
+        //
+        //     auto pipeline = concurrency::Pipeline<std::string>()
+        //         .map("parse", [](std::string&& line) { return parse(line); }, {4, 256})
+        //         .batch<void>("store", [](std::vector<Record>& records) { db.insert(records); });
+        //     for (auto& line : lines) pipeline.push(std::move(line));
+        //     pipeline.wait();
+        //
+        // A stage function that throws stops the whole pipeline: push() then
+        // throws, and wait() rethrows the stage's exception. A pipeline that
+        // does not end in a sink must have output() drained, or the last stage
+        // blocks once that queue is full. Destroying a pipeline that has not
+        // been waited on closes both ends and discards what has not been
+        // output yet.
+        template <typename In, typename Out = In>
+        class Pipeline
+        {
+        private:
+            template <typename, typename> friend class Pipeline;
+            
+            using Value = std::conditional_t<std::is_void_v<Out>, pipeline::None, Out>;
+            
+            std::shared_ptr<ConcurrentQueue<In>> input;
+            std::shared_ptr<ConcurrentQueue<Value>> tail;   // null once a sink is added
+            std::shared_ptr<pipeline::Shared> shared;
+            std::vector<std::unique_ptr<pipeline::Stage>> stages;
+            
+            Pipeline(std::shared_ptr<ConcurrentQueue<In>> in, std::shared_ptr<ConcurrentQueue<Value>> last,
+                     std::shared_ptr<pipeline::Shared> state, std::vector<std::unique_ptr<pipeline::Stage>> list)
+                : input(std::move(in)), tail(std::move(last)), shared(std::move(state)), stages(std::move(list)) {}
+            
+            template <typename Next, typename Process>
+            Pipeline<In, Next> attach(std::string name, const StageOptions& options, Process process)
+            {
+                static_assert(!std::is_void_v<Out>, "a sink must be the last stage of a Pipeline");
+                using NextValue = typename Pipeline<In, Next>::Value;
+                std::shared_ptr<ConcurrentQueue<NextValue>> next;
+                if constexpr (!std::is_void_v<Next>) next = std::make_shared<ConcurrentQueue<NextValue>>(options.capacity);
+                stages.push_back(std::make_unique<pipeline::Worker<Out, NextValue, Process>>(
+                    std::move(name), options, std::move(tail), next, shared, std::move(process)));
+                return Pipeline<In, Next>(std::move(input), std::move(next), std::move(shared), std::move(stages));
+            }
+            
+        public:
+            // capacity bounds the pipeline's input queue; 0 is unbounded.
+            explicit Pipeline(size_t capacity = 1024)
+                : input(std::make_shared<ConcurrentQueue<In>>(capacity)), shared(std::make_shared<pipeline::Shared>())
+            {
+                static_assert(std::is_same_v<In, Out>, "a Pipeline starts out with no stages");
+                tail = input;
+            }
+            
+            Pipeline(Pipeline&&) = default;
+            Pipeline& operator=(Pipeline&&) = delete;
+            
+            ~Pipeline()
+            {
+                if (input) input->close();
+                if (tail) tail->close();
+                stages.clear();
+            }
+            
+            // Adds a stage calling fn(item) for every item. A stage whose fn
+            // returns void is a sink and ends the pipeline.
+            template <typename F>
+            auto map(std::string name, F fn, const StageOptions& options = {})
+            {
+                using Next = std::invoke_result_t<F&, Out&&>;
+                using NextValue = typename Pipeline<In, Next>::Value;
+                return attach<Next>(std::move(name), options,
+                    [fn = std::move(fn)](std::vector<Value>& items, std::vector<NextValue>& results) mutable
+                    {
+                        for (Value& item : items)
+                        {
+                            if constexpr (std::is_void_v<Next>) fn(std::move(item));
+                            else results.push_back(fn(std::move(item)));
+                        }
+                    });
+            }
+            
+            // Adds a stage that takes whole batches: fn(items, results) appends
+            // any number of results to results, or, with Next = void,
+            // fn(items) ends the pipeline as a sink.
+            template <typename Next, typename F>
+            Pipeline<In, Next> batch(std::string name, F fn, const StageOptions& options = {})
+            {
+                using NextValue = typename Pipeline<In, Next>::Value;
+                return attach<Next>(std::move(name), options,
+                    [fn = std::move(fn)](std::vector<Value>& items, std::vector<NextValue>& results) mutable
+                    {
+                        if constexpr (std::is_void_v<Next>) fn(items);
+                        else fn(items, results);
+                    });
+            }
+            
+            // Blocks while the input queue is full.
+            void push(In value)
+            {
+                if (shared->failed.load(std::memory_order_relaxed)) throw std::runtime_error("push to a failed Pipeline");
+                input->push(std::move(value));
+            }
+            
+            template <typename InputIt>
+            size_t push_bulk(InputIt first, InputIt last)
+            {
+                if (shared->failed.load(std::memory_order_relaxed)) throw std::runtime_error("push to a failed Pipeline");
+                return input->push_bulk(first, last);
+            }
+            
+            // Ends the input; the stages finish what is queued and stop.
+            void close() { input->close(); }
+            
+            // Results of the last stage. Closed once every stage has finished.
+            ConcurrentQueue<Out>& output()
+            {
+                static_assert(!std::is_void_v<Out>, "a Pipeline ending in a sink has no output");
+                return *tail;
+            }
+            
+            // Closes the input, waits for every stage to finish and rethrows
+            // the first exception a stage function threw.
+            void wait()
+            {
+                close();
+                for (auto& stage : stages) stage->join();
+                std::lock_guard<std::mutex> lock(shared->mutex);
+                if (shared->error) std::rethrow_exception(shared->error);
+            }
+            
+            std::vector<StageStats> stats() const
+            {
+                std::vector<StageStats> result;
+                result.reserve(stages.size());
+                for (const auto& stage : stages) result.push_back(stage->stats());
+                return result;
+            }
+        };
+        
+        // Lock-free token bucket using the generic cell rate algorithm: a single
+        // atomic holds the theoretical arrival time (steady_clock nanoseconds)
+        // of the next permit. Up to `burst` permits may be taken back to back;
+        // blocking callers sleep without holding any lock.
+        class RateLimiter
+        {
+        private:
+            friend class ShardedRateLimiter;
+            
+            // Null until attach_metrics().
+            struct Instruments
+            {
+                std::atomic<metrics::Counter*> acquired{nullptr};
+                std::atomic<metrics::Counter*> throttled{nullptr};
+                std::atomic<metrics::Histogram*> wait_ns{nullptr};
+                
+                void attach(metrics::Registry& registry, const std::string& prefix)
+                {
+                    acquired.store(&registry.counter(prefix + ".acquired", "Permits handed out"), std::memory_order_release);
+                    throttled.store(&registry.counter(prefix + ".throttled", "Requests refused for lack of permits"),
+                                    std::memory_order_release);
+                    wait_ns.store(&registry.histogram(prefix + ".wait_ns", "Time blocked waiting for permits in nanoseconds"),
+                                  std::memory_order_release);
+                }
+                
+                void granted(size_t permits, std::int64_t wait)
+                {
+                    if (metrics::Counter* counter = acquired.load(std::memory_order_acquire)) counter->add(permits);
+                    if (metrics::Histogram* histogram = wait_ns.load(std::memory_order_acquire))
+                        histogram->record(static_cast<uint64_t>(wait));
+                }
+                
+                void refused()
+                {
+                    if (metrics::Counter* counter = throttled.load(std::memory_order_acquire)) counter->add();
+                }
+            };
+            
+            std::int64_t interval_ns;
+            std::int64_t burst_ns;
+            std::atomic<std::int64_t> next_free;
+            Instruments instruments;
+            
+            static std::int64_t now_ns()
+            {
+                return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now().time_since_epoch()).count();
+            }
+            
+            // Reserves n permits if that needs a wait of at most max_wait_ns.
+            // Returns the wait in nanoseconds, or -1 if nothing was reserved.
+            std::int64_t reserve(size_t n, std::int64_t max_wait_ns)
+            {
+                const std::int64_t now = now_ns();
+                const std::int64_t cost = interval_ns * static_cast<std::int64_t>(n);
+                std::int64_t tat = next_free.load(std::memory_order_relaxed);
+                while (true)
+                {
+                    std::int64_t next = std::max(tat, now) + cost;
+                    std::int64_t wait = std::max<std::int64_t>(0, next - now - burst_ns);
+                    if (wait > max_wait_ns) return -1;
+                    if (next_free.compare_exchange_weak(tat, next, std::memory_order_relaxed)) return wait;
+                }
+            }
+            
+        public:
+            RateLimiter(double calls_per_second, size_t burst = 1)
+            {
+                if (!(calls_per_second > 0)) throw std::invalid_argument("RateLimiter rate must be positive");
+                interval_ns = std::max<std::int64_t>(1, std::llround(1e9 / calls_per_second));
+                burst_ns = interval_ns * static_cast<std::int64_t>(std::max<size_t>(burst, 1));
+                next_free.store(now_ns(), std::memory_order_relaxed);
+            }
+            
+            RateLimiter(const RateLimiter&) = delete;
+            RateLimiter& operator=(const RateLimiter&) = delete;
+            
+            void acquire(size_t permits = 1)
+            {
+                std::int64_t wait = reserve(permits, std::numeric_limits<std::int64_t>::max());
+                instruments.granted(permits, wait);
+                if (wait > 0) std::this_thread::sleep_for(std::chrono::nanoseconds(wait));
+            }
+            
+            // Takes permits only if they are available right now.
+            bool try_acquire(size_t permits = 1)
+            {
+                if (reserve(permits, 0) < 0)
+                {
+                    instruments.refused();
+                    return false;
+                }
+                instruments.granted(permits, 0);
+                return true;
+            }
+            
+            // Waits for permits unless that would run past the deadline, in which
+            // case it returns false immediately and takes nothing.
+            template <typename Clock, typename Duration>
+            bool acquire_until(const std::chrono::time_point<Clock, Duration>& deadline, size_t permits = 1)
+            {
+                auto budget = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline - Clock::now()).count();
+                std::int64_t wait = reserve(permits, std::max<std::int64_t>(0, budget));
+                if (wait < 0)
+                {
+                    instruments.refused();
+                    return false;
+                }
+                instruments.granted(permits, wait);
+                if (wait > 0) std::this_thread::sleep_for(std::chrono::nanoseconds(wait));
+                return true;
+            }
+            
+            // Registers <prefix>.acquired, <prefix>.throttled and
+            // <prefix>.wait_ns (how long granted callers had to sleep).
+            void attach_metrics(metrics::Registry& registry = metrics::Registry::instance(), const std::string& prefix = "ratelimiter")
+            {
+                instruments.attach(registry, prefix);
+            }
+        };
+        
+        // Splits the rate across per-core shards so threads do not contend on a
+        // single atomic. Threads take permits from their home shard first and
+        // borrow from a few others before blocking on the home shard. The
+        // burst is divided exactly, and every shard needs a burst of at least
+        // one, so an explicit burst below the shard count means fewer shards;
+        // the default burst of 0 gives each shard one permit. The rate follows
+        // each shard's share of the burst.
+        class ShardedRateLimiter
+        {
+        private:
+            struct alignas(threading::cache_line_size) Shard
+            {
+                RateLimiter limiter;
+                Shard(double rate, size_t burst) : limiter(rate, burst) {}
+            };
+            
+            std::vector<std::unique_ptr<Shard>> shards;
+            RateLimiter::Instruments instruments;   // counted here, not per shard
+            
+            // Shards tried per request, home included, so an exhausted limiter
+            // costs the same few probes however many shards it has.
+            static constexpr size_t max_probes = 4;
+            
+            size_t home() const
+            {
+                static std::atomic<size_t> next_thread{0};
+                static thread_local size_t thread_slot = next_thread.fetch_add(1, std::memory_order_relaxed);
+                return thread_slot % shards.size();
+            }
+            
+            // Borrowing starts at a rotating offset so that, over many calls,
+            // every other shard's spare permits are reachable.
+            bool take_any(size_t permits)
+            {
+                const size_t count = shards.size();
+                const size_t start = home();
+                if (shards[start]->limiter.reserve(permits, 0) >= 0) return true;
+                if (count == 1) return false;
+                
+                static thread_local size_t rotation = 0;
+                const size_t first = rotation++;
+                for (size_t i = 0; i < std::min(count - 1, max_probes - 1); ++i)
+                {
+                    size_t offset = 1 + (first + i) % (count - 1);
+                    if (shards[(start + offset) % count]->limiter.reserve(permits, 0) >= 0) return true;
+                }
+                return false;
+            }
+            
+        public:
+            ShardedRateLimiter(double calls_per_second, size_t burst = 0,
+                               size_t shard_count = std::thread::hardware_concurrency())
+            {
+                shard_count = std::max<size_t>(shard_count, 1);
+                if (burst == 0) burst = shard_count;
+                shard_count = std::min(shard_count, burst);
+                for (size_t i = 0; i < shard_count; ++i)
+                {
+                    size_t shard_burst = burst / shard_count + (i < burst % shard_count ? 1 : 0);
+                    shards.emplace_back(std::make_unique<Shard>(calls_per_second * static_cast<double>(shard_burst) / static_cast<double>(burst),
+                                                                shard_burst));
+                }
+            }
+            
+            bool try_acquire(size_t permits = 1)
+            {
+                if (!take_any(permits))
+                {
+                    instruments.refused();
+                    return false;
+                }
+                instruments.granted(permits, 0);
+                return true;
+            }
+            
+            void acquire(size_t permits = 1)
+            {
+                if (take_any(permits))
+                {
+                    instruments.granted(permits, 0);
+                    return;
+                }
+                std::int64_t wait = shards[home()]->limiter.reserve(permits, std::numeric_limits<std::int64_t>::max());
+                instruments.granted(permits, wait);
+                if (wait > 0) std::this_thread::sleep_for(std::chrono::nanoseconds(wait));
+            }
+            
+            template <typename Clock, typename Duration>
+            bool acquire_until(const std::chrono::time_point<Clock, Duration>& deadline, size_t permits = 1)
+            {
+                if (take_any(permits))
+                {
+                    instruments.granted(permits, 0);
+                    return true;
+                }
+                auto budget = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline - Clock::now()).count();
+                std::int64_t wait = shards[home()]->limiter.reserve(permits, std::max<std::int64_t>(0, budget));
+                if (wait < 0)
+                {
+                    instruments.refused();
+                    return false;
+                }
+                instruments.granted(permits, wait);
+                if (wait > 0) std::this_thread::sleep_for(std::chrono::nanoseconds(wait));
+                return true;
+            }
+            
+            // Same metrics as RateLimiter::attach_metrics, for the limiter as a whole.
+            void attach_metrics(metrics::Registry& registry = metrics::Registry::instance(), const std::string& prefix = "ratelimiter")
+            {
+                instruments.attach(registry, prefix);
+            }
+            
+            size_t shard_count() const { return shards.size(); }
+        };
+        
+        // Epoch-based memory reclamation. Readers pin the current epoch for the
+        // duration of a lock-free traversal; writers retire unlinked objects
+        // instead of deleting them, and an object is freed once the global
+        // epoch has advanced twice past its retirement, at which point no
+        // pinned reader can still hold it. There is one process-wide domain;
+        // a Guard must be released on the thread that created it.
+        class EpochDomain
+        {
+        private:
+            struct Retired
+            {
+                void* object;
+                void (*deleter)(void*);
+                uint64_t epoch;
+            };
+            
+            struct alignas(threading::cache_line_size) Record
+            {
+                std::atomic<uint64_t> epoch{0};   // 0 while the thread is not pinned
+                std::atomic<bool> in_use{false};
+                Record* next = nullptr;
+                unsigned nesting = 0;
+                std::vector<Retired> retired;
+            };
+            
+            static constexpr size_t collect_threshold = 64;
+            
+            std::atomic<uint64_t> global{1};
+            std::atomic<Record*> records{nullptr};
+            std::mutex orphan_mutex;
+            std::vector<Retired> orphans;   // left behind by exited threads
+            
+            EpochDomain() = default;
+            
+            Record* acquire_record()
+            {
+                for (Record* r = records.load(std::memory_order_acquire); r; r = r->next)
+                {
+                    bool expected = false;
+                    if (!r->in_use.load(std::memory_order_relaxed) &&
+                        r->in_use.compare_exchange_strong(expected, true, std::memory_order_acquire)) return r;
+                }
+                Record* r = new Record();
+                r->in_use.store(true, std::memory_order_relaxed);
+                Record* head = records.load(std::memory_order_relaxed);
+                do { r->next = head; } while (!records.compare_exchange_weak(head, r, std::memory_order_release, std::memory_order_relaxed));
+                return r;
+            }
+            
+            void release_record(Record* r)
+            {
+                collect_record(r);
+                if (!r->retired.empty())
+                {
+                    std::lock_guard<std::mutex> lock(orphan_mutex);
+                    orphans.insert(orphans.end(), r->retired.begin(), r->retired.end());
+                    r->retired.clear();
+                }
+                r->in_use.store(false, std::memory_order_release);
+            }
+            
+            Record* local()
+            {
+                struct Handle
+                {
+                    EpochDomain* domain;
+                    Record* record = nullptr;
+                    ~Handle() { if (record) domain->release_record(record); }
+                };
+                thread_local Handle handle{this};
+                if (!handle.record) handle.record = acquire_record();
+                return handle.record;
+            }
+            
+            // Moves the epoch on if every pinned thread has seen the current one.
+            bool try_advance()
+            {
+                uint64_t current = global.load(std::memory_order_seq_cst);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                for (Record* r = records.load(std::memory_order_acquire); r; r = r->next)
+                {
+                    uint64_t pinned = r->epoch.load(std::memory_order_acquire);
+                    if (pinned != 0 && pinned != current) return false;
+                }
+                return global.compare_exchange_strong(current, current + 1, std::memory_order_acq_rel);
+            }
+            
+            static size_t free_ready(std::vector<Retired>& list, uint64_t safe_epoch)
+            {
+                auto ready = std::partition(list.begin(), list.end(), [&](const Retired& item) { return item.epoch + 2 > safe_epoch; });
+                std::vector<Retired> freed(ready, list.end());
+                list.erase(ready, list.end());
+                for (const Retired& item : freed) item.deleter(item.object);
+                return freed.size();
+            }
+            
+            size_t collect_record(Record* r)
+            {
+                try_advance();
+                uint64_t now = global.load(std::memory_order_acquire);
+                size_t freed = free_ready(r->retired, now);
+                
+                std::unique_lock<std::mutex> lock(orphan_mutex, std::try_to_lock);
+                if (lock.owns_lock() && !orphans.empty())
+                {
+                    std::vector<Retired> mine;
+                    mine.swap(orphans);
+                    lock.unlock();
+                    freed += free_ready(mine, now);
+                    lock.lock();
+                    orphans.insert(orphans.end(), mine.begin(), mine.end());
+                }
+                return freed;
+            }
+            
+            void unpin(Record* r)
+            {
+                if (--r->nesting == 0) r->epoch.store(0, std::memory_order_release);
+            }
+            
+        public:
+            // Never destroyed, so threads exiting during static destruction can
+            // still hand their records back.
+            static EpochDomain& instance()
+            {
+                static EpochDomain* domain = new EpochDomain();
+                return *domain;
+            }
+            
+            class Guard
+            {
+            private:
+                friend class EpochDomain;
+                EpochDomain* domain = nullptr;
+                Record* record = nullptr;
+                
+                Guard(EpochDomain* d, Record* r) : domain(d), record(r) {}
+                
+            public:
+                Guard() = default;
+                Guard(Guard&& other) noexcept
+                    : domain(std::exchange(other.domain, nullptr)), record(std::exchange(other.record, nullptr)) {}
+                
+                Guard& operator=(Guard&& other) noexcept
+                {
+                    if (this != &other)
+                    {
+                        reset();
+                        domain = std::exchange(other.domain, nullptr);
+                        record = std::exchange(other.record, nullptr);
+                    }
+                    return *this;
+                }
+                
+                Guard(const Guard&) = delete;
+                Guard& operator=(const Guard&) = delete;
+                
+                ~Guard() { reset(); }
+                
+                void reset()
+                {
+                    if (domain) domain->unpin(record);
+                    domain = nullptr;
+                    record = nullptr;
+                }
+            };
+            
+            // Pins the current epoch; guards nest.
+            Guard pin()
+            {
+                Record* r = local();
+                if (r->nesting++ == 0)
+                {
+                    r->epoch.store(global.load(std::memory_order_relaxed), std::memory_order_relaxed);
+                    std::atomic_thread_fence(std::memory_order_seq_cst);
+                }
+                return Guard(this, r);
+            }
+            
+            // Defers deleter(object) until no reader can still see object. Call
+            // only after object has been unlinked from every shared structure.
+            void retire(void* object, void (*deleter)(void*))
+            {
+                Record* r = local();
+                r->retired.push_back({object, deleter, global.load(std::memory_order_seq_cst)});
+                if (r->retired.size() >= collect_threshold) collect_record(r);
+            }
+            
+            template <typename T>
+            void retire(T* object)
+            {
+                retire(object, [](void* p) { delete static_cast<T*>(p); });
+            }
+            
+            // Frees what the calling thread has retired and is now safe, and
+            // returns how many objects were freed.
+            size_t collect() { return collect_record(local()); }
+            
+            uint64_t epoch() const { return global.load(std::memory_order_relaxed); }
+        };
+        
+        // Hash map for read-mostly shared state. Readers never lock: they walk
+        // bucket chains under an EpochDomain guard, and find() hands out a
+        // ReadHandle that references the stored value in place. Writers lock
+        // one of 64 stripes picked by hash, and replace nodes (copy-on-write)
+        // instead of mutating them, so a value seen by a reader never changes
+        // under it. Growing copies every entry into a table twice the size
+        // with all stripes held, so K and V must be copy-constructible; size
+        // the map up front when that matters.
+        template <typename K, typename V, typename Hash = hash::Hash<K>, typename KeyEqual = std::equal_to<>>
+        class ConcurrentHashMap
+        {
+        private:
+            static constexpr bool transparent = hash::swiss::is_transparent<Hash>::value && hash::swiss::is_transparent<KeyEqual>::value;
+            
+            template <typename Q>
+            using key_arg = typename hash::swiss::KeyArg<transparent>::template type<Q, K>;
+            
+            struct Node
+            {
+                const size_t hash;
+                const K key;
+                const V value;
+                std::atomic<Node*> next;
+                
+                template <typename KK, typename VV>
+                Node(size_t h, KK&& k, VV&& v, Node* n) : hash(h), key(std::forward<KK>(k)), value(std::forward<VV>(v)), next(n) {}
+            };
+            
+            struct Table
+            {
+                size_t mask;
+                std::unique_ptr<std::atomic<Node*>[]> buckets;
+                
+                explicit Table(size_t size) : mask(size - 1), buckets(new std::atomic<Node*>[size])
+                {
+                    for (size_t i = 0; i < size; ++i) buckets[i].store(nullptr, std::memory_order_relaxed);
+                }
+                
+                ~Table()
+                {
+                    for (size_t i = 0; i <= mask; ++i)
+                    {
+                        Node* n = buckets[i].load(std::memory_order_relaxed);
+                        while (n)
+                        {
+                            Node* next = n->next.load(std::memory_order_relaxed);
+                            delete n;
+                            n = next;
+                        }
+                    }
+                }
+            };
+            
+            static constexpr size_t stripe_count = 64;
+            
+            struct alignas(threading::cache_line_size) Stripe
+            {
+                std::mutex mutex;
+            };
+            
+            std::unique_ptr<Stripe[]> stripes;
+            std::atomic<Table*> table;
+            // Mirrors table->mask + 1 so writers can test for growth without
+            // touching a table another thread may be retiring.
+            std::atomic<size_t> bucket_count;
+            alignas(threading::cache_line_size) std::atomic<size_t> count{0};
+            Hash hasher;
+            KeyEqual equal;
+            
+            static EpochDomain& domain() { return EpochDomain::instance(); }
+            
+            // Stripe choice depends only on the low hash bits, and every table
+            // has at least stripe_count buckets, so a bucket never changes
+            // stripe when the table grows.
+            std::mutex& stripe_for(size_t hash) const { return stripes[hash & (stripe_count - 1)].mutex; }
+            
+            template <typename Q>
+            const Node* find_node(const Q& key, size_t hash) const
+            {
+                const Table* t = table.load(std::memory_order_acquire);
+                for (const Node* n = t->buckets[hash & t->mask].load(std::memory_order_acquire); n;
+                     n = n->next.load(std::memory_order_acquire))
+                {
+                    if (n->hash == hash && equal(n->key, key)) return n;
+                }
+                return nullptr;
+            }
+            
+            // Link pointing at key's node (or the chain's terminating null);
+            // stripe must be held.
+            template <typename Q>
+            std::atomic<Node*>* find_link(Table* t, const Q& key, size_t hash)
+            {
+                std::atomic<Node*>* link = &t->buckets[hash & t->mask];
+                for (Node* n = link->load(std::memory_order_relaxed); n; n = link->load(std::memory_order_relaxed))
+                {
+                    if (n->hash == hash && equal(n->key, key)) return link;
+                    link = &n->next;
+                }
+                return link;
+            }
+            
+            static size_t table_size_for(size_t capacity)
+            {
+                size_t size = stripe_count;
+                while (size < capacity) size <<= 1;
+                return size;
+            }
+            
+            std::vector<std::unique_lock<std::mutex>> lock_all()
+            {
+                std::vector<std::unique_lock<std::mutex>> locks;
+                locks.reserve(stripe_count);
+                for (size_t i = 0; i < stripe_count; ++i) locks.emplace_back(stripes[i].mutex);
+                return locks;
+            }
+            
+            // Keeps chains at about one node per bucket.
+            void maybe_grow()
+            {
+                if (count.load(std::memory_order_relaxed) <= bucket_count.load(std::memory_order_acquire)) return;
+                auto locks = lock_all();
+                Table* old_table = table.load(std::memory_order_relaxed);
+                if (count.load(std::memory_order_relaxed) <= old_table->mask + 1) return;
+                
+                auto grown = std::make_unique<Table>((old_table->mask + 1) * 2);
+                for (size_t i = 0; i <= old_table->mask; ++i)
+                {
+                    for (Node* n = old_table->buckets[i].load(std::memory_order_relaxed); n; n = n->next.load(std::memory_order_relaxed))
+                    {
+                        std::atomic<Node*>& bucket = grown->buckets[n->hash & grown->mask];
+                        bucket.store(new Node(n->hash, n->key, n->value, bucket.load(std::memory_order_relaxed)), std::memory_order_relaxed);
+                    }
+                }
+                bucket_count.store(grown->mask + 1, std::memory_order_release);
+                table.store(grown.release(), std::memory_order_release);
+                locks.clear();
+                domain().retire(old_table);
+            }
+            
+            // Retiring happens after the stripe is released, since it may run
+            // deleters of other retired objects.
+            template <typename KK, typename VV>
+            bool put(KK&& key, VV&& value, bool assign)
+            {
+                const size_t hash = hasher(key);
+                Node* existing;
+                {
+                    std::lock_guard<std::mutex> lock(stripe_for(hash));
+                    Table* t = table.load(std::memory_order_relaxed);
+                    std::atomic<Node*>* link = find_link(t, key, hash);
+                    existing = link->load(std::memory_order_relaxed);
+                    if (existing)
+                    {
+                        if (!assign) return false;
+                        Node* replacement = new Node(hash, std::forward<KK>(key), std::forward<VV>(value),
+                                                     existing->next.load(std::memory_order_relaxed));
+                        link->store(replacement, std::memory_order_release);
+                    }
+                    else
+                    {
+                        std::atomic<Node*>& bucket = t->buckets[hash & t->mask];
+                        bucket.store(new Node(hash, std::forward<KK>(key), std::forward<VV>(value), bucket.load(std::memory_order_relaxed)),
+                                     std::memory_order_release);
+                        count.fetch_add(1, std::memory_order_relaxed);
+                    }
+                }
+                if (existing)
+                {
+                    domain().retire(existing);
+                    return false;
+                }
+                maybe_grow();
+                return true;
+            }
+            
+        public:
+            // Reference to a stored value that stays valid while the handle
+            // lives, even if the entry is replaced or erased meanwhile. Keep it
+            // short-lived and on one thread: it pins the epoch, which holds
+            // back reclamation for the whole process.
+            class ReadHandle
+            {
+            private:
+                friend class ConcurrentHashMap;
+                EpochDomain::Guard guard;
+                const Node* node = nullptr;
+                
+                ReadHandle(EpochDomain::Guard&& g, const Node* n) : guard(std::move(g)), node(n) {}
+                
+            public:
+                ReadHandle() = default;
+                
+                explicit operator bool() const { return node != nullptr; }
+                const K& key() const { return node->key; }
+                const V& value() const { return node->value; }
+                const V& operator*() const { return node->value; }
+                const V* operator->() const { return &node->value; }
+            };
+            
+            explicit ConcurrentHashMap(size_t capacity = 0, const Hash& hash = Hash(), const KeyEqual& key_equal = KeyEqual())
+                : stripes(new Stripe[stripe_count]), table(new Table(table_size_for(capacity))),
+                  bucket_count(table_size_for(capacity)), hasher(hash), equal(key_equal) {}
+            
+            // Callers must ensure no other thread still uses the map.
+            ~ConcurrentHashMap() { delete table.load(std::memory_order_relaxed); }
+            
+            ConcurrentHashMap(const ConcurrentHashMap&) = delete;
+            ConcurrentHashMap& operator=(const ConcurrentHashMap&) = delete;
+            
+            template <typename Q = K>
+            ReadHandle find(const key_arg<Q>& key) const
+            {
+                EpochDomain::Guard guard = domain().pin();
+                const Node* n = find_node(key, hasher(key));
+                return n ? ReadHandle(std::move(guard), n) : ReadHandle();
+            }
+            
+            template <typename Q = K>
+            bool contains(const key_arg<Q>& key) const
+            {
+                EpochDomain::Guard guard = domain().pin();
+                return find_node(key, hasher(key)) != nullptr;
+            }
+            
+            // Calls fn(value) under the epoch guard if key is present.
+            template <typename Fn, typename Q = K>
+            bool visit(const key_arg<Q>& key, Fn&& fn) const
+            {
+                EpochDomain::Guard guard = domain().pin();
+                const Node* n = find_node(key, hasher(key));
+                if (!n) return false;
+                fn(n->value);
+                return true;
+            }
+            
+            template <typename Q = K>
+            std::optional<V> get(const key_arg<Q>& key) const
+            {
+                EpochDomain::Guard guard = domain().pin();
+                const Node* n = find_node(key, hasher(key));
+                if (!n) return std::nullopt;
+                return n->value;
+            }
+            
+            // Weakly consistent walk: sees every entry present for the whole
+            // call, and may or may not see concurrent changes.
+            template <typename Fn>
+            void for_each(Fn&& fn) const
+            {
+                EpochDomain::Guard guard = domain().pin();
+                const Table* t = table.load(std::memory_order_acquire);
+                for (size_t i = 0; i <= t->mask; ++i)
+                {
+                    for (const Node* n = t->buckets[i].load(std::memory_order_acquire); n; n = n->next.load(std::memory_order_acquire))
+                        fn(n->key, n->value);
+                }
+            }
+            
+            // Adds key if absent; returns false (and leaves the map alone) otherwise.
+            template <typename KK, typename VV>
+            bool insert(KK&& key, VV&& value)
+            {
+                return put(std::forward<KK>(key), std::forward<VV>(value), false);
+            }
+            
+            // Returns true if key was inserted, false if its value was replaced.
+            template <typename KK, typename VV>
+            bool insert_or_assign(KK&& key, VV&& value)
+            {
+                return put(std::forward<KK>(key), std::forward<VV>(value), true);
+            }
+            
+            // Replaces key's value with fn(old value) atomically with respect
+            // to other writers. Returns false if key is absent.
+            template <typename Fn, typename Q = K>
+            bool update(const key_arg<Q>& key, Fn&& fn)
+            {
+                const size_t hash = hasher(key);
+                Node* existing;
+                {
+                    std::lock_guard<std::mutex> lock(stripe_for(hash));
+                    std::atomic<Node*>* link = find_link(table.load(std::memory_order_relaxed), key, hash);
+                    existing = link->load(std::memory_order_relaxed);
+                    if (!existing) return false;
+                    Node* replacement = new Node(hash, existing->key, fn(existing->value), existing->next.load(std::memory_order_relaxed));
+                    link->store(replacement, std::memory_order_release);
+                }
+                domain().retire(existing);
+                return true;
+            }
+            
+            template <typename Q = K>
+            bool erase(const key_arg<Q>& key)
+            {
+                const size_t hash = hasher(key);
+                Node* existing;
+                {
+                    std::lock_guard<std::mutex> lock(stripe_for(hash));
+                    std::atomic<Node*>* link = find_link(table.load(std::memory_order_relaxed), key, hash);
+                    existing = link->load(std::memory_order_relaxed);
+                    if (!existing) return false;
+                    link->store(existing->next.load(std::memory_order_relaxed), std::memory_order_release);
+                    count.fetch_sub(1, std::memory_order_relaxed);
+                }
+                domain().retire(existing);
+                return true;
+            }
+            
+            void clear()
+            {
+                auto locks = lock_all();
+                Table* old_table = table.load(std::memory_order_relaxed);
+                table.store(new Table(old_table->mask + 1), std::memory_order_release);
+                count.store(0, std::memory_order_relaxed);
+                locks.clear();
+                domain().retire(old_table);
+            }
+            
+            size_t size() const { return count.load(std::memory_order_relaxed); }
+            bool empty() const { return size() == 0; }
+        };
+    }
+
+#if defined(SPUTIL_HAS_COROUTINES)
+    // ===== ASYNC UTILITIES (C++20 coroutines) =====
+    namespace async
+    {
+        template <typename T = void>
+        class Task;
+        
+        struct TaskPromiseBase
+        {
+            std::coroutine_handle<> continuation = std::noop_coroutine();
+            std::exception_ptr error;
+            
+            // Hands control straight to whoever awaited the task (symmetric
+            // transfer), so long await chains do not grow the stack.
+            struct FinalAwaiter
+            {
+                bool await_ready() noexcept { return false; }
+                
+                template <typename Promise>
+                std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept
+                {
+                    return handle.promise().continuation;
+                }
+                
+                void await_resume() noexcept {}
+            };
+            
+            std::suspend_always initial_suspend() noexcept { return {}; }
+            FinalAwaiter final_suspend() noexcept { return {}; }
+            void unhandled_exception() { error = std::current_exception(); }
+        };
+        
+        template <typename T>
+        struct TaskPromise : TaskPromiseBase
+        {
+            std::optional<T> value;
+            
+            Task<T> get_return_object();
+            
+            template <typename U>
+            void return_value(U&& result) { value.emplace(std::forward<U>(result)); }
+            
+            T take()
+            {
+                if (error) std::rethrow_exception(error);
+                return std::move(*value);
+            }
+        };
+        
+        template <>
+        struct TaskPromise<void> : TaskPromiseBase
+        {
+            Task<void> get_return_object();
+            
+            void return_void() {}
+            
+            void take()
+            {
+                if (error) std::rethrow_exception(error);
+            }
+        };
+        
+        // Lazy coroutine task: the body starts when the task is awaited and the
+        // awaiting coroutine resumes on whichever thread finishes it, so no
+        // thread ever blocks on a result. Exceptions propagate through
+        // co_await. Move-only; awaiting a task more than once is not allowed.
+        template <typename T>
+        class [[nodiscard]] Task
+        {
+        public:
+            using promise_type = TaskPromise<T>;
+            using value_type = T;
+            
+        private:
+            std::coroutine_handle<promise_type> handle;
+            
+        public:
+            Task() = default;
+            explicit Task(std::coroutine_handle<promise_type> h) : handle(h) {}
+            
+            Task(Task&& other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+            
+            Task& operator=(Task&& other) noexcept
+            {
+                if (this != &other)
+                {
+                    if (handle) handle.destroy();
+                    handle = std::exchange(other.handle, nullptr);
+                }
+                return *this;
+            }
+            
+            Task(const Task&) = delete;
+            Task& operator=(const Task&) = delete;
+            
+            ~Task()
+            {
+                if (handle) handle.destroy();
+            }
+            
+            bool valid() const { return static_cast<bool>(handle); }
+            bool done() const { return handle && handle.done(); }
+            
+            bool await_ready() const noexcept { return !handle || handle.done(); }
+            
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+            {
+                handle.promise().continuation = awaiting;
+                return handle;
+            }
+            
+            T await_resume() { return handle.promise().take(); }
+        };
+        
+        template <typename T>
+        Task<T> TaskPromise<T>::get_return_object()
+        {
+            return Task<T>(std::coroutine_handle<TaskPromise<T>>::from_promise(*this));
+        }
+        
+        Task<void> TaskPromise<void>::get_return_object()
+        {
+            return Task<void>(std::coroutine_handle<TaskPromise<void>>::from_promise(*this));
+        }
+        
+        // co_await schedule(pool) (or just co_await pool) continues the
+        // coroutine on one of the pool's workers.
+        struct ScheduleAwaiter
+        {
+            threading::ThreadPool& pool;
+            
+            bool await_ready() noexcept { return false; }
+            void await_suspend(std::coroutine_handle<> handle) { pool.post([handle] { handle.resume(); }); }
+            void await_resume() noexcept {}
+        };
+        
+        ScheduleAwaiter schedule(threading::ThreadPool& pool)
+        {
+            return ScheduleAwaiter{pool};
+        }
+        
+        // Resumes on a pool worker once delay has passed, without holding a
+        // thread meanwhile.
+        template <typename Rep, typename Period>
+        struct SleepAwaiter
+        {
+            threading::TimerWheel& wheel;
+            std::chrono::duration<Rep, Period> delay;
+            
+            bool await_ready() noexcept { return delay <= delay.zero(); }
+            void await_suspend(std::coroutine_handle<> handle) { wheel.schedule_after(delay, [handle] { handle.resume(); }); }
+            void await_resume() noexcept {}
+        };
+        
+        template <typename Rep, typename Period>
+        SleepAwaiter<Rep, Period> sleep_for(threading::TimerWheel& wheel, std::chrono::duration<Rep, Period> delay)
+        {
+            return SleepAwaiter<Rep, Period>{wheel, delay};
+        }
+        
+        // Eagerly started, self-destroying coroutine used to drive tasks from
+        // non-coroutine code. An escaping exception terminates, like a
+        // throwing ThreadPool::post job.
+        struct Detached
+        {
+            struct promise_type
+            {
+                Detached get_return_object() { return {}; }
+                std::suspend_never initial_suspend() noexcept { return {}; }
+                std::suspend_never final_suspend() noexcept { return {}; }
+                void return_void() {}
+                void unhandled_exception() { std::terminate(); }
+            };
+        };
+        
+        Detached spawn_detached(threading::ThreadPool& pool, Task<void> task)
+        {
+            co_await schedule(pool);
+            co_await task;
+        }
+        
+        // Runs task on pool without waiting for it.
+        void spawn(threading::ThreadPool& pool, Task<void> task)
+        {
+            spawn_detached(pool, std::move(task));
+        }
+        
+        template <typename T>
+        using ResultOf = std::conditional_t<std::is_void_v<T>, std::monostate, T>;
+        
+        template <typename T>
+        struct SyncWaitState
+        {
+            std::mutex mutex;
+            std::condition_variable condition;
+            bool finished = false;
+            std::optional<ResultOf<T>> value;
+            std::exception_ptr error;
+        };
+        
+        template <typename T>
+        Detached sync_wait_driver(Task<T> task, SyncWaitState<T>* state)
+        {
+            try
+            {
+                if constexpr (std::is_void_v<T>)
+                {
+                    co_await task;
+                    state->value.emplace();
+                }
+                else
+                {
+                    state->value.emplace(co_await task);
+                }
+            }
+            catch (...)
+            {
+                state->error = std::current_exception();
+            }
+            // Notify under the lock: the waiter owns state and may return as
+            // soon as it sees finished.
+            std::lock_guard<std::mutex> lock(state->mutex);
+            state->finished = true;
+            state->condition.notify_all();
+        }
+        
+        // Blocks the calling thread until task completes and returns its
+        // result. For the edge of async code (main, tests); calling it from a
+        // pool worker whose pool runs the task can deadlock.
+        template <typename T>
+        T sync_wait(Task<T> task)
+        {
+            SyncWaitState<T> state;
+            sync_wait_driver(std::move(task), &state);
+            std::unique_lock<std::mutex> lock(state.mutex);
+            state.condition.wait(lock, [&] { return state.finished; });
+            if (state.error) std::rethrow_exception(state.error);
+            if constexpr (!std::is_void_v<T>) return std::move(*state.value);
+        }
+        
+        // Count-down latch for when_all: the last child to finish (or the
+        // parent, if every child finished while being started) resumes the
+        // awaiting coroutine.
+        struct WhenAllLatch
+        {
+            std::atomic<size_t> count;
+            std::coroutine_handle<> waiter;
+            
+            explicit WhenAllLatch(size_t children) : count(children + 1) {}
+            
+            bool arrive() { return count.fetch_sub(1, std::memory_order_acq_rel) == 1; }
+        };
+        
+        class WhenAllChild
+        {
+        public:
+            struct promise_type
+            {
+                WhenAllLatch* latch = nullptr;
+                
+                struct FinalAwaiter
+                {
+                    bool await_ready() noexcept { return false; }
+                    
+                    std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> handle) noexcept
+                    {
+                        WhenAllLatch* latch = handle.promise().latch;
+                        return latch->arrive() ? latch->waiter : std::noop_coroutine();
+                    }
+                    
+                    void await_resume() noexcept {}
+                };
+                
+                WhenAllChild get_return_object() { return WhenAllChild(std::coroutine_handle<promise_type>::from_promise(*this)); }
+                std::suspend_always initial_suspend() noexcept { return {}; }
+                FinalAwaiter final_suspend() noexcept { return {}; }
+                void return_void() {}
+                void unhandled_exception() { std::terminate(); }
+            };
+            
+        private:
+            std::coroutine_handle<promise_type> handle;
+            
+        public:
+            explicit WhenAllChild(std::coroutine_handle<promise_type> h) : handle(h) {}
+            WhenAllChild(WhenAllChild&& other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+            WhenAllChild(const WhenAllChild&) = delete;
+            WhenAllChild& operator=(const WhenAllChild&) = delete;
+            
+            ~WhenAllChild()
+            {
+                if (handle) handle.destroy();
+            }
+            
+            void start(WhenAllLatch& latch)
+            {
+                handle.promise().latch = &latch;
+                handle.resume();
+            }
+        };
+        
+        template <typename T>
+        WhenAllChild when_all_child(Task<T> task, std::optional<ResultOf<T>>* slot, std::exception_ptr* error)
+        {
+            try
+            {
+                if constexpr (std::is_void_v<T>)
+                {
+                    co_await task;
+                    slot->emplace();
+                }
+                else
+                {
+                    slot->emplace(co_await task);
+                }
+            }
+            catch (...)
+            {
+                *error = std::current_exception();
+            }
+        }
+        
+        struct WhenAllAwaiter
+        {
+            std::vector<WhenAllChild>& children;
+            WhenAllLatch latch;
+            
+            explicit WhenAllAwaiter(std::vector<WhenAllChild>& c) : children(c), latch(c.size()) {}
+            
+            bool await_ready() noexcept { return children.empty(); }
+            
+            bool await_suspend(std::coroutine_handle<> handle)
+            {
+                latch.waiter = handle;
+                for (WhenAllChild& child : children) child.start(latch);
+                return !latch.arrive();
+            }
+            
+            void await_resume() noexcept {}
+        };
+        
+        // Awaits every task and returns their results in order. Tasks are
+        // started one after another on the current thread and run
+        // concurrently from their first suspension, e.g. a co_await pool. The
+        // first exception (by position) is rethrown once all have finished.
+        template <typename T>
+        Task<std::conditional_t<std::is_void_v<T>, void, std::vector<T>>> when_all(std::vector<Task<T>> tasks)
+        {
+            const size_t n = tasks.size();
+            std::vector<std::optional<ResultOf<T>>> slots(n);
+            std::vector<std::exception_ptr> errors(n);
+            std::vector<WhenAllChild> children;
+            children.reserve(n);
+            for (size_t i = 0; i < n; ++i) children.push_back(when_all_child(std::move(tasks[i]), &slots[i], &errors[i]));
+            co_await WhenAllAwaiter(children);
+            
+            for (const std::exception_ptr& error : errors)
+            {
+                if (error) std::rethrow_exception(error);
+            }
+            if constexpr (!std::is_void_v<T>)
+            {
+                std::vector<T> results;
+                results.reserve(n);
+                for (auto& slot : slots) results.push_back(std::move(*slot));
+                co_return results;
+            }
+        }
+        
+        // Heterogeneous form; void tasks contribute std::monostate.
+        template <typename... Ts>
+        Task<std::tuple<ResultOf<Ts>...>> when_all(Task<Ts>... tasks)
+        {
+            std::tuple<std::optional<ResultOf<Ts>>...> slots;
+            std::exception_ptr errors[sizeof...(Ts) ? sizeof...(Ts) : 1];
+            std::vector<WhenAllChild> children;
+            children.reserve(sizeof...(Ts));
+            [&]<size_t... I>(std::index_sequence<I...>)
+            {
+                (children.push_back(when_all_child(std::move(tasks), &std::get<I>(slots), &errors[I])), ...);
+            }(std::index_sequence_for<Ts...>{});
+            co_await WhenAllAwaiter(children);
+            
+            for (const std::exception_ptr& error : errors)
+            {
+                if (error) std::rethrow_exception(error);
+            }
+            co_return std::apply([](auto&... slot) { return std::tuple<ResultOf<Ts>...>(std::move(*slot)...); }, slots);
+        }
+        
+        template <typename T>
+        struct WhenAnyState
+        {
+            std::atomic<bool> decided{false};
+            std::atomic<int> gate{2};   // the winner and the starting parent
+            std::coroutine_handle<> waiter;
+            size_t index = 0;
+            std::optional<ResultOf<T>> value;
+            std::exception_ptr error;
+            
+            // Whichever of winner and parent arrives second resumes the waiter.
+            bool arrive() { return gate.fetch_sub(1, std::memory_order_acq_rel) == 1; }
+        };
+        
+        template <typename T>
+        struct WhenAnyChild
+        {
+            struct promise_type
+            {
+                WhenAnyChild get_return_object() { return {std::coroutine_handle<promise_type>::from_promise(*this)}; }
+                std::suspend_always initial_suspend() noexcept { return {}; }
+                std::suspend_never final_suspend() noexcept { return {}; }
+                void return_void() {}
+                void unhandled_exception() { std::terminate(); }
+            };
+            
+            std::coroutine_handle<promise_type> handle;
+        };
+        
+        // Children own the shared state, so the losers may keep running after
+        // when_any has returned.
+        template <typename T>
+        WhenAnyChild<T> when_any_child(Task<T> task, std::shared_ptr<WhenAnyState<T>> state, size_t index)
+        {
+            std::optional<ResultOf<T>> value;
+            std::exception_ptr error;
+            try
+            {
+                if constexpr (std::is_void_v<T>)
+                {
+                    co_await task;
+                    value.emplace();
+                }
+                else
+                {
+                    value.emplace(co_await task);
+                }
+            }
+            catch (...)
+            {
+                error = std::current_exception();
+            }
+            if (state->decided.exchange(true, std::memory_order_acq_rel)) co_return;
+            state->index = index;
+            state->value = std::move(value);
+            state->error = error;
+            if (state->arrive()) state->waiter.resume();
+        }
+        
+        template <typename T>
+        struct WhenAnyAwaiter
+        {
+            WhenAnyState<T>& state;
+            std::vector<WhenAnyChild<T>>& children;
+            
+            bool await_ready() noexcept { return false; }
+            
+            // Children destroy their own frames, so the handles are dead once
+            // started; only the gate keeps the waiter suspended until the loop
+            // is done with them.
+            bool await_suspend(std::coroutine_handle<> handle)
+            {
+                state.waiter = handle;
+                for (WhenAnyChild<T>& child : children) child.handle.resume();
+                return !state.arrive();
+            }
+            
+            void await_resume() noexcept {}
+        };
+        
+        // Completes with the index and result of the first task to finish (its
+        // exception, if it threw). The others run to completion in the
+        // background and their results are dropped. tasks must not be empty.
+        template <typename T>
+        Task<std::pair<size_t, ResultOf<T>>> when_any(std::vector<Task<T>> tasks)
+        {
+            if (tasks.empty()) throw std::invalid_argument("when_any needs at least one task");
+            auto state = std::make_shared<WhenAnyState<T>>();
+            std::vector<WhenAnyChild<T>> children;
+            children.reserve(tasks.size());
+            for (size_t i = 0; i < tasks.size(); ++i) children.push_back(when_any_child(std::move(tasks[i]), state, i));
+            co_await WhenAnyAwaiter<T>{*state, children};
+            
+            if (state->error) std::rethrow_exception(state->error);
+            co_return std::pair<size_t, ResultOf<T>>(state->index, std::move(*state->value));
+        }
+    }
+    
+    namespace threading
+    {
+        // Lets coroutines write co_await pool to hop onto a worker.
+        async::ScheduleAwaiter operator co_await(ThreadPool& pool)
+        {
+            return async::schedule(pool);
+        }
+    }
+#endif
+
+    // ===== FILE SYSTEM UTILITIES (ThreadPool-backed) =====
+    namespace fs
+    {
+        // Appends to a file from ThreadPool workers so callers never block on
+        // disk I/O. Data appended while a write is in flight is coalesced into
+        // the next write, so many small appends become one write call. At most
+        // one job per writer is queued on the pool at a time. flush() and sync()
+        // may be called from the pool's own workers, where they write inline;
+        // the destructor waits for the queued job, so destroy it elsewhere.
+        class AsyncWriter
+        {
+        private:
+            threading::ThreadPool& pool;
+            std::string path;
+            std::FILE* file;
+            std::mutex mutex;
+            std::condition_variable idle;
+            std::string pending;
+            std::string writing;
+            bool scheduled = false;
+            bool writing_out = false;
+            bool sync_requested = false;
+            std::exception_ptr error;
+            
+            // Writes pending data (and any requested sync) until none is left.
+            // Called with the lock held; one thread writes at a time, so a
+            // second caller waits for the first to finish its write.
+            void write_out(std::unique_lock<std::mutex>& lock)
+            {
+                while (!pending.empty() || sync_requested || writing_out)
+                {
+                    if (writing_out)
+                    {
+                        idle.wait(lock);
+                        continue;
+                    }
+                    writing_out = true;
+                    std::swap(pending, writing);
+                    bool sync = sync_requested;
+                    sync_requested = false;
+                    lock.unlock();
+                    
+                    bool ok = writing.empty() || std::fwrite(writing.data(), 1, writing.size(), file) == writing.size();
+                    if (ok && sync) ok = sync_file(file);
+                    writing.clear();
+                    
+                    lock.lock();
+                    writing_out = false;
+                    if (!ok && !error) error = std::make_exception_ptr(std::runtime_error("Cannot write file: " + path));
+                    idle.notify_all();
+                }
+            }
+            
+            void drain()
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                write_out(lock);
+                scheduled = false;
+                idle.notify_all();
+            }
+            
+            void schedule(std::unique_lock<std::mutex>& lock)
+            {
+                if (scheduled) return;
+                scheduled = true;
+                lock.unlock();
+                try
+                {
+                    pool.post([this] { drain(); });
+                }
+                catch (...)
+                {
+                    // Stopped pool: write on the caller's thread instead.
+                    drain();
+                }
+                lock.lock();
+            }
+            
+            // A worker of the pool may be the one the queued job is waiting
+            // for, so there it writes the data itself instead of waiting.
+            void wait_idle(std::unique_lock<std::mutex>& lock)
+            {
+                if (pool.is_worker_thread()) write_out(lock);
+                else idle.wait(lock, [this] { return !scheduled; });
+                if (error) std::rethrow_exception(std::exchange(error, nullptr));
+            }
+            
+        public:
+            AsyncWriter(threading::ThreadPool& thread_pool, const std::string& file_path, bool append = true)
+                : pool(thread_pool), path(file_path), file(std::fopen(file_path.c_str(), append ? "ab" : "wb"))
+            {
+                if (!file) throw std::runtime_error("Cannot open file: " + file_path);
+                // Writes are already batched here, so skip stdio's own buffer.
+                std::setvbuf(file, nullptr, _IONBF, 0);
+            }
+            
+            AsyncWriter(const AsyncWriter&) = delete;
+            AsyncWriter& operator=(const AsyncWriter&) = delete;
+            
+            ~AsyncWriter()
+            {
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    idle.wait(lock, [this] { return !scheduled; });
+                }
+                std::fclose(file);
+            }
+            
+            void append(std::string_view data)
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                pending.append(data.data(), data.size());
+                schedule(lock);
+            }
+            
+            // Appends a batch of buffers under one lock.
+            template <typename Buffers>
+            void append_all(const Buffers& buffers)
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                for (const auto& buffer : buffers)
+                {
+                    std::string_view data(buffer);
+                    pending.append(data.data(), data.size());
+                }
+                schedule(lock);
+            }
+            
+            // Blocks until everything appended so far has been written, and
+            // rethrows the first write error since the last flush.
+            void flush()
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wait_idle(lock);
+            }
+            
+            // Like flush, but also fsyncs the file.
+            void sync()
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                sync_requested = true;
+                if (!pool.is_worker_thread()) schedule(lock);
+                wait_idle(lock);
+            }
+        };
+        
+        enum class EntryType
+        {
+            File,
+            Directory,
+            Symlink,
+            Other
+        };
+        
+        // Passed to the scan callback. path and name point into a buffer that
+        // is reused for the next entry, so copy them if they must outlive the call.
+        struct ScanEntry
+        {
+            std::string_view path;
+            std::string_view name;
+            EntryType type;
+            size_t depth;
+        };
+        
+        struct ScanOptions
+        {
+            std::vector<std::string> extensions;  // e.g. ".log"; empty accepts every file
+            std::string glob;                     // matched against the file name; empty accepts all
+            bool include_directories = false;     // also report directories (filters do not apply)
+            bool follow_symlinks = false;         // descend into symlinked directories once each (POSIX)
+            size_t max_depth = std::numeric_limits<size_t>::max();
+        };
+        
+        // Walks root recursively with every directory as a unit of work shared
+        // between the pool's workers and the calling thread. Pool helpers are
+        // posted as subdirectories turn up (at most pool.size() at a time) and
+        // return as soon as the queue is empty, so an idle walk holds no
+        // workers; only the caller waits for stragglers. On POSIX the entry
+        // type comes from readdir's d_type, so regular trees need no stat calls.
+        // Filters run on the bare name before any path is built.
+        //
+        // on_entry(const ScanEntry&) is called concurrently from several
+        // threads. Unreadable directories are skipped. The first exception from
+        // on_entry stops the walk and is rethrown. Returns the reported count.
+        template <typename Func>
+        size_t scan(threading::ThreadPool& pool, const std::string& root, const ScanOptions& options, Func&& on_entry)
+        {
+            using Fn = std::remove_reference_t<Func>;
+            struct State
+            {
+                std::mutex mutex;
+                std::condition_variable condition;
+                std::vector<std::pair<std::string, size_t>> directories;
+                size_t active = 0;
+                size_t helpers = 0;  // pool jobs posted and not yet finished
+                std::atomic<bool> stopped{false};
+                std::exception_ptr error;
+                std::atomic<size_t> reported{0};
+                hash::FlatHashSet<std::pair<uint64_t, uint64_t>> visited;  // (device, inode) when following links
+                const ScanOptions* options;
+                Fn* on_entry;
+                threading::ThreadPool* pool;
+            };
+            
+            auto state = std::make_shared<State>();
+            state->options = &options;
+            state->on_entry = &on_entry;
+            state->pool = &pool;
+            std::string start = root;
+            while (start.size() > 1 && (start.back() == '/' || start.back() == '\\')) start.pop_back();
+            state->directories.emplace_back(start, 0);
+            
+            auto accepts = [](const ScanOptions& opts, std::string_view name)
+            {
+                if (!opts.extensions.empty() &&
+                    std::none_of(opts.extensions.begin(), opts.extensions.end(),
+                                 [&](const std::string& ext) { return string::ends_with(name, ext); }))
+                    return false;
+                return opts.glob.empty() || glob_match(opts.glob, name);
+            };
+            
+            // Lists one directory: reports matches and collects subdirectories.
+            auto process = [accepts](State& s, const std::string& dir, size_t depth,
+                                     std::vector<std::pair<std::string, size_t>>& subdirs)
+            {
+                const ScanOptions& opts = *s.options;
+                std::string path;
+                auto report = [&](std::string_view name, EntryType type)
+                {
+                    path.assign(dir);
+                    if (path.empty() || path.back() != '/') path += '/';
+                    path.append(name.data(), name.size());
+                    if (type == EntryType::Directory && depth < opts.max_depth) subdirs.emplace_back(path, depth + 1);
+                    bool wanted = type == EntryType::Directory ? opts.include_directories : accepts(opts, name);
+                    if (!wanted) return;
+                    const ScanEntry entry{path, std::string_view(path).substr(path.size() - name.size()), type, depth};
+                    (*s.on_entry)(entry);
+                    s.reported.fetch_add(1, std::memory_order_relaxed);
+                };
+                
+#if defined(_WIN32)
+                std::error_code ec;
+                for (std::filesystem::directory_iterator it(dir, ec), end; !ec && it != end; it.increment(ec))
+                {
+                    std::string name = it->path().filename().string();
+                    EntryType type = EntryType::Other;
+                    if (it->is_symlink(ec)) type = EntryType::Symlink;
+                    else if (it->is_directory(ec)) type = EntryType::Directory;
+                    else if (it->is_regular_file(ec)) type = EntryType::File;
+                    report(name, type);
+                    if (s.stopped) return;
+                }
+#else
+                std::unique_ptr<DIR, int (*)(DIR*)> guard(::opendir(dir.c_str()), ::closedir);
+                DIR* handle = guard.get();
+                if (!handle) return;
+                while (dirent* entry = ::readdir(handle))
+                {
+                    std::string_view name(entry->d_name);
+                    if (name == "." || name == "..") continue;
+                    
+                    unsigned char kind = entry->d_type;
+                    struct stat info;
+                    bool have_info = false;
+                    if (kind == DT_UNKNOWN && ::fstatat(::dirfd(handle), entry->d_name, &info, AT_SYMLINK_NOFOLLOW) == 0)
+                    {
+                        have_info = true;
+                        kind = S_ISDIR(info.st_mode) ? DT_DIR : S_ISREG(info.st_mode) ? DT_REG : S_ISLNK(info.st_mode) ? DT_LNK : DT_UNKNOWN;
+                    }
+                    
+                    EntryType type = kind == DT_REG ? EntryType::File : kind == DT_DIR ? EntryType::Directory :
+                                     kind == DT_LNK ? EntryType::Symlink : EntryType::Other;
+                    
+                    if (type == EntryType::Symlink && opts.follow_symlinks &&
+                        ::fstatat(::dirfd(handle), entry->d_name, &info, 0) == 0)
+                    {
+                        have_info = true;
+                        if (S_ISDIR(info.st_mode)) type = EntryType::Directory;
+                        else if (S_ISREG(info.st_mode)) type = EntryType::File;
+                    }
+                    
+                    if (type == EntryType::Directory && opts.follow_symlinks)
+                    {
+                        if (!have_info && ::fstatat(::dirfd(handle), entry->d_name, &info, 0) != 0) continue;
+                        std::lock_guard<std::mutex> lock(s.mutex);
+                        if (!s.visited.emplace(static_cast<uint64_t>(info.st_dev), static_cast<uint64_t>(info.st_ino)).second) continue;
+                    }
+                    
+                    report(name, type);
+                    if (s.stopped) break;
+                }
+#endif
+            };
+            
+            // Helpers leave when the queue runs dry; the caller instead waits
+            // for more directories or for the walk to finish. A listing that
+            // turns up more than one subdirectory posts helpers for the rest.
+            auto work = [process](const auto& self, const std::shared_ptr<State>& state, bool caller) -> void
+            {
+                std::vector<std::pair<std::string, size_t>> subdirs;
+                std::unique_lock<std::mutex> lock(state->mutex);
+                while (true)
+                {
+                    if (caller) state->condition.wait(lock, [&] { return state->stopped || !state->directories.empty() || state->active == 0; });
+                    if (state->stopped || state->directories.empty()) break;
+                    
+                    auto [dir, depth] = std::move(state->directories.back());
+                    state->directories.pop_back();
+                    state->active++;
+                    lock.unlock();
+                    
+                    try
+                    {
+                        process(*state, dir, depth, subdirs);
+                    }
+                    catch (...)
+                    {
+                        lock.lock();
+                        if (!state->error) state->error = std::current_exception();
+                        state->stopped = true;
+                        lock.unlock();
+                    }
+                    
+                    lock.lock();
+                    state->active--;
+                    size_t extra = 0;
+                    if (!state->stopped && subdirs.size() > 1 && state->helpers < state->pool->size())
+                        extra = std::min(subdirs.size() - 1, state->pool->size() - state->helpers);
+                    for (auto& subdir : subdirs) state->directories.push_back(std::move(subdir));
+                    subdirs.clear();
+                    if (!state->directories.empty() || state->active == 0 || state->stopped) state->condition.notify_all();
+                    
+                    state->helpers += extra;
+                    for (; extra > 0; --extra)
+                    {
+                        try
+                        {
+                            state->pool->post([self, state] { self(self, state, false); });
+                        }
+                        catch (...)
+                        {
+                            // Stopped pool: whoever is walking carries on alone.
+                            state->helpers -= extra;
+                            break;
+                        }
+                    }
+                }
+                if (!caller) state->helpers--;
+            };
+            
+            if (options.follow_symlinks)
+            {
+#if !defined(_WIN32)
+                struct stat info;
+                if (::stat(start.c_str(), &info) == 0)
+                    state->visited.emplace(static_cast<uint64_t>(info.st_dev), static_cast<uint64_t>(info.st_ino));
+#endif
+            }
+            
+            work(work, state, true);
+            
+            std::unique_lock<std::mutex> lock(state->mutex);
+            state->condition.wait(lock, [&] { return state->active == 0; });
+            if (state->error) std::rethrow_exception(state->error);
+            return state->reported.load();
+        }
+        
+        // Runs atomic_write on the pool; the future reports completion or the
+        // write error. Content is moved into the job, so the caller's snapshot
+        // buffer is not copied.
+        threading::Future<void> atomic_write_async(threading::ThreadPool& pool, const std::string& path, std::string content)
+        {
+            return pool.submit([path, content = std::move(content)]
+            {
+                atomic_write(path, content);
+            });
+        }
+    }
+
+    // ===== ALGORITHM UTILITIES =====
+    namespace algorithm
+    {
+        template <typename Container, typename T>
+        bool binary_search(const Container& container, const T& value)
+        {
+            return std::binary_search(std::begin(container), std::end(container), value);
+        }
+        
+        // ----- Search indexes -----
+        
+        void prefetch_read(const void* address)
+        {
+#if defined(__GNUC__) || defined(__clang__)
+            __builtin_prefetch(address, 0, 3);
+#elif defined(SPUTIL_SIMD_SSE2)
+            _mm_prefetch(static_cast<const char*>(address), _MM_HINT_T0);
+#else
+            (void)address;
+#endif
+        }
+        
+        unsigned trailing_ones(uint64_t value)
+        {
+#if defined(_MSC_VER) && !defined(__clang__)
+            unsigned long index;
+            _BitScanForward64(&index, ~value);
+            return static_cast<unsigned>(index);
+#else
+            return static_cast<unsigned>(__builtin_ctzll(~value));
+#endif
+        }
+        
+        // Position of the first element not less than value in a sorted
+        // random-access container. The loop has no data-dependent branch (the
+        // step is a conditional move) and prefetches both possible next probes.
+        template <typename Container, typename T, typename Compare = std::less<>>
+        size_t lower_bound(const Container& container, const T& value, Compare comp = Compare())
+        {
+            auto first = std::begin(container);
+            size_t n = static_cast<size_t>(std::size(container));
+            if (n == 0) return 0;
+            
+            auto base = first;
+            while (n > 1)
+            {
+                size_t half = n / 2;
+                prefetch_read(&base[half / 2]);
+                prefetch_read(&base[half + half / 2]);
+                base += comp(base[half], value) ? half : 0;
+                n -= half;
+            }
+            return static_cast<size_t>(base - first) + (comp(*base, value) ? 1 : 0);
+        }
+        
+        // Static search index over a sorted container in Eytzinger (BFS) order:
+        // the first levels of the implicit tree share cache lines and the
+        // descent prefetches the line holding the node's great-grandchildren,
+        // so every probe after the first few is already in flight. Keys are
+        // copied; lower_bound returns positions in the original container.
+        // Index bounds the size and sets the width of the stored positions.
+        template <typename T, typename Compare = std::less<T>, typename Index = uint32_t>
+        class EytzingerIndex
+        {
+        public:
+            EytzingerIndex() = default;
+            
+            template <typename Container>
+            explicit EytzingerIndex(const Container& sorted, Compare comp = Compare())
+                : comp_(comp), size_(static_cast<size_t>(std::size(sorted)))
+            {
+                if (size_ >= static_cast<size_t>(std::numeric_limits<Index>::max()))
+                    throw std::length_error("EytzingerIndex: too many keys for index type");
+                keys_.resize(size_ + 1);
+                positions_.resize(size_ + 1);
+                size_t next = 0;
+                build(std::begin(sorted), next, 1);
+            }
+            
+            // Position of the first key not less than value, or size().
+            size_t lower_bound(const T& value) const
+            {
+                size_t slot = find_slot(value);
+                return slot ? positions_[slot] : size_;
+            }
+            
+            bool contains(const T& value) const
+            {
+                size_t slot = find_slot(value);
+                return slot && !comp_(value, keys_[slot]);
+            }
+            
+            // Runs lookups in groups whose descents are interleaved, so the
+            // cache misses of one lookup overlap with those of the others.
+            void lower_bound_batch(const T* values, size_t count, size_t* out) const
+            {
+                constexpr size_t group = 16;
+                size_t slots[group];
+                for (size_t base = 0; base < count; base += group)
+                {
+                    size_t m = std::min(group, count - base);
+                    for (size_t g = 0; g < m; ++g) slots[g] = 1;
+                    
+                    for (bool active = size_ > 0; active;)
+                    {
+                        active = false;
+                        for (size_t g = 0; g < m; ++g)
+                        {
+                            size_t k = slots[g];
+                            if (k > size_) continue;
+                            prefetch_ahead(k);
+                            slots[g] = 2 * k + (comp_(keys_[k], values[base + g]) ? 1 : 0);
+                            active = true;
+                        }
+                    }
+                    
+                    for (size_t g = 0; g < m; ++g)
+                    {
+                        size_t slot = slots[g] >> (trailing_ones(slots[g]) + 1);
+                        out[base + g] = slot ? positions_[slot] : size_;
+                    }
+                }
+            }
+            
+            size_t size() const { return size_; }
+            bool empty() const { return size_ == 0; }
+            
+        private:
+            static constexpr size_t prefetch_stride = std::max<size_t>(1, threading::cache_line_size / sizeof(T));
+            
+            template <typename Iter>
+            void build(Iter first, size_t& next, size_t k)
+            {
+                if (k > size_) return;
+                build(first, next, 2 * k);
+                keys_[k] = first[next];
+                positions_[k] = static_cast<Index>(next);
+                next++;
+                build(first, next, 2 * k + 1);
+            }
+            
+            // Computed on integers so it may point past the array; a prefetch
+            // never faults.
+            void prefetch_ahead(size_t k) const
+            {
+                uintptr_t address = reinterpret_cast<uintptr_t>(keys_.data()) + k * prefetch_stride * sizeof(T);
+                prefetch_read(reinterpret_cast<const void*>(address));
+            }
+            
+            // The descent goes right while keys are less than value; the answer
+            // is the last node where it went left, recovered by dropping the
+            // trailing right turns (ones) and the left turn before them.
+            size_t find_slot(const T& value) const
+            {
+                size_t k = 1;
+                while (k <= size_)
+                {
+                    prefetch_ahead(k);
+                    k = 2 * k + (comp_(keys_[k], value) ? 1 : 0);
+                }
+                return k >> (trailing_ones(k) + 1);
+            }
+            
+            Compare comp_{};
+            size_t size_ = 0;
+            std::vector<T> keys_;
+            std::vector<Index> positions_;
+        };
+        
+        // Static B-tree ("S-tree") over sorted numeric keys: each node is one
+        // cache line of keys, so a lookup touches log_(B+1)(n) lines instead of
+        // log2(n), and the rank inside a node is a SIMD compare-and-count
+        // (SSE2 for int32_t, an auto-vectorizable loop otherwise). NaN keys
+        // are not supported.
+        template <typename T, typename Index = uint32_t>
+        class STreeIndex
+        {
+            static_assert(std::is_arithmetic_v<T> && !std::is_same_v<T, bool>, "STreeIndex needs a numeric key type");
+            
+        public:
+            static constexpr size_t node_keys = threading::cache_line_size / sizeof(T);
+            
+            STreeIndex() = default;
+            
+            template <typename Container>
+            explicit STreeIndex(const Container& sorted)
+                : size_(static_cast<size_t>(std::size(sorted)))
+            {
+                if (size_ >= static_cast<size_t>(std::numeric_limits<Index>::max()))
+                    throw std::length_error("STreeIndex: too many keys for index type");
+                nodes_.resize((size_ + node_keys - 1) / node_keys);
+                positions_.resize(nodes_.size() * node_keys);
+                size_t next = 0;
+                build(std::begin(sorted), next, 0);
+            }
+            
+            // Position of the first key not less than value, or size().
+            size_t lower_bound(T value) const
+            {
+                T key{};
+                return search(value, key);
+            }
+            
+            bool contains(T value) const
+            {
+                T key{};
+                return search(value, key) != size_ && !(value < key);
+            }
+            
+            void lower_bound_batch(const T* values, size_t count, size_t* out) const
+            {
+                for (size_t i = 0; i < count; ++i) out[i] = lower_bound(values[i]);
+            }
+            
+            size_t size() const { return size_; }
+            bool empty() const { return size_ == 0; }
+            
+        private:
+            struct alignas(threading::cache_line_size) Node
+            {
+                T keys[node_keys];
+            };
+            
+            static size_t child(size_t k, size_t i) { return k * (node_keys + 1) + i + 1; }
+            
+            size_t search(T value, T& key) const
+            {
+                size_t result = size_;
+                size_t k = 0;
+                while (k < nodes_.size())
+                {
+                    size_t i = rank_in_node(nodes_[k], value);
+                    if (i < node_keys)
+                    {
+                        result = positions_[k * node_keys + i];
+                        key = nodes_[k].keys[i];
+                    }
+                    k = child(k, i);
+                }
+                return result;
+            }
+            
+            // Greater than or equal to every key, so padding sorts last.
+            static constexpr T padding()
+            {
+                if constexpr (std::numeric_limits<T>::has_infinity) return std::numeric_limits<T>::infinity();
+                else return std::numeric_limits<T>::max();
+            }
+            
+            template <typename Iter>
+            void build(Iter first, size_t& next, size_t k)
+            {
+                if (k >= nodes_.size()) return;
+                for (size_t i = 0; i < node_keys; ++i)
+                {
+                    build(first, next, child(k, i));
+                    bool real = next < size_;
+                    nodes_[k].keys[i] = real ? static_cast<T>(first[next]) : padding();
+                    positions_[k * node_keys + i] = static_cast<Index>(real ? next : size_);
+                    if (real) next++;
+                }
+                build(first, next, child(k, node_keys));
+            }
+            
+            // Number of keys in the node that are less than value; keys in a
+            // node are sorted, so this is also the index of the first key >= value.
+            static size_t rank_in_node(const Node& node, T value)
+            {
+#if defined(SPUTIL_SIMD_SSE2)
+                if constexpr (std::is_same_v<T, int32_t>)
+                {
+                    __m128i needle = _mm_set1_epi32(value);
+                    unsigned mask = 0;
+                    for (size_t j = 0; j < node_keys; j += 4)
+                    {
+                        __m128i keys = _mm_load_si128(reinterpret_cast<const __m128i*>(node.keys + j));
+                        __m128i less = _mm_cmpgt_epi32(needle, keys);
+                        mask |= static_cast<unsigned>(_mm_movemask_ps(_mm_castsi128_ps(less))) << j;
+                    }
+#if defined(_MSC_VER) && !defined(__clang__)
+                    return __popcnt(mask);
+#else
+                    return static_cast<size_t>(__builtin_popcount(mask));
+#endif
+                }
+#endif
+                size_t count = 0;
+                for (size_t j = 0; j < node_keys; ++j) count += node.keys[j] < value ? 1 : 0;
+                return count;
+            }
+            
+            size_t size_ = 0;
+            std::vector<Node> nodes_;
+            std::vector<Index> positions_;
+        };
+        
+        // ----- Sort engine -----
+        //
+        // algorithm::sort picks a strategy by type: arithmetic keys in contiguous
+        // storage sorted by std::less/std::greater go through an LSD radix sort,
+        // everything else through pdqsort. parallel_sort (further down) adds a
+        // sample sort on ThreadPool for large inputs.
+        
+        // Pattern-defeating quicksort internals (after Orson Peters' pdqsort):
+        // median-of-3 or ninther pivots, insertion sort on small or nearly
+        // sorted ranges, shuffles against bad patterns and a heapsort fallback
+        // that keeps the worst case at O(n log n).
+        namespace pdq
+        {
+            constexpr std::ptrdiff_t insertion_sort_threshold = 24;
+            constexpr std::ptrdiff_t ninther_threshold = 128;
+            constexpr std::ptrdiff_t partial_insertion_sort_limit = 8;
+            
+            template <typename Iter, typename Compare>
+            void insertion_sort(Iter begin, Iter end, Compare& comp)
+            {
+                using T = typename std::iterator_traits<Iter>::value_type;
+                if (begin == end) return;
+                for (Iter cur = begin + 1; cur != end; ++cur)
+                {
+                    Iter sift = cur;
+                    Iter sift_1 = cur - 1;
+                    if (comp(*sift, *sift_1))
+                    {
+                        T tmp = std::move(*sift);
+                        do { *sift-- = std::move(*sift_1); } while (sift != begin && comp(tmp, *--sift_1));
+                        *sift = std::move(tmp);
+                    }
+                }
+            }
+            
+            // Requires an element before begin that is not greater than any in range.
+            template <typename Iter, typename Compare>
+            void unguarded_insertion_sort(Iter begin, Iter end, Compare& comp)
+            {
+                using T = typename std::iterator_traits<Iter>::value_type;
+                if (begin == end) return;
+                for (Iter cur = begin + 1; cur != end; ++cur)
+                {
+                    Iter sift = cur;
+                    Iter sift_1 = cur - 1;
+                    if (comp(*sift, *sift_1))
+                    {
+                        T tmp = std::move(*sift);
+                        do { *sift-- = std::move(*sift_1); } while (comp(tmp, *--sift_1));
+                        *sift = std::move(tmp);
+                    }
+                }
+            }
+            
+            // Insertion sort that gives up once it has moved too many elements.
+            template <typename Iter, typename Compare>
+            bool partial_insertion_sort(Iter begin, Iter end, Compare& comp)
+            {
+                using T = typename std::iterator_traits<Iter>::value_type;
+                if (begin == end) return true;
+                std::ptrdiff_t moved = 0;
+                for (Iter cur = begin + 1; cur != end; ++cur)
+                {
+                    Iter sift = cur;
+                    Iter sift_1 = cur - 1;
+                    if (comp(*sift, *sift_1))
+                    {
+                        T tmp = std::move(*sift);
+                        do { *sift-- = std::move(*sift_1); } while (sift != begin && comp(tmp, *--sift_1));
+                        *sift = std::move(tmp);
+                        moved += cur - sift;
+                    }
+                    if (moved > partial_insertion_sort_limit) return false;
+                }
+                return true;
+            }
+            
+            template <typename Iter, typename Compare>
+            void sort2(Iter a, Iter b, Compare& comp)
+            {
+                if (comp(*b, *a)) std::iter_swap(a, b);
+            }
+            
+            template <typename Iter, typename Compare>
+            void sort3(Iter a, Iter b, Iter c, Compare& comp)
+            {
+                sort2(a, b, comp);
+                sort2(b, c, comp);
+                sort2(a, b, comp);
+            }
+            
+            // Partitions around *begin with equal elements to the right. Returns
+            // the pivot position and whether no element had to move.
+            template <typename Iter, typename Compare>
+            std::pair<Iter, bool> partition_right(Iter begin, Iter end, Compare& comp)
+            {
+                using T = typename std::iterator_traits<Iter>::value_type;
+                T pivot(std::move(*begin));
+                Iter first = begin;
+                Iter last = end;
+                
+                while (comp(*++first, pivot));
+                if (first - 1 == begin) while (first < last && !comp(*--last, pivot));
+                else while (!comp(*--last, pivot));
+                
+                bool already_partitioned = first >= last;
+                while (first < last)
+                {
+                    std::iter_swap(first, last);
+                    while (comp(*++first, pivot));
+                    while (!comp(*--last, pivot));
+                }
+                
+                Iter pivot_pos = first - 1;
+                *begin = std::move(*pivot_pos);
+                *pivot_pos = std::move(pivot);
+                return {pivot_pos, already_partitioned};
+            }
+            
+            // Partitions with elements equal to the pivot on the left; used when
+            // the pivot equals the element before the range, i.e. many duplicates.
+            template <typename Iter, typename Compare>
+            Iter partition_left(Iter begin, Iter end, Compare& comp)
+            {
+                using T = typename std::iterator_traits<Iter>::value_type;
+                T pivot(std::move(*begin));
+                Iter first = begin;
+                Iter last = end;
+                
+                while (comp(pivot, *--last));
+                if (last + 1 == end) while (first < last && !comp(pivot, *++first));
+                else while (!comp(pivot, *++first));
+                
+                while (first < last)
+                {
+                    std::iter_swap(first, last);
+                    while (comp(pivot, *--last));
+                    while (!comp(pivot, *++first));
+                }
+                
+                Iter pivot_pos = last;
+                *begin = std::move(*pivot_pos);
+                *pivot_pos = std::move(pivot);
+                return pivot_pos;
+            }
+            
+            template <typename Iter, typename Compare>
+            void loop(Iter begin, Iter end, Compare& comp, int bad_allowed, bool leftmost)
+            {
+                using diff_t = typename std::iterator_traits<Iter>::difference_type;
+                while (true)
+                {
+                    diff_t size = end - begin;
+                    if (size < insertion_sort_threshold)
+                    {
+                        if (leftmost) insertion_sort(begin, end, comp);
+                        else unguarded_insertion_sort(begin, end, comp);
+                        return;
+                    }
+                    
+                    diff_t half = size / 2;
+                    if (size > ninther_threshold)
+                    {
+                        sort3(begin, begin + half, end - 1, comp);
+                        sort3(begin + 1, begin + (half - 1), end - 2, comp);
+                        sort3(begin + 2, begin + (half + 1), end - 3, comp);
+                        sort3(begin + (half - 1), begin + half, begin + (half + 1), comp);
+                        std::iter_swap(begin, begin + half);
+                    }
+                    else
+                    {
+                        sort3(begin + half, begin, end - 1, comp);
+                    }
+                    
+                    if (!leftmost && !comp(*(begin - 1), *begin))
+                    {
+                        begin = partition_left(begin, end, comp) + 1;
+                        continue;
+                    }
+                    
+                    auto [pivot_pos, already_partitioned] = partition_right(begin, end, comp);
+                    diff_t l_size = pivot_pos - begin;
+                    diff_t r_size = end - (pivot_pos + 1);
+                    
+                    if (l_size < size / 8 || r_size < size / 8)
+                    {
+                        if (--bad_allowed == 0)
+                        {
+                            std::make_heap(begin, end, comp);
+                            std::sort_heap(begin, end, comp);
+                            return;
+                        }
+                        
+                        if (l_size >= insertion_sort_threshold)
+                        {
+                            std::iter_swap(begin, begin + l_size / 4);
+                            std::iter_swap(pivot_pos - 1, pivot_pos - l_size / 4);
+                            if (l_size > ninther_threshold)
+                            {
+                                std::iter_swap(begin + 1, begin + (l_size / 4 + 1));
+                                std::iter_swap(begin + 2, begin + (l_size / 4 + 2));
+                                std::iter_swap(pivot_pos - 2, pivot_pos - (l_size / 4 + 1));
+                                std::iter_swap(pivot_pos - 3, pivot_pos - (l_size / 4 + 2));
+                            }
+                        }
+                        if (r_size >= insertion_sort_threshold)
+                        {
+                            std::iter_swap(pivot_pos + 1, pivot_pos + (1 + r_size / 4));
+                            std::iter_swap(end - 1, end - r_size / 4);
+                            if (r_size > ninther_threshold)
+                            {
+                                std::iter_swap(pivot_pos + 2, pivot_pos + (2 + r_size / 4));
+                                std::iter_swap(pivot_pos + 3, pivot_pos + (3 + r_size / 4));
+                                std::iter_swap(end - 2, end - (1 + r_size / 4));
+                                std::iter_swap(end - 3, end - (2 + r_size / 4));
+                            }
+                        }
+                    }
+                    else if (already_partitioned && partial_insertion_sort(begin, pivot_pos, comp) &&
+                             partial_insertion_sort(pivot_pos + 1, end, comp))
+                    {
+                        return;
+                    }
+                    
+                    // Recurse into the left side, loop on the right.
+                    loop(begin, pivot_pos, comp, bad_allowed, leftmost);
+                    begin = pivot_pos + 1;
+                    leftmost = false;
+                }
+            }
+        }
+        
+        template <typename Iter, typename Compare>
+        void pdq_sort(Iter first, Iter last, Compare comp)
+        {
+            if (last - first < 2) return;
+            int depth = 0;
+            for (auto n = last - first; n > 1; n >>= 1) depth++;
+            pdq::loop(first, last, comp, depth, true);
+        }
+        
+        // Unsigned key whose natural order matches the order of value; floats
+        // have their sign handled so negatives sort first (-0.0 before +0.0).
+        template <typename T>
+        auto sort_key(T value)
+        {
+            if constexpr (std::is_floating_point_v<T>)
+            {
+                using U = std::conditional_t<sizeof(T) == 4, uint32_t, uint64_t>;
+                static_assert(sizeof(T) == sizeof(U), "unsupported floating point width");
+                U bits;
+                std::memcpy(&bits, &value, sizeof(bits));
+                const U sign = U(1) << (sizeof(U) * 8 - 1);
+                return (bits & sign) ? U(~bits) : U(bits | sign);
+            }
+            else
+            {
+                return array::radix_key(value);
+            }
+        }
+        
+        // Stable LSD radix sort of n items by key_of(item), an unsigned integer.
+        // All byte histograms come from one read pass, and passes in which
+        // every key shares the same byte are skipped. Needs n items of scratch.
+        template <typename Item, typename KeyOf>
+        void radix_sort_by(Item* data, size_t n, KeyOf key_of)
+        {
+            using Key = decltype(key_of(*data));
+            constexpr size_t passes = sizeof(Key);
+            if (n < 2) return;
+            
+            std::vector<size_t> counts(passes * 256, 0);
+            for (size_t i = 0; i < n; ++i)
+            {
+                Key key = key_of(data[i]);
+                for (size_t p = 0; p < passes; ++p) counts[p * 256 + ((key >> (p * 8)) & 0xFF)]++;
+            }
+            
+            std::unique_ptr<Item[]> scratch(new Item[n]);
+            Item* src = data;
+            Item* dst = scratch.get();
+            for (size_t p = 0; p < passes; ++p)
+            {
+                size_t* count = &counts[p * 256];
+                if (count[(key_of(src[0]) >> (p * 8)) & 0xFF] == n) continue;
+                
+                size_t offset = 0;
+                for (size_t b = 0; b < 256; ++b)
+                {
+                    size_t c = count[b];
+                    count[b] = offset;
+                    offset += c;
+                }
+                for (size_t i = 0; i < n; ++i) dst[count[(key_of(src[i]) >> (p * 8)) & 0xFF]++] = std::move(src[i]);
+                std::swap(src, dst);
+            }
+            if (src != data) std::move(src, src + n, data);
+        }
+        
+        // Integers and 4- or 8-byte floats; wider floats such as an x87 long
+        // double have padding and no matching unsigned key, so they go to pdq_sort.
+        template <typename T>
+        constexpr bool is_radix_sortable_v =
+            (std::is_integral_v<T> && !std::is_same_v<T, bool>) ||
+            (std::is_floating_point_v<T> && (sizeof(T) == 4 || sizeof(T) == 8));
+        
+        // Ascending radix sort of integers or floating point values.
+        template <typename T>
+        void radix_sort(T* data, size_t n)
+        {
+            static_assert(is_radix_sortable_v<T>, "radix_sort needs an integer or a 4- or 8-byte float");
+            radix_sort_by(data, n, [](T value) { return sort_key(value); });
+        }
+        
+        template <typename Iter>
+        constexpr bool is_contiguous_iterator_v =
+            std::is_pointer_v<Iter> ||
+            std::is_same_v<Iter, typename std::vector<typename std::iterator_traits<Iter>::value_type>::iterator>;
+        
+        template <typename Iter, typename Compare>
+        void sort(Iter first, Iter last, Compare comp)
+        {
+            using T = typename std::iterator_traits<Iter>::value_type;
+            constexpr bool radix_able = is_radix_sortable_v<T> && is_contiguous_iterator_v<Iter>;
+            constexpr bool ascending = std::is_same_v<Compare, std::less<T>> || std::is_same_v<Compare, std::less<>>;
+            constexpr bool descending = std::is_same_v<Compare, std::greater<T>> || std::is_same_v<Compare, std::greater<>>;
+            
+            // Below a few hundred elements the radix passes cost more than they save.
+            if constexpr (radix_able && (ascending || descending))
+            {
+                if (last - first >= 256)
+                {
+                    radix_sort(&*first, static_cast<size_t>(last - first));
+                    if constexpr (descending) std::reverse(first, last);
+                    return;
+                }
+            }
+            pdq_sort(first, last, comp);
+        }
+        
+        template <typename Iter>
+        void sort(Iter first, Iter last)
+        {
+            algorithm::sort(first, last, std::less<typename std::iterator_traits<Iter>::value_type>());
+        }
+        
+        // Sorts records by key(record), evaluating key once per record. Radix
+        // sortable keys go through a stable radix sort of (key, index) pairs; other keys
+        // through std::stable_sort of the same pairs. Records are then moved
+        // into place once, so each is moved twice in total.
+        template <typename Iter, typename KeyFunc>
+        void sort_by_key(Iter first, Iter last, KeyFunc key)
+        {
+            using T = typename std::iterator_traits<Iter>::value_type;
+            using K = std::decay_t<decltype(key(*first))>;
+            const size_t n = static_cast<size_t>(last - first);
+            if (n < 2) return;
+            
+            std::vector<size_t> order(n);
+            if constexpr (is_radix_sortable_v<K>)
+            {
+                using U = decltype(sort_key(std::declval<K>()));
+                std::vector<std::pair<U, size_t>> keyed(n);
+                for (size_t i = 0; i < n; ++i) keyed[i] = {sort_key(static_cast<K>(key(first[i]))), i};
+                radix_sort_by(keyed.data(), n, [](const std::pair<U, size_t>& entry) { return entry.first; });
+                for (size_t i = 0; i < n; ++i) order[i] = keyed[i].second;
+            }
+            else
+            {
+                std::vector<std::pair<K, size_t>> keyed;
+                keyed.reserve(n);
+                for (size_t i = 0; i < n; ++i) keyed.emplace_back(key(first[i]), i);
+                std::stable_sort(keyed.begin(), keyed.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+                for (size_t i = 0; i < n; ++i) order[i] = keyed[i].second;
+            }
+            
+            std::vector<T> sorted;
+            sorted.reserve(n);
+            for (size_t i : order) sorted.push_back(std::move(first[i]));
+            std::move(sorted.begin(), sorted.end(), first);
+        }
+        
+        template <typename Container, typename Predicate>
+        void quick_sort(Container& container, Predicate comp)
+        {
+            algorithm::sort(std::begin(container), std::end(container), comp);
+        }
+        
+        template <typename Container>
+        void quick_sort(Container& container)
+        {
+            algorithm::sort(std::begin(container), std::end(container));
+        }
+        
+        // ----- Sequences and lazy ranges -----
+        //
+        // sequence(start, end, step) is the lazy form of generate_sequence: it
+        // covers start, start + step, ... up to and including end, computes its
+        // length up front, and produces terms as start + i * step, so nothing
+        // accumulates rounding error or overflows past end.
+        
+        // Number of terms of the inclusive sequence; throws on step == 0.
+        template <typename T>
+        constexpr size_t sequence_count(T start, T end, T step)
+        {
+            static_assert(std::is_arithmetic_v<T> && !std::is_same_v<T, bool>, "sequence needs a numeric type");
+            if (step == T(0)) throw std::invalid_argument("sequence step must not be zero");
+            if constexpr (std::is_integral_v<T>)
+            {
+                using U = std::make_unsigned_t<T>;
+                if (step > 0)
+                {
+                    if (start > end) return 0;
+                    return static_cast<size_t>((static_cast<U>(end) - static_cast<U>(start)) / static_cast<U>(step)) + 1;
+                }
+                if (start < end) return 0;
+                return static_cast<size_t>((static_cast<U>(start) - static_cast<U>(end)) / (U(0) - static_cast<U>(step))) + 1;
+            }
+            else
+            {
+                if ((step > 0 && start > end) || (step < 0 && start < end)) return 0;
+                // Tolerate rounding so that e.g. 0..1 by 0.1 still includes 1.
+                long double terms = static_cast<long double>(end - start) / static_cast<long double>(step);
+                return static_cast<size_t>(terms + terms * 1e-12L + 1e-12L) + 1;
+            }
+        }
+        
+        template <typename T>
+        constexpr T sequence_term(T start, T step, size_t index)
+        {
+            if constexpr (std::is_integral_v<T>)
+            {
+                using U = std::make_unsigned_t<T>;
+                return static_cast<T>(static_cast<U>(start) + static_cast<U>(index) * static_cast<U>(step));
+            }
+            else
+            {
+                return static_cast<T>(start + static_cast<T>(index) * step);
+            }
+        }
+        
+        template <typename Range, typename Func> class MapRange;
+        template <typename Range, typename Predicate> class FilterRange;
+        
+        // Shared adapters for the lazy ranges below. Adapters keep their source
+        // by value, so a chain is self-contained and cheap to copy.
+        template <typename Derived>
+        class LazyRange
+        {
+        private:
+            constexpr const Derived& self() const { return static_cast<const Derived&>(*this); }
+            
+        public:
+            template <typename Func>
+            constexpr MapRange<Derived, Func> map(Func transform) const { return MapRange<Derived, Func>(self(), transform); }
+            
+            template <typename Predicate>
+            constexpr FilterRange<Derived, Predicate> filter(Predicate predicate) const
+            {
+                return FilterRange<Derived, Predicate>(self(), predicate);
+            }
+            
+            template <typename Func>
+            constexpr void for_each(Func fn) const
+            {
+                for (auto&& value : self()) fn(value);
+            }
+            
+            auto to_vector() const
+            {
+                using Value = std::decay_t<decltype(*self().begin())>;
+                std::vector<Value> result;
+                if constexpr (Derived::sized) result.reserve(self().size());
+                for (auto&& value : self()) result.push_back(value);
+                return result;
+            }
+        };
+        
+        template <typename T>
+        class SequenceRange : public LazyRange<SequenceRange<T>>
+        {
+        private:
+            T first;
+            T step_;
+            size_t count;
+            
+        public:
+            static constexpr bool sized = true;
+            
+            class iterator
+            {
+            private:
+                T start;
+                T step;
+                size_t index;
+                
+            public:
+                using iterator_category = std::random_access_iterator_tag;
+                using value_type = T;
+                using difference_type = std::ptrdiff_t;
+                using pointer = void;
+                using reference = T;
+                
+                constexpr iterator() : start(), step(), index(0) {}
+                constexpr iterator(T s, T st, size_t i) : start(s), step(st), index(i) {}
+                
+                constexpr T operator*() const { return sequence_term(start, step, index); }
+                constexpr T operator[](difference_type n) const { return sequence_term(start, step, index + n); }
+                constexpr iterator& operator++() { ++index; return *this; }
+                constexpr iterator operator++(int) { iterator previous = *this; ++index; return previous; }
+                constexpr iterator& operator--() { --index; return *this; }
+                constexpr iterator operator--(int) { iterator previous = *this; --index; return previous; }
+                constexpr iterator& operator+=(difference_type n) { index += n; return *this; }
+                constexpr iterator& operator-=(difference_type n) { index -= n; return *this; }
+                constexpr iterator operator+(difference_type n) const { return iterator(start, step, index + n); }
+                constexpr iterator operator-(difference_type n) const { return iterator(start, step, index - n); }
+                constexpr difference_type operator-(const iterator& other) const
+                {
+                    return static_cast<difference_type>(index) - static_cast<difference_type>(other.index);
+                }
+                constexpr bool operator==(const iterator& other) const { return index == other.index; }
+                constexpr bool operator!=(const iterator& other) const { return index != other.index; }
+                constexpr bool operator<(const iterator& other) const { return index < other.index; }
+            };
+            
+            constexpr SequenceRange(T start, T end, T step) : first(start), step_(step), count(sequence_count(start, end, step)) {}
+            
+            constexpr iterator begin() const { return iterator(first, step_, 0); }
+            constexpr iterator end() const { return iterator(first, step_, count); }
+            constexpr size_t size() const { return count; }
+            constexpr bool empty() const { return count == 0; }
+            constexpr T operator[](size_t i) const { return sequence_term(first, step_, i); }
+        };
+        
+        // Lazy start, start + step, ... through end (inclusive).
+        template <typename T>
+        constexpr SequenceRange<T> sequence(T start, T end, T step = 1)
+        {
+            return SequenceRange<T>(start, end, step);
+        }
+        
+        // Lazy 0, 1, ..., count - 1.
+        template <typename T>
+        constexpr SequenceRange<T> iota(T count)
+        {
+            return count > T(0) ? SequenceRange<T>(T(0), static_cast<T>(count - 1), T(1)) : SequenceRange<T>(T(1), T(0), T(1));
+        }
+        
+        template <typename Range, typename Func>
+        class MapRange : public LazyRange<MapRange<Range, Func>>
+        {
+        private:
+            Range source;
+            Func transform;
+            
+            using BaseIterator = decltype(std::declval<const Range&>().begin());
+            
+        public:
+            static constexpr bool sized = Range::sized;
+            
+            class iterator
+            {
+            private:
+                BaseIterator it;
+                const Func* fn = nullptr;
+                
+            public:
+                using iterator_category = std::forward_iterator_tag;
+                using value_type = std::decay_t<decltype(std::declval<const Func&>()(*std::declval<BaseIterator>()))>;
+                using difference_type = std::ptrdiff_t;
+                using pointer = void;
+                using reference = value_type;
+                
+                constexpr iterator() = default;
+                constexpr iterator(BaseIterator i, const Func* f) : it(i), fn(f) {}
+                
+                constexpr value_type operator*() const { return (*fn)(*it); }
+                constexpr iterator& operator++() { ++it; return *this; }
+                constexpr iterator operator++(int) { iterator previous = *this; ++it; return previous; }
+                constexpr bool operator==(const iterator& other) const { return it == other.it; }
+                constexpr bool operator!=(const iterator& other) const { return it != other.it; }
+            };
+            
+            constexpr MapRange(const Range& range, Func f) : source(range), transform(f) {}
+            
+            constexpr iterator begin() const { return iterator(source.begin(), &transform); }
+            constexpr iterator end() const { return iterator(source.end(), &transform); }
+            constexpr size_t size() const { return source.size(); }
+        };
+        
+        template <typename Range, typename Predicate>
+        class FilterRange : public LazyRange<FilterRange<Range, Predicate>>
+        {
+        private:
+            Range source;
+            Predicate predicate;
+            
+            using BaseIterator = decltype(std::declval<const Range&>().begin());
+            
+        public:
+            static constexpr bool sized = false;
+            
+            class iterator
+            {
+            private:
+                BaseIterator it;
+                BaseIterator last;
+                const Predicate* pred = nullptr;
+                
+                constexpr void skip()
+                {
+                    while (it != last && !(*pred)(*it)) ++it;
+                }
+                
+            public:
+                using iterator_category = std::forward_iterator_tag;
+                using value_type = std::decay_t<decltype(*std::declval<BaseIterator>())>;
+                using difference_type = std::ptrdiff_t;
+                using pointer = void;
+                using reference = decltype(*std::declval<BaseIterator>());
+                
+                constexpr iterator() = default;
+                constexpr iterator(BaseIterator i, BaseIterator e, const Predicate* p) : it(i), last(e), pred(p) { skip(); }
+                
+                constexpr reference operator*() const { return *it; }
+                constexpr iterator& operator++() { ++it; skip(); return *this; }
+                constexpr iterator operator++(int) { iterator previous = *this; ++*this; return previous; }
+                constexpr bool operator==(const iterator& other) const { return it == other.it; }
+                constexpr bool operator!=(const iterator& other) const { return it != other.it; }
+            };
+            
+            constexpr FilterRange(const Range& range, Predicate p) : source(range), predicate(p) {}
+            
+            constexpr iterator begin() const { return iterator(source.begin(), source.end(), &predicate); }
+            constexpr iterator end() const { return iterator(source.end(), source.end(), &predicate); }
+        };
         
-    //     double radians_to_degrees(double radians)
-    //     {
-    //         return radians * 180.0 / PI;
-    //     }
+        // Materialized sequence: sized up front and filled by index, which
+        // the compiler can vectorize. Throws std::invalid_argument on step 0.
+        template <typename T>
+        std::vector<T> generate_sequence(T start, T end, T step = 1)
+        {
+            std::vector<T> result(sequence_count(start, end, step));
+            T* out = result.data();
+            const size_t count = result.size();
+            for (size_t i = 0; i < count; ++i) out[i] = sequence_term(start, step, i);
+            return result;
+        }
         
-    //     int random_int(int min, int max)
-    //     {
-    //         static std::random_device rd;
-    //         static std::mt19937 gen(rd());
-    //         std::uniform_int_distribution<> dis(min, max);
-    //         return dis(gen);
-    //     }
+        // ----- Parallel algorithms built on threading::ThreadPool -----
+        //
+        // The calling thread always takes part in the work, so these are safe to
+        // call from inside a pool task. A grain of 0 picks a chunk size that gives
+        // every worker several chunks, which evens out chunks of uneven cost.
         
-    //     double random_double(double min, double max)
-    //     {
-    //         static std::random_device rd;
-    //         static std::mt19937 gen(rd());
-    //         std::uniform_real_distribution<> dis(min, max);
-    //         return dis(gen);
-    //     }
+        size_t parallel_grain(const threading::ThreadPool& pool, size_t count, size_t grain = 0)
+        {
+            if (grain != 0) return grain;
+            size_t target_chunks = (pool.size() + 1) * 8;
+            return std::max<size_t>(1, count / target_chunks);
+        }
         
-    //     template <typename T>
-    //     T min(const std::vector<T>& values)
-    //     {
-    //         return *std::min_element(values.begin(), values.end());
-    //     }
+        // Calls fn(chunk_begin, chunk_end) for consecutive chunks of [begin, end).
+        // The first exception thrown by fn stops further chunks and is rethrown.
+        template <typename Func>
+        void parallel_for_chunks(threading::ThreadPool& pool, size_t begin, size_t end, size_t grain, Func&& fn)
+        {
+            if (end <= begin) return;
+            grain = parallel_grain(pool, end - begin, grain);
+            const size_t chunks = (end - begin + grain - 1) / grain;
+            if (chunks == 1)
+            {
+                fn(begin, end);
+                return;
+            }
+            
+            using Fn = std::remove_reference_t<Func>;
+            struct State
+            {
+                size_t begin, end, grain, chunks;
+                Fn* fn;
+                std::atomic<size_t> next{0};
+                std::atomic<size_t> done{0};
+                std::atomic<bool> failed{false};
+                std::exception_ptr error;
+                std::mutex mutex;
+                std::condition_variable condition;
+            };
+            
+            // Helpers that start after every chunk has been claimed only touch the
+            // shared state, never fn, so they may outlive this call safely.
+            auto state = std::make_shared<State>();
+            state->begin = begin;
+            state->end = end;
+            state->grain = grain;
+            state->chunks = chunks;
+            state->fn = &fn;
+            
+            auto work = [state]()
+            {
+                size_t chunk;
+                while ((chunk = state->next.fetch_add(1)) < state->chunks)
+                {
+                    if (!state->failed.load(std::memory_order_relaxed))
+                    {
+                        size_t first = state->begin + chunk * state->grain;
+                        size_t last = std::min(state->end, first + state->grain);
+                        try
+                        {
+                            (*state->fn)(first, last);
+                        }
+                        catch (...)
+                        {
+                            std::lock_guard<std::mutex> lock(state->mutex);
+                            if (!state->error) state->error = std::current_exception();
+                            state->failed = true;
+                        }
+                    }
+                    if (state->done.fetch_add(1) + 1 == state->chunks)
+                    {
+                        std::lock_guard<std::mutex> lock(state->mutex);
+                        state->condition.notify_all();
+                    }
+                }
+            };
+            
+            size_t helpers = std::min(pool.size(), chunks - 1);
+            for (size_t i = 0; i < helpers; ++i) pool.post(work);
+            work();
+            
+            std::unique_lock<std::mutex> lock(state->mutex);
+            state->condition.wait(lock, [&] { return state->done.load() == chunks; });
+            if (state->error) std::rethrow_exception(state->error);
+        }
         
-    //     template <typename T>
-    //     T max(const std::vector<T>& values)
-    //     {
-    //         return *std::max_element(values.begin(), values.end());
-    //     }
+        template <typename Func>
+        void parallel_for(threading::ThreadPool& pool, size_t begin, size_t end, size_t grain, Func&& fn)
+        {
+            parallel_for_chunks(pool, begin, end, grain, [&fn](size_t first, size_t last)
+            {
+                for (size_t i = first; i < last; ++i) fn(i);
+            });
+        }
+        
+        // Parallel array::map. The result type must be default-constructible.
+        template <typename T, typename Func>
+        auto parallel_map(threading::ThreadPool& pool, const std::vector<T>& data, Func transform, size_t grain = 0)
+        {
+            std::vector<std::decay_t<decltype(transform(data[0]))>> result(data.size());
+            parallel_for_chunks(pool, 0, data.size(), grain, [&](size_t first, size_t last)
+            {
+                for (size_t i = first; i < last; ++i) result[i] = transform(data[i]);
+            });
+            return result;
+        }
+        
+        // Parallel array::filter, order preserving. Pass one evaluates the
+        // predicate and counts matches per chunk; a prefix sum over the counts
+        // gives each chunk its output offset for pass two.
+        template <typename T, typename Func>
+        std::vector<T> parallel_filter(threading::ThreadPool& pool, const std::vector<T>& data, Func predicate, size_t grain = 0)
+        {
+            grain = parallel_grain(pool, data.size(), grain);
+            const size_t chunks = (data.size() + grain - 1) / grain;
+            std::vector<unsigned char> keep(data.size());
+            std::vector<size_t> offsets(chunks + 1, 0);
+            
+            parallel_for_chunks(pool, 0, data.size(), grain, [&](size_t first, size_t last)
+            {
+                size_t kept = 0;
+                for (size_t i = first; i < last; ++i)
+                {
+                    keep[i] = predicate(data[i]) ? 1 : 0;
+                    kept += keep[i];
+                }
+                offsets[first / grain + 1] = kept;
+            });
+            
+            for (size_t c = 0; c < chunks; ++c) offsets[c + 1] += offsets[c];
+            
+            std::vector<T> result(offsets[chunks]);
+            parallel_for_chunks(pool, 0, data.size(), grain, [&](size_t first, size_t last)
+            {
+                size_t out = offsets[first / grain];
+                for (size_t i = first; i < last; ++i)
+                {
+                    if (keep[i]) result[out++] = data[i];
+                }
+            });
+            return result;
+        }
+        
+        // Reduces each chunk on its own, starting from identity, with op(U, const T&),
+        // then folds the chunk results together with combine(U, U) in chunk order.
+        // identity must be neutral for combine (0 for +, 1 for *), and op and
+        // combine must agree, as with tbb::parallel_reduce.
+        template <typename T, typename U, typename Op, typename Combine,
+                  std::enable_if_t<std::is_invocable_v<Combine&, U, U>, int> = 0>
+        U parallel_reduce(threading::ThreadPool& pool, const std::vector<T>& data, U identity, Op op, Combine combine, size_t grain = 0)
+        {
+            static_assert(std::is_invocable_v<Op&, U, const T&>, "parallel_reduce: op must be callable as op(U, const T&)");
+            
+            grain = parallel_grain(pool, data.size(), grain);
+            const size_t chunks = (data.size() + grain - 1) / grain;
+            std::vector<std::optional<U>> partials(chunks);
+            
+            parallel_for_chunks(pool, 0, data.size(), grain, [&](size_t first, size_t last)
+            {
+                U partial = identity;
+                for (size_t i = first; i < last; ++i) partial = op(std::move(partial), data[i]);
+                partials[first / grain].emplace(std::move(partial));
+            });
+            
+            for (auto& partial : partials) identity = combine(std::move(identity), std::move(*partial));
+            return identity;
+        }
+        
+        // Reduces each chunk on its own, then folds the partial results into init
+        // in chunk order. op must be associative, and since it also joins chunk
+        // results the accumulator has to be the element type; for accumulate-style
+        // ops such as op(long long, int), pass an identity and a combine instead.
+        template <typename T, typename U, typename Op>
+        U parallel_reduce(threading::ThreadPool& pool, const std::vector<T>& data, U init, Op op, size_t grain = 0)
+        {
+            static_assert(std::is_same_v<U, T>, "parallel_reduce: init must have the element type; pass a combine(U, U) to reduce into another type");
+            static_assert(std::is_invocable_v<Op&, U, const T&>, "parallel_reduce: op must be callable as op(U, const T&)");
+            
+            grain = parallel_grain(pool, data.size(), grain);
+            const size_t chunks = (data.size() + grain - 1) / grain;
+            std::vector<std::optional<U>> partials(chunks);
+            
+            parallel_for_chunks(pool, 0, data.size(), grain, [&](size_t first, size_t last)
+            {
+                U partial = data[first];
+                for (size_t i = first + 1; i < last; ++i) partial = op(std::move(partial), data[i]);
+                partials[first / grain].emplace(std::move(partial));
+            });
+            
+            for (auto& partial : partials) init = op(std::move(init), std::move(*partial));
+            return init;
+        }
+        
+        // Sorts one run per worker in parallel, then merges neighbouring runs
+        // pairwise, each round in parallel.
+        template <typename T, typename Compare = std::less<T>>
+        void parallel_merge_sort(threading::ThreadPool& pool, std::vector<T>& data, Compare comp = Compare())
+        {
+            const size_t min_run = 4096;
+            size_t runs = std::min(pool.size() + 1, data.size() / min_run);
+            if (runs < 2)
+            {
+                std::sort(data.begin(), data.end(), comp);
+                return;
+            }
+            
+            std::vector<size_t> bounds(runs + 1);
+            for (size_t r = 0; r <= runs; ++r) bounds[r] = data.size() * r / runs;
+            
+            parallel_for(pool, 0, runs, 1, [&](size_t r)
+            {
+                std::sort(data.begin() + bounds[r], data.begin() + bounds[r + 1], comp);
+            });
+            
+            for (size_t width = 1; width < runs; width *= 2)
+            {
+                size_t pairs = (runs + 2 * width - 1) / (2 * width);
+                parallel_for(pool, 0, pairs, 1, [&](size_t p)
+                {
+                    size_t left = p * 2 * width;
+                    size_t mid = std::min(left + width, runs);
+                    size_t right = std::min(left + 2 * width, runs);
+                    if (mid < right)
+                    {
+                        std::inplace_merge(data.begin() + bounds[left], data.begin() + bounds[mid],
+                                           data.begin() + bounds[right], comp);
+                    }
+                });
+            }
+        }
+        
+        // Sample sort: splitters picked from a sorted oversample divide the
+        // input into several buckets per thread, chunks are classified and
+        // scattered into a scratch buffer in parallel, then every bucket is
+        // sorted with algorithm::sort and moved back. Small inputs are sorted
+        // directly. The element type must be default-constructible.
+        template <typename T, typename Compare = std::less<T>>
+        void parallel_sort(threading::ThreadPool& pool, std::vector<T>& data, Compare comp = Compare())
+        {
+            const size_t n = data.size();
+            const size_t threads = pool.size() + 1;
+            if (n < (size_t(1) << 16) || threads < 2)
+            {
+                algorithm::sort(data.begin(), data.end(), comp);
+                return;
+            }
+            
+            const size_t buckets = std::min<size_t>(threads * 4, 1024);
+            const size_t oversample = 32;
+            std::vector<T> samples;
+            samples.reserve(buckets * oversample);
+            uint64_t x = 0x9e3779b97f4a7c15ULL ^ n;
+            for (size_t i = 0; i < buckets * oversample; ++i)
+            {
+                x ^= x << 13;
+                x ^= x >> 7;
+                x ^= x << 17;
+                samples.push_back(data[x % n]);
+            }
+            algorithm::sort(samples.begin(), samples.end(), comp);
+            std::vector<T> splitters;
+            splitters.reserve(buckets - 1);
+            for (size_t b = 1; b < buckets; ++b) splitters.push_back(samples[b * oversample]);
+            
+            const size_t chunks = threads * 4;
+            const size_t grain = (n + chunks - 1) / chunks;
+            std::vector<uint16_t> bucket_of(n);
+            std::vector<size_t> counts(chunks * buckets, 0);
+            
+            parallel_for_chunks(pool, 0, n, grain, [&](size_t first, size_t last)
+            {
+                size_t* count = &counts[(first / grain) * buckets];
+                for (size_t i = first; i < last; ++i)
+                {
+                    size_t b = std::upper_bound(splitters.begin(), splitters.end(), data[i], comp) - splitters.begin();
+                    bucket_of[i] = static_cast<uint16_t>(b);
+                    count[b]++;
+                }
+            });
+            
+            // Bucket-major prefix sums: counts[c][b] becomes chunk c's write
+            // position inside bucket b.
+            std::vector<size_t> bucket_begin(buckets + 1, 0);
+            size_t offset = 0;
+            for (size_t b = 0; b < buckets; ++b)
+            {
+                bucket_begin[b] = offset;
+                for (size_t c = 0; c < chunks; ++c)
+                {
+                    size_t count = counts[c * buckets + b];
+                    counts[c * buckets + b] = offset;
+                    offset += count;
+                }
+            }
+            bucket_begin[buckets] = n;
+            
+            std::vector<T> scratch(n);
+            parallel_for_chunks(pool, 0, n, grain, [&](size_t first, size_t last)
+            {
+                size_t* position = &counts[(first / grain) * buckets];
+                for (size_t i = first; i < last; ++i) scratch[position[bucket_of[i]]++] = std::move(data[i]);
+            });
+            
+            parallel_for(pool, 0, buckets, 1, [&](size_t b)
+            {
+                auto begin = scratch.begin() + bucket_begin[b];
+                auto end = scratch.begin() + bucket_begin[b + 1];
+                algorithm::sort(begin, end, comp);
+                std::move(begin, end, data.begin() + bucket_begin[b]);
+            });
+        }
+        
+        // Fixed-capacity LRU cache. Entries live in preallocated node storage
+        // linked into an index-based recency list, and an open-addressed table
+        // maps keys to nodes. Once constructed, put/get/erase do not allocate;
+        // eviction reuses the least recently used node and its stored hash.
+        template <typename K, typename V = void, typename Hash = hash::Hash<K>, typename KeyEqual = std::equal_to<K>,
+                  typename Allocator = std::allocator<std::pair<const K, V>>>
+        class LRUCache
+        {
+        private:
+            template <typename, typename, typename, typename, typename> friend class ShardedLRUCache;
+            
+            static constexpr uint32_t npos = std::numeric_limits<uint32_t>::max();
+            
+            struct Slot
+            {
+                uint32_t node;
+                uint32_t hash;
+            };
+            
+            struct Node
+            {
+                std::optional<std::pair<K, V>> entry;
+                uint32_t hash;
+                uint32_t prev;
+                uint32_t next;
+            };
+            
+            size_t capacity_;
+            size_t count = 0;
+            size_t used = 0;          // nodes handed out so far; the rest are untouched
+            uint32_t free_head = npos;
+            uint32_t head = npos;     // most recently used
+            uint32_t tail = npos;     // least recently used
+            size_t mask;
+            using NodeAllocator = typename std::allocator_traits<Allocator>::template rebind_alloc<Node>;
+            using SlotAllocator = typename std::allocator_traits<Allocator>::template rebind_alloc<Slot>;
+            memory::AllocatedArray<Node, NodeAllocator> nodes;
+            memory::AllocatedArray<Slot, SlotAllocator> slots;
+            Hash hasher;
+            KeyEqual equal;
+            metrics::Counter* hits = nullptr;        // null until attach_metrics()
+            metrics::Counter* misses = nullptr;
+            metrics::Counter* evictions = nullptr;
+            
+            static uint64_t mix_wide(size_t h)
+            {
+                uint64_t x = static_cast<uint64_t>(h);
+                x ^= x >> 33;
+                x *= 0xff51afd7ed558ccdULL;
+                x ^= x >> 33;
+                return x;
+            }
+            
+            static uint32_t mix(size_t h) { return static_cast<uint32_t>(mix_wide(h)); }
+            
+            size_t find_slot(const K& key, uint32_t hash) const
+            {
+                for (size_t i = hash & mask; ; i = (i + 1) & mask)
+                {
+                    const Slot& slot = slots[i];
+                    if (slot.node == npos) return npos;
+                    if (slot.hash == hash && equal(nodes[slot.node].entry->first, key)) return i;
+                }
+            }
+            
+            // Backward-shift deletion keeps probe chains intact without tombstones.
+            void remove_slot(size_t i)
+            {
+                for (size_t j = (i + 1) & mask; slots[j].node != npos; j = (j + 1) & mask)
+                {
+                    size_t home = slots[j].hash & mask;
+                    if (((j - home) & mask) >= ((j - i) & mask))
+                    {
+                        slots[i] = slots[j];
+                        i = j;
+                    }
+                }
+                slots[i].node = npos;
+            }
+            
+            void insert_slot(uint32_t node, uint32_t hash)
+            {
+                size_t i = hash & mask;
+                while (slots[i].node != npos) i = (i + 1) & mask;
+                slots[i] = Slot{node, hash};
+            }
+            
+            void unlink(uint32_t n)
+            {
+                Node& node = nodes[n];
+                if (node.prev != npos) nodes[node.prev].next = node.next;
+                else head = node.next;
+                if (node.next != npos) nodes[node.next].prev = node.prev;
+                else tail = node.prev;
+            }
+            
+            void push_front(uint32_t n)
+            {
+                Node& node = nodes[n];
+                node.prev = npos;
+                node.next = head;
+                if (head != npos) nodes[head].prev = n;
+                head = n;
+                if (tail == npos) tail = n;
+            }
+            
+            void touch(uint32_t n)
+            {
+                if (head == n) return;
+                unlink(n);
+                push_front(n);
+            }
+            
+            V* get_hashed(const K& key, uint32_t hash)
+            {
+                size_t i = find_slot(key, hash);
+                if (i == npos)
+                {
+                    if (misses) misses->add();
+                    return nullptr;
+                }
+                if (hits) hits->add();
+                touch(slots[i].node);
+                return &nodes[slots[i].node].entry->second;
+            }
+            
+            const V* peek_hashed(const K& key, uint32_t hash) const
+            {
+                size_t i = find_slot(key, hash);
+                if (i == npos) return nullptr;
+                return &nodes[slots[i].node].entry->second;
+            }
+            
+            template <typename KK, typename VV>
+            void put_hashed(KK&& key, VV&& value, uint32_t hash)
+            {
+                if (capacity_ == 0) return;
+                
+                size_t i = find_slot(key, hash);
+                if (i != npos)
+                {
+                    uint32_t n = slots[i].node;
+                    nodes[n].entry->second = std::forward<VV>(value);
+                    touch(n);
+                    return;
+                }
+                
+                uint32_t n;
+                if (count == capacity_)
+                {
+                    n = tail;
+                    remove_slot(find_node_slot(n));
+                    unlink(n);
+                    count--;
+                    if (evictions) evictions->add();
+                }
+                else if (free_head != npos)
+                {
+                    n = free_head;
+                    free_head = nodes[n].next;
+                }
+                else
+                {
+                    n = static_cast<uint32_t>(used++);
+                }
+                
+                nodes[n].entry.emplace(std::forward<KK>(key), std::forward<VV>(value));
+                nodes[n].hash = hash;
+                insert_slot(n, hash);
+                push_front(n);
+                count++;
+            }
+            
+            bool erase_hashed(const K& key, uint32_t hash)
+            {
+                size_t i = find_slot(key, hash);
+                if (i == npos) return false;
+                uint32_t n = slots[i].node;
+                remove_slot(i);
+                unlink(n);
+                nodes[n].entry.reset();
+                nodes[n].next = free_head;
+                free_head = n;
+                count--;
+                return true;
+            }
+            
+            static size_t table_size_for(size_t capacity)
+            {
+                size_t table_size = 2;
+                while (table_size < capacity * 2) table_size <<= 1;
+                return table_size;
+            }
+            
+            size_t find_node_slot(uint32_t n) const
+            {
+                size_t i = nodes[n].hash & mask;
+                while (slots[i].node != n) i = (i + 1) & mask;
+                return i;
+            }
+            
+        public:
+            // The node and slot arrays are allocated once, up front, through
+            // Allocator (rebound to the internal node types).
+            LRUCache(size_t capacity, const Hash& hash = Hash(), const KeyEqual& key_equal = KeyEqual(),
+                     const Allocator& allocator = Allocator())
+                : capacity_(std::min<size_t>(capacity, npos - 1)), mask(table_size_for(capacity_) - 1),
+                  nodes(std::max<size_t>(capacity_, 1), NodeAllocator(allocator)),
+                  slots(mask + 1, SlotAllocator(allocator)), hasher(hash), equal(key_equal)
+            {
+                for (size_t i = 0; i <= mask; ++i) slots[i].node = npos;
+            }
+            
+            template <typename VV>
+            void put(const K& key, VV&& value)
+            {
+                put_hashed(key, std::forward<VV>(value), mix(hasher(key)));
+            }
+            
+            template <typename VV>
+            void put(K&& key, VV&& value)
+            {
+                uint32_t hash = mix(hasher(key));
+                put_hashed(std::move(key), std::forward<VV>(value), hash);
+            }
+            
+            // Returns the cached value and marks it most recently used, or nullptr.
+            // The pointer stays valid until the entry is evicted or erased.
+            V* get(const K& key)
+            {
+                return get_hashed(key, mix(hasher(key)));
+            }
+            
+            // Like get, but leaves the recency order untouched.
+            const V* peek(const K& key) const
+            {
+                return peek_hashed(key, mix(hasher(key)));
+            }
+            
+            bool contains(const K& key) const
+            {
+                return find_slot(key, mix(hasher(key))) != npos;
+            }
+            
+            bool erase(const K& key)
+            {
+                return erase_hashed(key, mix(hasher(key)));
+            }
+            
+            void clear()
+            {
+                for (size_t i = 0; i < used; ++i) nodes[i].entry.reset();
+                for (size_t i = 0; i <= mask; ++i) slots[i].node = npos;
+                count = used = 0;
+                free_head = head = tail = npos;
+            }
+            
+            size_t size() const { return count; }
+            size_t capacity() const { return capacity_; }
+            
+            // Counts get() hits and misses and evictions into <prefix>.hits,
+            // <prefix>.misses and <prefix>.evictions. The cache is not thread
+            // safe, so attach before handing it out; caches attached under the
+            // same prefix add into the same counters.
+            void attach_metrics(metrics::Registry& registry = metrics::Registry::instance(), const std::string& prefix = "lru")
+            {
+                hits = &registry.counter(prefix + ".hits", "Cache lookups that found the key");
+                misses = &registry.counter(prefix + ".misses", "Cache lookups that missed");
+                evictions = &registry.counter(prefix + ".evictions", "Entries evicted to make room");
+            }
+        };
         
-    //     template <typename T>
-    //     double average(const std::vector<T>& values)
-    //     {
-    //         if (values.empty()) return 0.0;
-    //         double sum = 0.0;
-    //         for (const auto& value : values) sum += value;
-    //         return sum / values.size();
-    //     }
-    // }
+        // Key-only cache: put(key) records a key, get(key) reports whether it is
+        // still cached and refreshes it.
+        template <typename K, typename Hash, typename KeyEqual, typename Allocator>
+        class LRUCache<K, void, Hash, KeyEqual, Allocator>
+        {
+        private:
+            struct Empty {};
+            LRUCache<K, Empty, Hash, KeyEqual, Allocator> cache;
+            
+        public:
+            LRUCache(size_t capacity, const Hash& hash = Hash(), const KeyEqual& key_equal = KeyEqual(),
+                     const Allocator& allocator = Allocator())
+                : cache(capacity, hash, key_equal, allocator) {}
+            
+            void put(const K& key) { cache.put(key, Empty{}); }
+            bool get(const K& key) { return cache.get(key) != nullptr; }
+            bool contains(const K& key) const { return cache.contains(key); }
+            bool erase(const K& key) { return cache.erase(key); }
+            void clear() { cache.clear(); }
+            size_t size() const { return cache.size(); }
+            size_t capacity() const { return cache.capacity(); }
+            
+            void attach_metrics(metrics::Registry& registry = metrics::Registry::instance(), const std::string& prefix = "lru")
+            {
+                cache.attach_metrics(registry, prefix);
+            }
+        };
+        
+        // LRUCache split into independently locked shards, picked by key hash,
+        // for lookups from many threads. The capacity is divided exactly, with
+        // capacity % shards shards holding one extra entry, and the shard count
+        // is lowered to keep every shard at least one entry. Recency is tracked
+        // per shard rather than globally.
+        template <typename K, typename V, typename Hash = hash::Hash<K>, typename KeyEqual = std::equal_to<K>,
+                  typename Allocator = std::allocator<std::pair<const K, V>>>
+        class ShardedLRUCache
+        {
+            static_assert(!std::is_void_v<V>, "ShardedLRUCache needs a value type");
+            
+        private:
+            using Cache = LRUCache<K, V, Hash, KeyEqual, Allocator>;
+            
+            struct alignas(threading::cache_line_size) Shard
+            {
+                std::mutex mutex;
+                Cache cache;
+                Shard(size_t capacity, const Hash& hash, const KeyEqual& key_equal, const Allocator& allocator)
+                    : cache(capacity, hash, key_equal, allocator) {}
+            };
+            
+            std::vector<std::unique_ptr<Shard>> shards;
+            size_t shard_mask;
+            Hash hasher;
+            metrics::Registration registration;
+            
+            // The shard comes from the top byte of the 64-bit mix, which the
+            // 32-bit slot hash never sees, so shard and slot stay independent
+            // however large a shard's table grows.
+            Shard& shard_for(const K& key, uint32_t& hash) const
+            {
+                uint64_t wide = Cache::mix_wide(hasher(key));
+                hash = static_cast<uint32_t>(wide);
+                return *shards[(wide >> 56) & shard_mask];
+            }
+            
+        public:
+            ShardedLRUCache(size_t capacity, size_t shard_count = 16, const Hash& hash = Hash(),
+                            const KeyEqual& key_equal = KeyEqual(), const Allocator& allocator = Allocator())
+                : hasher(hash)
+            {
+                size_t count = 1;
+                while (count < shard_count && count < 256) count <<= 1;
+                while (count > 1 && count > capacity) count >>= 1;
+                shard_mask = count - 1;
+                for (size_t i = 0; i < count; ++i)
+                {
+                    size_t per_shard = capacity / count + (i < capacity % count ? 1 : 0);
+                    shards.emplace_back(std::make_unique<Shard>(per_shard, hash, key_equal, allocator));
+                }
+            }
+            
+            template <typename VV>
+            void put(const K& key, VV&& value)
+            {
+                uint32_t hash;
+                Shard& shard = shard_for(key, hash);
+                std::lock_guard<std::mutex> lock(shard.mutex);
+                shard.cache.put_hashed(key, std::forward<VV>(value), hash);
+            }
+            
+            // Returns a copy of the value since the entry may be evicted as soon
+            // as the shard lock is released.
+            std::optional<V> get(const K& key)
+            {
+                uint32_t hash;
+                Shard& shard = shard_for(key, hash);
+                std::lock_guard<std::mutex> lock(shard.mutex);
+                V* value = shard.cache.get_hashed(key, hash);
+                if (!value) return std::nullopt;
+                return *value;
+            }
+            
+            // Calls fn(value) under the shard lock on a hit, avoiding the copy.
+            template <typename Func>
+            bool visit(const K& key, Func&& fn)
+            {
+                uint32_t hash;
+                Shard& shard = shard_for(key, hash);
+                std::lock_guard<std::mutex> lock(shard.mutex);
+                V* value = shard.cache.get_hashed(key, hash);
+                if (!value) return false;
+                fn(*value);
+                return true;
+            }
+            
+            bool contains(const K& key) const
+            {
+                uint32_t hash;
+                Shard& shard = shard_for(key, hash);
+                std::lock_guard<std::mutex> lock(shard.mutex);
+                return shard.cache.find_slot(key, hash) != Cache::npos;
+            }
+            
+            bool erase(const K& key)
+            {
+                uint32_t hash;
+                Shard& shard = shard_for(key, hash);
+                std::lock_guard<std::mutex> lock(shard.mutex);
+                return shard.cache.erase_hashed(key, hash);
+            }
+            
+            size_t size() const
+            {
+                size_t total = 0;
+                for (const auto& shard : shards)
+                {
+                    std::lock_guard<std::mutex> lock(shard->mutex);
+                    total += shard->cache.size();
+                }
+                return total;
+            }
+            
+            size_t capacity() const
+            {
+                size_t total = 0;
+                for (const auto& shard : shards) total += shard->cache.capacity();
+                return total;
+            }
+            
+            size_t shard_count() const { return shards.size(); }
+            
+            // Like LRUCache::attach_metrics, with the shards sharing one set
+            // of counters, plus a <prefix>.size gauge.
+            void attach_metrics(metrics::Registry& registry = metrics::Registry::instance(), const std::string& prefix = "lru")
+            {
+                metrics::Counter& hits = registry.counter(prefix + ".hits", "Cache lookups that found the key");
+                metrics::Counter& misses = registry.counter(prefix + ".misses", "Cache lookups that missed");
+                metrics::Counter& evictions = registry.counter(prefix + ".evictions", "Entries evicted to make room");
+                for (const auto& shard : shards)
+                {
+                    std::lock_guard<std::mutex> lock(shard->mutex);
+                    shard->cache.hits = &hits;
+                    shard->cache.misses = &misses;
+                    shard->cache.evictions = &evictions;
+                }
+                registration.reset();
+                registration.callback_gauge(registry, prefix + ".size", "Cached entries",
+                                            [this] { return static_cast<double>(size()); });
+            }
+        };
+    }
 
-    // ===== FILE SYSTEM UTILITIES =====
-    namespace fs
+    // ===== NETWORKING UTILITIES (Basic) =====
+    namespace net
     {
-        bool exists(const std::string& path)
+        // Lookup tables shared by the URL codecs: unreserved marks the RFC 3986
+        // bytes that pass through url_encode, hex maps a digit to its value or -1.
+        struct UrlTables
         {
-            return std::filesystem::exists(path);
-        }
+            bool unreserved[256] = {};
+            signed char hex[256] = {};
+            
+            constexpr UrlTables()
+            {
+                for (int c = 0; c < 256; ++c)
+                {
+                    unreserved[c] = (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+                                    c == '-' || c == '_' || c == '.' || c == '~';
+                    hex[c] = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 :
+                             c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+                }
+            }
+        };
         
-        bool is_file(const std::string& path)
+        inline constexpr UrlTables url_tables{};
+        
+        // Appends the percent-encoding of value to out, growing it exactly once.
+        void url_encode_append(std::string& out, std::string_view value)
         {
-            return std::filesystem::is_regular_file(path);
+            static constexpr char digits[] = "0123456789ABCDEF";
+            
+            size_t escaped = 0;
+            for (unsigned char c : value) escaped += !url_tables.unreserved[c];
+            
+            size_t offset = out.size();
+            out.resize(offset + value.size() + escaped * 2);
+            char* dst = &out[offset];
+            for (unsigned char c : value)
+            {
+                if (url_tables.unreserved[c])
+                {
+                    *dst++ = static_cast<char>(c);
+                }
+                else
+                {
+                    dst[0] = '%';
+                    dst[1] = digits[c >> 4];
+                    dst[2] = digits[c & 15];
+                    dst += 3;
+                }
+            }
         }
         
-        bool is_directory(const std::string& path)
+        std::string url_encode(std::string_view value)
         {
-            return std::filesystem::is_directory(path);
+            std::string result;
+            url_encode_append(result, value);
+            return result;
         }
         
-        std::string read_file(const std::string& path)
+        // Appends the decoding of value to out. '+' becomes a space and only
+        // well-formed %XX escapes are decoded; anything else is copied as-is.
+        void url_decode_append(std::string& out, std::string_view value)
         {
-            std::ifstream file(path);
-            if (!file.is_open()) throw std::runtime_error("Cannot open file: " + path);
+            size_t offset = out.size();
+            out.resize(offset + value.size());
+            char* begin = &out[offset];
+            char* dst = begin;
+            const char* src = value.data();
+            const char* end = src + value.size();
             
-            std::string content((std::istreambuf_iterator<char>(file)),
-                        std::istreambuf_iterator<char>());
-            return content;
+            while (src < end)
+            {
+                char c = *src;
+                if (c == '%' && end - src > 2)
+                {
+                    int hi = url_tables.hex[static_cast<unsigned char>(src[1])];
+                    int lo = url_tables.hex[static_cast<unsigned char>(src[2])];
+                    if ((hi | lo) >= 0)
+                    {
+                        *dst++ = static_cast<char>((hi << 4) | lo);
+                        src += 3;
+                        continue;
+                    }
+                }
+                *dst++ = c == '+' ? ' ' : c;
+                src++;
+            }
+            
+            out.resize(offset + (dst - begin));
         }
         
-        void write_file(const std::string& path, const std::string& content)
+        std::string url_decode(std::string_view value)
         {
-            std::ofstream file(path);
-            if (!file.is_open()) throw std::runtime_error("Cannot open file: " + path);
-            file << content;
+            std::string result;
+            url_decode_append(result, value);
+            return result;
         }
         
-        std::vector<std::string> list_files(const std::string& path)
+        // True if the still-encoded text decodes to plain, without allocating.
+        bool url_decoded_equals(std::string_view encoded, std::string_view plain)
         {
-            std::vector<std::string> files;
-            for (const auto& entry : std::filesystem::directory_iterator(path))
+            size_t j = 0;
+            for (size_t i = 0; i < encoded.size(); ++i, ++j)
             {
-                if (entry.is_regular_file())
+                if (j == plain.size()) return false;
+                char c = encoded[i];
+                if (c == '%' && encoded.size() - i > 2)
                 {
-                    files.push_back(entry.path().string());
+                    int hi = url_tables.hex[static_cast<unsigned char>(encoded[i + 1])];
+                    int lo = url_tables.hex[static_cast<unsigned char>(encoded[i + 2])];
+                    if ((hi | lo) >= 0)
+                    {
+                        c = static_cast<char>((hi << 4) | lo);
+                        i += 2;
+                    }
                 }
+                else if (c == '+')
+                {
+                    c = ' ';
+                }
+                if (c != plain[j]) return false;
             }
-            return files;
+            return j == plain.size();
         }
         
-        bool create_directory(const std::string& path)
+        // One key/value pair of a query string, still percent-encoded. Views
+        // point into the parsed query, which must outlive the pair.
+        struct QueryParam
         {
-            return std::filesystem::create_directories(path);
+            std::string_view key;
+            std::string_view value;
+            bool has_value = false;  // false for a bare "key" without '='
+            
+            std::string decoded_key() const { return url_decode(key); }
+            std::string decoded_value() const { return url_decode(value); }
+            void decode_value_into(std::string& out) const { out.clear(); url_decode_append(out, value); }
+        };
+        
+        // Lazy single-pass view over "a=1&b=2&c": yields pairs in order,
+        // keeps duplicates and skips empty segments. A leading '?' is ignored.
+        class QueryView
+        {
+        private:
+            std::string_view query;
+            
+        public:
+            class iterator
+            {
+            private:
+                std::string_view query;
+                size_t next = std::string_view::npos;
+                QueryParam current;
+                
+                void advance()
+                {
+                    while (next < query.size())
+                    {
+                        size_t end = query.find('&', next);
+                        if (end == std::string_view::npos) end = query.size();
+                        std::string_view segment = query.substr(next, end - next);
+                        next = end + 1;
+                        if (segment.empty()) continue;
+                        
+                        size_t eq = segment.find('=');
+                        current.has_value = eq != std::string_view::npos;
+                        current.key = segment.substr(0, eq);
+                        current.value = current.has_value ? segment.substr(eq + 1) : std::string_view();
+                        return;
+                    }
+                    next = std::string_view::npos;
+                }
+                
+            public:
+                using iterator_category = std::forward_iterator_tag;
+                using value_type = QueryParam;
+                using difference_type = std::ptrdiff_t;
+                using pointer = const QueryParam*;
+                using reference = const QueryParam&;
+                
+                iterator() = default;
+                explicit iterator(std::string_view q) : query(q), next(0) { advance(); }
+                
+                const QueryParam& operator*() const { return current; }
+                const QueryParam* operator->() const { return &current; }
+                
+                iterator& operator++()
+                {
+                    advance();
+                    return *this;
+                }
+                
+                iterator operator++(int)
+                {
+                    iterator previous = *this;
+                    advance();
+                    return previous;
+                }
+                
+                bool operator==(const iterator& other) const
+                {
+                    return next == other.next && (next == std::string_view::npos || query.data() == other.query.data());
+                }
+                bool operator!=(const iterator& other) const { return !(*this == other); }
+            };
+            
+            explicit QueryView(std::string_view q)
+                : query(!q.empty() && q.front() == '?' ? q.substr(1) : q) {}
+            
+            iterator begin() const { return iterator(query); }
+            iterator end() const { return iterator(); }
+            
+            // First pair whose decoded key equals key.
+            std::optional<QueryParam> find(std::string_view key) const
+            {
+                for (const QueryParam& param : *this)
+                {
+                    if (url_decoded_equals(param.key, key)) return param;
+                }
+                return std::nullopt;
+            }
+            
+            std::optional<std::string> get(std::string_view key) const
+            {
+                auto param = find(key);
+                if (!param) return std::nullopt;
+                return param->decoded_value();
+            }
+        };
+        
+        // Flat pair list with room for N pairs inline; larger queries spill to
+        // the heap once. Keeps insertion order and duplicate keys.
+        template <size_t N = 32>
+        class QueryParams
+        {
+        private:
+            QueryParam inline_params[N];
+            std::vector<QueryParam> heap;
+            size_t count = 0;
+            
+        public:
+            QueryParams() = default;
+            explicit QueryParams(std::string_view query) { parse(query); }
+            
+            // Replaces the contents with the pairs of query; returns the count.
+            size_t parse(std::string_view query)
+            {
+                clear();
+                for (const QueryParam& param : QueryView(query)) push_back(param);
+                return count;
+            }
+            
+            void push_back(const QueryParam& param)
+            {
+                if (count < N)
+                {
+                    inline_params[count++] = param;
+                    return;
+                }
+                if (heap.empty())
+                {
+                    heap.reserve(N * 2);
+                    heap.assign(inline_params, inline_params + N);
+                }
+                heap.push_back(param);
+                count++;
+            }
+            
+            void clear()
+            {
+                heap.clear();
+                count = 0;
+            }
+            
+            const QueryParam* begin() const { return heap.empty() ? inline_params : heap.data(); }
+            const QueryParam* end() const { return begin() + count; }
+            const QueryParam& operator[](size_t index) const { return begin()[index]; }
+            size_t size() const { return count; }
+            bool empty() const { return count == 0; }
+            
+            const QueryParam* find(std::string_view key) const
+            {
+                for (const QueryParam& param : *this)
+                {
+                    if (url_decoded_equals(param.key, key)) return &param;
+                }
+                return nullptr;
+            }
+            
+            bool contains(std::string_view key) const { return find(key) != nullptr; }
+            
+            size_t count_of(std::string_view key) const
+            {
+                size_t matches = 0;
+                for (const QueryParam& param : *this) matches += url_decoded_equals(param.key, key);
+                return matches;
+            }
+            
+            std::optional<std::string> get(std::string_view key) const
+            {
+                const QueryParam* param = find(key);
+                if (!param) return std::nullopt;
+                return param->decoded_value();
+            }
+            
+            // Calls fn(const QueryParam&) for every pair with the given key.
+            template <typename Func>
+            void for_each(std::string_view key, Func&& fn) const
+            {
+                for (const QueryParam& param : *this)
+                {
+                    if (url_decoded_equals(param.key, key)) fn(param);
+                }
+            }
+        };
+        
+        // Decoded map of the query. Keys without '=' map to an empty value,
+        // values may contain '=', and the last of duplicate keys wins.
+        std::map<std::string, std::string> parse_query_string(std::string_view query)
+        {
+            std::map<std::string, std::string> result;
+            for (const QueryParam& param : QueryView(query))
+            {
+                result[param.decoded_key()] = param.decoded_value();
+            }
+            return result;
         }
         
-        uintmax_t file_size(const std::string& path)
+        // parse_query_string into a flat hash map, for callers that only look
+        // keys up and do not need them ordered.
+        hash::FlatHashMap<std::string, std::string> parse_query_map(std::string_view query)
         {
-            return std::filesystem::file_size(path);
+            hash::FlatHashMap<std::string, std::string> result;
+            for (const QueryParam& param : QueryView(query))
+            {
+                result.insert_or_assign(param.decoded_key(), param.decoded_value());
+            }
+            return result;
         }
     }
 
-    // ===== THREADING UTILITIES =====
-    namespace threading
+    // ===== DEBUGGING UTILITIES =====
+    namespace debug
     {
-        class ThreadPool
+        class ScopeTimer
         {
         private:
-            std::vector<std::thread> workers;
-            std::queue<std::function<void()>> tasks;
-            std::mutex queue_mutex;
-            std::condition_variable condition;
-            std::atomic<bool> stop;
+            std::string name;
+            time::Timer timer;
+            
+        public:
+            explicit ScopeTimer(const std::string& func_name) : name(func_name) {}
+            
+            ~ScopeTimer()
+            {
+                std::cout << name << " took " << timer.elapsed_ms() << "ms\n";
+            }
+        };
+        
+        #define SPTR_SCOPE_TIMER() sputil::debug::ScopeTimer _scope_timer(__FUNCTION__)
+        
+        // Raw profiling timestamp: the TSC on x86, steady_clock nanoseconds elsewhere.
+        uint64_t profile_ticks()
+        {
+            return time::cpu_ticks();
+        }
+        
+        // HDR-style log-linear histogram: 32 linear sub-buckets per power of two,
+        // so any recorded value is reported within about 3% of its true value.
+        class LatencyHistogram
+        {
+        private:
+            static constexpr unsigned sub_bits = 5;
+            static constexpr size_t sub_count = size_t(1) << sub_bits;
+            static constexpr size_t bucket_count = (64 - sub_bits + 1) * sub_count;
+            
+            std::vector<uint64_t> buckets;
+            uint64_t total = 0;
+            uint64_t min_value = std::numeric_limits<uint64_t>::max();
+            uint64_t max_value = 0;
+            double sum = 0;
             
         public:
-            ThreadPool(size_t threads = std::thread::hardware_concurrency()) : stop(false)
+            LatencyHistogram() : buckets(bucket_count, 0) {}
+            
+            static size_t bucket_of(uint64_t value)
             {
-                for (size_t i = 0; i < threads; ++i)
-                {
-                    workers.emplace_back([this]
-                    {
-                        while (true)
-                        {
-                            std::function<void()> task;
-                            {
-                                std::unique_lock<std::mutex> lock(this->queue_mutex);
-                                this->condition.wait(lock, [this]
-                                {
-                                    return this->stop || !this->tasks.empty();
-                                });
-                                
-                                if (this->stop && this->tasks.empty()) return;
-                                
-                                task = std::move(this->tasks.front());
-                                this->tasks.pop();
-                            }
-                            task();
-                        }
-                    });
-                }
+                if (value < sub_count) return static_cast<size_t>(value);
+#if defined(_MSC_VER) && !defined(__clang__)
+                unsigned long top;
+                _BitScanReverse64(&top, value);
+                unsigned shift = static_cast<unsigned>(top) - sub_bits;
+#else
+                unsigned shift = static_cast<unsigned>(63 - __builtin_clzll(value)) - sub_bits;
+#endif
+                return (shift + 1) * sub_count + static_cast<size_t>(value >> shift) - sub_count;
+            }
+            
+            // Largest value that lands in bucket index.
+            static uint64_t bucket_high(size_t index)
+            {
+                if (index < sub_count) return index;
+                unsigned shift = static_cast<unsigned>(index / sub_count - 1);
+                uint64_t mantissa = index % sub_count + sub_count;
+                return ((mantissa + 1) << shift) - 1;
+            }
+            
+            void record(uint64_t value, uint64_t n = 1)
+            {
+                buckets[bucket_of(value)] += n;
+                total += n;
+                sum += static_cast<double>(value) * static_cast<double>(n);
+                min_value = std::min(min_value, value);
+                max_value = std::max(max_value, value);
+            }
+            
+            void merge(const LatencyHistogram& other)
+            {
+                for (size_t i = 0; i < bucket_count; ++i) buckets[i] += other.buckets[i];
+                total += other.total;
+                sum += other.sum;
+                min_value = std::min(min_value, other.min_value);
+                max_value = std::max(max_value, other.max_value);
             }
             
-            template<class F, class... Args>
-            auto enqueue(F&& f, Args&&... args) -> std::future<decltype(f(args...))>
+            void reset()
             {
-                using return_type = decltype(f(args...));
-                
-                auto task = std::make_shared<std::packaged_task<return_type()>>(
-                    std::bind(std::forward<F>(f), std::forward<Args>(args)...)
-                );
-                
-                std::future<return_type> res = task->get_future();
-                {
-                    std::unique_lock<std::mutex> lock(queue_mutex);
-                    if (stop) throw std::runtime_error("enqueue on stopped ThreadPool");
-                    tasks.emplace([task](){ (*task)(); });
-                }
-                condition.notify_one();
-                return res;
+                std::fill(buckets.begin(), buckets.end(), 0);
+                total = 0;
+                sum = 0;
+                min_value = std::numeric_limits<uint64_t>::max();
+                max_value = 0;
             }
             
-            ~ThreadPool()
+            uint64_t count() const { return total; }
+            uint64_t min() const { return total ? min_value : 0; }
+            uint64_t max() const { return max_value; }
+            double mean() const { return total ? sum / static_cast<double>(total) : 0.0; }
+            
+            // Value at percentile p (0-100), e.g. 99.9 for p999.
+            uint64_t percentile(double p) const
             {
+                if (total == 0) return 0;
+                double wanted = std::ceil(std::clamp(p, 0.0, 100.0) / 100.0 * static_cast<double>(total));
+                uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(wanted));
+                uint64_t seen = 0;
+                for (size_t i = 0; i < bucket_count; ++i)
                 {
-                    std::unique_lock<std::mutex> lock(queue_mutex);
-                    stop = true;
+                    seen += buckets[i];
+                    if (seen >= rank) return std::min(bucket_high(i), max_value);
                 }
-                condition.notify_all();
-                for (std::thread& worker : workers)
-                    worker.join();
+                return max_value;
             }
         };
         
-        class MutexGuard
+        // Process-wide collector for SPUTIL_PROFILE_SCOPE. Each thread appends
+        // (name id, start, end) records to its own SPSC ring with no locks;
+        // collect() drains the rings into per-name histograms and, when
+        // tracing is on, into a bounded event list for Chrome's trace viewer.
+        // A full ring drops new records until the next collect().
+        class Profiler
         {
+        public:
+            struct Stats
+            {
+                std::string name;
+                LatencyHistogram histogram;  // nanoseconds
+            };
+            
         private:
-            std::mutex& mutex;
+            static constexpr size_t ring_capacity = 8192;
             
-        public:
-            explicit MutexGuard(std::mutex& m) : mutex(m)
+            struct Record
             {
-                mutex.lock();
-            }
+                uint64_t start;
+                uint64_t end;
+                uint32_t id;
+            };
             
-            ~MutexGuard()
+            struct ThreadBuffer
             {
-                mutex.unlock();
+                std::unique_ptr<Record[]> records{new Record[ring_capacity]};
+                alignas(threading::cache_line_size) std::atomic<uint64_t> head{0};
+                uint64_t cached_tail = 0;
+                alignas(threading::cache_line_size) std::atomic<uint64_t> tail{0};
+                std::atomic<uint64_t> dropped{0};
+                std::atomic<bool> retired{false};
+                uint32_t thread_id = 0;
+            };
+            
+            struct ThreadSlot
+            {
+                std::shared_ptr<ThreadBuffer> buffer;
+                ~ThreadSlot()
+                {
+                    if (buffer) buffer->retired.store(true, std::memory_order_release);
+                }
+            };
+            
+            struct TraceEvent
+            {
+                uint64_t start;
+                uint64_t end;
+                uint32_t id;
+                uint32_t thread_id;
+            };
+            
+            std::atomic<bool> enabled{true};
+            
+            std::mutex registry_mutex;
+            std::vector<std::string> names;
+            hash::FlatHashMap<std::string, uint32_t> ids;
+            std::vector<std::shared_ptr<ThreadBuffer>> buffers;
+            uint32_t next_thread_id = 0;
+            
+            std::mutex collect_mutex;
+            std::vector<LatencyHistogram> histograms;
+            std::vector<TraceEvent> trace;
+            size_t trace_limit = 0;
+            uint64_t dropped_records = 0;
+            
+            uint64_t base_ticks;
+            std::chrono::steady_clock::time_point base_time;
+            
+            std::mutex reporter_mutex;
+            std::condition_variable reporter_condition;
+            std::thread reporter;
+            bool reporter_stop = false;
+            
+            Profiler() : base_ticks(profile_ticks()), base_time(std::chrono::steady_clock::now()) {}
+            
+            ThreadBuffer& local_buffer()
+            {
+                static thread_local ThreadBuffer* cached = nullptr;
+                if (cached) return *cached;
+                
+                static thread_local ThreadSlot slot;
+                slot.buffer = std::make_shared<ThreadBuffer>();
+                {
+                    std::lock_guard<std::mutex> lock(registry_mutex);
+                    slot.buffer->thread_id = next_thread_id++;
+                    buffers.push_back(slot.buffer);
+                }
+                cached = slot.buffer.get();
+                return *cached;
             }
             
-            MutexGuard(const MutexGuard&) = delete;
-            MutexGuard& operator=(const MutexGuard&) = delete;
-        };
-    }
-
-    // ===== CONCURRENCY UTILITIES =====
-    namespace concurrency
-    {
-        template <typename T>
-        class ConcurrentQueue
-        {
-        private:
-            std::queue<T> queue;
-            mutable std::mutex mutex;
-            std::condition_variable condition;
+            // Nanoseconds per tick, measured against steady_clock since startup.
+            double tick_scale() const
+            {
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+                uint64_t ticks = profile_ticks() - base_ticks;
+                double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - base_time).count();
+                return ticks ? ns / static_cast<double>(ticks) : 1.0;
+#else
+                return 1.0;
+#endif
+            }
             
-        public:
-            void push(T value)
+            void drain(ThreadBuffer& buffer, double scale)
             {
+                uint64_t tail = buffer.tail.load(std::memory_order_relaxed);
+                uint64_t head = buffer.head.load(std::memory_order_acquire);
+                for (; tail != head; ++tail)
                 {
-                    std::unique_lock<std::mutex> lock(mutex);
-                    queue.push(std::move(value));
+                    const Record& record = buffer.records[tail & (ring_capacity - 1)];
+                    uint64_t ticks = record.end >= record.start ? record.end - record.start : 0;
+                    // The id may have been registered after collect() looked at the names.
+                    if (record.id >= histograms.size()) histograms.resize(record.id + 1);
+                    histograms[record.id].record(static_cast<uint64_t>(static_cast<double>(ticks) * scale));
+                    if (trace.size() < trace_limit) trace.push_back({record.start, record.end, record.id, buffer.thread_id});
                 }
-                condition.notify_one();
+                buffer.tail.store(tail, std::memory_order_release);
+                dropped_records += buffer.dropped.exchange(0, std::memory_order_relaxed);
             }
             
-            T pop()
+            static void append_json_string(std::string& out, std::string_view text)
             {
-                std::unique_lock<std::mutex> lock(mutex);
-                condition.wait(lock, [this]{ return !queue.empty(); });
-                T value = std::move(queue.front());
-                queue.pop();
-                return value;
+                out += '"';
+                for (char c : text)
+                {
+                    if (c == '"' || c == '\\') out += '\\';
+                    if (static_cast<unsigned char>(c) >= 0x20) out += c;
+                }
+                out += '"';
             }
             
-            bool try_pop(T& value)
+        public:
+            Profiler(const Profiler&) = delete;
+            Profiler& operator=(const Profiler&) = delete;
+            
+            ~Profiler()
             {
-                std::unique_lock<std::mutex> lock(mutex);
-                if (queue.empty()) return false;
-                value = std::move(queue.front());
-                queue.pop();
-                return true;
+                stop_reporter();
             }
             
-            bool empty() const
+            static Profiler& instance()
             {
-                std::unique_lock<std::mutex> lock(mutex);
-                return queue.empty();
+                static Profiler profiler;
+                return profiler;
             }
             
-            size_t size() const
+            // Returns the id for name, registering it on first use.
+            uint32_t register_name(std::string_view name)
             {
-                std::unique_lock<std::mutex> lock(mutex);
-                return queue.size();
+                std::lock_guard<std::mutex> lock(registry_mutex);
+                auto it = ids.find(name);
+                if (it != ids.end()) return it->second;
+                uint32_t id = static_cast<uint32_t>(names.size());
+                names.emplace_back(name);
+                ids.emplace(names.back(), id);
+                return id;
             }
-        };
-        
-        class RateLimiter
-        {
-        private:
-            std::chrono::steady_clock::time_point last_call;
-            std::chrono::milliseconds min_delay;
-            std::mutex mutex;
             
-        public:
-            RateLimiter(int calls_per_second) : 
-                last_call(std::chrono::steady_clock::now()),
-                min_delay(std::chrono::milliseconds(1000 / calls_per_second)) {}
+            void set_enabled(bool on) { enabled.store(on, std::memory_order_relaxed); }
+            bool is_enabled() const { return enabled.load(std::memory_order_relaxed); }
             
-            void acquire()
+            // Hot path: one relaxed flag check and one slot write in the thread's ring.
+            void record(uint32_t id, uint64_t start, uint64_t end)
             {
-                std::unique_lock<std::mutex> lock(mutex);
-                auto now = std::chrono::steady_clock::now();
-                auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(now - last_call);
-                
-                if (elapsed < min_delay)
+                if (!enabled.load(std::memory_order_relaxed)) return;
+                ThreadBuffer& buffer = local_buffer();
+                uint64_t head = buffer.head.load(std::memory_order_relaxed);
+                if (head - buffer.cached_tail >= ring_capacity)
                 {
-                    std::this_thread::sleep_for(min_delay - elapsed);
+                    buffer.cached_tail = buffer.tail.load(std::memory_order_acquire);
+                    if (head - buffer.cached_tail >= ring_capacity)
+                    {
+                        buffer.dropped.fetch_add(1, std::memory_order_relaxed);
+                        return;
+                    }
                 }
-                
-                last_call = std::chrono::steady_clock::now();
+                buffer.records[head & (ring_capacity - 1)] = Record{start, end, id};
+                buffer.head.store(head + 1, std::memory_order_release);
             }
-        };
-    }
-
-    // ===== ALGORITHM UTILITIES =====
-    namespace algorithm
-    {
-        template <typename Container, typename T>
-        bool binary_search(const Container& container, const T& value)
-        {
-            return std::binary_search(std::begin(container), std::end(container), value);
-        }
-        
-        template <typename Container, typename Predicate>
-        void quick_sort(Container& container, Predicate comp)
-        {
-            std::sort(std::begin(container), std::end(container), comp);
-        }
-        
-        template <typename T>
-        std::vector<T> generate_sequence(T start, T end, T step = 1)
-        {
-            std::vector<T> result;
-            for (T i = start; i <= end; i += step)
+            
+            // Keeps up to max_events raw scopes from later collect() calls for
+            // write_chrome_trace. Zero turns tracing off and frees the events.
+            void enable_trace(size_t max_events = 1 << 20)
             {
-                result.push_back(i);
+                std::lock_guard<std::mutex> lock(collect_mutex);
+                trace_limit = max_events;
+                if (max_events == 0) std::vector<TraceEvent>().swap(trace);
+                else trace.reserve(std::min<size_t>(max_events, 1 << 16));
             }
-            return result;
-        }
-        
-        template <typename T, typename Hash = std::hash<T>>
-        class LRUCache
-        {
-        private:
-            size_t capacity;
-            std::list<T> items;
-            std::unordered_map<T, typename std::list<T>::iterator, Hash> cache_map;
-            
-        public:
-            LRUCache(size_t capacity) : capacity(capacity) {}
             
-            void put(const T& key)
+            // Moves every thread's pending records into the aggregates.
+            void collect()
             {
-                auto it = cache_map.find(key);
-                if (it != cache_map.end())
+                std::vector<std::shared_ptr<ThreadBuffer>> snapshot;
                 {
-                    items.erase(it->second);
-                    cache_map.erase(it);
+                    std::lock_guard<std::mutex> lock(registry_mutex);
+                    snapshot = buffers;
                 }
                 
-                items.push_front(key);
-                cache_map[key] = items.begin();
+                std::lock_guard<std::mutex> lock(collect_mutex);
+                double scale = tick_scale();
+                for (auto& buffer : snapshot) drain(*buffer, scale);
                 
-                if (cache_map.size() > capacity)
+                std::lock_guard<std::mutex> registry_lock(registry_mutex);
+                buffers.erase(std::remove_if(buffers.begin(), buffers.end(), [](const std::shared_ptr<ThreadBuffer>& buffer)
                 {
-                    auto last = items.end();
-                    last--;
-                    cache_map.erase(*last);
-                    items.pop_back();
-                }
+                    return buffer->retired.load(std::memory_order_acquire) &&
+                           buffer->tail.load(std::memory_order_relaxed) == buffer->head.load(std::memory_order_acquire);
+                }), buffers.end());
             }
             
-            bool get(const T& key)
+            // Clears histograms, trace events and the dropped count; pending
+            // ring contents are discarded too.
+            void reset()
             {
-                auto it = cache_map.find(key);
-                if (it == cache_map.end()) return false;
-                
-                items.splice(items.begin(), items, it->second);
-                return true;
+                collect();
+                std::lock_guard<std::mutex> lock(collect_mutex);
+                for (auto& histogram : histograms) histogram.reset();
+                trace.clear();
+                dropped_records = 0;
             }
             
-            bool contains(const T& key) const
+            // Aggregated stats per scope name, in registration order.
+            std::vector<Stats> snapshot()
             {
-                return cache_map.find(key) != cache_map.end();
+                collect();
+                std::vector<Stats> result;
+                std::lock_guard<std::mutex> lock(collect_mutex);
+                std::lock_guard<std::mutex> registry_lock(registry_mutex);
+                for (size_t i = 0; i < histograms.size(); ++i)
+                {
+                    if (histograms[i].count()) result.push_back({names[i], histograms[i]});
+                }
+                return result;
             }
             
-            size_t size() const { return items.size(); }
-        };
-    }
-
-    // ===== NETWORKING UTILITIES (Basic) =====
-    namespace net
-    {
-        std::string url_encode(const std::string& value)
-        {
-            std::ostringstream escaped;
-            escaped.fill('0');
-            escaped << std::hex;
+            uint64_t dropped()
+            {
+                std::lock_guard<std::mutex> lock(collect_mutex);
+                return dropped_records;
+            }
             
-            for (char c : value)
+            // Fixed-width table of count, mean and p50/p99/p999/max in nanoseconds.
+            std::string summary()
             {
-                if (isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~')
+                auto stats = snapshot();
+                std::string out;
+                char line[192];
+                std::snprintf(line, sizeof(line), "%-32s %10s %10s %10s %10s %10s %10s\n",
+                              "scope", "count", "mean", "p50", "p99", "p999", "max");
+                out += line;
+                for (const auto& entry : stats)
                 {
-                    escaped << c;
+                    const auto& h = entry.histogram;
+                    std::snprintf(line, sizeof(line), "%-32.32s %10llu %10.0f %10llu %10llu %10llu %10llu\n",
+                                  entry.name.c_str(), static_cast<unsigned long long>(h.count()), h.mean(),
+                                  static_cast<unsigned long long>(h.percentile(50)),
+                                  static_cast<unsigned long long>(h.percentile(99)),
+                                  static_cast<unsigned long long>(h.percentile(99.9)),
+                                  static_cast<unsigned long long>(h.max()));
+                    out += line;
                 }
-                else
+                uint64_t lost = dropped();
+                if (lost)
                 {
-                    escaped << '%' << std::setw(2) << int((unsigned char)c);
+                    std::snprintf(line, sizeof(line), "(%llu records dropped)\n", static_cast<unsigned long long>(lost));
+                    out += line;
                 }
+                return out;
             }
             
-            return escaped.str();
-        }
-        
-        std::string url_decode(const std::string& value)
-        {
-            std::string result;
-            result.reserve(value.size());
-            
-            for (size_t i = 0; i < value.size(); ++i)
+            // Writes the traced scopes as Chrome trace-event JSON ("X" events,
+            // microsecond timestamps), loadable in chrome://tracing or Perfetto.
+            void write_chrome_trace(std::ostream& out)
             {
-                if (value[i] == '%' && i + 2 < value.size())
-                {
-                    int hex_value;
-                    std::istringstream hex_stream(value.substr(i + 1, 2));
-                    if (hex_stream >> std::hex >> hex_value)
-                    {
-                        result += static_cast<char>(hex_value);
-                        i += 2;
-                    }
-                    else
-                    {
-                        result += value[i];
-                    }
-                }
-                else if (value[i] == '+')
+                collect();
+                std::lock_guard<std::mutex> lock(collect_mutex);
+                std::vector<std::string> copy;
                 {
-                    result += ' ';
+                    std::lock_guard<std::mutex> registry_lock(registry_mutex);
+                    copy = names;
                 }
-                else
+                
+                double us_per_tick = tick_scale() / 1000.0;
+                std::string json = "{\"traceEvents\":[";
+                char number[96];
+                for (size_t i = 0; i < trace.size(); ++i)
                 {
-                    result += value[i];
+                    const TraceEvent& event = trace[i];
+                    if (i) json += ',';
+                    json += "{\"name\":";
+                    append_json_string(json, copy[event.id]);
+                    double ts = static_cast<double>(event.start - base_ticks) * us_per_tick;
+                    double dur = static_cast<double>(event.end >= event.start ? event.end - event.start : 0) * us_per_tick;
+                    std::snprintf(number, sizeof(number), ",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+                                  event.thread_id, ts, dur);
+                    json += number;
                 }
+                json += "]}\n";
+                out << json;
             }
             
-            return result;
-        }
-        
-        std::map<std::string, std::string> parse_query_string(const std::string& query)
-        {
-            std::map<std::string, std::string> result;
-            auto pairs = string::split(query, "&");
+            // Starts a background thread that collects every interval and hands
+            // summary() to sink. Replaces a previously started reporter.
+            void start_reporter(std::chrono::milliseconds interval, std::function<void(const std::string&)> sink)
+            {
+                stop_reporter();
+                reporter_stop = false;
+                reporter = std::thread([this, interval, sink = std::move(sink)]()
+                {
+                    std::unique_lock<std::mutex> lock(reporter_mutex);
+                    while (!reporter_condition.wait_for(lock, interval, [this] { return reporter_stop; }))
+                    {
+                        lock.unlock();
+                        sink(summary());
+                        lock.lock();
+                    }
+                });
+            }
             
-            for (const auto& pair : pairs)
+            void stop_reporter()
             {
-                auto key_value = string::split(pair, "=");
-                if (key_value.size() == 2)
                 {
-                    result[url_decode(key_value[0])] = url_decode(key_value[1]);
+                    std::lock_guard<std::mutex> lock(reporter_mutex);
+                    reporter_stop = true;
                 }
+                reporter_condition.notify_all();
+                if (reporter.joinable()) reporter.join();
             }
-            
-            return result;
-        }
-    }
-
-    // ===== DEBUGGING UTILITIES =====
-    namespace debug
-    {
-        class ScopeTimer
+        };
+        
+        // RAII scope measured by the Profiler; normally created through
+        // SPUTIL_PROFILE_SCOPE so the name is registered only once.
+        class ProfileScope
         {
         private:
-            std::string name;
-            time::Timer timer;
+            uint32_t id;
+            uint64_t start;
             
         public:
-            explicit ScopeTimer(const std::string& func_name) : name(func_name) {}
+            explicit ProfileScope(uint32_t name_id) : id(name_id), start(profile_ticks()) {}
+            ProfileScope(const ProfileScope&) = delete;
+            ProfileScope& operator=(const ProfileScope&) = delete;
             
-            ~ScopeTimer()
+            ~ProfileScope()
             {
-                std::cout << name << " took " << timer.elapsed_ms() << "ms\n";
+                Profiler::instance().record(id, start, profile_ticks());
             }
         };
         
-        #define SPTR_SCOPE_TIMER() SPTRutil::debug::ScopeTimer _scope_timer(__FUNCTION__)
+        // Define SPUTIL_NO_PROFILER to compile every profiling scope out.
+        #define SPUTIL_PROFILE_CONCAT_IMPL(a, b) a##b
+        #define SPUTIL_PROFILE_CONCAT(a, b) SPUTIL_PROFILE_CONCAT_IMPL(a, b)
+        #if defined(SPUTIL_NO_PROFILER)
+        #define SPUTIL_PROFILE_SCOPE(name) ((void)0)
+        #else
+        #define SPUTIL_PROFILE_SCOPE(name) \
+            static const uint32_t SPUTIL_PROFILE_CONCAT(_profile_id_, __LINE__) = \
+                sputil::debug::Profiler::instance().register_name(name); \
+            sputil::debug::ProfileScope SPUTIL_PROFILE_CONCAT(_profile_scope_, __LINE__)(SPUTIL_PROFILE_CONCAT(_profile_id_, __LINE__))
+        #endif
+        #define SPUTIL_PROFILE_FUNCTION() SPUTIL_PROFILE_SCOPE(__FUNCTION__)
         
         template <typename T>
         void printc(const T& container, const std::string& name = "")
@@ -732,62 +10062,234 @@ namespace sputil
     // ===== FUNCTIONAL PROGRAMMING UTILITIES =====
     namespace functional
     {
+        // Optional value with monadic helpers. Copies are trivial when T's
+        // are, and the rvalue overloads move the payload out instead of
+        // copying, so move-only types work.
         template <typename T>
-        class Maybe
+        class [[nodiscard]] Maybe
         {
         private:
             std::optional<T> value;
             
         public:
-            Maybe() = default;
-            Maybe(const T& val) : value(val) {}
-            Maybe(T&& val) : value(std::move(val)) {}
+            constexpr Maybe() = default;
+            constexpr Maybe(const T& val) : value(val) {}
+            constexpr Maybe(T&& val) : value(std::move(val)) {}
+            
+            constexpr bool is_just() const { return value.has_value(); }
+            constexpr bool is_nothing() const { return !value.has_value(); }
+            constexpr explicit operator bool() const { return value.has_value(); }
+            
+            // Throw std::bad_optional_access on nothing.
+            constexpr T& get() & { return value.value(); }
+            constexpr const T& get() const& { return value.value(); }
+            constexpr T&& get() && { return std::move(value.value()); }
+            
+            // The fallback is only converted to T when there is no value.
+            template <typename U>
+            constexpr T get_or(U&& fallback) const&
+            {
+                return value ? *value : static_cast<T>(std::forward<U>(fallback));
+            }
+            
+            template <typename U>
+            constexpr T get_or(U&& fallback) &&
+            {
+                return value ? std::move(*value) : static_cast<T>(std::forward<U>(fallback));
+            }
+            
+            // f(value) -> U gives Maybe<U>.
+            template <typename Func>
+            constexpr auto map(Func&& f) const&
+            {
+                using U = std::remove_cv_t<std::remove_reference_t<std::invoke_result_t<Func, const T&>>>;
+                if (!value) return Maybe<U>();
+                return Maybe<U>(std::forward<Func>(f)(*value));
+            }
+            
+            template <typename Func>
+            constexpr auto map(Func&& f) &&
+            {
+                using U = std::remove_cv_t<std::remove_reference_t<std::invoke_result_t<Func, T&&>>>;
+                if (!value) return Maybe<U>();
+                return Maybe<U>(std::forward<Func>(f)(std::move(*value)));
+            }
             
-            bool is_just() const { return value.has_value(); }
-            bool is_nothing() const { return !value.has_value(); }
+            // f(value) -> Maybe<U>.
+            template <typename Func>
+            constexpr auto and_then(Func&& f) const&
+            {
+                using R = std::remove_cv_t<std::remove_reference_t<std::invoke_result_t<Func, const T&>>>;
+                if (!value) return R();
+                return std::forward<Func>(f)(*value);
+            }
             
-            T& get() { return value.value(); }
-            const T& get() const { return value.value(); }
+            template <typename Func>
+            constexpr auto and_then(Func&& f) &&
+            {
+                using R = std::remove_cv_t<std::remove_reference_t<std::invoke_result_t<Func, T&&>>>;
+                if (!value) return R();
+                return std::forward<Func>(f)(std::move(*value));
+            }
             
-            T get_or(const T& default_val) const
+            // f() -> Maybe<T>, called only on nothing.
+            template <typename Func>
+            constexpr Maybe or_else(Func&& f) const&
             {
-                return value.value_or(default_val);
+                if (value) return *this;
+                return std::forward<Func>(f)();
             }
             
             template <typename Func>
-            auto map(Func f) const -> Maybe<decltype(f(value.value()))>
+            constexpr Maybe or_else(Func&& f) &&
             {
-                if (is_nothing()) return Maybe<decltype(f(value.value()))>();
-                return Maybe<decltype(f(value.value()))>(f(value.value()));
+                if (value) return std::move(*this);
+                return std::forward<Func>(f)();
             }
         };
         
+        static_assert(std::is_trivially_copyable_v<Maybe<int>>, "Maybe of a trivial type must stay trivially copyable");
+        
+        struct in_place_ok_t { explicit in_place_ok_t() = default; };
+        struct in_place_err_t { explicit in_place_err_t() = default; };
+        inline constexpr in_place_ok_t in_place_ok{};
+        inline constexpr in_place_err_t in_place_err{};
+        
+        // Value or error in a single std::variant (index 0 ok, 1 error), so it
+        // is no larger than the bigger of the two plus a tag. The implicit
+        // constructors from T and E exist only when the types differ; use
+        // Ok/Err or the in_place_ok/in_place_err tags when T and E are the
+        // same type. Accessing the wrong side throws std::runtime_error.
         template <typename T, typename E>
-        class Result
+        class [[nodiscard]] Result
         {
         private:
-            std::optional<T> success_value;
-            std::optional<E> error_value;
+            std::variant<T, E> storage;
+            
+            constexpr void expect_ok() const
+            {
+                if (storage.index() != 0) throw std::runtime_error("Result::unwrap called on an error");
+            }
+            
+            constexpr void expect_err() const
+            {
+                if (storage.index() != 1) throw std::runtime_error("Result::unwrap_err called on a success");
+            }
             
         public:
-            static Result Ok(const T& value) { return Result(value); }
-            static Result Err(const E& error) { return Result(error); }
+            static constexpr Result Ok(T value) { return Result(in_place_ok, std::move(value)); }
+            static constexpr Result Err(E error) { return Result(in_place_err, std::move(error)); }
+            
+            template <typename... Args>
+            constexpr explicit Result(in_place_ok_t, Args&&... args) : storage(std::in_place_index<0>, std::forward<Args>(args)...) {}
+            
+            template <typename... Args>
+            constexpr explicit Result(in_place_err_t, Args&&... args) : storage(std::in_place_index<1>, std::forward<Args>(args)...) {}
+            
+            template <typename U = T, std::enable_if_t<!std::is_same_v<U, E>, int> = 0>
+            constexpr Result(const T& value) : storage(std::in_place_index<0>, value) {}
+            
+            template <typename U = T, std::enable_if_t<!std::is_same_v<U, E>, int> = 0>
+            constexpr Result(T&& value) : storage(std::in_place_index<0>, std::move(value)) {}
+            
+            // The long parameter keeps these distinct from the T overloads
+            // when T and E are the same type, where all four are disabled.
+            template <typename U = E, std::enable_if_t<!std::is_same_v<U, T>, long> = 0>
+            constexpr Result(const E& error) : storage(std::in_place_index<1>, error) {}
+            
+            template <typename U = E, std::enable_if_t<!std::is_same_v<U, T>, long> = 0>
+            constexpr Result(E&& error) : storage(std::in_place_index<1>, std::move(error)) {}
+            
+            constexpr bool is_ok() const { return storage.index() == 0; }
+            constexpr bool is_err() const { return storage.index() == 1; }
+            constexpr explicit operator bool() const { return is_ok(); }
+            
+            constexpr T& unwrap() & { expect_ok(); return std::get<0>(storage); }
+            constexpr const T& unwrap() const& { expect_ok(); return std::get<0>(storage); }
+            constexpr T&& unwrap() && { expect_ok(); return std::move(std::get<0>(storage)); }
             
-            Result(const T& value) : success_value(value) {}
-            Result(const E& error) : error_value(error) {}
+            constexpr E& unwrap_err() & { expect_err(); return std::get<1>(storage); }
+            constexpr const E& unwrap_err() const& { expect_err(); return std::get<1>(storage); }
+            constexpr E&& unwrap_err() && { expect_err(); return std::move(std::get<1>(storage)); }
             
-            bool is_ok() const { return success_value.has_value(); }
-            bool is_err() const { return error_value.has_value(); }
+            template <typename U>
+            constexpr T unwrap_or(U&& fallback) const&
+            {
+                return is_ok() ? std::get<0>(storage) : static_cast<T>(std::forward<U>(fallback));
+            }
+            
+            template <typename U>
+            constexpr T unwrap_or(U&& fallback) &&
+            {
+                return is_ok() ? std::move(std::get<0>(storage)) : static_cast<T>(std::forward<U>(fallback));
+            }
+            
+            // f(value) -> U gives Result<U, E>; errors pass through.
+            template <typename Func>
+            constexpr auto map(Func&& f) const&
+            {
+                using U = std::remove_cv_t<std::remove_reference_t<std::invoke_result_t<Func, const T&>>>;
+                if (is_err()) return Result<U, E>(in_place_err, std::get<1>(storage));
+                return Result<U, E>(in_place_ok, std::forward<Func>(f)(std::get<0>(storage)));
+            }
+            
+            template <typename Func>
+            constexpr auto map(Func&& f) &&
+            {
+                using U = std::remove_cv_t<std::remove_reference_t<std::invoke_result_t<Func, T&&>>>;
+                if (is_err()) return Result<U, E>(in_place_err, std::move(std::get<1>(storage)));
+                return Result<U, E>(in_place_ok, std::forward<Func>(f)(std::move(std::get<0>(storage))));
+            }
+            
+            // f(error) -> F gives Result<T, F>; values pass through.
+            template <typename Func>
+            constexpr auto map_err(Func&& f) const&
+            {
+                using F = std::remove_cv_t<std::remove_reference_t<std::invoke_result_t<Func, const E&>>>;
+                if (is_ok()) return Result<T, F>(in_place_ok, std::get<0>(storage));
+                return Result<T, F>(in_place_err, std::forward<Func>(f)(std::get<1>(storage)));
+            }
+            
+            template <typename Func>
+            constexpr auto map_err(Func&& f) &&
+            {
+                using F = std::remove_cv_t<std::remove_reference_t<std::invoke_result_t<Func, E&&>>>;
+                if (is_ok()) return Result<T, F>(in_place_ok, std::move(std::get<0>(storage)));
+                return Result<T, F>(in_place_err, std::forward<Func>(f)(std::move(std::get<1>(storage))));
+            }
+            
+            // f(value) -> Result<U, E>; errors pass through.
+            template <typename Func>
+            constexpr auto and_then(Func&& f) const&
+            {
+                using R = std::remove_cv_t<std::remove_reference_t<std::invoke_result_t<Func, const T&>>>;
+                if (is_err()) return R(in_place_err, std::get<1>(storage));
+                return std::forward<Func>(f)(std::get<0>(storage));
+            }
             
-            T& unwrap() { return success_value.value(); }
-            const T& unwrap() const { return success_value.value(); }
+            template <typename Func>
+            constexpr auto and_then(Func&& f) &&
+            {
+                using R = std::remove_cv_t<std::remove_reference_t<std::invoke_result_t<Func, T&&>>>;
+                if (is_err()) return R(in_place_err, std::move(std::get<1>(storage)));
+                return std::forward<Func>(f)(std::move(std::get<0>(storage)));
+            }
             
-            E& unwrap_err() { return error_value.value(); }
-            const E& unwrap_err() const { return error_value.value(); }
+            // f(error) -> Result<T, F>, used to recover; values pass through.
+            template <typename Func>
+            constexpr auto or_else(Func&& f) const&
+            {
+                using R = std::remove_cv_t<std::remove_reference_t<std::invoke_result_t<Func, const E&>>>;
+                if (is_ok()) return R(in_place_ok, std::get<0>(storage));
+                return std::forward<Func>(f)(std::get<1>(storage));
+            }
             
-            T unwrap_or(const T& default_val) const
+            template <typename Func>
+            constexpr auto or_else(Func&& f) &&
             {
-                return success_value.value_or(default_val);
+                using R = std::remove_cv_t<std::remove_reference_t<std::invoke_result_t<Func, E&&>>>;
+                if (is_ok()) return R(in_place_ok, std::move(std::get<0>(storage)));
+                return std::forward<Func>(f)(std::move(std::get<1>(storage)));
             }
         };
     }